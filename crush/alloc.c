@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+static void *crush_libc_alloc(void *ctx, size_t size, size_t align)
+{
+	void *p;
+
+	if (align <= CRUSH_ALLOC_ALIGN)
+		return malloc(size);
+	if (posix_memalign(&p, align, size))
+		return NULL;
+	return p;
+}
+
+static void *crush_libc_realloc(void *ctx, void *p, size_t size)
+{
+	return realloc(p, size);
+}
+
+static void crush_libc_free(void *ctx, void *p)
+{
+	free(p);
+}
+
+static const struct crush_allocator crush_libc_allocator = {
+	.alloc = crush_libc_alloc,
+	.realloc = crush_libc_realloc,
+	.free = crush_libc_free,
+	.ctx = NULL,
+};
+
+static struct crush_allocator crush_allocator = {
+	.alloc = crush_libc_alloc,
+	.realloc = crush_libc_realloc,
+	.free = crush_libc_free,
+	.ctx = NULL,
+};
+
+void crush_set_allocator(const struct crush_allocator *allocator)
+{
+	crush_allocator = allocator ? *allocator : crush_libc_allocator;
+}
+
+const struct crush_allocator *crush_get_allocator(void)
+{
+	return &crush_allocator;
+}
+
+void *crush_malloc(size_t size)
+{
+	return crush_allocator.alloc(crush_allocator.ctx, size, CRUSH_ALLOC_ALIGN);
+}
+
+void *crush_malloc_aligned(size_t size, size_t align)
+{
+	if (align < CRUSH_ALLOC_ALIGN)
+		align = CRUSH_ALLOC_ALIGN;
+	return crush_allocator.alloc(crush_allocator.ctx, size, align);
+}
+
+void *crush_calloc(size_t count, size_t size)
+{
+	void *p;
+
+	if (size && count > (size_t)-1 / size)
+		return NULL;
+	p = crush_malloc(count * size);
+	if (p)
+		memset(p, 0, count * size);
+	return p;
+}
+
+void *crush_realloc(void *p, size_t size)
+{
+	return crush_allocator.realloc(crush_allocator.ctx, p, size);
+}
+
+void crush_free(void *p)
+{
+	if (p)
+		crush_allocator.free(crush_allocator.ctx, p);
+}
@@ -0,0 +1,69 @@
+#ifndef CEPH_CRUSH_ALLOC_H
+#define CEPH_CRUSH_ALLOC_H
+
+#include <stddef.h>
+
+/** @ingroup API
+ *
+ * The functions libcrush uses to allocate the memory it owns: maps,
+ * buckets, rules, arenas, indexes and the workspaces of
+ * crush_multithread_job(). See crush_set_allocator().
+ */
+struct crush_allocator {
+	/*! return __size__ bytes aligned on __align__, a power of two
+	 *  at least ::CRUSH_ALLOC_ALIGN, or NULL */
+	void *(*alloc)(void *ctx, size_t size, size_t align);
+	/*! resize __p__ as __realloc(3)__ does, __p__ is NULL or was
+	 *  returned by __alloc__ with ::CRUSH_ALLOC_ALIGN or by __realloc__ */
+	void *(*realloc)(void *ctx, void *p, size_t size);
+	/*! release __p__, never NULL, returned by __alloc__ or __realloc__ */
+	void (*free)(void *ctx, void *p);
+	/*! given as is to each function */
+	void *ctx;
+};
+
+/** @ingroup API
+ *
+ * The alignment of the memory libcrush allocates, unless it asks for
+ * more. It is the alignment of __malloc(3)__ on 64 bits platforms.
+ */
+#define CRUSH_ALLOC_ALIGN 16
+
+/** @ingroup API
+ *
+ * Use __allocator__ for all the allocations made by libcrush from
+ * now on, or __malloc(3)__, __realloc(3)__ and __free(3)__ if
+ * __allocator__ is NULL, which is the default. The functions are
+ * called concurrently if libcrush is used by more than one thread.
+ *
+ * The allocator must be set before creating the first crush_map and
+ * must not be changed while memory allocated by libcrush with the
+ * previous allocator is still in use. Memory that libcrush gives to
+ * the caller and documents as released with __free(3)__ (for
+ * instance the buffer of crush_encode()) is allocated with
+ * __malloc(3)__ regardless.
+ *
+ * @param allocator the functions to use, copied, or NULL
+ */
+extern void crush_set_allocator(const struct crush_allocator *allocator);
+
+/** @ingroup API
+ *
+ * Return the allocator libcrush uses, see crush_set_allocator().
+ *
+ * @returns a pointer to the current allocator, never NULL
+ */
+extern const struct crush_allocator *crush_get_allocator(void);
+
+/*! @cond INTERNAL */
+
+/* allocate with the current allocator, as malloc(3) etc. would */
+extern void *crush_malloc(size_t size);
+extern void *crush_malloc_aligned(size_t size, size_t align);
+extern void *crush_calloc(size_t count, size_t size);
+extern void *crush_realloc(void *p, size_t size);
+extern void crush_free(void *p);
+
+/*! @endcond */
+
+#endif
@@ -0,0 +1,104 @@
+#include "arena.h"
+#include "hugepage.h"
+
+/* the smallest chunk, for arenas created with a tiny initial size */
+#define CRUSH_ARENA_MIN_CHUNK 4096
+
+static struct crush_arena_chunk *crush_arena_add_chunk(struct crush_arena *arena,
+						       size_t size)
+{
+	struct crush_arena_chunk *chunk;
+	size_t mapped = sizeof(*chunk) + size;
+
+	/* the rounding to huge pages is used as well */
+	chunk = crush_hugepage_alloc(&mapped, NULL);
+	if (chunk) {
+		size = mapped - sizeof(*chunk);
+	} else {
+		mapped = 0;
+		chunk = crush_malloc(sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+	}
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->mapped = mapped;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk;
+}
+
+struct crush_arena *crush_arena_create(size_t size)
+{
+	struct crush_arena *arena;
+
+	arena = crush_malloc(sizeof(*arena));
+	if (!arena)
+		return NULL;
+	arena->chunks = NULL;
+	if (size < CRUSH_ARENA_MIN_CHUNK)
+		size = CRUSH_ARENA_MIN_CHUNK;
+	arena->chunk_size = size;
+	if (!crush_arena_add_chunk(arena, size)) {
+		crush_free(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+void *crush_arena_alloc(struct crush_arena *arena, size_t size)
+{
+	struct crush_arena_chunk *chunk = arena->chunks;
+	void *p;
+
+	/* never return a pointer crush_arena_contains() does not know */
+	if (size == 0)
+		size = 1;
+	size = (size + CRUSH_ARENA_ALIGN - 1) & ~(CRUSH_ARENA_ALIGN - 1);
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		arena->chunk_size *= 2;
+		if (arena->chunk_size < size)
+			arena->chunk_size = size;
+		chunk = crush_arena_add_chunk(arena, arena->chunk_size);
+		if (!chunk)
+			return NULL;
+	}
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+int crush_arena_contains(const struct crush_arena *arena, const void *p)
+{
+	const struct crush_arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		if ((const char *)p >= chunk->data &&
+		    (const char *)p < chunk->data + chunk->used)
+			return 1;
+	return 0;
+}
+
+size_t crush_arena_size(const struct crush_arena *arena)
+{
+	const struct crush_arena_chunk *chunk;
+	size_t size = 0;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		size += chunk->used;
+	return size;
+}
+
+void crush_arena_destroy(struct crush_arena *arena)
+{
+	struct crush_arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		if (chunk->mapped)
+			crush_hugepage_free(chunk, chunk->mapped);
+		else
+			crush_free(chunk);
+	}
+	crush_free(arena);
+}
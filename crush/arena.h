@@ -0,0 +1,63 @@
+#ifndef CEPH_CRUSH_ARENA_H
+#define CEPH_CRUSH_ARENA_H
+
+#include "crush_compat.h"
+
+/*
+ * A growable arena: memory is carved out of large chunks and can
+ * only be released all at once with crush_arena_destroy(). It is
+ * used to allocate the buckets and rules of a crush_map in bulk, see
+ * crush_map.arena.
+ */
+
+struct crush_arena_chunk {
+	struct crush_arena_chunk *next;
+	size_t size;		/* bytes available in data */
+	size_t used;		/* bytes already allocated in data */
+	size_t mapped;		/* length of the huge pages mapping or 0 */
+	char data[0];
+};
+
+struct crush_arena {
+	struct crush_arena_chunk *chunks; /* the most recent chunk first */
+	size_t chunk_size;                /* size of the next chunk */
+};
+
+/*
+ * All allocations are aligned on this boundary, which is enough for
+ * every structure of a crush_map.
+ */
+#define CRUSH_ARENA_ALIGN sizeof(__u64)
+
+/*
+ * Allocate an arena whose first chunk can hold __size__ bytes.
+ * Return NULL if malloc(3) fails. The chunks that are large enough
+ * are mapped in huge pages, see crush_set_hugepages().
+ */
+extern struct crush_arena *crush_arena_create(size_t size);
+
+/*
+ * Return __size__ bytes from the current chunk or from a new chunk
+ * at least twice as large as the previous one, or NULL if
+ * malloc(3) fails. The memory is not initialized.
+ */
+extern void *crush_arena_alloc(struct crush_arena *arena, size_t size);
+
+/*
+ * Return 1 if __p__ was allocated by crush_arena_alloc() on __arena__
+ * and 0 otherwise. The cost is linear in the number of chunks, which
+ * grows logarithmically with the size of the arena.
+ */
+extern int crush_arena_contains(const struct crush_arena *arena, const void *p);
+
+/*
+ * Return the number of bytes allocated from the arena chunks.
+ */
+extern size_t crush_arena_size(const struct crush_arena *arena);
+
+/*
+ * Deallocate the arena and all the memory allocated from it.
+ */
+extern void crush_arena_destroy(struct crush_arena *arena);
+
+#endif
@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "crush_compat.h"
+#include "mapper.h"
+#include "hugepage.h"
+#include "batch.h"
+
+/*
+ * Inputs are handed to the threads in chunks small enough to balance
+ * the load when some values need many retries and large enough for
+ * the shared counter not to show in profiles.
+ */
+#define CRUSH_BATCH_CHUNK 1024
+
+struct crush_batch_job {
+	const struct crush_map *map;
+	int ruleno;
+	const int *xs;
+	int x_start;
+	int count;
+	int *results;
+	int *result_lens;
+	int result_max;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	int next;		/* index of the next chunk to map */
+	int error;
+};
+
+static void crush_batch_run(struct crush_batch_job *job, void *cwin)
+{
+	int start, end, i, x;
+
+	for (;;) {
+		start = __sync_fetch_and_add(&job->next, CRUSH_BATCH_CHUNK);
+		if (start >= job->count)
+			break;
+		end = start + CRUSH_BATCH_CHUNK;
+		if (end > job->count)
+			end = job->count;
+		for (i = start; i < end; i++) {
+			x = job->xs ? job->xs[i] : job->x_start + i;
+			job->result_lens[i] = crush_do_rule(
+				job->map, job->ruleno, x,
+				job->results + (size_t)i * job->result_max,
+				job->result_max,
+				job->weights, job->weight_max,
+				cwin, job->choose_args);
+		}
+	}
+}
+
+static void *crush_batch_thread(void *arg)
+{
+	struct crush_batch_job *job = arg;
+	size_t size = crush_work_size(job->map, job->result_max);
+	size_t mapped = size;
+	void *cwin;
+
+	cwin = crush_hugepage_alloc(&mapped, NULL);
+	if (!cwin) {
+		mapped = 0;
+		cwin = crush_malloc(size);
+	}
+	if (!cwin) {
+		job->error = -ENOMEM;
+		return NULL;
+	}
+	crush_init_workspace(job->map, cwin);
+	crush_batch_run(job, cwin);
+	if (mapped)
+		crush_hugepage_free(cwin, mapped);
+	else
+		crush_free(cwin);
+	return NULL;
+}
+
+int crush_batch_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+
+int crush_do_rule_batch(const struct crush_map *map, int ruleno,
+			const int *xs, int x_start, int count,
+			int *results, int *result_lens, int result_max,
+			const __u32 *weights, int weight_max,
+			const struct crush_choose_arg *choose_args,
+			int num_threads)
+{
+	struct crush_batch_job job;
+	pthread_t *threads;
+	int started, i;
+
+	if (count < 0 || result_max < 0)
+		return -EINVAL;
+	if (num_threads <= 0)
+		num_threads = crush_batch_default_threads();
+	if (num_threads > (count + CRUSH_BATCH_CHUNK - 1) / CRUSH_BATCH_CHUNK)
+		num_threads = (count + CRUSH_BATCH_CHUNK - 1) / CRUSH_BATCH_CHUNK;
+
+	job.map = map;
+	job.ruleno = ruleno;
+	job.xs = xs;
+	job.x_start = x_start;
+	job.count = count;
+	job.results = results;
+	job.result_lens = result_lens;
+	job.result_max = result_max;
+	job.weights = weights;
+	job.weight_max = weight_max;
+	job.choose_args = choose_args;
+	job.next = 0;
+	job.error = 0;
+
+	if (num_threads <= 1) {
+		crush_batch_thread(&job);
+		return job.error;
+	}
+
+	threads = crush_malloc(sizeof(*threads) * num_threads);
+	if (!threads)
+		return -ENOMEM;
+	for (started = 0; started < num_threads; started++)
+		if (pthread_create(&threads[started], NULL,
+				   crush_batch_thread, &job))
+			break;
+	/*
+	 * the threads that did start share the whole job, the result
+	 * is complete unless none of them could be created
+	 */
+	if (started == 0) {
+		crush_free(threads);
+		return -EAGAIN;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	crush_free(threads);
+	if (job.error && job.next < count)
+		return job.error;
+	return 0;
+}
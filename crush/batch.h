@@ -0,0 +1,60 @@
+#ifndef CEPH_CRUSH_BATCH_H
+#define CEPH_CRUSH_BATCH_H
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * Map __count__ values with crush_do_rule() using __num_threads__
+ * threads. The value mapped at index __i__ is __xs[i]__ or, if
+ * __xs__ is NULL, __x_start + i__.
+ *
+ * The items found for the value at index __i__ are stored in
+ * __results[i * result_max]__ to __results[i * result_max +
+ * result_max - 1]__ and the number of items found (i.e. the return
+ * value of crush_do_rule()) is stored in __result_lens[i]__. The
+ * content of __results__ beyond __result_lens[i]__ is undefined.
+ *
+ * Each thread allocates its own workspace with crush_work_size()
+ * and crush_init_workspace(), in huge pages if it is large enough
+ * (see crush_set_hugepages()), and is given a contiguous chunk of
+ * inputs at a time. The __map__, __weights__ and __choose_args__ are
+ * only read and may be shared with other readers, as long as nobody
+ * modifies them while crush_do_rule_batch() runs.
+ *
+ * - return -EINVAL if __count__ or __result_max__ is negative
+ * - return -ENOMEM if a workspace cannot be allocated
+ * - return -EAGAIN if a thread cannot be created
+ *
+ * @param map the crush_map, after crush_finalize()
+ * @param ruleno the rule to use, as in crush_do_rule()
+ * @param xs the values to map or NULL
+ * @param x_start the first value to map if __xs__ is NULL
+ * @param count the number of values to map
+ * @param results an array of __count * result_max__ items
+ * @param result_lens an array of __count__ result sizes
+ * @param result_max the maximum number of items per value
+ * @param weights as in crush_do_rule()
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args as in crush_do_rule(), may be NULL
+ * @param num_threads the number of threads, 0 for one per online cpu
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_do_rule_batch(const struct crush_map *map, int ruleno,
+			       const int *xs, int x_start, int count,
+			       int *results, int *result_lens, int result_max,
+			       const __u32 *weights, int weight_max,
+			       const struct crush_choose_arg *choose_args,
+			       int num_threads);
+
+/** @ingroup API
+ *
+ * Return the number of threads crush_do_rule_batch() uses when
+ * __num_threads__ is 0, i.e. the number of online cpus.
+ *
+ * @returns a number of threads >= 1
+ */
+extern int crush_batch_default_threads(void);
+
+#endif
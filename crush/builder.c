@@ -10,6 +10,8 @@
 
 #include "builder.h"
 #include "hash.h"
+#include "arena.h"
+#include "probes.h"
 
 #define dprintk(args...) /* printf(args) */
 
@@ -18,7 +20,7 @@
 struct crush_map *crush_create()
 {
 	struct crush_map *m;
-	m = malloc(sizeof(*m));
+	m = crush_malloc(sizeof(*m));
         if (!m)
                 return NULL;
 	memset(m, 0, sizeof(*m));
@@ -27,6 +29,92 @@ struct crush_map *crush_create()
 	return m;
 }
 
+struct crush_map *crush_create_arena_map(size_t size)
+{
+	struct crush_map *m = crush_create();
+
+	if (!m)
+		return NULL;
+	m->arena = crush_arena_create(size);
+	if (!m->arena) {
+		crush_destroy(m);
+		return NULL;
+	}
+	m->arena_only = 1;
+	return m;
+}
+
+/*
+ * Called by all the functions modifying the hierarchy or the weights
+ * of the map: crush_get_topology() analyzes it again when needed.
+ */
+static void crush_drop_topology(struct crush_map *map)
+{
+	crush_destroy_topology(map->topology);
+	map->topology = NULL;
+}
+
+/* the number of sizes __rule__ has in the rule index */
+static __u32 crush_rule_index_entries(const struct crush_rule *rule)
+{
+	if (rule->mask.min_size > rule->mask.max_size)
+		return 0;
+	return rule->mask.max_size - rule->mask.min_size + 1;
+}
+
+/* map the sizes of __rule__ to __ruleno__ unless a lower rule has them */
+static void crush_rule_index_insert(struct crush_rule_index *index,
+				    const struct crush_rule *rule, int ruleno)
+{
+	__u32 mask = (1 << index->order) - 1;
+	int size;
+
+	for (size = rule->mask.min_size; size <= rule->mask.max_size; size++) {
+		__u32 key = crush_rule_index_key(rule->mask.ruleset,
+						 rule->mask.type, size);
+		__u32 i = crush_rule_index_hash(index, key);
+
+		while (index->slots[i].key != 0 && index->slots[i].key != key)
+			i = (i + 1) & mask;
+		if (index->slots[i].key == 0) {
+			index->slots[i].key = key;
+			index->slots[i].ruleno = ruleno;
+			index->used++;
+		} else if (index->slots[i].ruleno > ruleno) {
+			index->slots[i].ruleno = ruleno;
+		}
+	}
+}
+
+/*
+ * Index all the rules of __map__ in a table at most half full. On
+ * error the map has no index and crush_find_rule() scans the rules.
+ */
+static int crush_build_rule_index(struct crush_map *map)
+{
+	struct crush_rule_index *index;
+	__u32 entries = 0, order = 4;
+	__u32 r;
+
+	crush_destroy_rule_index(map);
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			entries += crush_rule_index_entries(map->rules[r]);
+	while ((1u << order) < 2 * entries)
+		order++;
+	index = crush_calloc(1, sizeof(*index) + (sizeof(index->slots[0]) << order));
+	if (!index)
+		return -ENOMEM;
+	index->order = order;
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			crush_rule_index_insert(index, map->rules[r], r);
+	index->rules = map->rules;
+	index->max_rules = map->max_rules;
+	map->rule_index = index;
+	return 0;
+}
+
 /*
  * finalize should be called _after_ all buckets are added to the map.
  */
@@ -35,6 +123,10 @@ void crush_finalize(struct crush_map *map)
 	int b;
 	__u32 i;
 
+	CRUSH_PROBE1(finalize_entry, map->max_buckets);
+	crush_drop_topology(map);
+	crush_build_rule_index(map);
+
 	/* Calculate the needed working space while we do other
 	   finalization tasks. */
 	map->working_size = sizeof(struct crush_work);
@@ -61,6 +153,8 @@ void crush_finalize(struct crush_map *map)
 		/* Every bucket has a permutation array. */
 		map->working_size += map->buckets[b]->size * sizeof(__u32);
 	}
+	CRUSH_PROBE3(finalize_return, map->max_buckets, map->max_devices,
+		     map->working_size);
 }
 
 
@@ -69,6 +163,10 @@ void crush_finalize(struct crush_map *map)
 
 int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 {
+	struct crush_rule_index *index = map->rule_index;
+	/* the rules were modified without crush_add_rule() */
+	int stale = index == NULL ||
+		index->rules != map->rules || index->max_rules != map->max_rules;
 	__u32 r;
 
 	if (ruleno < 0) {
@@ -88,7 +186,7 @@ int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 			return -ENOSPC;
 		oldsize = map->max_rules;
 		map->max_rules = r+1;
-		if ((_realloc = realloc(map->rules, map->max_rules * sizeof(map->rules[0]))) == NULL) {
+		if ((_realloc = crush_realloc(map->rules, map->max_rules * sizeof(map->rules[0]))) == NULL) {
 			return -ENOMEM; 
 		} else {
 			map->rules = _realloc;
@@ -96,15 +194,24 @@ int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 		memset(map->rules + oldsize, 0, (map->max_rules-oldsize) * sizeof(map->rules[0]));
 	}
 
-	/* add it */
-	map->rules[r] = rule;
+	/* add it, rebuilding the index if a rule is replaced or it is full */
+	if (stale || map->rules[r] ||
+	    2 * (index->used + crush_rule_index_entries(rule)) > (1u << index->order)) {
+		map->rules[r] = rule;
+		crush_build_rule_index(map);
+	} else {
+		map->rules[r] = rule;
+		crush_rule_index_insert(index, rule, r);
+		index->rules = map->rules;
+		index->max_rules = map->max_rules;
+	}
 	return r;
 }
 
 struct crush_rule *crush_make_rule(int len, int ruleset, int type, int minsize, int maxsize)
 {
 	struct crush_rule *rule;
-	rule = malloc(crush_rule_size(len));
+	rule = crush_malloc(crush_rule_size(len));
         if (!rule)
                 return NULL;
 	rule->len = len;
@@ -115,6 +222,27 @@ struct crush_rule *crush_make_rule(int len, int ruleset, int type, int minsize,
 	return rule;
 }
 
+struct crush_rule *crush_make_arena_rule(struct crush_map *map, int len, int ruleset,
+					 int type, int minsize, int maxsize)
+{
+	struct crush_rule *rule;
+
+	if (map->arena == NULL) {
+		map->arena = crush_arena_create(0);
+		if (map->arena == NULL)
+			return NULL;
+	}
+	rule = crush_arena_alloc(map->arena, crush_rule_size(len));
+	if (!rule)
+		return NULL;
+	rule->len = len;
+	rule->mask.ruleset = ruleset;
+	rule->mask.type = type;
+	rule->mask.min_size = minsize;
+	rule->mask.max_size = maxsize;
+	return rule;
+}
+
 /*
  * be careful; this doesn't verify that the buffer you allocated is big enough!
  */
@@ -138,6 +266,287 @@ int crush_get_next_bucket_id(struct crush_map *map)
 }
 
 
+/*
+ * Return a pointer to the parent of __item__ in __map->parents__,
+ * growing it if __grow__ is set, NULL if the item is beyond its end
+ * or on error.
+ */
+static __s32 *crush_parent_slot(struct crush_map *map, int item, int grow)
+{
+	struct crush_parents *parents = map->parents;
+	__s32 **array = item >= 0 ? &parents->devices : &parents->buckets;
+	__s32 *max = item >= 0 ? &parents->max_devices : &parents->max_buckets;
+	int pos = item >= 0 ? item : -1 - item;
+
+	if (pos >= *max) {
+		int new_max = *max ? *max : 8;
+		void *_realloc;
+		if (!grow)
+			return NULL;
+		while (new_max <= pos)
+			new_max *= 2;
+		if ((_realloc = crush_realloc(*array, new_max * sizeof(**array))) == NULL)
+			return NULL;
+		*array = _realloc;
+		memset(*array + *max, 0, (new_max - *max) * sizeof(**array));
+		*max = new_max;
+	}
+	return *array + pos;
+}
+
+/*
+ * Record that __item__ is in bucket __id__ if the map has parents.
+ * The parents are dropped if they cannot grow: they are rebuilt when
+ * needed.
+ */
+static void crush_parent_link(struct crush_map *map, int item, int id)
+{
+	__s32 *parent;
+
+	if (map->parents == NULL)
+		return;
+	parent = crush_parent_slot(map, item, 1);
+	if (parent == NULL) {
+		crush_destroy_parents(map->parents);
+		map->parents = NULL;
+		return;
+	}
+	if (*parent == CRUSH_PARENT_NONE)
+		*parent = id;
+	else if (*parent != id)
+		*parent = CRUSH_PARENT_MANY;
+}
+
+/*
+ * Record that __item__ is no longer in bucket __id__. An item that
+ * was in several buckets stays marked as such.
+ */
+static void crush_parent_unlink(struct crush_map *map, int item, int id)
+{
+	__s32 *parent;
+
+	if (map->parents == NULL)
+		return;
+	parent = crush_parent_slot(map, item, 0);
+	if (parent && *parent == id)
+		*parent = CRUSH_PARENT_NONE;
+}
+
+static inline __u32 crush_item_hash(int item)
+{
+	return (__u32)item * 2654435761u;
+}
+
+/* the slot of __item__ in __index__ or the empty slot where it belongs */
+static struct crush_item_position *crush_item_index_find(struct crush_item_index *index,
+							 int item)
+{
+	__u32 i;
+
+	for (i = crush_item_hash(item) & index->mask; ; i = (i + 1) & index->mask)
+		if (index->slots[i].item == item ||
+		    index->slots[i].item == CRUSH_ITEM_NONE)
+			return &index->slots[i];
+}
+
+static void crush_item_index_delete(struct crush_item_index *index,
+				    struct crush_item_position *slot)
+{
+	__u32 hole = slot - index->slots;
+	__u32 i = hole;
+
+	/* move back the slots that would not be found past the hole */
+	for (;;) {
+		__u32 home;
+		i = (i + 1) & index->mask;
+		if (index->slots[i].item == CRUSH_ITEM_NONE)
+			break;
+		home = crush_item_hash(index->slots[i].item) & index->mask;
+		if (((i - home) & index->mask) >= ((i - hole) & index->mask)) {
+			index->slots[hole] = index->slots[i];
+			hole = i;
+		}
+	}
+	index->slots[hole].item = CRUSH_ITEM_NONE;
+}
+
+/* the index of bucket __id__ or NULL */
+static struct crush_item_index *crush_get_item_index(const struct crush_map *map, int id)
+{
+	int pos = -1 - id;
+
+	if (pos >= map->max_item_indexes)
+		return NULL;
+	return map->item_indexes[pos];
+}
+
+static void crush_drop_item_index(struct crush_map *map, int id)
+{
+	int pos = -1 - id;
+
+	if (pos >= map->max_item_indexes)
+		return;
+	crush_free(map->item_indexes[pos]);
+	map->item_indexes[pos] = NULL;
+}
+
+/*
+ * (Re)build the index of bucket __b__, with at least twice as many
+ * slots as items. Return NULL if __malloc(3)__ fails.
+ */
+static struct crush_item_index *crush_build_bucket_item_index(struct crush_map *map,
+							      const struct crush_bucket *b)
+{
+	struct crush_item_index *index;
+	int pos = -1 - b->id;
+	__u32 slots = 32;
+	unsigned i;
+
+	if (pos >= map->max_item_indexes) {
+		int max = map->max_buckets > pos ? map->max_buckets : pos + 1;
+		void *_realloc;
+		if ((_realloc = crush_realloc(map->item_indexes, max * sizeof(*map->item_indexes))) == NULL)
+			return NULL;
+		map->item_indexes = _realloc;
+		memset(map->item_indexes + map->max_item_indexes, 0,
+		       (max - map->max_item_indexes) * sizeof(*map->item_indexes));
+		map->max_item_indexes = max;
+	}
+	crush_drop_item_index(map, b->id);
+
+	while (slots < 2 * b->size)
+		slots *= 2;
+	index = crush_malloc(sizeof(*index) + slots * sizeof(index->slots[0]));
+	if (!index)
+		return NULL;
+	index->size = b->size;
+	index->mask = slots - 1;
+	for (i = 0; i < slots; i++)
+		index->slots[i].item = CRUSH_ITEM_NONE;
+	/* the first position of an item, as a linear search would */
+	for (i = 0; i < b->size; i++) {
+		struct crush_item_position *slot = crush_item_index_find(index, b->items[i]);
+		if (slot->item == CRUSH_ITEM_NONE) {
+			slot->item = b->items[i];
+			slot->pos = i;
+		}
+	}
+	map->item_indexes[pos] = index;
+	return index;
+}
+
+/*
+ * Return the position of __item__ in __b__ or -ENOENT. The index of
+ * the bucket is built if needed. The functions that only take the
+ * bucket, for instance crush_add_straw2_bucket_item(), do not update
+ * it: a position that does not hold __item__ or a miss that a linear
+ * search contradicts means it is stale and it is rebuilt.
+ */
+static int crush_bucket_item_position(struct crush_map *map,
+				      const struct crush_bucket *b, int item)
+{
+	struct crush_item_index *index = NULL;
+	struct crush_item_position *slot;
+	unsigned i;
+
+	if (b->size >= CRUSH_ITEM_INDEX_MIN) {
+		index = crush_get_item_index(map, b->id);
+		if (index == NULL || index->size != b->size)
+			index = crush_build_bucket_item_index(map, b);
+		if (index) {
+			slot = crush_item_index_find(index, item);
+			if (slot->item != CRUSH_ITEM_NONE &&
+			    (__u32)slot->pos < b->size && b->items[slot->pos] == item)
+				return slot->pos;
+		}
+	}
+	for (i = 0; i < b->size; i++)
+		if (b->items[i] == item)
+			break;
+	/* stale, the next lookups will be fast again (or linear if malloc fails) */
+	if (index && (i < b->size || slot->item != CRUSH_ITEM_NONE))
+		crush_build_bucket_item_index(map, b);
+	return i < b->size ? (int)i : -ENOENT;
+}
+
+/* __item__ was appended to __b__ */
+static void crush_item_index_added(struct crush_map *map,
+				   const struct crush_bucket *b, int item)
+{
+	struct crush_item_index *index = crush_get_item_index(map, b->id);
+	struct crush_item_position *slot;
+
+	if (index == NULL)
+		return;
+	if (index->size + 1 != b->size || 2 * b->size > index->mask + 1) {
+		crush_drop_item_index(map, b->id);
+		return;
+	}
+	slot = crush_item_index_find(index, item);
+	if (slot->item == CRUSH_ITEM_NONE) {
+		slot->item = item;
+		slot->pos = b->size - 1;
+	}
+	index->size = b->size;
+}
+
+/* __item__ at position __pos__ was removed from __b__, shifting the items after it */
+static void crush_item_index_removed(struct crush_map *map,
+				     const struct crush_bucket *b, int item, unsigned pos)
+{
+	struct crush_item_index *index = crush_get_item_index(map, b->id);
+	struct crush_item_position *slot;
+	unsigned i;
+
+	if (index == NULL)
+		return;
+	if (index->size != b->size + 1) {
+		crush_drop_item_index(map, b->id);
+		return;
+	}
+	slot = crush_item_index_find(index, item);
+	if (slot->item == item && (unsigned)slot->pos == pos)
+		crush_item_index_delete(index, slot);
+	for (i = pos; i < b->size; i++) {
+		slot = crush_item_index_find(index, b->items[i]);
+		if (slot->item == CRUSH_ITEM_NONE) {
+			/* another copy of the removed item */
+			slot->item = b->items[i];
+			slot->pos = i;
+		} else if ((unsigned)slot->pos > i) {
+			slot->pos = i;
+		}
+	}
+	index->size = b->size;
+}
+
+/*
+ * Remember that bucket __id__ of an arena only map has, or is about
+ * to have, memory outside of the arena that crush_destroy() must
+ * release.
+ */
+static int crush_add_heap_bucket(struct crush_map *map, int id)
+{
+	if (map->heap_bucket_count == map->max_heap_buckets) {
+		int max = map->max_heap_buckets ? 2 * map->max_heap_buckets : 8;
+		void *_realloc = crush_realloc(map->heap_buckets, max * sizeof(__s32));
+		if (!_realloc)
+			return -ENOMEM;
+		map->heap_buckets = _realloc;
+		map->max_heap_buckets = max;
+	}
+	map->heap_buckets[map->heap_bucket_count++] = id;
+	return 0;
+}
+
+/* true if some of the memory of bucket __b__ is not in the arena */
+static int crush_bucket_on_heap(const struct crush_map *map,
+				const struct crush_bucket *b)
+{
+	return !crush_arena_contains(map->arena, b) ||
+		(b->items && !crush_arena_contains(map->arena, b->items));
+}
+
 int crush_add_bucket(struct crush_map *map,
 		     int id,
 		     struct crush_bucket *bucket,
@@ -158,7 +567,7 @@ int crush_add_bucket(struct crush_map *map,
 		else
 			map->max_buckets = 8;
 		void *_realloc = NULL;
-		if ((_realloc = realloc(map->buckets, map->max_buckets * sizeof(map->buckets[0]))) == NULL) {
+		if ((_realloc = crush_realloc(map->buckets, map->max_buckets * sizeof(map->buckets[0]))) == NULL) {
 			return -ENOMEM; 
 		} else {
 			map->buckets = _realloc;
@@ -170,9 +579,16 @@ int crush_add_bucket(struct crush_map *map,
 		return -EEXIST;
 	}
 
+	if (map->arena_only && crush_bucket_on_heap(map, bucket) &&
+	    crush_add_heap_bucket(map, id) < 0)
+		return -ENOMEM;
+
         /* add it */
+	crush_drop_topology(map);
 	bucket->id = id;
 	map->buckets[pos] = bucket;
+	for (pos = 0; map->parents && pos < (int)bucket->size; pos++)
+		crush_parent_link(map, bucket->items[pos], id);
 
 	if (idout) *idout = id;
 	return 0;
@@ -181,9 +597,14 @@ int crush_add_bucket(struct crush_map *map,
 int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucket)
 {
 	int pos = -1 - bucket->id;
+	unsigned i;
        assert(pos < map->max_buckets);
 	map->buckets[pos] = NULL;
-	crush_destroy_bucket(bucket);
+	crush_drop_topology(map);
+	crush_drop_item_index(map, bucket->id);
+	for (i = 0; map->parents && i < bucket->size; i++)
+		crush_parent_unlink(map, bucket->items[i], bucket->id);
+	crush_destroy_map_bucket(map, bucket);
 	return 0;
 }
 
@@ -198,7 +619,7 @@ crush_make_uniform_bucket(int hash, int type, int size,
 	int i;
 	struct crush_bucket_uniform *bucket;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_malloc(sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -212,7 +633,7 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	bucket->h.weight = size * item_weight;
 	bucket->item_weight = item_weight;
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = crush_malloc(sizeof(__s32)*size);
 
         if (!bucket->h.items)
                 goto err;
@@ -222,8 +643,8 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->h.items);
-        free(bucket);
+        crush_free(bucket->h.items);
+        crush_free(bucket);
         return NULL;
 }
 
@@ -239,7 +660,7 @@ crush_make_list_bucket(int hash, int type, int size,
 	int w;
 	struct crush_bucket_list *bucket;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_malloc(sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -248,15 +669,15 @@ crush_make_list_bucket(int hash, int type, int size,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = crush_malloc(sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
 
 
-        bucket->item_weights = malloc(sizeof(__u32)*size);
+        bucket->item_weights = crush_malloc(sizeof(__u32)*size);
         if (!bucket->item_weights)
                 goto err;
-	bucket->sum_weights = malloc(sizeof(__u32)*size);
+	bucket->sum_weights = crush_malloc(sizeof(__u32)*size);
         if (!bucket->sum_weights)
                 goto err;
 	w = 0;
@@ -277,10 +698,10 @@ crush_make_list_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->sum_weights);
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_free(bucket->sum_weights);
+        crush_free(bucket->item_weights);
+        crush_free(bucket->h.items);
+        crush_free(bucket);
         return NULL;
 }
 
@@ -332,7 +753,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 	int node;
 	int i, j;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_malloc(sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -350,7 +771,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 		return bucket;
 	}
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = crush_malloc(sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
 
@@ -359,7 +780,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 	bucket->num_nodes = 1 << depth;
 	dprintk("size %d depth %d nodes %d\n", size, depth, bucket->num_nodes);
 
-        bucket->node_weights = malloc(sizeof(__u32)*bucket->num_nodes);
+        bucket->node_weights = crush_malloc(sizeof(__u32)*bucket->num_nodes);
         if (!bucket->node_weights)
                 goto err;
 
@@ -390,9 +811,9 @@ crush_make_tree_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->node_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_free(bucket->node_weights);
+        crush_free(bucket->h.items);
+        crush_free(bucket);
         return NULL;
 }
 
@@ -437,7 +858,7 @@ int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
 	__u32 *weights = bucket->item_weights;
 
 	/* reverse sort by weight (simple insertion sort) */
-	reverse = malloc(sizeof(int) * size);
+	reverse = crush_malloc(sizeof(int) * size);
         if (!reverse)
                 return -ENOMEM;
 	if (size)
@@ -541,7 +962,7 @@ int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
 		}
 	}
 
-	free(reverse);
+	crush_free(reverse);
 	return 0;
 }
 
@@ -556,7 +977,7 @@ crush_make_straw_bucket(struct crush_map *map,
 	struct crush_bucket_straw *bucket;
 	int i;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_malloc(sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -565,13 +986,13 @@ crush_make_straw_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = crush_malloc(sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = crush_malloc(sizeof(__u32)*size);
         if (!bucket->item_weights)
                 goto err;
-        bucket->straws = malloc(sizeof(__u32)*size);
+        bucket->straws = crush_malloc(sizeof(__u32)*size);
         if (!bucket->straws)
                 goto err;
 
@@ -587,10 +1008,10 @@ crush_make_straw_bucket(struct crush_map *map,
 
 	return bucket;
 err:
-        free(bucket->straws);
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_free(bucket->straws);
+        crush_free(bucket->item_weights);
+        crush_free(bucket->h.items);
+        crush_free(bucket);
         return NULL;
 }
 
@@ -605,7 +1026,7 @@ crush_make_straw2_bucket(struct crush_map *map,
 	struct crush_bucket_straw2 *bucket;
 	int i;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = crush_malloc(sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -614,10 +1035,10 @@ crush_make_straw2_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = crush_malloc(sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = crush_malloc(sizeof(__u32)*size);
         if (!bucket->item_weights)
                 goto err;
 
@@ -630,9 +1051,9 @@ crush_make_straw2_bucket(struct crush_map *map,
 
 	return bucket;
 err:
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        crush_free(bucket->item_weights);
+        crush_free(bucket->h.items);
+        crush_free(bucket);
         return NULL;
 }
 
@@ -646,6 +1067,13 @@ crush_make_bucket(struct crush_map *map,
 {
 	int item_weight;
 
+	if (map->arena_only) {
+		int zero = 0;
+		if (alg == CRUSH_BUCKET_UNIFORM && weights == NULL)
+			weights = &zero;
+		return crush_make_arena_bucket(map, alg, hash, type, size,
+					       items, weights);
+	}
 	switch (alg) {
 	case CRUSH_BUCKET_UNIFORM:
 		if (size && weights)
@@ -668,9 +1096,401 @@ crush_make_bucket(struct crush_map *map,
 	return 0;
 }
 
+struct crush_bucket *
+crush_make_arena_bucket(struct crush_map *map,
+			int alg, int hash, int type, int size,
+			const int *items,
+			const int *weights)
+{
+	struct crush_bucket *bucket;
+	size_t struct_size, arrays;
+	__u32 *p;
+	int num_nodes = 0;
+	int depth = 0;
+	int i, j, node;
+
+	if (size < 0)
+		return NULL;
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		struct_size = sizeof(struct crush_bucket_uniform);
+		arrays = 0;
+		break;
+	case CRUSH_BUCKET_LIST:
+		struct_size = sizeof(struct crush_bucket_list);
+		arrays = 2 * (size_t)size;
+		break;
+	case CRUSH_BUCKET_TREE:
+		struct_size = sizeof(struct crush_bucket_tree);
+		if (size > 0) {
+			depth = calc_depth(size);
+			num_nodes = 1 << depth;
+		}
+		arrays = num_nodes;
+		break;
+	case CRUSH_BUCKET_STRAW:
+		struct_size = sizeof(struct crush_bucket_straw);
+		arrays = 2 * (size_t)size;
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		struct_size = sizeof(struct crush_bucket_straw2);
+		arrays = size;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (map->arena == NULL) {
+		map->arena = crush_arena_create(0);
+		if (map->arena == NULL)
+			return NULL;
+	}
+	bucket = crush_arena_alloc(map->arena, struct_size +
+				   ((size_t)size + arrays) * sizeof(__u32));
+	if (!bucket)
+		return NULL;
+	memset(bucket, 0, struct_size);
+	bucket->alg = alg;
+	bucket->hash = hash;
+	bucket->type = type;
+	bucket->size = size;
+	if (size == 0)
+		return bucket;
+
+	p = (__u32 *)((char *)bucket + struct_size);
+	bucket->items = (__s32 *)p;
+	memcpy(bucket->items, items, sizeof(__s32) * size);
+	p += size;
+
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM: {
+		struct crush_bucket_uniform *uniform = (struct crush_bucket_uniform *)bucket;
+		if (crush_multiplication_is_unsafe(size, weights[0]))
+			return NULL;
+		uniform->item_weight = weights[0];
+		bucket->weight = size * weights[0];
+		break;
+	}
+	case CRUSH_BUCKET_LIST: {
+		struct crush_bucket_list *list = (struct crush_bucket_list *)bucket;
+		list->item_weights = p;
+		list->sum_weights = p + size;
+		for (i = 0; i < size; i++) {
+			if (crush_addition_is_unsafe(bucket->weight, weights[i]))
+				return NULL;
+			bucket->weight += weights[i];
+			list->item_weights[i] = weights[i];
+			list->sum_weights[i] = bucket->weight;
+		}
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		struct crush_bucket_tree *tree = (struct crush_bucket_tree *)bucket;
+		tree->num_nodes = num_nodes;
+		tree->node_weights = p;
+		memset(tree->node_weights, 0, sizeof(__u32) * num_nodes);
+		for (i = 0; i < size; i++) {
+			node = crush_calc_tree_node(i);
+			tree->node_weights[node] = weights[i];
+			if (crush_addition_is_unsafe(bucket->weight, weights[i]))
+				return NULL;
+			bucket->weight += weights[i];
+			for (j = 1; j < depth; j++) {
+				node = parent(node);
+				tree->node_weights[node] += weights[i];
+			}
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		struct crush_bucket_straw *straw = (struct crush_bucket_straw *)bucket;
+		straw->item_weights = p;
+		straw->straws = p + size;
+		for (i = 0; i < size; i++) {
+			if (crush_addition_is_unsafe(bucket->weight, weights[i]))
+				return NULL;
+			bucket->weight += weights[i];
+			straw->item_weights[i] = weights[i];
+		}
+		if (crush_calc_straw(map, straw) < 0)
+			return NULL;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		struct crush_bucket_straw2 *straw2 = (struct crush_bucket_straw2 *)bucket;
+		straw2->item_weights = p;
+		for (i = 0; i < size; i++) {
+			if (crush_addition_is_unsafe(bucket->weight, weights[i]))
+				return NULL;
+			bucket->weight += weights[i];
+			straw2->item_weights[i] = weights[i];
+		}
+		break;
+	}
+	}
+	return bucket;
+}
+
+int crush_add_hierarchy(struct crush_map *map, int count,
+			const int *parent, const int *alg, const int *type,
+			const int *weight, int *ids)
+{
+	int *offsets, *children, *order, *weights, *node_ids, *items, *item_weights;
+	char *reserved = NULL;
+	int max_buckets = map->max_buckets;
+	int reserved_size = map->max_buckets;
+	int added = 0, next_pos = 0;
+	int head, tail, i, j;
+	int err = 0;
+
+	if (count <= 0)
+		return count < 0 ? -EINVAL : 0;
+	/* one allocation for all the temporary arrays */
+	offsets = crush_malloc(sizeof(int) * (7 * (size_t)count + 1));
+	if (!offsets)
+		return -ENOMEM;
+	children = offsets + count + 1;
+	order = children + count;
+	weights = order + count;
+	node_ids = weights + count;
+	items = node_ids + count;
+	item_weights = items + count;
+
+	/* the children of node i are children[offsets[i]..offsets[i+1]) */
+	memset(offsets, 0, sizeof(int) * (count + 1));
+	for (i = 0; i < count; i++) {
+		if (parent[i] < -1 || parent[i] >= count ||
+		    (parent[i] >= 0 && alg[parent[i]] == 0) ||
+		    (alg[i] == 0 && (ids[i] < 0 || parent[i] < 0)) ||
+		    (alg[i] != 0 && (ids[i] > 0 || alg[i] < CRUSH_BUCKET_UNIFORM ||
+				     alg[i] > CRUSH_BUCKET_STRAW2))) {
+			err = -EINVAL;
+			goto out;
+		}
+		if (parent[i] >= 0)
+			offsets[parent[i] + 1]++;
+		if (alg[i] != 0 && ids[i] < 0 && -ids[i] > reserved_size)
+			reserved_size = -ids[i];
+	}
+	for (i = 0; i < count; i++)
+		offsets[i + 1] += offsets[i];
+	/* order is used as the insertion cursor of each node */
+	memcpy(order, offsets, sizeof(int) * count);
+	for (i = 0; i < count; i++)
+		if (parent[i] >= 0)
+			children[order[parent[i]]++] = i;
+
+	/* breadth first from the roots, a node that is never reached is in a cycle */
+	tail = 0;
+	for (i = 0; i < count; i++)
+		if (parent[i] < 0)
+			order[tail++] = i;
+	for (head = 0; head < tail; head++)
+		for (j = offsets[order[head]]; j < offsets[order[head] + 1]; j++)
+			order[tail++] = children[j];
+	if (tail != count) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* the weights, bottom up, before the map is modified */
+	for (head = count - 1; head >= 0; head--) {
+		int node = order[head];
+		__u64 sum = 0;
+		if (alg[node] == 0) {
+			weights[node] = weight[node];
+			continue;
+		}
+		for (j = offsets[node]; j < offsets[node + 1]; j++) {
+			int child = children[j];
+			if (alg[node] == CRUSH_BUCKET_UNIFORM &&
+			    weights[child] != weights[children[offsets[node]]]) {
+				err = -EINVAL;
+				goto out;
+			}
+			sum += (__u32)weights[child];
+		}
+		if (sum > 0xffffffffull) {
+			err = -ERANGE;
+			goto out;
+		}
+		weights[node] = (int)sum;
+	}
+
+	/*
+	 * The bucket ids: the explicit ones are reserved first so that
+	 * the others, allocated in order, do not take them.
+	 */
+	reserved_size += count;
+	reserved = crush_calloc(reserved_size, 1);
+	if (!reserved) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		int pos = -1 - ids[i];
+		node_ids[i] = ids[i];
+		if (alg[i] == 0 || ids[i] == 0)
+			continue;
+		if (reserved[pos] ||
+		    (pos < map->max_buckets && map->buckets[pos])) {
+			err = -EEXIST;
+			goto out;
+		}
+		reserved[pos] = 1;
+	}
+	for (i = 0; i < count; i++) {
+		if (alg[i] == 0 || ids[i] != 0)
+			continue;
+		while (reserved[next_pos] ||
+		       (next_pos < map->max_buckets && map->buckets[next_pos]))
+			next_pos++;
+		reserved[next_pos] = 1;
+		node_ids[i] = -1 - next_pos;
+	}
+
+	/* the buckets, children first for their ids to be known */
+	for (head = count - 1; head >= 0; head--) {
+		int node = order[head];
+		int size = offsets[node + 1] - offsets[node];
+		struct crush_bucket *b;
+		if (alg[node] == 0)
+			continue;
+		for (j = 0; j < size; j++) {
+			int child = children[offsets[node] + j];
+			items[j] = node_ids[child];
+			item_weights[j] = weights[child];
+		}
+		b = crush_make_arena_bucket(map, alg[node], CRUSH_HASH_DEFAULT,
+					    type[node], size, items, item_weights);
+		if (!b) {
+			err = -ENOMEM;
+			goto rollback;
+		}
+		err = crush_add_bucket(map, node_ids[node], b, NULL);
+		if (err < 0)
+			goto rollback;
+		added++;
+	}
+	memcpy(ids, node_ids, sizeof(int) * count);
+	goto out;
+
+rollback:
+	/* the buckets are in the arena and released with the map */
+	for (head = count - 1; added > 0; head--) {
+		int node = order[head];
+		if (alg[node] == 0)
+			continue;
+		map->buckets[-1 - node_ids[node]] = NULL;
+		added--;
+	}
+	/* the array may have grown, the slots beyond max_buckets are NULL */
+	map->max_buckets = max_buckets;
+	/* the items that were already in a bucket are now CRUSH_PARENT_MANY */
+	if (map->parents)
+		crush_build_parents(map);
+out:
+	crush_free(reserved);
+	crush_free(offsets);
+	return err;
+}
+
 
 /************************************************/
 
+/*
+ * Return a crush_malloc(3) copy of the __size__ bytes at __p__ if it is in
+ * the __map__ arena, __p__ otherwise. Return NULL on error and set
+ * __copied__ to 1 if __p__ was copied.
+ */
+static void *crush_arena_unshare(struct crush_map *map, void *p, size_t size,
+				 int *copied)
+{
+	void *copy;
+
+	*copied = 0;
+	if (p == NULL || !crush_arena_contains(map->arena, p))
+		return p;
+	copy = crush_malloc(size ? size : 1);
+	if (!copy)
+		return NULL;
+	memcpy(copy, p, size);
+	*copied = 1;
+	return copy;
+}
+
+/*
+ * The arrays of a bucket allocated from the map arena (for instance
+ * by crush_decode()) cannot be resized with crush_realloc(3). Before a
+ * bucket is resized, all its arrays are copied out of the arena so
+ * that the rest of the builder does not need to know about it. The
+ * bucket itself stays in the arena.
+ */
+static int crush_bucket_unshare(struct crush_map *map, struct crush_bucket *b)
+{
+	void *arrays[3] = { NULL, NULL, NULL };
+	__u32 **fields[3] = { NULL, NULL, NULL };
+	size_t sizes[3] = { 0, 0, 0 };
+	int copied[3] = { 0, 0, 0 };
+	__s32 *items;
+	int items_copied;
+	int n = 0, i;
+
+	if (map->arena == NULL)
+		return 0;
+
+	/* the arrays are about to leave the arena, if they are not already */
+	if (map->arena_only && b->id < 0 &&
+	    -1 - b->id < map->max_buckets && map->buckets[-1 - b->id] == b &&
+	    !crush_bucket_on_heap(map, b) &&
+	    crush_add_heap_bucket(map, b->id) < 0)
+		return -ENOMEM;
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST:
+		fields[n] = &((struct crush_bucket_list *)b)->item_weights;
+		sizes[n++] = sizeof(__u32) * b->size;
+		fields[n] = &((struct crush_bucket_list *)b)->sum_weights;
+		sizes[n++] = sizeof(__u32) * b->size;
+		break;
+	case CRUSH_BUCKET_TREE:
+		fields[n] = &((struct crush_bucket_tree *)b)->node_weights;
+		sizes[n++] = sizeof(__u32) * ((struct crush_bucket_tree *)b)->num_nodes;
+		break;
+	case CRUSH_BUCKET_STRAW:
+		fields[n] = &((struct crush_bucket_straw *)b)->item_weights;
+		sizes[n++] = sizeof(__u32) * b->size;
+		fields[n] = &((struct crush_bucket_straw *)b)->straws;
+		sizes[n++] = sizeof(__u32) * b->size;
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		fields[n] = &((struct crush_bucket_straw2 *)b)->item_weights;
+		sizes[n++] = sizeof(__u32) * b->size;
+		break;
+	}
+
+	items = crush_arena_unshare(map, b->items, sizeof(__s32) * b->size,
+				    &items_copied);
+	if (!items && b->items)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		arrays[i] = crush_arena_unshare(map, *fields[i], sizes[i], &copied[i]);
+		if (!arrays[i] && *fields[i])
+			goto err;
+	}
+	b->items = items;
+	for (i = 0; i < n; i++)
+		*fields[i] = arrays[i];
+	return 0;
+err:
+	while (i-- > 0)
+		if (copied[i])
+			crush_free(arrays[i]);
+	if (items_copied)
+		crush_free(items);
+	return -ENOMEM;
+}
+
 int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item, int weight)
 {
         int newsize = bucket->h.size + 1;
@@ -685,7 +1505,7 @@ int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item,
 	  return -EINVAL;
 	}
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
@@ -707,17 +1527,17 @@ int crush_add_list_bucket_item(struct crush_bucket_list *bucket, int item, int w
         int newsize = bucket->h.size + 1;
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->sum_weights = _realloc;
@@ -752,12 +1572,12 @@ int crush_add_tree_bucket_item(struct crush_bucket_tree *bucket, int item, int w
 
 	bucket->num_nodes = 1 << depth;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->node_weights, sizeof(__u32)*bucket->num_nodes)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->node_weights, sizeof(__u32)*bucket->num_nodes)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->node_weights = _realloc;
@@ -804,17 +1624,17 @@ int crush_add_straw_bucket_item(struct crush_map *map,
 
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->straws = _realloc;
@@ -840,12 +1660,12 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
@@ -866,37 +1686,55 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 int crush_bucket_add_item(struct crush_map *map,
 			  struct crush_bucket *b, int item, int weight)
 {
+	int r;
+
+	if (crush_bucket_unshare(map, b) < 0)
+		return -ENOMEM;
+
+	crush_drop_topology(map);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_add_uniform_bucket_item((struct crush_bucket_uniform *)b, item, weight);
+		r = crush_add_uniform_bucket_item((struct crush_bucket_uniform *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_LIST:
-		return crush_add_list_bucket_item((struct crush_bucket_list *)b, item, weight);
+		r = crush_add_list_bucket_item((struct crush_bucket_list *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_TREE:
-		return crush_add_tree_bucket_item((struct crush_bucket_tree *)b, item, weight);
+		r = crush_add_tree_bucket_item((struct crush_bucket_tree *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_STRAW:
-		return crush_add_straw_bucket_item(map, (struct crush_bucket_straw *)b, item, weight);
+		r = crush_add_straw_bucket_item(map, (struct crush_bucket_straw *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_STRAW2:
-		return crush_add_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item, weight);
+		r = crush_add_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item, weight);
+		break;
 	default:
 		return -1;
 	}
+	if (r == 0) {
+		crush_item_index_added(map, b, item);
+		crush_parent_link(map, item, b->id);
+	} else {
+		crush_drop_item_index(map, b->id);
+	}
+	return r;
 }
 
 /************************************************/
 
-int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item)
+/*
+ * The crush_remove_*_bucket_item_at() and
+ * crush_adjust_*_bucket_item_weight_at() functions operate on the
+ * item at position __i__, found by the caller.
+ */
+
+static int crush_remove_uniform_bucket_item_at(struct crush_bucket_uniform *bucket, unsigned i)
 {
-	unsigned i, j;
+	unsigned j;
 	int newsize;
 	void *_realloc = NULL;
-	
-	for (i = 0; i < bucket->h.size; i++)
-		if (bucket->h.items[i] == item)
-			break;
-	if (i == bucket->h.size)
-		return -ENOENT;
 
-	for (j = i; j < bucket->h.size; j++)
+	for (j = i; j + 1 < bucket->h.size; j++)
 		bucket->h.items[j] = bucket->h.items[j+1];
 	newsize = --bucket->h.size;
 	if (bucket->item_weight < bucket->h.weight)
@@ -904,7 +1742,12 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	else
 		bucket->h.weight = 0;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (newsize == 0) {
+		crush_free(bucket->h.items);
+		bucket->h.items = NULL;
+		return 0;
+	}
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
@@ -912,20 +1755,24 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	return 0;
 }
 
-int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
+int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item)
 {
-	unsigned i, j;
-	int newsize;
-	unsigned weight;
+	unsigned i;
 
 	for (i = 0; i < bucket->h.size; i++)
 		if (bucket->h.items[i] == item)
-			break;
-	if (i == bucket->h.size)
-		return -ENOENT;
+			return crush_remove_uniform_bucket_item_at(bucket, i);
+	return -ENOENT;
+}
+
+static int crush_remove_list_bucket_item_at(struct crush_bucket_list *bucket, unsigned i)
+{
+	unsigned j;
+	int newsize;
+	unsigned weight;
 
 	weight = bucket->item_weights[i];
-	for (j = i; j < bucket->h.size; j++) {
+	for (j = i; j + 1 < bucket->h.size; j++) {
 		bucket->h.items[j] = bucket->h.items[j+1];
 		bucket->item_weights[j] = bucket->item_weights[j+1];
 		bucket->sum_weights[j] = bucket->sum_weights[j+1] - weight;
@@ -938,17 +1785,26 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 	
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (newsize == 0) {
+		crush_free(bucket->h.items);
+		crush_free(bucket->item_weights);
+		crush_free(bucket->sum_weights);
+		bucket->h.items = NULL;
+		bucket->item_weights = NULL;
+		bucket->sum_weights = NULL;
+		return 0;
+	}
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->sum_weights = _realloc;
@@ -956,38 +1812,38 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 	return 0;
 }
 
-int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
+int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 {
 	unsigned i;
-	unsigned newsize;
 
-	for (i = 0; i < bucket->h.size; i++) {
-		int node;
-		unsigned weight;
-		int j;
-		int depth = calc_depth(bucket->h.size);
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			return crush_remove_list_bucket_item_at(bucket, i);
+	return -ENOENT;
+}
 
-		if (bucket->h.items[i] != item)
-			continue;
+static int crush_remove_tree_bucket_item_at(struct crush_bucket_tree *bucket, unsigned i)
+{
+	unsigned newsize;
+	int node;
+	unsigned weight;
+	int j;
+	int depth = calc_depth(bucket->h.size);
 
-		bucket->h.items[i] = 0;
-		node = crush_calc_tree_node(i);
-		weight = bucket->node_weights[node];
-		bucket->node_weights[node] = 0;
+	bucket->h.items[i] = 0;
+	node = crush_calc_tree_node(i);
+	weight = bucket->node_weights[node];
+	bucket->node_weights[node] = 0;
 
-		for (j = 1; j < depth; j++) {
-			node = parent(node);
-			bucket->node_weights[node] -= weight;
-			dprintk(" node %d weight %d\n", node, bucket->node_weights[node]);
-		}
-		if (weight < bucket->h.weight)
-			bucket->h.weight -= weight;
-		else
-			bucket->h.weight = 0;
-		break;
+	for (j = 1; j < depth; j++) {
+		node = parent(node);
+		bucket->node_weights[node] -= weight;
+		dprintk(" node %d weight %d\n", node, bucket->node_weights[node]);
 	}
-	if (i == bucket->h.size)
-		return -ENOENT;
+	if (weight < bucket->h.weight)
+		bucket->h.weight -= weight;
+	else
+		bucket->h.weight = 0;
 
 	newsize = bucket->h.size;
 	while (newsize > 0) {
@@ -1002,7 +1858,10 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 
 		void *_realloc = NULL;
 
-		if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+		if (newsize == 0) {
+			crush_free(bucket->h.items);
+			bucket->h.items = NULL;
+		} else if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 			return -ENOMEM;
 		} else {
 			bucket->h.items = _realloc;
@@ -1012,7 +1871,7 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 		newdepth = calc_depth(newsize);
 		if (olddepth != newdepth) {
 			bucket->num_nodes = 1 << newdepth;
-			if ((_realloc = realloc(bucket->node_weights, 
+			if ((_realloc = crush_realloc(bucket->node_weights, 
 						sizeof(__u32)*bucket->num_nodes)) == NULL) {
 				return -ENOMEM;
 			} else {
@@ -1025,42 +1884,53 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 	return 0;
 }
 
-int crush_remove_straw_bucket_item(struct crush_map *map,
-				   struct crush_bucket_straw *bucket, int item)
+int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
+{
+	unsigned i;
+
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			return crush_remove_tree_bucket_item_at(bucket, i);
+	return -ENOENT;
+}
+
+static int crush_remove_straw_bucket_item_at(struct crush_map *map,
+					     struct crush_bucket_straw *bucket, unsigned i)
 {
 	int newsize = bucket->h.size - 1;
-	unsigned i, j;
+	unsigned j;
+	void *_realloc = NULL;
 
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item) {
-			bucket->h.size--;
-			if (bucket->item_weights[i] < bucket->h.weight)
-				bucket->h.weight -= bucket->item_weights[i];
-			else
-				bucket->h.weight = 0;
-			for (j = i; j < bucket->h.size; j++) {
-				bucket->h.items[j] = bucket->h.items[j+1];
-				bucket->item_weights[j] = bucket->item_weights[j+1];
-			}
-			break;
-		}
+	bucket->h.size--;
+	if (bucket->item_weights[i] < bucket->h.weight)
+		bucket->h.weight -= bucket->item_weights[i];
+	else
+		bucket->h.weight = 0;
+	for (j = i; j < bucket->h.size; j++) {
+		bucket->h.items[j] = bucket->h.items[j+1];
+		bucket->item_weights[j] = bucket->item_weights[j+1];
 	}
-	if (i == bucket->h.size)
-		return -ENOENT;
-	
-	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (newsize == 0) {
+		crush_free(bucket->h.items);
+		crush_free(bucket->item_weights);
+		crush_free(bucket->straws);
+		bucket->h.items = NULL;
+		bucket->item_weights = NULL;
+		bucket->straws = NULL;
+		return 0;
+	}
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->straws = _realloc;
@@ -1069,37 +1939,47 @@ int crush_remove_straw_bucket_item(struct crush_map *map,
 	return crush_calc_straw(map, bucket);
 }
 
-int crush_remove_straw2_bucket_item(struct crush_map *map,
-				    struct crush_bucket_straw2 *bucket, int item)
+int crush_remove_straw_bucket_item(struct crush_map *map,
+				   struct crush_bucket_straw *bucket, int item)
 {
-	int newsize = bucket->h.size - 1;
-	unsigned i, j;
+	unsigned i;
 
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item) {
-			bucket->h.size--;
-			if (bucket->item_weights[i] < bucket->h.weight)
-				bucket->h.weight -= bucket->item_weights[i];
-			else
-				bucket->h.weight = 0;
-			for (j = i; j < bucket->h.size; j++) {
-				bucket->h.items[j] = bucket->h.items[j+1];
-				bucket->item_weights[j] = bucket->item_weights[j+1];
-			}
-			break;
-		}
-	}
-	if (i == bucket->h.size)
-		return -ENOENT;
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			return crush_remove_straw_bucket_item_at(map, bucket, i);
+	return -ENOENT;
+}
 
+static int crush_remove_straw2_bucket_item_at(struct crush_map *map,
+					      struct crush_bucket_straw2 *bucket, unsigned i)
+{
+	int newsize = bucket->h.size - 1;
+	unsigned j;
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	bucket->h.size--;
+	if (bucket->item_weights[i] < bucket->h.weight)
+		bucket->h.weight -= bucket->item_weights[i];
+	else
+		bucket->h.weight = 0;
+	for (j = i; j < bucket->h.size; j++) {
+		bucket->h.items[j] = bucket->h.items[j+1];
+		bucket->item_weights[j] = bucket->item_weights[j+1];
+	}
+
+	if (newsize == 0) {
+		crush_free(bucket->h.items);
+		crush_free(bucket->item_weights);
+		bucket->h.items = NULL;
+		bucket->item_weights = NULL;
+		return 0;
+	}
+	if ((_realloc = crush_realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = crush_realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
@@ -1108,22 +1988,56 @@ int crush_remove_straw2_bucket_item(struct crush_map *map,
 	return 0;
 }
 
+int crush_remove_straw2_bucket_item(struct crush_map *map,
+				    struct crush_bucket_straw2 *bucket, int item)
+{
+	unsigned i;
+
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			return crush_remove_straw2_bucket_item_at(map, bucket, i);
+	return -ENOENT;
+}
+
 int crush_bucket_remove_item(struct crush_map *map, struct crush_bucket *b, int item)
 {
+	int pos;
+	int r;
+
+	if (crush_bucket_unshare(map, b) < 0)
+		return -ENOMEM;
+
+	crush_drop_topology(map);
+	pos = crush_bucket_item_position(map, b, item);
+	if (pos < 0 && b->alg >= CRUSH_BUCKET_UNIFORM && b->alg <= CRUSH_BUCKET_STRAW2)
+		return pos;
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_remove_uniform_bucket_item((struct crush_bucket_uniform *)b, item);
+		r = crush_remove_uniform_bucket_item_at((struct crush_bucket_uniform *)b, pos);
+		break;
 	case CRUSH_BUCKET_LIST:
-		return crush_remove_list_bucket_item((struct crush_bucket_list *)b, item);
+		r = crush_remove_list_bucket_item_at((struct crush_bucket_list *)b, pos);
+		break;
 	case CRUSH_BUCKET_TREE:
-		return crush_remove_tree_bucket_item((struct crush_bucket_tree *)b, item);
+		r = crush_remove_tree_bucket_item_at((struct crush_bucket_tree *)b, pos);
+		break;
 	case CRUSH_BUCKET_STRAW:
-		return crush_remove_straw_bucket_item(map, (struct crush_bucket_straw *)b, item);
+		r = crush_remove_straw_bucket_item_at(map, (struct crush_bucket_straw *)b, pos);
+		break;
 	case CRUSH_BUCKET_STRAW2:
-		return crush_remove_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item);
+		r = crush_remove_straw2_bucket_item_at(map, (struct crush_bucket_straw2 *)b, pos);
+		break;
 	default:
 		return -1;
 	}
+	/* the items of a tree bucket are not shifted */
+	if (r == 0 && b->alg != CRUSH_BUCKET_TREE)
+		crush_item_index_removed(map, b, item, pos);
+	else
+		crush_drop_item_index(map, b->id);
+	if (r == 0)
+		crush_parent_unlink(map, item, b->id);
+	return r;
 }
 
 
@@ -1139,17 +2053,11 @@ int crush_adjust_uniform_bucket_item_weight(struct crush_bucket_uniform *bucket,
 	return diff;
 }
 
-int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int item, int weight)
+static int crush_adjust_list_bucket_item_weight_at(struct crush_bucket_list *bucket,
+						   unsigned i, int weight)
 {
 	int diff;
-	unsigned i, j;
-
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item)
-			break;
-	}
-	if (i == bucket->h.size)
-		return 0;
+	unsigned j;
 
 	diff = weight - bucket->item_weights[i];
 	bucket->item_weights[i] = weight;
@@ -1161,20 +2069,24 @@ int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int i
 	return diff;
 }
 
-int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int item, int weight)
+int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int item, int weight)
+{
+	unsigned i;
+
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			return crush_adjust_list_bucket_item_weight_at(bucket, i, weight);
+	return 0;
+}
+
+static int crush_adjust_tree_bucket_item_weight_at(struct crush_bucket_tree *bucket,
+						   unsigned i, int weight)
 {
 	int diff;
 	int node;
-	unsigned i, j;
+	unsigned j;
 	unsigned depth = calc_depth(bucket->h.size);
 
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item)
-			break;
-	}
-	if (i == bucket->h.size)
-		return 0;
-	
 	node = crush_calc_tree_node(i);
 	diff = weight - bucket->node_weights[node];
 	bucket->node_weights[node] = weight;
@@ -1188,20 +2100,23 @@ int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int i
 	return diff;
 }
 
-int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
-					  struct crush_bucket_straw *bucket,
-					  int item, int weight)
+int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int item, int weight)
+{
+	unsigned i;
+
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			return crush_adjust_tree_bucket_item_weight_at(bucket, i, weight);
+	return 0;
+}
+
+static int crush_adjust_straw_bucket_item_weight_at(struct crush_map *map,
+						    struct crush_bucket_straw *bucket,
+						    unsigned idx, int weight)
 {
-	unsigned idx;
 	int diff;
         int r;
 
-	for (idx = 0; idx < bucket->h.size; idx++)
-		if (bucket->h.items[idx] == item)
-			break;
-	if (idx == bucket->h.size)
-		return 0;
-
 	diff = weight - bucket->item_weights[idx];
 	bucket->item_weights[idx] = weight;
 	bucket->h.weight += diff;
@@ -1213,18 +2128,22 @@ int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
 	return diff;
 }
 
-int crush_adjust_straw2_bucket_item_weight(struct crush_map *map,
-					   struct crush_bucket_straw2 *bucket,
-					   int item, int weight)
+int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
+					  struct crush_bucket_straw *bucket,
+					  int item, int weight)
 {
 	unsigned idx;
-	int diff;
 
 	for (idx = 0; idx < bucket->h.size; idx++)
 		if (bucket->h.items[idx] == item)
-			break;
-	if (idx == bucket->h.size)
-		return 0;
+			return crush_adjust_straw_bucket_item_weight_at(map, bucket, idx, weight);
+	return 0;
+}
+
+static int crush_adjust_straw2_bucket_item_weight_at(struct crush_bucket_straw2 *bucket,
+						     unsigned idx, int weight)
+{
+	int diff;
 
 	diff = weight - bucket->item_weights[idx];
 	bucket->item_weights[idx] = weight;
@@ -1233,28 +2152,45 @@ int crush_adjust_straw2_bucket_item_weight(struct crush_map *map,
 	return diff;
 }
 
+int crush_adjust_straw2_bucket_item_weight(struct crush_map *map,
+					   struct crush_bucket_straw2 *bucket,
+					   int item, int weight)
+{
+	unsigned idx;
+
+	for (idx = 0; idx < bucket->h.size; idx++)
+		if (bucket->h.items[idx] == item)
+			return crush_adjust_straw2_bucket_item_weight_at(bucket, idx, weight);
+	return 0;
+}
+
 int crush_bucket_adjust_item_weight(struct crush_map *map,
 				    struct crush_bucket *b,
 				    int item, int weight)
 {
-	switch (b->alg) {
-	case CRUSH_BUCKET_UNIFORM:
+	int pos;
+
+	crush_drop_topology(map);
+	if (b->alg == CRUSH_BUCKET_UNIFORM)
 		return crush_adjust_uniform_bucket_item_weight((struct crush_bucket_uniform *)b,
 							     item, weight);
+	pos = crush_bucket_item_position(map, b, item);
+	if (pos < 0)
+		return 0;
+	switch (b->alg) {
 	case CRUSH_BUCKET_LIST:
-		return crush_adjust_list_bucket_item_weight((struct crush_bucket_list *)b,
-							    item, weight);
+		return crush_adjust_list_bucket_item_weight_at((struct crush_bucket_list *)b,
+							       pos, weight);
 	case CRUSH_BUCKET_TREE:
-		return crush_adjust_tree_bucket_item_weight((struct crush_bucket_tree *)b,
-							    item, weight);
+		return crush_adjust_tree_bucket_item_weight_at((struct crush_bucket_tree *)b,
+							       pos, weight);
 	case CRUSH_BUCKET_STRAW:
-		return crush_adjust_straw_bucket_item_weight(map,
-							     (struct crush_bucket_straw *)b,
-							     item, weight);
+		return crush_adjust_straw_bucket_item_weight_at(map,
+								(struct crush_bucket_straw *)b,
+								pos, weight);
 	case CRUSH_BUCKET_STRAW2:
-		return crush_adjust_straw2_bucket_item_weight(map,
-							      (struct crush_bucket_straw2 *)b,
-							     item, weight);
+		return crush_adjust_straw2_bucket_item_weight_at((struct crush_bucket_straw2 *)b,
+								 pos, weight);
 	default:
 		return -1;
 	}
@@ -1262,6 +2198,105 @@ int crush_bucket_adjust_item_weight(struct crush_map *map,
 
 /************************************************/
 
+int crush_build_parents(struct crush_map *map)
+{
+	struct crush_parents *parents = map->parents;
+	int b;
+	unsigned i;
+
+	if (parents) {
+		memset(parents->devices, 0, parents->max_devices * sizeof(__s32));
+		memset(parents->buckets, 0, parents->max_buckets * sizeof(__s32));
+	} else {
+		parents = crush_calloc(1, sizeof(*parents));
+		if (!parents)
+			return -ENOMEM;
+		map->parents = parents;
+	}
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+		if (bucket == NULL)
+			continue;
+		for (i = 0; i < bucket->size; i++) {
+			crush_parent_link(map, bucket->items[i], bucket->id);
+			if (map->parents == NULL)
+				return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+int crush_get_parent(const struct crush_map *map, int item)
+{
+	const struct crush_parents *parents = map->parents;
+
+	if (parents == NULL)
+		return CRUSH_PARENT_UNKNOWN;
+	if (item >= 0)
+		return item < parents->max_devices ?
+			parents->devices[item] : CRUSH_PARENT_NONE;
+	return -1 - item < parents->max_buckets ?
+		parents->buckets[-1 - item] : CRUSH_PARENT_NONE;
+}
+
+static int crush_adjust_item_weight_in(struct crush_map *map, int item, int weight);
+
+/*
+ * Set the weight of __item__ in __bucket__ and propagate the change
+ * of the weight of the bucket to its ancestors.
+ */
+static int crush_adjust_item_weight_in_bucket(struct crush_map *map,
+					      struct crush_bucket *bucket,
+					      int item, int weight)
+{
+	__u32 weight_before = bucket->weight;
+
+	crush_bucket_adjust_item_weight(map, bucket, item, weight);
+	if (bucket->weight == weight_before)
+		return 0;
+	return crush_adjust_item_weight_in(map, bucket->id, bucket->weight);
+}
+
+/* set the weight of __item__ in all the buckets containing it */
+static int crush_adjust_item_weight_in(struct crush_map *map, int item, int weight)
+{
+	int parent = crush_get_parent(map, item);
+	int b;
+	int r;
+
+	if (parent < 0)
+		return crush_adjust_item_weight_in_bucket(map, map->buckets[-1 - parent],
+							  item, weight);
+	if (parent == CRUSH_PARENT_NONE)
+		return 0;
+	/* CRUSH_PARENT_MANY */
+	for (b = 0; b < map->max_buckets; b++) {
+		struct crush_bucket *bucket = map->buckets[b];
+		if (bucket == NULL || crush_bucket_item_position(map, bucket, item) < 0)
+			continue;
+		r = crush_adjust_item_weight_in_bucket(map, bucket, item, weight);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+int crush_adjust_item_weight(struct crush_map *map, int item, int weight)
+{
+	int r;
+
+	if (map->parents == NULL) {
+		r = crush_build_parents(map);
+		if (r < 0)
+			return r;
+	}
+	if (crush_get_parent(map, item) == CRUSH_PARENT_NONE)
+		return -ENOENT;
+	return crush_adjust_item_weight_in(map, item, weight);
+}
+
+/************************************************/
+
 static int crush_reweight_uniform_bucket(struct crush_map *map, struct crush_bucket_uniform *bucket)
 {
 	unsigned i;
@@ -1384,6 +2419,7 @@ static int crush_reweight_straw2_bucket(struct crush_map *map, struct crush_buck
 
 int crush_reweight_bucket(struct crush_map *map, struct crush_bucket *b)
 {
+	crush_drop_topology(map);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
 		return crush_reweight_uniform_bucket(map, (struct crush_bucket_uniform *)b);
@@ -1417,7 +2453,7 @@ struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_p
               sizeof(struct crush_weight_set) * bucket_count * num_positions +
               sizeof(__u32) * sum_bucket_size * num_positions + // weights
               sizeof(__u32) * sum_bucket_size); // ids
-  char *space = malloc(size);
+  char *space = crush_malloc(size);
   struct crush_choose_arg *arg = (struct crush_choose_arg *)space;
   struct crush_weight_set *weight_set = (struct crush_weight_set *)(arg + map->max_buckets);
   __u32 *weights = (__u32 *)(weight_set + bucket_count * num_positions);
@@ -1458,7 +2494,7 @@ struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_p
 
 void crush_destroy_choose_args(struct crush_choose_arg *args)
 {
-  free(args);
+  crush_free(args);
 }
 
 /***************************/
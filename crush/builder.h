@@ -17,6 +17,30 @@
  * @returns a pointer to the newly created crush_map or NULL
  */
 extern struct crush_map *crush_create();
+/** @ingroup API
+ *
+ * Same as crush_create() but the buckets created with
+ * crush_make_bucket() for the new crush_map are allocated from
+ * __map->arena__, whose first chunk holds __size__ bytes, as with
+ * crush_make_arena_bucket(). Rules can be allocated from the arena
+ * with crush_make_arena_rule().
+ *
+ * crush_destroy() releases the arena at once instead of visiting
+ * every bucket, except the buckets that have memory outside of the
+ * arena: buckets added with crush_add_bucket() that were allocated
+ * otherwise and buckets resized by crush_bucket_add_item() or
+ * crush_bucket_remove_item(), whose arrays are moved out of the
+ * arena. They are remembered in the map and released one by one.
+ *
+ * The buckets of the map must not be released with
+ * crush_destroy_bucket(), only with crush_remove_bucket() or with
+ * the map.
+ *
+ * @param size the size of the first chunk of the arena, in bytes
+ *
+ * @returns a pointer to the newly created crush_map or NULL
+ */
+extern struct crush_map *crush_create_arena_map(size_t size);
 /** @ingroup API
  *
  * Analyze the content of __map__ and set the internal values required
@@ -57,6 +81,24 @@ extern void crush_finalize(struct crush_map *map);
  * @returns a pointer to the newly created rule or NULL
  */
 extern struct crush_rule *crush_make_rule(int len, int ruleset, int type, int minsize, int maxsize);
+/** @ingroup API
+ *
+ * Same as crush_make_rule() but the rule is allocated from
+ * __map->arena__, which is created if needed. The rule must be
+ * added to the same __map__ with crush_add_rule() and is released
+ * with it, it must not be released with crush_destroy_rule().
+ *
+ * @param map the crush_map owning the arena
+ * @param len number of steps in the rule
+ * @param ruleset user defined value
+ * @param type user defined value
+ * @param minsize minimum number of items the rule can map
+ * @param maxsize maximum number of items the rule can map
+ *
+ * @returns a pointer to the newly created rule or NULL
+ */
+extern struct crush_rule *crush_make_arena_rule(struct crush_map *map, int len, int ruleset,
+						int type, int minsize, int maxsize);
 /** @ingroup API
  *
  * Set the __pos__ step of the __rule__ to an operand and up to two arguments.
@@ -133,6 +175,9 @@ extern void crush_rule_set_step(struct crush_rule *rule, int pos, int op, int ar
  * assign the lowest available identifier. The __ruleno__ value must be
  * a positive integer lower than __CRUSH_MAX_RULES__.
  *
+ * The index used by crush_find_rule() is updated, or rebuilt if
+ * __ruleno__ replaces an existing rule.
+ *
  * - return -ENOSPC if the rule identifier is >= __CRUSH_MAX_RULES__
  * - return -ENOMEM if __realloc(3)__ fails to expand the array of
  *   rules in the __map__
@@ -172,8 +217,9 @@ extern int crush_add_bucket(struct crush_map *map,
 			    struct crush_bucket *bucket, int *idout);
 /** @ingroup API
  *
- * Allocate a crush_bucket with __malloc(3)__ and initialize it. The
- * content of the bucket is filled with __size__ items from
+ * Allocate a crush_bucket with __malloc(3)__, or from the arena if
+ * __map__ was created with crush_create_arena_map(), and initialize
+ * it. The content of the bucket is filled with __size__ items from
  * __items__. The item selection is set to use __alg__ which is one of
  * ::CRUSH_BUCKET_UNIFORM , ::CRUSH_BUCKET_LIST or
  * ::CRUSH_BUCKET_STRAW2. The initial __items__ are assigned a
@@ -183,9 +229,9 @@ extern int crush_add_bucket(struct crush_map *map,
  * __items[x]__ is set to be the value of __weights[x]__.
  *
  * The caller is responsible for deallocating the returned pointer via
- * crush_destroy_bucket().
+ * crush_destroy_bucket(), unless it was allocated from the arena.
  *
- * @param map __unused__
+ * @param map the crush_map the bucket is for
  * @param alg algorithm for item selection
  * @param hash always set to CRUSH_HASH_RJENKINS1
  * @param type user defined bucket type
@@ -196,6 +242,79 @@ extern int crush_add_bucket(struct crush_map *map,
  * @returns a pointer to the newly created bucket or NULL
  */
 struct crush_bucket *crush_make_bucket(struct crush_map *map, int alg, int hash, int type, int size, int *items, int *weights);
+/** @ingroup API
+ *
+ * Same as crush_make_bucket() but the bucket and all its arrays are
+ * allocated at once from __map->arena__, which is created if
+ * needed. Building many buckets this way costs a few large
+ * allocations instead of a few __malloc(3)__ per bucket, and the
+ * buckets are all released at once when the __map__ is destroyed.
+ *
+ * The bucket must be added to the same __map__ with
+ * crush_add_bucket(). It can be modified with the other builder
+ * functions, which first move its arrays out of the arena.
+ *
+ * @param map the crush_map owning the arena
+ * @param alg algorithm for item selection
+ * @param hash always set to CRUSH_HASH_RJENKINS1
+ * @param type user defined bucket type
+ * @param size of the __items__ array
+ * @param items array of __size__ items
+ * @param weights the weight of each item in __items__, depending on __alg__
+ *
+ * @returns a pointer to the newly created bucket or NULL if the
+ *          arena cannot grow, __alg__ is unknown or the weights overflow
+ */
+extern struct crush_bucket *crush_make_arena_bucket(struct crush_map *map,
+						    int alg, int hash, int type, int size,
+						    const int *items,
+						    const int *weights);
+/** @ingroup API
+ *
+ * Add a whole hierarchy of __count__ nodes to __map__ at once,
+ * instead of one crush_make_bucket(), crush_add_bucket() and
+ * crush_bucket_add_item() at a time. Node __i__ is described by the
+ * __i__-th element of each array:
+ *
+ * - __parent[i]__ is the index of the bucket node containing it or -1
+ *   if it is a root. Only buckets can be roots.
+ * - __alg[i]__ is the algorithm of the bucket or 0 if the node is
+ *   a device.
+ * - __type[i]__ is the type of the bucket, ignored for a device.
+ * - __weight[i]__ is the weight of the device, ignored for a bucket
+ *   whose weight is the sum of the weights of its items.
+ * - __ids[i]__ is the id of the device, >= 0, or the id of the
+ *   bucket, < 0, or 0 for the bucket to get the first free id. It
+ *   is set to the id of the bucket on success.
+ *
+ * The items of a bucket are in the order of their nodes. The buckets
+ * are allocated from __map->arena__ with crush_make_arena_bucket()
+ * and the weights are computed bottom up, in time linear in
+ * __count__. The __map__ must be finalized with crush_finalize()
+ * afterwards.
+ *
+ * - return -EINVAL if a parent is not a bucket, a device is a root,
+ *   the nodes have a cycle, an algorithm is unknown or the items of
+ *   a ::CRUSH_BUCKET_UNIFORM bucket do not all have the same weight
+ * - return -ERANGE if the weight of a bucket overflows
+ * - return -EEXIST if a bucket id is already used
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * On error, neither the __map__ nor __ids__ are modified.
+ *
+ * @param map the crush_map to add the buckets to
+ * @param count the number of nodes
+ * @param parent the parent node of each node
+ * @param alg the algorithm of each bucket, 0 for devices
+ * @param type the type of each bucket
+ * @param weight the weight of each device
+ * @param[in,out] ids the id of each node
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_add_hierarchy(struct crush_map *map, int count,
+			       const int *parent, const int *alg, const int *type,
+			       const int *weight, int *ids);
 extern struct crush_choose_arg *crush_make_choose_args(struct crush_map *map, int num_positions);
 extern void crush_destroy_choose_args(struct crush_choose_arg *args);
 /** @ingroup API
@@ -230,6 +349,11 @@ extern int crush_bucket_add_item(struct crush_map *map, struct crush_bucket *buc
  * The return value is the difference between the new item weight and the former
  * item weight.
  *
+ * In buckets of ::CRUSH_ITEM_INDEX_MIN items or more, the item is
+ * found in constant time with an index of the position of each item,
+ * built the first time it is needed and maintained by
+ * crush_bucket_add_item() and crush_bucket_remove_item().
+ *
  * @returns the difference between the new weight and the former weight
  */
 extern int crush_bucket_adjust_item_weight(struct crush_map *map, struct crush_bucket *bucket, int item, int weight);
@@ -247,6 +371,56 @@ extern int crush_bucket_adjust_item_weight(struct crush_map *map, struct crush_b
  * @returns 0 on success, < 0 on error
  */
 extern int crush_reweight_bucket(struct crush_map *map, struct crush_bucket *bucket);
+/** @ingroup API
+ *
+ * Index the bucket containing each item of __map__, in time linear
+ * in the size of the map. Once built, the index is maintained by
+ * crush_add_bucket(), crush_remove_bucket(), crush_bucket_add_item()
+ * and crush_bucket_remove_item(). It must be built again if the
+ * buckets are modified otherwise. It is deallocated by
+ * crush_destroy().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map to index
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_build_parents(struct crush_map *map);
+/** @ingroup API
+ *
+ * Return the id of the bucket containing __item__, as indexed by
+ * crush_build_parents(): ::CRUSH_PARENT_NONE if the item is in no
+ * bucket, ::CRUSH_PARENT_MANY if it is in more than one bucket or
+ * ::CRUSH_PARENT_UNKNOWN if the index was not built.
+ *
+ * @param map the crush_map containing __item__
+ * @param item a device or bucket id
+ * @returns the bucket id (< 0) or one of the above
+ */
+extern int crush_get_parent(const struct crush_map *map, int item);
+/** @ingroup API
+ *
+ * Set the weight of __item__ to __weight__ in the bucket containing
+ * it and propagate the difference up to the roots: the weight of
+ * each ancestor is adjusted in its own parent with
+ * crush_bucket_adjust_item_weight(), which also computes the straws
+ * of ::CRUSH_BUCKET_STRAW buckets again. The cost is the sum of the
+ * cost of adjusting one item in each ancestor instead of
+ * crush_reweight_bucket() on the whole tree.
+ *
+ * The index of crush_build_parents() is built if needed. An item
+ * contained in more than one bucket is adjusted in all of them, at
+ * the cost of scanning all buckets.
+ *
+ * - return -ENOENT if __item__ is in no bucket
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map containing __item__
+ * @param item a device or bucket id
+ * @param weight the new 16.16 fixed point weight of __item__
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_adjust_item_weight(struct crush_map *map, int item, int weight);
 /** @ingroup API
  *
  * Remove __bucket__ from __map__ and deallocate it via crush_destroy_bucket().
@@ -264,10 +438,14 @@ extern int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucke
  * the bucket weight. If the weight of the item is greater than the
  * weight of the bucket, silentely set the bucket weight to zero.
  *
+ * The item is found as in crush_bucket_adjust_item_weight(), the
+ * items following it are then shifted.
+ *
+ * - return -ENOENT if __item__ is not in __bucket__.
  * - return -ENOMEM if the __bucket__ cannot be sized down with __realloc(3)__.
  * - return -1 if the value of __bucket->alg__ is unknown.
  *
- * @param map __unused__
+ * @param map the crush_map containing __bucket__
  * @param bucket the bucket from which __item__ is removed
  * @param item the item to remove from __bucket__
  * @returns 0 on success, < 0 on error
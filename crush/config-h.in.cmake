@@ -57,6 +57,15 @@
 /* Define to 1 if you have the <linux/types.h> header file. */
 #cmakedefine HAVE_LINUX_TYPES_H 1
 
+/* Define to 1 to count the retries of the mapper in workspaces. */
+#cmakedefine CRUSH_CHOOSE_STATS 1
+
+/* Define to 1 to count what the mapper does in workspaces. */
+#cmakedefine CRUSH_COUNTERS 1
+
+/* Define to 1 to compile the USDT probes in, see probes.h. */
+#cmakedefine CRUSH_USDT 1
+
 /* Version number of package */
 #cmakedefine VERSION "@VERSION@"
 
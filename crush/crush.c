@@ -4,6 +4,7 @@
 #else
 # include "crush_compat.h"
 # include "crush.h"
+# include "arena.h"
 #endif
 
 const char *crush_bucket_alg_name(int alg)
@@ -100,19 +101,110 @@ void crush_destroy_bucket(struct crush_bucket *b)
 	}
 }
 
+#ifndef __KERNEL__
+static void crush_free_unless_arena(const struct crush_arena *arena, void *p)
+{
+	if (!crush_arena_contains(arena, p))
+		kfree(p);
+}
+
+void crush_destroy_parents(struct crush_parents *parents)
+{
+	if (parents == NULL)
+		return;
+	kfree(parents->devices);
+	kfree(parents->buckets);
+	kfree(parents);
+}
+
+void crush_destroy_item_indexes(struct crush_map *map)
+{
+	__s32 b;
+
+	for (b = 0; b < map->max_item_indexes; b++)
+		kfree(map->item_indexes[b]);
+	kfree(map->item_indexes);
+	map->item_indexes = NULL;
+	map->max_item_indexes = 0;
+}
+
+void crush_destroy_topology(struct crush_topology *topology)
+{
+	kfree(topology);
+}
+
+void crush_destroy_rule_index(struct crush_map *map)
+{
+	kfree(map->rule_index);
+	map->rule_index = NULL;
+}
+
+/*
+ * A bucket allocated from the map arena is never freed individually
+ * but the builder moves its arrays out of the arena before resizing
+ * them (see crush_bucket_add_item()) and those must be freed.
+ */
+void crush_destroy_map_bucket(struct crush_map *map, struct crush_bucket *b)
+{
+	const struct crush_arena *arena = map->arena;
+
+	if (arena == NULL || !crush_arena_contains(arena, b)) {
+		crush_destroy_bucket(b);
+		return;
+	}
+	crush_free_unless_arena(arena, b->items);
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST:
+		crush_free_unless_arena(arena, ((struct crush_bucket_list *)b)->item_weights);
+		crush_free_unless_arena(arena, ((struct crush_bucket_list *)b)->sum_weights);
+		break;
+	case CRUSH_BUCKET_TREE:
+		crush_free_unless_arena(arena, ((struct crush_bucket_tree *)b)->node_weights);
+		break;
+	case CRUSH_BUCKET_STRAW:
+		crush_free_unless_arena(arena, ((struct crush_bucket_straw *)b)->item_weights);
+		crush_free_unless_arena(arena, ((struct crush_bucket_straw *)b)->straws);
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		crush_free_unless_arena(arena, ((struct crush_bucket_straw2 *)b)->item_weights);
+		break;
+	}
+}
+#endif
+
 /**
  * crush_destroy - Destroy a crush_map
  * @map: crush_map pointer
  */
 void crush_destroy(struct crush_map *map)
 {
+#ifndef __KERNEL__
+	/* the other buckets are released with the arena */
+	if (map->arena_only && map->buckets) {
+		__s32 i;
+		for (i = 0; i < map->heap_bucket_count; i++) {
+			__s32 b = -1 - map->heap_buckets[i];
+			if (b >= map->max_buckets || map->buckets[b] == NULL)
+				continue;
+			crush_destroy_map_bucket(map, map->buckets[b]);
+			map->buckets[b] = NULL;
+		}
+		kfree(map->buckets);
+		map->buckets = NULL;
+	}
+	kfree(map->heap_buckets);
+#endif
 	/* buckets */
 	if (map->buckets) {
 		__s32 b;
 		for (b = 0; b < map->max_buckets; b++) {
 			if (map->buckets[b] == NULL)
 				continue;
+#ifndef __KERNEL__
+			crush_destroy_map_bucket(map, map->buckets[b]);
+#else
 			crush_destroy_bucket(map->buckets[b]);
+#endif
 		}
 		kfree(map->buckets);
 	}
@@ -120,13 +212,25 @@ void crush_destroy(struct crush_map *map)
 	/* rules */
 	if (map->rules) {
 		__u32 b;
-		for (b = 0; b < map->max_rules; b++)
+		for (b = 0; b < map->max_rules; b++) {
+#ifndef __KERNEL__
+			if (map->arena &&
+			    crush_arena_contains(map->arena, map->rules[b]))
+				continue;
+#endif
 			crush_destroy_rule(map->rules[b]);
+		}
 		kfree(map->rules);
 	}
 
 #ifndef __KERNEL__
 	kfree(map->choose_tries);
+	crush_destroy_parents(map->parents);
+	crush_destroy_item_indexes(map);
+	crush_destroy_topology(map->topology);
+	crush_destroy_rule_index(map);
+	if (map->arena)
+		crush_arena_destroy(map->arena);
 #endif
 	kfree(map);
 }
@@ -455,11 +455,163 @@ struct crush_map {
 	 */
 	__u32 allowed_bucket_algs;
 
+	/*
+	 * No longer updated by the mapper, which must not write to a
+	 * map shared by threads: see crush_workspace_set_choose_stats().
+	 */
 	__u32 *choose_tries;
+
+	/*
+	 * The buckets and rules of a map decoded with crush_decode()
+	 * are allocated in bulk from this arena instead of one by
+	 * one. NULL if the map has no arena. See
+	 * crush_destroy_map_bucket().
+	 */
+	struct crush_arena *arena;
+
+	/*
+	 * Set by crush_create_arena_map(), crush_decode() and
+	 * crush_parse_text(): the builder allocates the buckets from
+	 * __arena__ and crush_destroy() does not visit them, except
+	 * those listed in __heap_buckets__ which may have memory outside
+	 * of the arena, for instance after crush_bucket_add_item().
+	 */
+	__u8 arena_only;
+	__s32 heap_bucket_count;
+	__s32 max_heap_buckets;
+	__s32 *heap_buckets;
+
+	/*
+	 * The bucket containing each item, maintained by the builder
+	 * once built by crush_build_parents(). NULL if it was not
+	 * built. See crush_adjust_item_weight().
+	 */
+	struct crush_parents *parents;
+
+	/*
+	 * The position of each item in the buckets of more than
+	 * CRUSH_ITEM_INDEX_MIN items, indexed like buckets and built
+	 * lazily by the builder. NULL if no index was built yet.
+	 */
+	struct crush_item_index **item_indexes;
+	__s32 max_item_indexes;
+
+	/*
+	 * The shape of the hierarchy, computed by crush_get_topology()
+	 * and dropped by the builder when the map is modified. NULL if
+	 * it was not computed.
+	 */
+	struct crush_topology *topology;
+
+	/*
+	 * The rule found by crush_find_rule() for each ruleset, type
+	 * and size, maintained by crush_add_rule() and rebuilt by
+	 * crush_finalize(). NULL if it was not built.
+	 */
+	struct crush_rule_index *rule_index;
 #endif
 	/*! @endcond */
 };
 
+#ifndef __KERNEL__
+/** @ingroup API
+ * The item is in no bucket, see crush_get_parent().
+ */
+#define CRUSH_PARENT_NONE 0
+/** @ingroup API
+ * The item is in more than one bucket, see crush_get_parent().
+ */
+#define CRUSH_PARENT_MANY 1
+/** @ingroup API
+ * The index of the parents was not built, see crush_get_parent().
+ */
+#define CRUSH_PARENT_UNKNOWN 2
+
+/*! @cond INTERNAL */
+
+/*
+ * The parent of each item of a crush_map: the id of the bucket
+ * containing it, CRUSH_PARENT_NONE or CRUSH_PARENT_MANY. The items
+ * beyond the end of the arrays are in no bucket.
+ */
+struct crush_parents {
+	__s32 max_devices;	/* elements in devices */
+	__s32 max_buckets;	/* elements in buckets */
+	__s32 *devices;		/* the parent of device i */
+	__s32 *buckets;		/* the parent of bucket -1-i */
+};
+
+/* buckets with fewer items are searched linearly */
+#define CRUSH_ITEM_INDEX_MIN 16
+
+/*
+ * An open addressing hash table of the position of each item of a
+ * bucket. Empty slots have the item CRUSH_ITEM_NONE.
+ */
+struct crush_item_position {
+	__s32 item;
+	__s32 pos;
+};
+
+struct crush_item_index {
+	__u32 size;		/* of the bucket when last updated */
+	__u32 mask;		/* slots - 1, a power of two minus one */
+	struct crush_item_position slots[0];
+};
+
+/*
+ * An open addressing hash table of the lowest numbered rule matching
+ * each ruleset, type and size, see crush_rule_index_key(). Empty
+ * slots have the key 0. It is only valid for the __rules__ and
+ * __max_rules__ of the map it was built for.
+ */
+struct crush_rule_slot {
+	__u32 key;
+	__s32 ruleno;
+};
+
+struct crush_rule_index {
+	struct crush_rule **rules;	/* map->rules when last updated */
+	__u32 max_rules;		/* map->max_rules when last updated */
+	__u32 used;			/* slots with a key */
+	__u32 order;			/* the table has 1 << order slots */
+	struct crush_rule_slot slots[0];
+};
+
+static inline __u32 crush_rule_index_key(int ruleset, int type, int size)
+{
+	return 1 << 24 | ruleset << 16 | type << 8 | size;
+}
+
+/* the first slot to probe for __key__ */
+static inline __u32 crush_rule_index_hash(const struct crush_rule_index *index,
+					  __u32 key)
+{
+	return (key * 2654435761u) >> (32 - index->order);
+}
+/*! @endcond */
+
+/** @ingroup API
+ *
+ * The shape of the hierarchy of a crush_map, see
+ * crush_get_topology(). The per bucket arrays have __max_buckets__
+ * elements and the element __i__ describes the bucket __-1-i__. A
+ * bucket found in more than one bucket is counted once for each
+ * path leading to it.
+ */
+struct crush_topology {
+	__s32 max_buckets;  /*!< elements in each per bucket array */
+	__s32 bucket_count; /*!< elements in __order__ */
+	__s32 root_count;   /*!< the buckets in no bucket, first in __order__ */
+	__s32 max_depth;    /*!< the largest __depth__ */
+	__s32 *order;       /*!< all buckets, each before the buckets it contains */
+	__s32 *depth;       /*!< longest path from a root, -1 if no bucket */
+	__s32 *parent;      /*!< containing bucket, ::CRUSH_PARENT_NONE or ::CRUSH_PARENT_MANY */
+	__u32 *leaves;      /*!< devices in the subtree */
+	__u64 *weight;      /*!< sum of the weights of the devices in the subtree */
+};
+#endif
+
 
 /* crush.c */
 /** @ingroup API
@@ -500,6 +652,32 @@ extern void crush_destroy_rule(struct crush_rule *r);
  * @param map the crush map
  */
 extern void crush_destroy(struct crush_map *map);
+#ifndef __KERNEL__
+/*
+ * Deallocate a bucket of __map__, including when it was allocated
+ * from __map->arena__.
+ */
+extern void crush_destroy_map_bucket(struct crush_map *map, struct crush_bucket *b);
+/*
+ * Deallocate the __parents__ of a map, see crush_build_parents().
+ */
+extern void crush_destroy_parents(struct crush_parents *parents);
+/*
+ * Deallocate the item indexes of __map__, see crush_bucket_remove_item().
+ */
+extern void crush_destroy_item_indexes(struct crush_map *map);
+/** @ingroup API
+ *
+ * Deallocate a __topology__ returned by crush_analyze_topology().
+ *
+ * @param topology the topology to deallocate
+ */
+extern void crush_destroy_topology(struct crush_topology *topology);
+/*
+ * Deallocate the rule index of __map__, see crush_find_rule().
+ */
+extern void crush_destroy_rule_index(struct crush_map *map);
+#endif
 
 static inline int crush_calc_tree_node(int i)
 {
@@ -524,8 +702,51 @@ struct crush_work_bucket {
 	__u32 *perm;  /* Permutation of the bucket's items */
 };
 
+#ifndef __KERNEL__
+/** @ingroup API
+ *
+ * What crush_do_rule() did with a workspace, counted if libcrush is
+ * configured with -DWITH_COUNTERS=ON, see crush_workspace_get_counters().
+ */
+struct crush_counters {
+	__u64 hashes;          /*!< crush_hash32_*() evaluations */
+	/*! buckets chosen from, per CRUSH_BUCKET_* algorithm */
+	__u64 bucket_visits[CRUSH_BUCKET_STRAW2 + 1];
+	__u64 retry_bucket;    /*!< retries in the same bucket */
+	__u64 retry_descent;   /*!< retries from the bucket of the step */
+	__u64 collisions;      /*!< items already chosen */
+	__u64 is_out;          /*!< devices rejected because they are out */
+	__u64 perm_fallback;   /*!< exhaustive searches of a bucket in a random permutation */
+	/*! replicas not found, ::CRUSH_ITEM_NONE in the result of
+	    indep rules and missing from the result of firstn rules */
+	__u64 item_none;
+};
+#endif
+
 struct crush_work {
 	struct crush_work_bucket **work; /* Per-bucket working store */
+#ifndef __KERNEL__
+	struct crush_choose_stats *stats; /* retries histogram or NULL */
+	struct crush_trace *trace; /* events recorded or NULL */
+#ifdef CRUSH_COUNTERS
+	struct crush_counters counters;
+#endif
+#endif
 };
 
+#ifndef __KERNEL__
+/** @ingroup API
+ *
+ * A histogram of the number of retries needed to choose an item, see
+ * crush_workspace_set_choose_stats().
+ */
+struct crush_choose_stats {
+	__u32 size;     /*!< number of elements in __tries__ */
+	/*! __tries[n]__ is the number of items chosen after __n__
+	    retries, the last element also counts the items that needed
+	    more */
+	__u64 tries[0];
+};
+#endif
+
 #endif
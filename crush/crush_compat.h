@@ -2,6 +2,7 @@
 #define CEPH_CRUSH_COMPAT_H
 
 #include "int_types.h"
+#include "alloc.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -33,7 +34,7 @@
 
 /* linux/slab.h */
 
-#define kmalloc(size, flags) malloc(size)
-#define kfree(x) do { if (x) free(x); } while (0)
+#define kmalloc(size, flags) crush_malloc(size)
+#define kfree(x) crush_free(x)
 
 #endif /* CEPH_CRUSH_COMPAT_H */
@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "batch.h"
+#include "mapper.h"
+#include "trace.h"
+#include "diff.h"
+
+/* the values mapped by a thread before the changes are walked */
+#define CRUSH_DIFF_CHUNK 1024
+
+/*
+ * The events kept for the old mapping of a value: if there are more,
+ * the value is mapped with the new epoch.
+ */
+#define CRUSH_DIFF_TRACE_EVENTS 512
+
+/*
+ * A thread and the chunk of values it maps. The changes are stored
+ * in the order of the values, the results of the change __i__ being
+ * at __before[i * result_max]__ and __after[i * result_max]__.
+ */
+struct crush_diff_slot {
+	struct crush_diff *diff;
+	void *before_work;
+	void *after_work;
+	struct crush_trace *trace;	/* NULL if no value can be skipped */
+	int x_start;
+	int count;
+	int changes;
+	int *xs;			/* CRUSH_DIFF_CHUNK */
+	int *before_lens;		/* CRUSH_DIFF_CHUNK */
+	int *after_lens;		/* CRUSH_DIFF_CHUNK */
+	int *before;			/* CRUSH_DIFF_CHUNK * result_max */
+	int *after;			/* CRUSH_DIFF_CHUNK * result_max */
+	__u64 skipped;
+	pthread_t thread;
+	int started;			/* mapping in __thread__ */
+};
+
+struct crush_diff {
+	struct crush_diff_epoch before;
+	struct crush_diff_epoch after;
+	int x_start;
+	int count;
+	int result_max;
+	int next;			/* index of the first value not mapped */
+	int num_slots;
+	struct crush_diff_slot *slots;
+	int slot;			/* the slot of the next change */
+	int change;			/* the next change in the slot */
+	unsigned char *changed_buckets;	/* max_buckets, NULL if none can be skipped */
+	unsigned char *changed_devices;	/* max_devices */
+	__u64 mapped;
+	__u64 changed;
+};
+
+static const struct crush_choose_arg *
+diff_choose_arg(const struct crush_diff_epoch *epoch, int pos)
+{
+	return epoch->choose_args ? &epoch->choose_args[pos] : NULL;
+}
+
+/* the arrays of __b__ the mapper reads, besides its items */
+static int diff_bucket_arrays_equal(const struct crush_bucket *a,
+				    const struct crush_bucket *b)
+{
+	size_t size = a->size * sizeof(__u32);
+
+	switch (a->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return ((const struct crush_bucket_uniform *)a)->item_weight ==
+			((const struct crush_bucket_uniform *)b)->item_weight;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *la = (const void *)a, *lb = (const void *)b;
+		return !memcmp(la->item_weights, lb->item_weights, size) &&
+			!memcmp(la->sum_weights, lb->sum_weights, size);
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *ta = (const void *)a, *tb = (const void *)b;
+		return ta->num_nodes == tb->num_nodes &&
+			!memcmp(ta->node_weights, tb->node_weights,
+				ta->num_nodes * sizeof(__u32));
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *sa = (const void *)a, *sb = (const void *)b;
+		return !memcmp(sa->item_weights, sb->item_weights, size) &&
+			!memcmp(sa->straws, sb->straws, size);
+	}
+	case CRUSH_BUCKET_STRAW2:
+		return !memcmp(((const struct crush_bucket_straw2 *)a)->item_weights,
+			       ((const struct crush_bucket_straw2 *)b)->item_weights, size);
+	}
+	return 0;
+}
+
+/* the weights a straw2 bucket uses at __position__, as the mapper does */
+static const __u32 *diff_choose_arg_weights(const struct crush_bucket *bucket,
+					    const struct crush_choose_arg *arg,
+					    __u32 position)
+{
+	if (arg == NULL || arg->weight_set == NULL || arg->weight_set_size == 0)
+		return ((const struct crush_bucket_straw2 *)bucket)->item_weights;
+	if (position >= arg->weight_set_size)
+		position = arg->weight_set_size - 1;
+	return arg->weight_set[position].weights;
+}
+
+static const int *diff_choose_arg_ids(const struct crush_bucket *bucket,
+				      const struct crush_choose_arg *arg)
+{
+	return arg && arg->ids ? arg->ids : bucket->items;
+}
+
+/*
+ * True if the straw2 buckets __a__ and __b__ draw with the same ids
+ * and weights at all positions: a choose_arg that repeats the weights
+ * of its bucket is the same as none.
+ */
+static int diff_choose_arg_equal(const struct crush_bucket *a,
+				 const struct crush_choose_arg *arg_a,
+				 const struct crush_bucket *b,
+				 const struct crush_choose_arg *arg_b)
+{
+	size_t size = a->size * sizeof(__u32);
+	__u32 positions = 1, i;
+
+	if (arg_a && arg_a->weight_set && arg_a->weight_set_size > positions)
+		positions = arg_a->weight_set_size;
+	if (arg_b && arg_b->weight_set && arg_b->weight_set_size > positions)
+		positions = arg_b->weight_set_size;
+	if (memcmp(diff_choose_arg_ids(a, arg_a), diff_choose_arg_ids(b, arg_b), size))
+		return 0;
+	for (i = 0; i < positions; i++)
+		if (memcmp(diff_choose_arg_weights(a, arg_a, i),
+			   diff_choose_arg_weights(b, arg_b, i), size))
+			return 0;
+	return 1;
+}
+
+/* true if the mapper reads the same from the bucket at __pos__ */
+static int diff_bucket_equal(const struct crush_diff *diff, int pos)
+{
+	const struct crush_bucket *a = diff->before.map->buckets[pos];
+	const struct crush_bucket *b = diff->after.map->buckets[pos];
+
+	if (a == NULL || b == NULL)
+		return a == b;
+	if (a != b &&
+	    (a->id != b->id || a->type != b->type || a->alg != b->alg ||
+	     a->hash != b->hash || a->weight != b->weight || a->size != b->size ||
+	     memcmp(a->items, b->items, a->size * sizeof(*a->items)) ||
+	     !diff_bucket_arrays_equal(a, b)))
+		return 0;
+	if (a->alg != CRUSH_BUCKET_STRAW2)
+		return 1;
+	return diff_choose_arg_equal(a, diff_choose_arg(&diff->before, pos),
+				     b, diff_choose_arg(&diff->after, pos));
+}
+
+static __u32 diff_weight(const struct crush_diff_epoch *epoch, int device)
+{
+	return device < epoch->weight_max ? epoch->weights[device] : 0;
+}
+
+/*
+ * Find the buckets and the devices that differ between the epochs,
+ * if the old trace of a value can tell whether it is unchanged: the
+ * maps must only differ by their buckets and the rule must take from
+ * buckets that do not change.
+ */
+static int diff_find_changes(struct crush_diff *diff)
+{
+	const struct crush_map *a = diff->before.map, *b = diff->after.map;
+	const struct crush_rule *ra = a->rules[diff->before.ruleno];
+	const struct crush_rule *rb = b->rules[diff->after.ruleno];
+	__u32 s;
+	int i;
+
+	if (a->max_buckets != b->max_buckets || a->max_devices != b->max_devices ||
+	    a->choose_local_tries != b->choose_local_tries ||
+	    a->choose_local_fallback_tries != b->choose_local_fallback_tries ||
+	    a->choose_total_tries != b->choose_total_tries ||
+	    a->chooseleaf_descend_once != b->chooseleaf_descend_once ||
+	    a->chooseleaf_vary_r != b->chooseleaf_vary_r ||
+	    a->chooseleaf_stable != b->chooseleaf_stable ||
+	    ra->len != rb->len ||
+	    memcmp(ra->steps, rb->steps, ra->len * sizeof(*ra->steps)))
+		return 0;
+
+	diff->changed_buckets = crush_calloc(a->max_buckets + 1, 1);
+	diff->changed_devices = crush_calloc(a->max_devices + 1, 1);
+	if (!diff->changed_buckets || !diff->changed_devices)
+		return -ENOMEM;
+	for (i = 0; i < a->max_buckets; i++)
+		diff->changed_buckets[i] = !diff_bucket_equal(diff, i);
+	for (i = 0; i < a->max_devices; i++)
+		diff->changed_devices[i] = diff_weight(&diff->before, i) !=
+			diff_weight(&diff->after, i);
+	for (s = 0; s < ra->len; s++) {
+		int take = ra->steps[s].arg1;
+		if (ra->steps[s].op == CRUSH_RULE_TAKE && take < 0 &&
+		    -1 - take < a->max_buckets && diff->changed_buckets[-1 - take])
+			break;
+	}
+	if (s == ra->len)
+		return 1;
+	crush_free(diff->changed_buckets);
+	crush_free(diff->changed_devices);
+	diff->changed_buckets = NULL;
+	diff->changed_devices = NULL;
+	return 0;
+}
+
+static int diff_changed_item(const struct crush_diff *diff, int item)
+{
+	if (item >= 0)
+		return item < diff->before.map->max_devices &&
+			diff->changed_devices[item];
+	return -1 - item < diff->before.map->max_buckets &&
+		diff->changed_buckets[-1 - item];
+}
+
+/*
+ * True if the old mapping traced in __trace__ may differ with the
+ * new epoch. The mapper reads a bucket after it was chosen or taken
+ * and before it chooses from it, and the weight of a device after it
+ * was chosen: a value is unchanged if none of the buckets and devices
+ * it chose or chose from changed.
+ */
+static int diff_touched(const struct crush_diff *diff,
+			const struct crush_trace *trace)
+{
+	__u64 i;
+
+	if (trace->head > trace->size)
+		return 1;
+	for (i = 0; i < trace->head; i++) {
+		const struct crush_trace_event *e = &trace->events[i];
+		switch (e->type) {
+		case CRUSH_TRACE_CHOOSE:
+			if (diff_changed_item(diff, e->item))
+				return 1;
+			/* fall through */
+		case CRUSH_TRACE_REJECT:
+			if (diff_changed_item(diff, e->bucket))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static void diff_map_chunk(struct crush_diff_slot *slot)
+{
+	const struct crush_diff *diff = slot->diff;
+	const struct crush_diff_epoch *before = &diff->before, *after = &diff->after;
+	int result_max = diff->result_max;
+	int i, x, before_len, after_len;
+
+	slot->changes = 0;
+	for (i = 0; i < slot->count; i++) {
+		int *before_result = slot->before + (size_t)slot->changes * result_max;
+		int *after_result = slot->after + (size_t)slot->changes * result_max;
+
+		x = slot->x_start + i;
+		if (slot->trace)
+			crush_trace_clear(slot->trace);
+		before_len = crush_do_rule(before->map, before->ruleno, x,
+					   before_result, result_max,
+					   before->weights, before->weight_max,
+					   slot->before_work, before->choose_args);
+		if (slot->trace && !diff_touched(diff, slot->trace)) {
+			slot->skipped++;
+			continue;
+		}
+		after_len = crush_do_rule(after->map, after->ruleno, x,
+					  after_result, result_max,
+					  after->weights, after->weight_max,
+					  slot->after_work, after->choose_args);
+		if (before_len == after_len &&
+		    !memcmp(before_result, after_result, before_len * sizeof(int)))
+			continue;
+		slot->xs[slot->changes] = x;
+		slot->before_lens[slot->changes] = before_len;
+		slot->after_lens[slot->changes] = after_len;
+		slot->changes++;
+	}
+}
+
+static void *diff_thread(void *arg)
+{
+	diff_map_chunk(arg);
+	return NULL;
+}
+
+/*
+ * Map the next chunk of values in each slot, the first in the calling
+ * thread and the others in their own threads, or in the calling
+ * thread if they cannot be created.
+ */
+static void diff_map_window(struct crush_diff *diff)
+{
+	int t;
+
+	for (t = 0; t < diff->num_slots; t++) {
+		struct crush_diff_slot *slot = &diff->slots[t];
+		slot->x_start = diff->x_start + diff->next;
+		slot->count = diff->count - diff->next;
+		if (slot->count > CRUSH_DIFF_CHUNK)
+			slot->count = CRUSH_DIFF_CHUNK;
+		diff->next += slot->count;
+		diff->mapped += slot->count;
+		slot->started = t > 0 && slot->count > 0 &&
+			!pthread_create(&slot->thread, NULL, diff_thread, slot);
+	}
+	for (t = 0; t < diff->num_slots; t++)
+		if (!diff->slots[t].started)
+			diff_map_chunk(&diff->slots[t]);
+	for (t = 0; t < diff->num_slots; t++) {
+		if (diff->slots[t].started)
+			pthread_join(diff->slots[t].thread, NULL);
+		diff->changed += diff->slots[t].changes;
+	}
+	diff->slot = 0;
+	diff->change = 0;
+}
+
+static int diff_valid_rule(const struct crush_diff_epoch *epoch)
+{
+	return epoch->ruleno >= 0 && (__u32)epoch->ruleno < epoch->map->max_rules &&
+		epoch->map->rules[epoch->ruleno] != NULL;
+}
+
+static int diff_init_slot(struct crush_diff *diff, struct crush_diff_slot *slot)
+{
+	size_t results = (size_t)CRUSH_DIFF_CHUNK * diff->result_max + 1;
+
+	slot->diff = diff;
+	slot->before_work = crush_malloc(crush_work_size(diff->before.map, diff->result_max));
+	slot->after_work = crush_malloc(crush_work_size(diff->after.map, diff->result_max));
+	slot->xs = crush_malloc(CRUSH_DIFF_CHUNK * sizeof(*slot->xs));
+	slot->before_lens = crush_malloc(CRUSH_DIFF_CHUNK * sizeof(*slot->before_lens));
+	slot->after_lens = crush_malloc(CRUSH_DIFF_CHUNK * sizeof(*slot->after_lens));
+	slot->before = crush_malloc(results * sizeof(*slot->before));
+	slot->after = crush_malloc(results * sizeof(*slot->after));
+	if (!slot->before_work || !slot->after_work || !slot->xs ||
+	    !slot->before_lens || !slot->after_lens || !slot->before || !slot->after)
+		return -ENOMEM;
+	crush_init_workspace(diff->before.map, slot->before_work);
+	crush_init_workspace(diff->after.map, slot->after_work);
+	if (diff->changed_buckets) {
+		slot->trace = crush_make_trace(CRUSH_DIFF_TRACE_EVENTS);
+		if (!slot->trace)
+			return -ENOMEM;
+		crush_workspace_set_trace(slot->before_work, slot->trace);
+	}
+	return 0;
+}
+
+int crush_make_diff(const struct crush_diff_epoch *before,
+		    const struct crush_diff_epoch *after,
+		    int x_start, int count, int result_max,
+		    int num_threads, struct crush_diff **diffp)
+{
+	struct crush_diff *diff;
+	int err, t;
+
+	if (count < 0 || result_max < 0 ||
+	    !diff_valid_rule(before) || !diff_valid_rule(after))
+		return -EINVAL;
+	if (num_threads <= 0)
+		num_threads = crush_batch_default_threads();
+	if (num_threads > (count + CRUSH_DIFF_CHUNK - 1) / CRUSH_DIFF_CHUNK)
+		num_threads = (count + CRUSH_DIFF_CHUNK - 1) / CRUSH_DIFF_CHUNK;
+	if (num_threads < 1)
+		num_threads = 1;
+
+	diff = crush_calloc(1, sizeof(*diff));
+	if (!diff)
+		return -ENOMEM;
+	diff->before = *before;
+	diff->after = *after;
+	diff->x_start = x_start;
+	diff->count = count;
+	diff->result_max = result_max;
+	diff->num_slots = num_threads;
+	/* nothing to walk until the first window is mapped */
+	diff->slot = num_threads;
+	err = diff_find_changes(diff);
+	if (err < 0)
+		goto fail;
+	diff->slots = crush_calloc(num_threads, sizeof(*diff->slots));
+	err = -ENOMEM;
+	if (!diff->slots)
+		goto fail;
+	for (t = 0; t < num_threads; t++) {
+		err = diff_init_slot(diff, &diff->slots[t]);
+		if (err < 0)
+			goto fail;
+	}
+	*diffp = diff;
+	return 0;
+fail:
+	crush_destroy_diff(diff);
+	return err;
+}
+
+int crush_diff_next(struct crush_diff *diff, struct crush_diff_change *change)
+{
+	const struct crush_diff_slot *slot;
+	size_t offset;
+
+	for (;;) {
+		while (diff->slot < diff->num_slots &&
+		       diff->change >= diff->slots[diff->slot].changes) {
+			diff->slot++;
+			diff->change = 0;
+		}
+		if (diff->slot < diff->num_slots)
+			break;
+		if (diff->next >= diff->count)
+			return 0;
+		diff_map_window(diff);
+	}
+	slot = &diff->slots[diff->slot];
+	offset = (size_t)diff->change * diff->result_max;
+	change->x = slot->xs[diff->change];
+	change->before_len = slot->before_lens[diff->change];
+	change->after_len = slot->after_lens[diff->change];
+	change->before = slot->before + offset;
+	change->after = slot->after + offset;
+	diff->change++;
+	return 1;
+}
+
+void crush_diff_stats(const struct crush_diff *diff, __u64 *mapped,
+		      __u64 *skipped, __u64 *changed)
+{
+	int t;
+
+	*mapped = diff->mapped;
+	*skipped = 0;
+	for (t = 0; t < diff->num_slots; t++)
+		*skipped += diff->slots[t].skipped;
+	*changed = diff->changed;
+}
+
+void crush_destroy_diff(struct crush_diff *diff)
+{
+	int t;
+
+	if (diff == NULL)
+		return;
+	for (t = 0; diff->slots && t < diff->num_slots; t++) {
+		struct crush_diff_slot *slot = &diff->slots[t];
+		if (slot->trace)
+			crush_destroy_trace(slot->trace);
+		crush_free(slot->before_work);
+		crush_free(slot->after_work);
+		crush_free(slot->xs);
+		crush_free(slot->before_lens);
+		crush_free(slot->after_lens);
+		crush_free(slot->before);
+		crush_free(slot->after);
+	}
+	crush_free(diff->slots);
+	crush_free(diff->changed_buckets);
+	crush_free(diff->changed_devices);
+	crush_free(diff);
+}
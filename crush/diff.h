@@ -0,0 +1,113 @@
+#ifndef CEPH_CRUSH_DIFF_H
+#define CEPH_CRUSH_DIFF_H
+
+#include "crush.h"
+
+/*
+ * A mapping diff walks the values whose result differs between two
+ * epochs, e.g. before and after devices are marked out or a bucket is
+ * reweighted, without holding the results of all the values: they
+ * are mapped by chunks, in parallel, and only the changes of the
+ * chunks being walked are kept.
+ *
+ * When the epochs differ only by some buckets, devices weights or
+ * choose_args, the old mapping of each value is traced (see
+ * crush_workspace_set_trace()) and a value whose descent did not
+ * choose from or choose any of them is known to be unchanged without
+ * mapping it with the new epoch.
+ */
+
+/** @ingroup API
+ *
+ * The arguments of crush_do_rule() for one epoch.
+ */
+struct crush_diff_epoch {
+	const struct crush_map *map;	/*!< the map, after crush_finalize() */
+	int ruleno;			/*!< the rule */
+	const __u32 *weights;		/*!< as in crush_do_rule() */
+	int weight_max;			/*!< the size of __weights__ */
+	const struct crush_choose_arg *choose_args; /*!< as in crush_do_rule(), may be NULL */
+};
+
+/** @ingroup API
+ *
+ * A value whose result changed. The results are valid until the next
+ * call to crush_diff_next().
+ */
+struct crush_diff_change {
+	int x;			/*!< the value */
+	int before_len;		/*!< the number of items before */
+	int after_len;		/*!< the number of items after */
+	const int *before;	/*!< the items before */
+	const int *after;	/*!< the items after */
+};
+
+/** @ingroup API
+ *
+ * Opaque mapping diff.
+ */
+struct crush_diff;
+
+/** @ingroup API
+ *
+ * Prepare the diff of the results of the __count__ values starting at
+ * __x_start__ between the epochs __before__ and __after__, mapped by
+ * __num_threads__ threads. The epochs are only read, by
+ * crush_diff_next(), and must not be modified or released until the
+ * diff is released with crush_destroy_diff().
+ *
+ * - return -EINVAL if __count__ or __result_max__ is negative or if a
+ *   rule does not exist
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param before the old epoch
+ * @param after the new epoch
+ * @param x_start the first value
+ * @param count the number of values
+ * @param result_max the maximum number of items per value
+ * @param num_threads the number of threads, 0 for one per online cpu
+ * @param[out] diff the new diff
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_make_diff(const struct crush_diff_epoch *before,
+			   const struct crush_diff_epoch *after,
+			   int x_start, int count, int result_max,
+			   int num_threads, struct crush_diff **diff);
+
+/** @ingroup API
+ *
+ * Set __change__ to the next value whose result differs, in
+ * increasing order of values. Results differ if they do not have the
+ * same items at the same positions.
+ *
+ * @param diff the diff
+ * @param[out] change the value and its results
+ *
+ * @returns 1 if __change__ is set, 0 if there are no more changes,
+ *          < 0 on error
+ */
+extern int crush_diff_next(struct crush_diff *diff,
+			   struct crush_diff_change *change);
+
+/** @ingroup API
+ *
+ * Get the number of values mapped so far, of those known to be
+ * unchanged without mapping them with the new epoch and of those
+ * whose result changed, walked or not yet.
+ *
+ * @param diff the diff
+ * @param[out] mapped the values mapped with the old epoch
+ * @param[out] skipped the values not mapped with the new epoch
+ * @param[out] changed the values whose result changed
+ */
+extern void crush_diff_stats(const struct crush_diff *diff, __u64 *mapped,
+			     __u64 *skipped, __u64 *changed);
+
+/** @ingroup API
+ *
+ * Release a diff made by crush_make_diff().
+ */
+extern void crush_destroy_diff(struct crush_diff *diff);
+
+#endif
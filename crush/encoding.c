@@ -0,0 +1,835 @@
+#include <errno.h>
+
+#include "crush_compat.h"
+#include "builder.h"
+#include "arena.h"
+#include "encoding.h"
+
+/*
+ * The layout is the one of CrushWrapper::encode() and
+ * CrushWrapper::decode() in Ceph: all integers are little endian and
+ * the containers are a __u32 number of elements followed by the
+ * elements.
+ */
+
+/*
+ * When __p__ is NULL the encoder only computes the __size__ of the
+ * encoded map, so that the same code can size the buffer and then
+ * fill it.
+ */
+struct crush_encoder {
+	unsigned char *p;
+	size_t size;
+};
+
+static void encode_u8(struct crush_encoder *e, __u8 v)
+{
+	if (e->p)
+		*e->p++ = v;
+	e->size += 1;
+}
+
+static void encode_u16(struct crush_encoder *e, __u16 v)
+{
+	encode_u8(e, v & 0xff);
+	encode_u8(e, v >> 8);
+}
+
+static void encode_u32(struct crush_encoder *e, __u32 v)
+{
+	if (e->p) {
+		e->p[0] = v & 0xff;
+		e->p[1] = (v >> 8) & 0xff;
+		e->p[2] = (v >> 16) & 0xff;
+		e->p[3] = v >> 24;
+		e->p += 4;
+	}
+	e->size += 4;
+}
+
+static void encode_u64(struct crush_encoder *e, __u64 v)
+{
+	encode_u32(e, v & 0xffffffff);
+	encode_u32(e, v >> 32);
+}
+
+static int encode_bucket(struct crush_encoder *e, const struct crush_bucket *b)
+{
+	__u32 j;
+
+	encode_u32(e, b->alg);
+	encode_u32(e, b->id);
+	encode_u16(e, b->type);
+	encode_u8(e, b->alg);
+	encode_u8(e, b->hash);
+	encode_u32(e, b->weight);
+	encode_u32(e, b->size);
+	for (j = 0; j < b->size; j++)
+		encode_u32(e, b->items[j]);
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		encode_u32(e, ((const struct crush_bucket_uniform *)b)->item_weight);
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *list = (const struct crush_bucket_list *)b;
+		for (j = 0; j < b->size; j++) {
+			encode_u32(e, list->item_weights[j]);
+			encode_u32(e, list->sum_weights[j]);
+		}
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *tree = (const struct crush_bucket_tree *)b;
+		encode_u8(e, tree->num_nodes);
+		for (j = 0; j < tree->num_nodes; j++)
+			encode_u32(e, tree->node_weights[j]);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *straw = (const struct crush_bucket_straw *)b;
+		for (j = 0; j < b->size; j++) {
+			encode_u32(e, straw->item_weights[j]);
+			encode_u32(e, straw->straws[j]);
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *straw2 = (const struct crush_bucket_straw2 *)b;
+		for (j = 0; j < b->size; j++)
+			encode_u32(e, straw2->item_weights[j]);
+		break;
+	}
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void encode_rule(struct crush_encoder *e, const struct crush_rule *rule)
+{
+	__u32 j;
+
+	encode_u32(e, rule->len);
+	encode_u8(e, rule->mask.ruleset);
+	encode_u8(e, rule->mask.type);
+	encode_u8(e, rule->mask.min_size);
+	encode_u8(e, rule->mask.max_size);
+	for (j = 0; j < rule->len; j++) {
+		encode_u32(e, rule->steps[j].op);
+		encode_u32(e, rule->steps[j].arg1);
+		encode_u32(e, rule->steps[j].arg2);
+	}
+}
+
+static void encode_choose_arg_map(struct crush_encoder *e,
+				  const struct crush_choose_arg_map *arg_map)
+{
+	__u32 i, j, k, size = 0;
+
+	for (i = 0; i < arg_map->size; i++)
+		if (arg_map->args[i].weight_set_size || arg_map->args[i].ids_size)
+			size++;
+	encode_u32(e, size);
+	for (i = 0; i < arg_map->size; i++) {
+		const struct crush_choose_arg *arg = &arg_map->args[i];
+		if (arg->weight_set_size == 0 && arg->ids_size == 0)
+			continue;
+		encode_u32(e, i);
+		encode_u32(e, arg->weight_set_size);
+		for (j = 0; j < arg->weight_set_size; j++) {
+			const struct crush_weight_set *weight_set = &arg->weight_set[j];
+			encode_u32(e, weight_set->size);
+			for (k = 0; k < weight_set->size; k++)
+				encode_u32(e, weight_set->weights[k]);
+		}
+		encode_u32(e, arg->ids_size);
+		for (k = 0; k < arg->ids_size; k++)
+			encode_u32(e, arg->ids[k]);
+	}
+}
+
+static int encode_map(struct crush_encoder *e, const struct crush_map *map,
+		      const struct crush_choose_args *choose_args,
+		      int choose_args_count)
+{
+	__s32 b;
+	__u32 r;
+	int i, err;
+
+	encode_u32(e, CRUSH_MAGIC);
+	encode_u32(e, map->max_buckets);
+	encode_u32(e, map->max_rules);
+	encode_u32(e, map->max_devices);
+
+	for (b = 0; b < map->max_buckets; b++) {
+		if (map->buckets[b] == NULL) {
+			encode_u32(e, 0);
+			continue;
+		}
+		err = encode_bucket(e, map->buckets[b]);
+		if (err < 0)
+			return err;
+	}
+
+	for (r = 0; r < map->max_rules; r++) {
+		if (map->rules[r] == NULL) {
+			encode_u32(e, 0);
+			continue;
+		}
+		encode_u32(e, 1);
+		encode_rule(e, map->rules[r]);
+	}
+
+	/* type, bucket and rule names */
+	encode_u32(e, 0);
+	encode_u32(e, 0);
+	encode_u32(e, 0);
+
+	/* tunables */
+	encode_u32(e, map->choose_local_tries);
+	encode_u32(e, map->choose_local_fallback_tries);
+	encode_u32(e, map->choose_total_tries);
+	encode_u32(e, map->chooseleaf_descend_once);
+	encode_u8(e, map->chooseleaf_vary_r);
+	encode_u8(e, map->straw_calc_version);
+	encode_u32(e, map->allowed_bucket_algs);
+	encode_u8(e, map->chooseleaf_stable);
+
+	/* device classes: class_map, class_name, class_bucket */
+	encode_u32(e, 0);
+	encode_u32(e, 0);
+	encode_u32(e, 0);
+
+	encode_u32(e, choose_args_count);
+	for (i = 0; i < choose_args_count; i++) {
+		if (choose_args[i].arg_map.size > (__u32)map->max_buckets)
+			return -EINVAL;
+		encode_u64(e, choose_args[i].key);
+		encode_choose_arg_map(e, &choose_args[i].arg_map);
+	}
+	return 0;
+}
+
+int crush_encode(const struct crush_map *map,
+		 const struct crush_choose_args *choose_args,
+		 int choose_args_count,
+		 void **buffer, size_t *length)
+{
+	struct crush_encoder e = { NULL, 0 };
+	unsigned char *p;
+	int err;
+
+	err = encode_map(&e, map, choose_args, choose_args_count);
+	if (err < 0)
+		return err;
+	p = malloc(e.size);
+	if (!p)
+		return -ENOMEM;
+	e.p = p;
+	e.size = 0;
+	encode_map(&e, map, choose_args, choose_args_count);
+	*buffer = p;
+	*length = e.size;
+	return 0;
+}
+
+/*
+ * Reading past the end of the buffer sets __error__ and returns
+ * zeros, so that the callers only need to check __error__ before
+ * using what they decoded.
+ */
+struct crush_decoder {
+	const unsigned char *p;
+	const unsigned char *end;
+	int error;
+};
+
+static size_t decode_remaining(const struct crush_decoder *d)
+{
+	return d->end - d->p;
+}
+
+static int decode_need(struct crush_decoder *d, size_t size)
+{
+	if (d->error || decode_remaining(d) < size) {
+		d->error = -EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+static __u8 decode_u8(struct crush_decoder *d)
+{
+	if (!decode_need(d, 1))
+		return 0;
+	return *d->p++;
+}
+
+static __u16 decode_u16(struct crush_decoder *d)
+{
+	__u16 v;
+
+	if (!decode_need(d, 2))
+		return 0;
+	v = d->p[0] | (d->p[1] << 8);
+	d->p += 2;
+	return v;
+}
+
+static __u32 decode_u32(struct crush_decoder *d)
+{
+	__u32 v;
+
+	if (!decode_need(d, 4))
+		return 0;
+	v = (__u32)d->p[0] | ((__u32)d->p[1] << 8) |
+		((__u32)d->p[2] << 16) | ((__u32)d->p[3] << 24);
+	d->p += 4;
+	return v;
+}
+
+static __u64 decode_u64(struct crush_decoder *d)
+{
+	__u64 v = decode_u32(d);
+
+	return v | ((__u64)decode_u32(d) << 32);
+}
+
+static void decode_u32_array(struct crush_decoder *d, __u32 *v, __u32 n)
+{
+	if (!decode_need(d, (size_t)n * 4))
+		return;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* the encoding is the memory layout */
+	memcpy(v, d->p, (size_t)n * 4);
+	d->p += (size_t)n * 4;
+#else
+	{
+		__u32 i;
+		for (i = 0; i < n; i++)
+			v[i] = decode_u32(d);
+	}
+#endif
+}
+
+static void decode_skip(struct crush_decoder *d, size_t size)
+{
+	if (decode_need(d, size))
+		d->p += size;
+}
+
+/* return 0 if there are less than __n__ elements of __size__ bytes left */
+static int decode_check_count(struct crush_decoder *d, size_t n, size_t size)
+{
+	if (decode_remaining(d) / size < n) {
+		d->error = -EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+static void decode_skip_string_map(struct crush_decoder *d)
+{
+	__u32 n = decode_u32(d);
+
+	while (n-- > 0 && !d->error) {
+		decode_skip(d, 4);
+		decode_skip(d, decode_u32(d));
+	}
+}
+
+/*
+ * The number of nodes crush_make_tree_bucket() gives to a tree bucket
+ * of __size__ items.
+ */
+static size_t decode_tree_num_nodes(__u32 size)
+{
+	size_t num_nodes = 1;
+
+	if (size > 0)
+		for (num_nodes = 2; num_nodes < 2 * (size_t)size; num_nodes <<= 1)
+			;
+	return num_nodes;
+}
+
+/*
+ * The mapper descends a tree bucket following the weights of its
+ * nodes and returns the item of the leaf it reaches. It cannot reach
+ * a leaf beyond the items if every node weighs as much as its two
+ * children and the leaves beyond the items weigh nothing.
+ */
+static int decode_check_tree(const struct crush_bucket_tree *tree)
+{
+	const __u32 *w = tree->node_weights;
+	int n, half;
+
+	for (n = 2; n < tree->num_nodes; n += 2) {
+		half = (n & -n) >> 1;
+		if ((__u64)w[n - half] + w[n + half] != w[n])
+			return 0;
+	}
+	for (n = 1; n < tree->num_nodes; n += 2)
+		if ((__u32)(n >> 1) >= tree->h.size && w[n] != 0)
+			return 0;
+	return 1;
+}
+
+static struct crush_bucket *decode_bucket(struct crush_decoder *d,
+					  struct crush_arena *arena,
+					  __u32 alg, int pos)
+{
+	struct crush_bucket *b;
+	size_t struct_size, arrays;
+	__s32 id = decode_u32(d);
+	__u16 type = decode_u16(d);
+	__u8 alg8 = decode_u8(d);
+	__u8 hash = decode_u8(d);
+	__u32 weight = decode_u32(d);
+	__u32 size = decode_u32(d);
+	__u8 num_nodes = 0;
+	__u32 *p, j;
+
+	if (d->error || alg8 != alg || id != -1-pos)
+		goto err;
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		struct_size = sizeof(struct crush_bucket_uniform);
+		arrays = 0;
+		break;
+	case CRUSH_BUCKET_LIST:
+		struct_size = sizeof(struct crush_bucket_list);
+		arrays = 2 * (size_t)size;
+		break;
+	case CRUSH_BUCKET_TREE:
+		struct_size = sizeof(struct crush_bucket_tree);
+		/* num_nodes is encoded after the items */
+		if (!decode_check_count(d, (size_t)size + 1, 4))
+			goto err;
+		num_nodes = d->p[(size_t)size * 4];
+		if (num_nodes != decode_tree_num_nodes(size))
+			goto err;
+		arrays = num_nodes;
+		break;
+	case CRUSH_BUCKET_STRAW:
+		struct_size = sizeof(struct crush_bucket_straw);
+		arrays = 2 * (size_t)size;
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		struct_size = sizeof(struct crush_bucket_straw2);
+		arrays = size;
+		break;
+	default:
+		goto err;
+	}
+	/* every item and every weight takes 4 bytes in the buffer */
+	if (!decode_check_count(d, size, 4) ||
+	    (alg != CRUSH_BUCKET_TREE && !decode_check_count(d, (size_t)size + arrays, 4)))
+		goto err;
+
+	/* the bucket and all its arrays in a single allocation */
+	b = crush_arena_alloc(arena, struct_size + ((size_t)size + arrays) * sizeof(__u32));
+	if (!b) {
+		d->error = -ENOMEM;
+		return NULL;
+	}
+	memset(b, 0, struct_size);
+	b->id = id;
+	b->type = type;
+	b->alg = alg;
+	b->hash = hash;
+	b->weight = weight;
+	b->size = size;
+	p = (__u32 *)((char *)b + struct_size);
+	if (size) {
+		b->items = (__s32 *)p;
+		decode_u32_array(d, p, size);
+		p += size;
+	}
+
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		((struct crush_bucket_uniform *)b)->item_weight = decode_u32(d);
+		break;
+	case CRUSH_BUCKET_LIST: {
+		struct crush_bucket_list *list = (struct crush_bucket_list *)b;
+		if (size == 0)
+			break;
+		list->item_weights = p;
+		list->sum_weights = p + size;
+		for (j = 0; j < size; j++) {
+			list->item_weights[j] = decode_u32(d);
+			list->sum_weights[j] = decode_u32(d);
+		}
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		struct crush_bucket_tree *tree = (struct crush_bucket_tree *)b;
+		tree->num_nodes = decode_u8(d);
+		tree->node_weights = p;
+		decode_u32_array(d, p, num_nodes);
+		if (!d->error && !decode_check_tree(tree))
+			goto err;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		struct crush_bucket_straw *straw = (struct crush_bucket_straw *)b;
+		if (size == 0)
+			break;
+		straw->item_weights = p;
+		straw->straws = p + size;
+		for (j = 0; j < size; j++) {
+			straw->item_weights[j] = decode_u32(d);
+			straw->straws[j] = decode_u32(d);
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		struct crush_bucket_straw2 *straw2 = (struct crush_bucket_straw2 *)b;
+		if (size == 0)
+			break;
+		straw2->item_weights = p;
+		decode_u32_array(d, p, size);
+		break;
+	}
+	}
+	return b;
+err:
+	d->error = -EINVAL;
+	return NULL;
+}
+
+
+/*
+ * The mapper follows the items of the buckets without checking them:
+ * each must be a device below max_devices or an existing bucket.
+ */
+static int decode_check_items(const struct crush_map *map)
+{
+	const struct crush_bucket *b;
+	__s32 item;
+	int i;
+	__u32 j;
+
+	for (i = 0; i < map->max_buckets; i++) {
+		b = map->buckets[i];
+		if (b == NULL)
+			continue;
+		for (j = 0; j < b->size; j++) {
+			item = b->items[j];
+			if (item >= 0 ? item >= map->max_devices :
+			    -1-item >= map->max_buckets || !map->buckets[-1-item])
+				return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static struct crush_rule *decode_rule(struct crush_decoder *d,
+				      struct crush_arena *arena)
+{
+	struct crush_rule *rule;
+	__u32 len = decode_u32(d);
+	__u32 j;
+
+	/* the mask takes 4 bytes and each step 3 * 4 bytes */
+	if (!decode_check_count(d, (size_t)len * 3 + 1, 4))
+		return NULL;
+	rule = crush_arena_alloc(arena, crush_rule_size(len));
+	if (!rule) {
+		d->error = -ENOMEM;
+		return NULL;
+	}
+	rule->len = len;
+	rule->mask.ruleset = decode_u8(d);
+	rule->mask.type = decode_u8(d);
+	rule->mask.min_size = decode_u8(d);
+	rule->mask.max_size = decode_u8(d);
+	for (j = 0; j < len; j++) {
+		rule->steps[j].op = decode_u32(d);
+		rule->steps[j].arg1 = decode_u32(d);
+		rule->steps[j].arg2 = decode_u32(d);
+	}
+	return rule;
+}
+
+static void decode_skip_class_maps(struct crush_decoder *d)
+{
+	__u32 n;
+
+	/* class_map */
+	n = decode_u32(d);
+	if (decode_check_count(d, n, 2 * 4))
+		decode_skip(d, (size_t)n * 2 * 4);
+	/* class_name */
+	decode_skip_string_map(d);
+	/* class_bucket */
+	n = decode_u32(d);
+	while (n-- > 0 && !d->error) {
+		__u32 m;
+		decode_skip(d, 4);
+		m = decode_u32(d);
+		if (decode_check_count(d, m, 2 * 4))
+			decode_skip(d, (size_t)m * 2 * 4);
+	}
+}
+
+/*
+ * When __args__ is NULL, validate the choose_args of one key and
+ * count the weight sets and the weights + ids they contain. Otherwise
+ * fill __args__ (__max_buckets__ elements), __weight_set__ and
+ * __u32s__ with them. The layout is the one of
+ * crush_make_choose_args() so that the args can be deallocated with
+ * crush_destroy_choose_args().
+ */
+static void decode_choose_arg_map(struct crush_decoder *d,
+				  const struct crush_map *map,
+				  struct crush_choose_arg *args,
+				  struct crush_weight_set *weight_set,
+				  __u32 *u32s,
+				  size_t *weight_set_count, size_t *u32_count)
+{
+	__u32 n = decode_u32(d);
+	__u32 i, j;
+
+	*weight_set_count = *u32_count = 0;
+	if (args)
+		memset(args, 0, sizeof(*args) * map->max_buckets);
+	for (i = 0; i < n && !d->error; i++) {
+		__u32 bucket_index = decode_u32(d);
+		__u32 positions = decode_u32(d);
+		__u32 size, ids_size;
+		const struct crush_bucket *b;
+
+		if (d->error ||
+		    bucket_index >= (__u32)map->max_buckets ||
+		    map->buckets[bucket_index] == NULL ||
+		    !decode_check_count(d, positions, 4))
+			goto err;
+		b = map->buckets[bucket_index];
+		if (args) {
+			args[bucket_index].weight_set = positions ? weight_set : NULL;
+			args[bucket_index].weight_set_size = positions;
+		}
+		for (j = 0; j < positions; j++) {
+			size = decode_u32(d);
+			if (d->error || size != b->size ||
+			    !decode_check_count(d, size, 4))
+				goto err;
+			if (args) {
+				weight_set->weights = u32s;
+				weight_set->size = size;
+				decode_u32_array(d, u32s, size);
+				weight_set++;
+				u32s += size;
+			} else {
+				decode_skip(d, (size_t)size * 4);
+			}
+			(*weight_set_count)++;
+			*u32_count += size;
+		}
+		ids_size = decode_u32(d);
+		if (d->error || (ids_size != 0 && ids_size != b->size) ||
+		    !decode_check_count(d, ids_size, 4))
+			goto err;
+		if (args) {
+			args[bucket_index].ids = ids_size ? (__s32 *)u32s : NULL;
+			args[bucket_index].ids_size = ids_size;
+			decode_u32_array(d, u32s, ids_size);
+			u32s += ids_size;
+		} else {
+			decode_skip(d, (size_t)ids_size * 4);
+		}
+		*u32_count += ids_size;
+	}
+	return;
+err:
+	d->error = -EINVAL;
+}
+
+static int decode_choose_args(struct crush_decoder *d,
+			      const struct crush_map *map,
+			      struct crush_choose_args **choose_argsp,
+			      int *countp)
+{
+	struct crush_choose_args *choose_args;
+	__u32 n = decode_u32(d);
+	__u32 i;
+
+	*choose_argsp = NULL;
+	*countp = 0;
+	/* a key and the number of args */
+	if (n == 0 || !decode_check_count(d, n, 8 + 4))
+		return d->error;
+	choose_args = crush_calloc(n, sizeof(*choose_args));
+	if (!choose_args)
+		return -ENOMEM;
+	*choose_argsp = choose_args;
+	for (i = 0; i < n; i++) {
+		const unsigned char *start;
+		size_t weight_set_count, u32_count;
+		struct crush_choose_arg *args;
+		struct crush_weight_set *weight_set;
+
+		choose_args[i].key = decode_u64(d);
+		start = d->p;
+		decode_choose_arg_map(d, map, NULL, NULL, NULL,
+				      &weight_set_count, &u32_count);
+		if (d->error)
+			return d->error;
+		args = crush_malloc(sizeof(*args) * map->max_buckets +
+			      sizeof(*weight_set) * weight_set_count +
+			      sizeof(__u32) * u32_count);
+		if (!args)
+			return -ENOMEM;
+		(*countp)++;
+		choose_args[i].arg_map.args = args;
+		choose_args[i].arg_map.size = map->max_buckets;
+		weight_set = (struct crush_weight_set *)(args + map->max_buckets);
+		d->p = start;
+		decode_choose_arg_map(d, map, args, weight_set,
+				      (__u32 *)(weight_set + weight_set_count),
+				      &weight_set_count, &u32_count);
+	}
+	return d->error;
+}
+
+int crush_decode(const void *buffer, size_t length,
+		 struct crush_map **mapp,
+		 struct crush_choose_args **choose_argsp,
+		 int *choose_args_countp)
+{
+	struct crush_decoder d;
+	struct crush_map *map;
+	struct crush_choose_args *choose_args = NULL;
+	int choose_args_count = 0;
+	__s32 max_buckets, max_devices, b;
+	__u32 max_rules, r;
+	int err;
+
+	d.p = buffer;
+	d.end = d.p + length;
+	d.error = 0;
+
+	if (decode_u32(&d) != CRUSH_MAGIC)
+		return -EINVAL;
+	max_buckets = decode_u32(&d);
+	max_rules = decode_u32(&d);
+	max_devices = decode_u32(&d);
+	/* every bucket and every rule takes at least 4 bytes */
+	if (d.error || max_buckets < 0 || max_devices < 0 ||
+	    max_rules > CRUSH_MAX_RULES ||
+	    !decode_check_count(&d, (size_t)max_buckets + max_rules, 4))
+		return -EINVAL;
+
+	map = crush_create();
+	if (!map)
+		return -ENOMEM;
+	set_legacy_crush_map(map);
+	/*
+	 * The decoded buckets and rules are never larger than their
+	 * encoding plus the difference between the size of the structs
+	 * and their headers: the arena is allocated at once.
+	 */
+	map->arena = crush_arena_create(length + 64 * (size_t)max_buckets +
+					16 * (size_t)max_rules);
+	if (!map->arena)
+		goto enomem;
+	map->arena_only = 1;
+	if (max_buckets > 0) {
+		map->buckets = crush_calloc(max_buckets, sizeof(*map->buckets));
+		if (!map->buckets)
+			goto enomem;
+	}
+	map->max_buckets = max_buckets;
+	if (max_rules > 0) {
+		map->rules = crush_calloc(max_rules, sizeof(*map->rules));
+		if (!map->rules)
+			goto enomem;
+	}
+	map->max_rules = max_rules;
+	map->max_devices = max_devices;
+
+	for (b = 0; b < max_buckets; b++) {
+		__u32 alg = decode_u32(&d);
+		if (d.error)
+			goto error;
+		if (alg == 0)
+			continue;
+		map->buckets[b] = decode_bucket(&d, map->arena, alg, b);
+		if (map->buckets[b] == NULL)
+			goto error;
+	}
+	d.error = decode_check_items(map);
+	if (d.error)
+		goto error;
+
+	for (r = 0; r < max_rules; r++) {
+		__u32 yes = decode_u32(&d);
+		if (d.error)
+			goto error;
+		if (!yes)
+			continue;
+		map->rules[r] = decode_rule(&d, map->arena);
+		if (map->rules[r] == NULL)
+			goto error;
+	}
+
+	/* type, bucket and rule names */
+	decode_skip_string_map(&d);
+	decode_skip_string_map(&d);
+	decode_skip_string_map(&d);
+
+	/* tunables added over time, missing from older encodings */
+	if (decode_remaining(&d) > 0) {
+		map->choose_local_tries = decode_u32(&d);
+		map->choose_local_fallback_tries = decode_u32(&d);
+		map->choose_total_tries = decode_u32(&d);
+	}
+	if (decode_remaining(&d) > 0)
+		map->chooseleaf_descend_once = decode_u32(&d);
+	if (decode_remaining(&d) > 0)
+		map->chooseleaf_vary_r = decode_u8(&d);
+	if (decode_remaining(&d) > 0)
+		map->straw_calc_version = decode_u8(&d);
+	if (decode_remaining(&d) > 0)
+		map->allowed_bucket_algs = decode_u32(&d);
+	if (decode_remaining(&d) > 0)
+		map->chooseleaf_stable = decode_u8(&d);
+	if (decode_remaining(&d) > 0)
+		decode_skip_class_maps(&d);
+	if (d.error)
+		goto error;
+	if (decode_remaining(&d) > 0 && choose_argsp) {
+		err = decode_choose_args(&d, map, &choose_args, &choose_args_count);
+		if (err < 0) {
+			d.error = err;
+			goto error;
+		}
+	}
+
+	crush_finalize(map);
+	*mapp = map;
+	if (choose_argsp)
+		*choose_argsp = choose_args;
+	if (choose_args_countp)
+		*choose_args_countp = choose_args_count;
+	return 0;
+
+enomem:
+	d.error = -ENOMEM;
+error:
+	crush_destroy_choose_args_array(choose_args, choose_args_count);
+	crush_destroy(map);
+	return d.error;
+}
+
+void crush_destroy_choose_args_array(struct crush_choose_args *choose_args,
+				     int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		crush_destroy_choose_args(choose_args[i].arg_map.args);
+	crush_free(choose_args);
+}
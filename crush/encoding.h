@@ -0,0 +1,93 @@
+#ifndef CEPH_CRUSH_ENCODING_H
+#define CEPH_CRUSH_ENCODING_H
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * A crush_choose_arg_map and the key identifying it, as found in the
+ * __choose_args__ section of a Ceph crush map. Ceph uses the pool id
+ * as a key, or -1 for the choose_args used by default.
+ */
+struct crush_choose_args {
+	__s64 key;                            /*!< identifier of the __arg_map__ */
+	struct crush_choose_arg_map arg_map;  /*!< __arg_map.size__ is __max_buckets__ */
+};
+
+/** @ingroup API
+ *
+ * Encode __map__ and __choose_args_count__ __choose_args__ in the Ceph
+ * crush map binary format (the format of "ceph osd getcrushmap"), as
+ * encoded by a Luminous or later cluster. The type, bucket and rule
+ * names are not known to libcrush and are encoded as empty maps, as
+ * are the device classes.
+ *
+ * The encoded map is stored in a __malloc(3)__ buffer returned in
+ * __buffer__ and its size in __length__. It is the responsibility of
+ * the caller to __free(3)__ the __buffer__.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EINVAL if a bucket has an unknown algorithm or if the
+ *   __arg_map.size__ of a choose_args is larger than __max_buckets__
+ *
+ * @param map the crush_map to encode
+ * @param choose_args the choose_args to encode or NULL
+ * @param choose_args_count the number of elements in __choose_args__
+ * @param[out] buffer the encoded map
+ * @param[out] length the number of bytes in __buffer__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_encode(const struct crush_map *map,
+			const struct crush_choose_args *choose_args,
+			int choose_args_count,
+			void **buffer, size_t *length);
+
+/** @ingroup API
+ *
+ * Decode the Ceph crush map binary format in the __length__ bytes of
+ * __buffer__ and return a new crush_map in __map__, ready to be used
+ * with crush_do_rule(). The caller is responsible for deallocating it
+ * with crush_destroy().
+ *
+ * The buffer is read once and the buckets and rules are allocated in
+ * bulk from __map->arena__ instead of one by one. They can be modified
+ * with the builder functions, as any other bucket and rule.
+ *
+ * Maps encoded by older Ceph versions lack some tunables: they keep
+ * the value set by set_legacy_crush_map(), as in Ceph. The names and
+ * device classes are ignored.
+ *
+ * If __choose_args__ is not NULL, it is set to a __malloc(3)__ array
+ * of __choose_args_count__ crush_choose_args to be deallocated with
+ * crush_destroy_choose_args_array(). The __arg_map.args__ of each
+ * element can be given to crush_do_rule().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EINVAL if the content of the buffer is not a valid crush map
+ *   or if it is truncated
+ *
+ * @param buffer the encoded map
+ * @param length the number of bytes in __buffer__
+ * @param[out] map the decoded crush_map
+ * @param[out] choose_args the decoded choose_args or NULL
+ * @param[out] choose_args_count the number of decoded choose_args or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_decode(const void *buffer, size_t length,
+			struct crush_map **map,
+			struct crush_choose_args **choose_args,
+			int *choose_args_count);
+
+/** @ingroup API
+ *
+ * Deallocate the __choose_args__ array returned by crush_decode().
+ *
+ * @param choose_args the array to deallocate
+ * @param count the number of elements in __choose_args__
+ */
+extern void crush_destroy_choose_args_array(struct crush_choose_args *choose_args,
+					    int count);
+
+#endif
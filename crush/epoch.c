@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "crush_compat.h"
+#include "epoch.h"
+
+#define CRUSH_CACHELINE 64
+
+struct crush_reader {
+	__u64 epoch;		/* global epoch when pinned, 0 if not */
+	struct crush_handle *handle;
+	int in_use;
+} __attribute__((aligned(CRUSH_CACHELINE)));
+
+struct crush_version {
+	void *object;		/* the map unless published as an object */
+	void (*destroy)(void *object);
+	__u64 version;
+	__u64 epoch;		/* global epoch before it was replaced */
+	struct crush_version *next;
+};
+
+struct crush_handle {
+	struct crush_version *current;
+	__u64 epoch;
+	pthread_mutex_t lock;	/* fields below and publishers */
+	__u64 version;
+	struct crush_version *retired;
+	int max_readers;
+	struct crush_reader *readers;
+};
+
+int crush_handle_create(int max_readers, struct crush_handle **handle)
+{
+	struct crush_handle *h;
+	int i;
+
+	if (max_readers < 1)
+		return -EINVAL;
+	h = crush_calloc(1, sizeof(*h));
+	if (h == NULL)
+		return -ENOMEM;
+	h->readers = crush_malloc_aligned(sizeof(*h->readers) * max_readers,
+					  CRUSH_CACHELINE);
+	if (h->readers == NULL) {
+		crush_free(h);
+		return -ENOMEM;
+	}
+	for (i = 0; i < max_readers; i++) {
+		h->readers[i].epoch = 0;
+		h->readers[i].handle = h;
+		h->readers[i].in_use = 0;
+	}
+	h->max_readers = max_readers;
+	h->epoch = 1;
+	pthread_mutex_init(&h->lock, NULL);
+	*handle = h;
+	return 0;
+}
+
+int crush_handle_register(struct crush_handle *h, struct crush_reader **reader)
+{
+	int i;
+
+	for (i = 0; i < h->max_readers; i++) {
+		if (__sync_bool_compare_and_swap(&h->readers[i].in_use, 0, 1)) {
+			*reader = &h->readers[i];
+			return 0;
+		}
+	}
+	return -EBUSY;
+}
+
+void crush_handle_unregister(struct crush_reader *reader)
+{
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * The reader publishes the epoch before loading the map. If a writer
+ * reclaiming maps sees the slot clear, the store comes later in the
+ * total order of sequentially consistent operations, so does the load
+ * and it returns the new map.
+ */
+const void *crush_handle_pin_object(struct crush_reader *reader, __u64 *version)
+{
+	struct crush_handle *h = reader->handle;
+	struct crush_version *v;
+
+	__atomic_store_n(&reader->epoch,
+			 __atomic_load_n(&h->epoch, __ATOMIC_SEQ_CST),
+			 __ATOMIC_SEQ_CST);
+	v = __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+	if (version)
+		*version = v ? v->version : 0;
+	return v ? v->object : NULL;
+}
+
+const struct crush_map *crush_handle_pin(struct crush_reader *reader,
+					 __u64 *version)
+{
+	return crush_handle_pin_object(reader, version);
+}
+
+void crush_handle_unpin(struct crush_reader *reader)
+{
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* called with the lock held */
+static int crush_handle_reclaim_locked(struct crush_handle *h)
+{
+	struct crush_version **p, *v;
+	__u64 oldest = (__u64)-1, epoch;
+	int i, pending = 0;
+
+	if (h->retired == NULL)
+		return 0;
+	for (i = 0; i < h->max_readers; i++) {
+		epoch = __atomic_load_n(&h->readers[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+	/* a map replaced at epoch E may be held by readers pinned at E or before */
+	p = &h->retired;
+	while ((v = *p) != NULL) {
+		if (v->epoch < oldest) {
+			*p = v->next;
+			v->destroy(v->object);
+			crush_free(v);
+		} else {
+			p = &v->next;
+			pending++;
+		}
+	}
+	return pending;
+}
+
+int crush_handle_publish_object(struct crush_handle *h, void *object,
+				void (*destroy)(void *object), __u64 *version)
+{
+	struct crush_version *v, *old;
+
+	v = crush_malloc(sizeof(*v));
+	if (v == NULL)
+		return -ENOMEM;
+	v->object = object;
+	v->destroy = destroy;
+	v->next = NULL;
+	pthread_mutex_lock(&h->lock);
+	v->version = ++h->version;
+	old = __atomic_exchange_n(&h->current, v, __ATOMIC_SEQ_CST);
+	if (old) {
+		old->epoch = __atomic_fetch_add(&h->epoch, 1, __ATOMIC_SEQ_CST);
+		old->next = h->retired;
+		h->retired = old;
+	}
+	crush_handle_reclaim_locked(h);
+	pthread_mutex_unlock(&h->lock);
+	if (version)
+		*version = v->version;
+	return 0;
+}
+
+static void crush_handle_destroy_map(void *map)
+{
+	crush_destroy(map);
+}
+
+int crush_handle_publish(struct crush_handle *h, struct crush_map *map,
+			 __u64 *version)
+{
+	return crush_handle_publish_object(h, map, crush_handle_destroy_map,
+					   version);
+}
+
+int crush_handle_reclaim(struct crush_handle *h)
+{
+	int pending;
+
+	pthread_mutex_lock(&h->lock);
+	pending = crush_handle_reclaim_locked(h);
+	pthread_mutex_unlock(&h->lock);
+	return pending;
+}
+
+void crush_handle_synchronize(struct crush_handle *h)
+{
+	while (crush_handle_reclaim(h))
+		sched_yield();
+}
+
+void crush_handle_destroy(struct crush_handle *h)
+{
+	struct crush_version *v, *next;
+
+	if (h == NULL)
+		return;
+	for (v = h->retired; v; v = next) {
+		next = v->next;
+		v->destroy(v->object);
+		crush_free(v);
+	}
+	if (h->current) {
+		h->current->destroy(h->current->object);
+		crush_free(h->current);
+	}
+	pthread_mutex_destroy(&h->lock);
+	crush_free(h->readers);
+	crush_free(h);
+}
@@ -0,0 +1,164 @@
+#ifndef CEPH_CRUSH_EPOCH_H
+#define CEPH_CRUSH_EPOCH_H
+
+#include "crush.h"
+
+/*
+ * The mapper does not modify a finalized crush_map and any number of
+ * threads can call crush_do_rule() on it without a lock. A
+ * crush_handle allows replacing that map while they do: readers pin
+ * the current map with two atomic operations, a writer publishes a
+ * new map with a single pointer swap and the map replaced is
+ * destroyed once no reader can still hold it.
+ *
+ * Reclamation is epoch based. Each reader has a slot in which it
+ * writes the global epoch when it pins the map and clears it when it
+ * unpins it. A publish bumps the global epoch after the swap and tags
+ * the map replaced with the previous epoch: once every slot is either
+ * clear or holds a later epoch, all readers pinned the new map and
+ * the old one is destroyed.
+ */
+
+/** @ingroup API
+ *
+ * Opaque handle on the current version of a map.
+ */
+struct crush_handle;
+
+/** @ingroup API
+ *
+ * A reader of a crush_handle, to be used by a single thread at a time.
+ */
+struct crush_reader;
+
+/** @ingroup API
+ *
+ * Create a handle with no map and room for __max_readers__ readers.
+ * It must be released with crush_handle_destroy().
+ *
+ * - return -EINVAL if __max_readers__ < 1
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param max_readers the largest number of readers registered at once
+ * @param[out] handle the new handle
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_handle_create(int max_readers, struct crush_handle **handle);
+
+/** @ingroup API
+ *
+ * Register a reader of __handle__, typically once per thread. The
+ * reader must be released with crush_handle_unregister().
+ *
+ * - return -EBUSY if __max_readers__ readers are already registered
+ *
+ * @param handle the handle
+ * @param[out] reader the new reader
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_handle_register(struct crush_handle *handle,
+				 struct crush_reader **reader);
+
+/** @ingroup API
+ *
+ * Release a __reader__ that does not have the map pinned.
+ */
+extern void crush_handle_unregister(struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Pin the current map of the handle of __reader__ and return it. It
+ * will not be destroyed until crush_handle_unpin(), even if another
+ * map is published in the meantime. The reader must only call
+ * functions that do not modify the map, such as crush_do_rule() and
+ * crush_find_rule(). Pins do not nest: a reader must unpin the map
+ * before pinning it again.
+ *
+ * No lock is taken and nothing is written outside of the slot of
+ * __reader__.
+ *
+ * @param reader the reader
+ * @param[out] version the version of the map (see crush_handle_publish()) or NULL
+ *
+ * @returns the current map or NULL if none was published
+ */
+extern const struct crush_map *crush_handle_pin(struct crush_reader *reader,
+						__u64 *version);
+
+/** @ingroup API
+ *
+ * Release the map pinned with crush_handle_pin(). The reader must not
+ * use it afterwards.
+ */
+extern void crush_handle_unpin(struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Make __map__ the current map of __handle__ and destroy the maps
+ * replaced that no reader can hold anymore, see
+ * crush_handle_reclaim(). The __map__ must have been finalized with
+ * crush_finalize() and belongs to the handle from now on: it must not
+ * be modified and it will be destroyed with crush_destroy(). Writers
+ * are serialized by a mutex that readers never take.
+ *
+ * The version of the first map published is 1 and it is incremented
+ * by one for each map published after it.
+ *
+ * - return -ENOMEM if memory allocation fails, the __map__ is not
+ *   published and still belongs to the caller
+ *
+ * @param handle the handle
+ * @param map the new map
+ * @param[out] version the version of __map__ or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_handle_publish(struct crush_handle *handle,
+				struct crush_map *map, __u64 *version);
+
+/** @ingroup API
+ *
+ * Destroy the maps replaced by crush_handle_publish() that all the
+ * readers unpinned since, without waiting for the others.
+ *
+ * @param handle the handle
+ *
+ * @returns the number of maps replaced that are not destroyed yet
+ */
+extern int crush_handle_reclaim(struct crush_handle *handle);
+
+/** @ingroup API
+ *
+ * Wait until all the readers unpinned the maps replaced by
+ * crush_handle_publish() and destroy them. It must not be called by
+ * a thread that has a map pinned.
+ *
+ * @param handle the handle
+ */
+extern void crush_handle_synchronize(struct crush_handle *handle);
+
+/** @ingroup API
+ *
+ * Destroy the current map and the maps replaced and release
+ * __handle__. No reader may have a map pinned; the readers that are
+ * still registered are released as well.
+ */
+extern void crush_handle_destroy(struct crush_handle *handle);
+
+/*! @cond INTERNAL */
+
+/*
+ * Like crush_handle_publish() and crush_handle_pin() for an __object__
+ * that is not a crush_map and is released with __destroy__, see
+ * crush_replicas_publish().
+ */
+extern int crush_handle_publish_object(struct crush_handle *handle, void *object,
+				       void (*destroy)(void *object), __u64 *version);
+extern const void *crush_handle_pin_object(struct crush_reader *reader,
+					   __u64 *version);
+
+/*! @endcond */
+
+#endif
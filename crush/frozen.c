@@ -0,0 +1,572 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crush_compat.h"
+#include "hash.h"
+#include "mapper.h"
+#include "trace.h"
+#include "probes.h"
+#include "frozen.h"
+
+#define dprintk(args...) /* printf(args) */
+
+#define FROZEN_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+static inline const void *frozen_ptr(const struct crush_frozen_map *map,
+				     __u32 offset)
+{
+	return (const char *)map + offset;
+}
+
+static inline const struct crush_frozen_bucket *
+frozen_bucket(const struct crush_frozen_map *map, int pos)
+{
+	const __u32 *buckets = frozen_ptr(map, map->buckets);
+
+	if (buckets[pos] == 0)
+		return NULL;
+	return frozen_ptr(map, buckets[pos]);
+}
+
+static inline const struct crush_rule *
+frozen_rule(const struct crush_frozen_map *map, __u32 ruleno)
+{
+	const __u32 *rules = frozen_ptr(map, map->rules);
+
+	if (rules[ruleno] == 0)
+		return NULL;
+	return frozen_ptr(map, rules[ruleno]);
+}
+
+/*
+ * Fletcher-64 on little or big endian 32 bits words: the sums are
+ * only reduced every few thousand words, which is fast enough to
+ * verify a large image in the time it takes to read it.
+ */
+__u64 crush_frozen_checksum(const void *p, size_t length)
+{
+	const __u32 *w = p;
+	size_t n = length / 4;
+	__u64 a = 0, b = 0;
+
+	while (n > 0) {
+		size_t block = n < 16384 ? n : 16384;
+		n -= block;
+		while (block-- > 0) {
+			a += *w++;
+			b += a;
+		}
+		a %= 0xffffffff;
+		b %= 0xffffffff;
+	}
+	return (b << 32) | a;
+}
+
+/* the number of __u32 in the arrays of a frozen bucket */
+static size_t frozen_bucket_items(const struct crush_bucket *b)
+{
+	if (b->alg == CRUSH_BUCKET_TREE) {
+		const struct crush_bucket_tree *tree = (const struct crush_bucket_tree *)b;
+		__u32 leaves = tree->num_nodes >> 1;
+		return (leaves > b->size ? leaves : b->size) + tree->num_nodes;
+	}
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return b->size;
+	case CRUSH_BUCKET_LIST:
+	case CRUSH_BUCKET_STRAW:
+		return 3 * (size_t)b->size;
+	default:
+		return 2 * (size_t)b->size;
+	}
+}
+
+/* copy __n__ __u32 at __offset__ and return the offset following them */
+static __u32 frozen_copy(char *image, __u32 offset, const void *src, size_t n)
+{
+	if (n)
+		memcpy(image + offset, src, n * sizeof(__u32));
+	return offset + n * sizeof(__u32);
+}
+
+static __u32 frozen_write_bucket(char *image, __u32 offset,
+				 const struct crush_bucket *b)
+{
+	struct crush_frozen_bucket *f = (struct crush_frozen_bucket *)(image + offset);
+	__u32 o = offset + sizeof(*f);
+	__u32 size = b->size;
+
+	f->id = b->id;
+	f->type = b->type;
+	f->alg = b->alg;
+	f->hash = b->hash;
+	f->weight = b->weight;
+	f->size = size;
+	f->items = o;
+	o = frozen_copy(image, o, b->items, size);
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		f->item_weight = ((const struct crush_bucket_uniform *)b)->item_weight;
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *list = (const struct crush_bucket_list *)b;
+		f->item_weights = o;
+		o = frozen_copy(image, o, list->item_weights, size);
+		f->sum_weights = o;
+		o = frozen_copy(image, o, list->sum_weights, size);
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *tree = (const struct crush_bucket_tree *)b;
+		__u32 j;
+		/* leaves past the last item are never chosen, see frozen.h */
+		for (j = size; j < (__u32)(tree->num_nodes >> 1); j++) {
+			*(__s32 *)(image + o) = CRUSH_ITEM_NONE;
+			o += sizeof(__s32);
+		}
+		f->num_nodes = tree->num_nodes;
+		f->node_weights = o;
+		o = frozen_copy(image, o, tree->node_weights, tree->num_nodes);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *straw = (const struct crush_bucket_straw *)b;
+		f->item_weights = o;
+		o = frozen_copy(image, o, straw->item_weights, size);
+		f->straws = o;
+		o = frozen_copy(image, o, straw->straws, size);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *straw2 = (const struct crush_bucket_straw2 *)b;
+		f->item_weights = o;
+		o = frozen_copy(image, o, straw2->item_weights, size);
+		break;
+	}
+	}
+	return FROZEN_ALIGN(o);
+}
+
+int crush_freeze(const struct crush_map *map, void **imagep, size_t *lengthp)
+{
+	struct crush_frozen_map *h;
+	char *image;
+	size_t length;
+	__u32 *buckets, *rules;
+	__u32 offset, r;
+	__s32 b;
+
+	/* the size of the image */
+	length = FROZEN_ALIGN(sizeof(*h));
+	length += FROZEN_ALIGN(map->max_buckets * sizeof(__u32));
+	length += FROZEN_ALIGN(map->max_rules * sizeof(__u32));
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+		if (bucket == NULL)
+			continue;
+		if (bucket->alg < CRUSH_BUCKET_UNIFORM ||
+		    bucket->alg > CRUSH_BUCKET_STRAW2)
+			return -EINVAL;
+		length += FROZEN_ALIGN(sizeof(struct crush_frozen_bucket) +
+				       frozen_bucket_items(bucket) * sizeof(__u32));
+	}
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			length += FROZEN_ALIGN(crush_rule_size(map->rules[r]->len));
+	if (length > 0xffffffffu)
+		return -E2BIG;
+
+	image = calloc(1, length);
+	if (!image)
+		return -ENOMEM;
+	h = (struct crush_frozen_map *)image;
+	h->magic = CRUSH_FROZEN_MAGIC;
+	h->version = CRUSH_FROZEN_VERSION;
+	h->length = length;
+	h->max_buckets = map->max_buckets;
+	h->max_rules = map->max_rules;
+	h->max_devices = map->max_devices;
+	h->choose_local_tries = map->choose_local_tries;
+	h->choose_local_fallback_tries = map->choose_local_fallback_tries;
+	h->choose_total_tries = map->choose_total_tries;
+	h->chooseleaf_descend_once = map->chooseleaf_descend_once;
+	h->chooseleaf_vary_r = map->chooseleaf_vary_r;
+	h->chooseleaf_stable = map->chooseleaf_stable;
+	h->straw_calc_version = map->straw_calc_version;
+	h->allowed_bucket_algs = map->allowed_bucket_algs;
+
+	offset = FROZEN_ALIGN(sizeof(*h));
+	if (map->max_buckets > 0)
+		h->buckets = offset;
+	buckets = (__u32 *)(image + offset);
+	offset += FROZEN_ALIGN(map->max_buckets * sizeof(__u32));
+	if (map->max_rules > 0)
+		h->rules = offset;
+	rules = (__u32 *)(image + offset);
+	offset += FROZEN_ALIGN(map->max_rules * sizeof(__u32));
+
+	for (b = 0; b < map->max_buckets; b++) {
+		if (map->buckets[b] == NULL)
+			continue;
+		buckets[b] = offset;
+		offset = frozen_write_bucket(image, offset, map->buckets[b]);
+		h->bucket_count++;
+		h->item_count += map->buckets[b]->size;
+	}
+	for (r = 0; r < map->max_rules; r++) {
+		size_t size;
+		if (map->rules[r] == NULL)
+			continue;
+		size = crush_rule_size(map->rules[r]->len);
+		rules[r] = offset;
+		memcpy(image + offset, map->rules[r], size);
+		offset += FROZEN_ALIGN(size);
+	}
+	BUG_ON(offset != length);
+
+	h->checksum = crush_frozen_checksum(image + sizeof(*h), length - sizeof(*h));
+	h->header_checksum = crush_frozen_checksum(h, offsetof(struct crush_frozen_map,
+							       header_checksum));
+	*imagep = image;
+	*lengthp = length;
+	return 0;
+}
+
+/* return 1 if __n__ elements of __size__ bytes at __offset__ are in the image */
+static int frozen_in_image(const struct crush_frozen_map *map, __u32 offset,
+			   size_t n, size_t size, size_t align)
+{
+	if (offset % align || offset < sizeof(*map) || offset > map->length)
+		return 0;
+	return (map->length - offset) / size >= n;
+}
+
+static int frozen_verify_bucket(const struct crush_frozen_map *map, __s32 pos,
+				const struct crush_frozen_bucket *b)
+{
+	__u32 size = b->size;
+	__u32 items = size;
+	const __s32 *item;
+	__u32 i;
+
+	if (b->id != -1-pos)
+		return 0;
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		break;
+	case CRUSH_BUCKET_LIST:
+		if (size > 0 &&
+		    (!frozen_in_image(map, b->item_weights, size, 4, 4) ||
+		     !frozen_in_image(map, b->sum_weights, size, 4, 4)))
+			return 0;
+		break;
+	case CRUSH_BUCKET_TREE:
+		/* the walk of a tree only stays in it if it is complete */
+		if (size > 0 &&
+		    (b->num_nodes < 2 || (b->num_nodes & (b->num_nodes - 1))))
+			return 0;
+		if (b->num_nodes >> 1 > items)
+			items = b->num_nodes >> 1;
+		if (b->num_nodes > 0 &&
+		    !frozen_in_image(map, b->node_weights, b->num_nodes, 4, 4))
+			return 0;
+		break;
+	case CRUSH_BUCKET_STRAW:
+		if (size > 0 &&
+		    (!frozen_in_image(map, b->item_weights, size, 4, 4) ||
+		     !frozen_in_image(map, b->straws, size, 4, 4)))
+			return 0;
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		if (size > 0 &&
+		    !frozen_in_image(map, b->item_weights, size, 4, 4))
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+	if (items == 0)
+		return 1;
+	if (!frozen_in_image(map, b->items, items, 4, 4))
+		return 0;
+	/* the mapper does not check that a bucket exists before using it */
+	item = frozen_ptr(map, b->items);
+	for (i = 0; i < items; i++)
+		if (item[i] < 0 &&
+		    (-1-item[i] >= map->max_buckets ||
+		     frozen_bucket(map, -1-item[i]) == NULL))
+			return 0;
+	return 1;
+}
+
+/*
+ * Return 0 if a bucket is its own ancestor, in which case the mapper
+ * would loop forever, or -ENOMEM. Depth first search from each bucket,
+ * with an explicit stack.
+ */
+static int frozen_verify_acyclic(const struct crush_frozen_map *map)
+{
+	enum { NEW = 0, ACTIVE, DONE };
+	char *state;
+	int *stack;
+	__s32 b;
+	int ret = 1;
+
+	if (map->max_buckets == 0)
+		return 1;
+	state = crush_calloc(map->max_buckets, sizeof(*state));
+	/* (bucket position, next item index) pairs */
+	stack = crush_malloc(map->max_buckets * 2 * sizeof(*stack));
+	if (!state || !stack) {
+		crush_free(state);
+		crush_free(stack);
+		return -ENOMEM;
+	}
+	for (b = 0; b < map->max_buckets && ret == 1; b++) {
+		int depth;
+		if (state[b] != NEW || frozen_bucket(map, b) == NULL)
+			continue;
+		state[b] = ACTIVE;
+		stack[0] = b;
+		stack[1] = 0;
+		depth = 1;
+		while (depth > 0) {
+			int *top = stack + 2 * (depth - 1);
+			const struct crush_frozen_bucket *bucket = frozen_bucket(map, top[0]);
+			const __s32 *items = frozen_ptr(map, bucket->items);
+			__s32 child;
+			if ((__u32)top[1] >= bucket->size) {
+				state[top[0]] = DONE;
+				depth--;
+				continue;
+			}
+			child = items[top[1]++];
+			if (child >= 0)
+				continue;
+			child = -1-child;
+			if (state[child] == ACTIVE) {
+				ret = 0;
+				break;
+			}
+			if (state[child] == DONE)
+				continue;
+			state[child] = ACTIVE;
+			top = stack + 2 * depth;
+			top[0] = child;
+			top[1] = 0;
+			depth++;
+		}
+	}
+	crush_free(stack);
+	crush_free(state);
+	return ret;
+}
+
+static int frozen_verify_structure(const struct crush_frozen_map *map)
+{
+	__u32 bucket_count = 0, item_count = 0, r;
+	__s32 b;
+	int acyclic;
+
+	if (map->max_buckets < 0 || map->max_devices < 0 ||
+	    (map->max_buckets > 0 &&
+	     !frozen_in_image(map, map->buckets, map->max_buckets, 4, 4)) ||
+	    (map->max_rules > 0 &&
+	     !frozen_in_image(map, map->rules, map->max_rules, 4, 4)))
+		return -EINVAL;
+	for (b = 0; b < map->max_buckets; b++) {
+		const __u32 *buckets = frozen_ptr(map, map->buckets);
+		if (buckets[b] == 0)
+			continue;
+		if (!frozen_in_image(map, buckets[b], 1,
+				     sizeof(struct crush_frozen_bucket), 8))
+			return -EINVAL;
+	}
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_frozen_bucket *bucket = frozen_bucket(map, b);
+		if (bucket == NULL)
+			continue;
+		if (!frozen_verify_bucket(map, b, bucket))
+			return -EINVAL;
+		bucket_count++;
+		item_count += bucket->size;
+	}
+	/* the workspace is sized with them */
+	if (bucket_count != map->bucket_count || item_count != map->item_count)
+		return -EINVAL;
+	for (r = 0; r < map->max_rules; r++) {
+		const __u32 *rules = frozen_ptr(map, map->rules);
+		const struct crush_rule *rule;
+		if (rules[r] == 0)
+			continue;
+		if (!frozen_in_image(map, rules[r], 1, sizeof(*rule), 4))
+			return -EINVAL;
+		rule = frozen_ptr(map, rules[r]);
+		if ((map->length - rules[r] - sizeof(*rule)) /
+		    sizeof(struct crush_rule_step) < rule->len)
+			return -EINVAL;
+	}
+	acyclic = frozen_verify_acyclic(map);
+	if (acyclic < 0)
+		return acyclic;
+	return acyclic ? 0 : -EINVAL;
+}
+
+int crush_frozen_check(const void *image, size_t length, int flags,
+		       const struct crush_frozen_map **mapp)
+{
+	const struct crush_frozen_map *map = image;
+	int err;
+
+	if ((size_t)image % 8 || length < sizeof(*map) ||
+	    map->magic != CRUSH_FROZEN_MAGIC ||
+	    map->version != CRUSH_FROZEN_VERSION ||
+	    map->length < sizeof(*map) || map->length > length ||
+	    map->length % 8)
+		return -EINVAL;
+	if (flags & CRUSH_FROZEN_VERIFY_CHECKSUM) {
+		if (map->header_checksum !=
+		    crush_frozen_checksum(map, offsetof(struct crush_frozen_map,
+							header_checksum)) ||
+		    map->checksum !=
+		    crush_frozen_checksum(map + 1, map->length - sizeof(*map)))
+			return -EINVAL;
+	}
+	if (flags & CRUSH_FROZEN_VERIFY_STRUCTURE) {
+		err = frozen_verify_structure(map);
+		if (err < 0)
+			return err;
+	}
+	*mapp = map;
+	return 0;
+}
+
+int crush_frozen_mmap(const char *path, int flags,
+		      const struct crush_frozen_map **mapp)
+{
+	const struct crush_frozen_map *map;
+	struct stat st;
+	void *addr;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	if ((size_t)st.st_size < sizeof(*map)) {
+		close(fd);
+		return -EINVAL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = -errno;
+	close(fd);
+	if (addr == MAP_FAILED)
+		return err;
+	err = crush_frozen_check(addr, st.st_size, flags, &map);
+	if (err == 0 && map->length != (__u64)st.st_size)
+		err = -EINVAL;
+	if (err < 0) {
+		munmap(addr, st.st_size);
+		return err;
+	}
+	*mapp = map;
+	return 0;
+}
+
+void crush_frozen_munmap(const struct crush_frozen_map *map)
+{
+	munmap((void *)map, map->length);
+}
+
+int crush_frozen_find_rule(const struct crush_frozen_map *map,
+			   int ruleset, int type, int size)
+{
+	__u32 i;
+
+	for (i = 0; i < map->max_rules; i++) {
+		const struct crush_rule *rule = frozen_rule(map, i);
+		if (rule &&
+		    rule->mask.ruleset == ruleset &&
+		    rule->mask.type == type &&
+		    rule->mask.min_size <= size &&
+		    rule->mask.max_size >= size)
+			return i;
+	}
+	return -1;
+}
+
+/* the working space of the buckets, without the result vectors */
+static size_t frozen_working_size(const struct crush_frozen_map *map)
+{
+	return sizeof(struct crush_work) +
+		map->max_buckets * sizeof(struct crush_work_bucket *) +
+		map->bucket_count * sizeof(struct crush_work_bucket) +
+		map->item_count * sizeof(__u32);
+}
+
+size_t crush_frozen_work_size(const struct crush_frozen_map *map,
+			      int result_max)
+{
+	return frozen_working_size(map) + result_max * 3 * sizeof(__u32);
+}
+
+void crush_frozen_init_workspace(const struct crush_frozen_map *map, void *v)
+{
+	struct crush_work *w = (struct crush_work *)v;
+	char *point = (char *)v;
+	__s32 b;
+
+	point += sizeof(struct crush_work);
+	w->stats = NULL;
+	w->trace = NULL;
+#ifdef CRUSH_COUNTERS
+	memset(&w->counters, 0, sizeof(w->counters));
+#endif
+	w->work = (struct crush_work_bucket **)point;
+	point += map->max_buckets * sizeof(struct crush_work_bucket *);
+	for (b = 0; b < map->max_buckets; ++b) {
+		const struct crush_frozen_bucket *bucket = frozen_bucket(map, b);
+		if (bucket == NULL)
+			continue;
+		w->work[b] = (struct crush_work_bucket *)point;
+		point += sizeof(struct crush_work_bucket);
+		w->work[b]->perm_x = 0;
+		w->work[b]->perm_n = 0;
+		w->work[b]->perm = (__u32 *)point;
+		point += bucket->size * sizeof(__u32);
+	}
+	BUG_ON((size_t)(point - (char *)v) != frozen_working_size(map));
+}
+
+/*
+ * The mapper of mapper.c, reading the buckets and rules of the frozen
+ * map instead of the crush_map. See mapper_impl.h.
+ */
+#define MAPPER_FN(name) crush_frozen_##name
+#define MAPPER_MAP struct crush_frozen_map
+#define MAPPER_BUCKET struct crush_frozen_bucket
+#define MAPPER_BUCKET_AT(map, pos) frozen_bucket(map, pos)
+#define MAPPER_RULE_AT(map, ruleno) frozen_rule(map, ruleno)
+#define MAPPER_WORKING_SIZE(map) frozen_working_size(map)
+#define MAPPER_ITEMS(map, b) ((const __s32 *)frozen_ptr(map, (b)->items))
+#define MAPPER_LIST_ITEM_WEIGHTS(map, b) \
+	((const __u32 *)frozen_ptr(map, (b)->item_weights))
+#define MAPPER_LIST_SUM_WEIGHTS(map, b) \
+	((const __u32 *)frozen_ptr(map, (b)->sum_weights))
+#define MAPPER_TREE_NUM_NODES(map, b) ((b)->num_nodes)
+#define MAPPER_TREE_NODE_WEIGHTS(map, b) \
+	((const __u32 *)frozen_ptr(map, (b)->node_weights))
+#define MAPPER_STRAW_STRAWS(map, b) \
+	((const __u32 *)frozen_ptr(map, (b)->straws))
+#define MAPPER_STRAW2_ITEM_WEIGHTS(map, b) \
+	((const __u32 *)frozen_ptr(map, (b)->item_weights))
+#include "mapper_impl.h"
@@ -0,0 +1,250 @@
+#ifndef CEPH_CRUSH_FROZEN_H
+#define CEPH_CRUSH_FROZEN_H
+
+#include "crush.h"
+
+/*
+ * A frozen map is a crush_map serialized in a single block of memory
+ * that crush_frozen_do_rule() can use as it is: all references are
+ * offsets from the beginning of the block instead of pointers. It can
+ * be written to a file and mapped read-only by any number of
+ * processes, which then share the same page cache copy and map
+ * inputs without allocating or parsing anything.
+ *
+ * The image is in the byte order of the host that froze it and is
+ * rejected on hosts of the other byte order. All offsets are 32 bits
+ * and the image can therefore not be larger than 4GB.
+ */
+
+#define CRUSH_FROZEN_MAGIC 0x5a465243 /* "CRFZ" */
+#define CRUSH_FROZEN_VERSION 1
+
+/** @ingroup API
+ *
+ * The header of a frozen map, at offset zero of the image.
+ */
+struct crush_frozen_map {
+	__u32 magic;              /*!< ::CRUSH_FROZEN_MAGIC */
+	__u32 version;            /*!< ::CRUSH_FROZEN_VERSION */
+	__u64 length;             /*!< size of the image, header included */
+	__s32 max_buckets;        /*!< same as crush_map.max_buckets */
+	__u32 max_rules;          /*!< same as crush_map.max_rules */
+	__s32 max_devices;        /*!< same as crush_map.max_devices */
+	__u32 buckets;            /*!< offset of __max_buckets__ bucket offsets, 0 if none */
+	__u32 rules;              /*!< offset of __max_rules__ rule offsets, 0 if none */
+	__u32 bucket_count;       /*!< number of buckets */
+	__u32 item_count;         /*!< sum of the size of all buckets */
+	__u32 choose_local_tries;
+	__u32 choose_local_fallback_tries;
+	__u32 choose_total_tries;
+	__u32 chooseleaf_descend_once;
+	__u8 chooseleaf_vary_r;
+	__u8 chooseleaf_stable;
+	__u8 straw_calc_version;
+	__u8 __pad8;
+	__u32 allowed_bucket_algs;
+	__u32 __pad32;
+	__u64 checksum;           /*!< of the bytes following the header */
+	__u64 header_checksum;    /*!< of the header bytes preceding this field */
+};
+
+/*
+ * A bucket of a frozen map. The arrays are offsets from the beginning
+ * of the image, 0 if the bucket algorithm does not use them. The
+ * __items__ of a tree bucket are padded with ::CRUSH_ITEM_NONE to
+ * __num_nodes__ / 2 elements.
+ */
+struct crush_frozen_bucket {
+	__s32 id;
+	__u16 type;
+	__u8 alg;
+	__u8 hash;
+	__u32 weight;
+	__u32 size;
+	__u32 item_weight;        /* uniform */
+	__u32 num_nodes;          /* tree */
+	__u32 items;
+	__u32 item_weights;       /* list, straw, straw2 */
+	__u32 sum_weights;        /* list */
+	__u32 node_weights;       /* tree */
+	__u32 straws;             /* straw */
+	__u32 __pad32;
+};
+
+/** @ingroup API
+ * Verify the checksums of the header and of the rest of the image.
+ */
+#define CRUSH_FROZEN_VERIFY_CHECKSUM	(1 << 0)
+/** @ingroup API
+ * Verify that all offsets are within the image, that all items
+ * reference existing buckets and that the hierarchy has no cycle.
+ */
+#define CRUSH_FROZEN_VERIFY_STRUCTURE	(1 << 1)
+/** @ingroup API
+ * All verifications, for images that are not trusted.
+ */
+#define CRUSH_FROZEN_VERIFY_ALL \
+	(CRUSH_FROZEN_VERIFY_CHECKSUM | CRUSH_FROZEN_VERIFY_STRUCTURE)
+
+/** @ingroup API
+ *
+ * Freeze __map__ into a __malloc(3)__ buffer returned in __image__
+ * and its size in __length__. It is the responsibility of the caller
+ * to __free(3)__ the __image__. The __map__ must have been finalized
+ * with crush_finalize().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -E2BIG if the image would be larger than 4GB
+ * - return -EINVAL if a bucket has an unknown algorithm
+ *
+ * @param map the crush_map to freeze
+ * @param[out] image the frozen map
+ * @param[out] length the number of bytes in __image__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_freeze(const struct crush_map *map, void **image, size_t *length);
+
+/** @ingroup API
+ *
+ * Check that the __length__ bytes at __image__ are a frozen map and
+ * set __map__ to the header of the image. The magic number, the
+ * version and the length are always checked, in constant time. The
+ * checksums and the structure are only verified if __flags__
+ * contains ::CRUSH_FROZEN_VERIFY_CHECKSUM and
+ * ::CRUSH_FROZEN_VERIFY_STRUCTURE respectively: both are linear in
+ * the size of the image and can be skipped for trusted images. The
+ * __image__ must be aligned on an 8 bytes boundary.
+ *
+ * crush_frozen_do_rule() is as safe with a verified image as
+ * crush_do_rule() is with a crush_map built with the builder.
+ *
+ * - return -EINVAL if the image is not valid
+ * - return -ENOMEM if __malloc(3)__ fails while verifying the structure
+ *
+ * @param image the frozen map
+ * @param length the number of bytes in __image__
+ * @param flags a combination of CRUSH_FROZEN_VERIFY_*
+ * @param[out] map the frozen map header
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_frozen_check(const void *image, size_t length, int flags,
+			      const struct crush_frozen_map **map);
+
+/** @ingroup API
+ *
+ * Map the file at __path__ read-only and shared, check it with
+ * crush_frozen_check() and __flags__ and set __map__ to its header.
+ * The file must only contain the image. The mapping must be released
+ * with crush_frozen_munmap().
+ *
+ * @param path the file containing the frozen map
+ * @param flags a combination of CRUSH_FROZEN_VERIFY_*
+ * @param[out] map the frozen map header
+ *
+ * @returns 0 on success, -errno on error
+ */
+extern int crush_frozen_mmap(const char *path, int flags,
+			     const struct crush_frozen_map **map);
+
+/** @ingroup API
+ *
+ * Unmap a frozen map mapped with crush_frozen_mmap().
+ *
+ * @param map the frozen map header
+ */
+extern void crush_frozen_munmap(const struct crush_frozen_map *map);
+
+/** @ingroup API
+ *
+ * Same as crush_find_rule() for a frozen map.
+ */
+extern int crush_frozen_find_rule(const struct crush_frozen_map *map,
+				  int ruleset, int type, int size);
+
+/** @ingroup API
+ *
+ * Return the size of the workspace crush_frozen_do_rule() needs for
+ * __map__ and __result_max__, the equivalent of crush_work_size().
+ */
+extern size_t crush_frozen_work_size(const struct crush_frozen_map *map,
+				     int result_max);
+
+/** @ingroup API
+ *
+ * Initialize a workspace of crush_frozen_work_size() bytes for
+ * __map__, the equivalent of crush_init_workspace().
+ */
+extern void crush_frozen_init_workspace(const struct crush_frozen_map *map,
+					void *v);
+
+/** @ingroup API
+ *
+ * Map __x__ with the rule __ruleno__ of the frozen __map__. The
+ * arguments and the result are the same as crush_do_rule() with the
+ * crush_map that was frozen: the __choose_args__ are indexed by
+ * bucket position, as returned by crush_make_choose_args() for that
+ * crush_map.
+ *
+ * @returns 0 on error or the size of __result__ on success
+ */
+extern int crush_frozen_do_rule(const struct crush_frozen_map *map,
+				int ruleno,
+				int x, int *result, int result_max,
+				const __u32 *weights, int weight_max,
+				void *cwin,
+				const struct crush_choose_arg *choose_args);
+
+struct crush_rule_plan;
+
+/** @ingroup API
+ *
+ * Same as crush_make_rule_plan() for a frozen map. The plan is
+ * released with crush_destroy_rule_plan().
+ */
+extern int crush_frozen_make_rule_plan(const struct crush_frozen_map *map,
+				       const int *rulenos, const int *result_max,
+				       int count, struct crush_rule_plan **plan);
+
+/** @ingroup API
+ *
+ * Same as crush_rule_plan_work_size() for a frozen map, the workspace
+ * being initialized with crush_frozen_init_workspace().
+ */
+extern size_t crush_frozen_rule_plan_work_size(const struct crush_frozen_map *map,
+					       const struct crush_rule_plan *plan);
+
+/** @ingroup API
+ *
+ * Same as crush_do_rule_plan() for a plan prepared by
+ * crush_frozen_make_rule_plan() for __map__.
+ */
+extern void crush_frozen_do_rule_plan(const struct crush_frozen_map *map,
+				      const struct crush_rule_plan *plan, int x,
+				      int *results, int *result_lens,
+				      const __u32 *weights, int weight_max,
+				      void *cwin,
+				      const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Same as crush_do_rule_plan_batch() for a plan prepared by
+ * crush_frozen_make_rule_plan() for __map__.
+ */
+extern void crush_frozen_do_rule_plan_batch(const struct crush_frozen_map *map,
+					    const struct crush_rule_plan *plan,
+					    const int *xs, int x_start, int count,
+					    int *results, int *result_lens,
+					    const __u32 *weights, int weight_max,
+					    void *cwin,
+					    const struct crush_choose_arg *choose_args);
+
+/*! @cond INTERNAL */
+
+/* the Fletcher-64 of the __length__ bytes at __p__, a multiple of 4 */
+extern __u64 crush_frozen_checksum(const void *p, size_t length);
+
+/*! @endcond */
+
+#endif
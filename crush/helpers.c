@@ -2,40 +2,129 @@
 
 #include "helpers.h"
 
-int crush_find_roots(struct crush_map *map, int **buckets)
+/*
+ * Kahn's algorithm: the buckets contained in no bucket come first in
+ * the order and a bucket is appended once all the buckets containing
+ * it are. The buckets of a cycle are never appended. The leaves and
+ * weights are then summed in the reverse order, children first.
+ */
+int crush_analyze_topology(const struct crush_map *map,
+                           struct crush_topology **topology)
 {
-  int ref[map->max_buckets];
-  int root_count = map->max_buckets;
-  int pos, i;
+  int max = map->max_buckets;
+  struct crush_topology *t;
+  int pos, head, tail;
+  __u32 i;
+
+  t = (struct crush_topology*)crush_malloc(sizeof(*t) +
+                                     max * (sizeof(__u64) + 4 * sizeof(__s32)));
+  if (t == NULL)
+    return -ENOMEM;
+  t->weight = (__u64*)(t + 1);
+  t->order = (__s32*)(t->weight + max);
+  t->depth = t->order + max;
+  t->parent = t->depth + max;
+  t->leaves = (__u32*)(t->parent + max);
+  t->max_buckets = max;
+  t->bucket_count = 0;
+  t->max_depth = 0;
+  memset(t->weight, '\0', max * sizeof(__u64));
+  /* the leaves count the buckets containing each bucket until summed */
+  memset(t->leaves, '\0', max * sizeof(__u32));
+  for (pos = 0; pos < max; pos++) {
+    t->depth[pos] = map->buckets[pos] ? 0 : -1;
+    t->parent[pos] = CRUSH_PARENT_NONE;
+  }
 
-  memset(ref, '\0', sizeof(ref));
-  for (pos = 0; pos < map->max_buckets; pos++) {
+  for (pos = 0; pos < max; pos++) {
     struct crush_bucket *b = map->buckets[pos];
-    if (b == NULL) {
-      root_count--;
+    if (b == NULL)
       continue;
-    }
+    t->bucket_count++;
     for (i = 0; i < b->size; i++) {
       if (b->items[i] >= 0)
         continue;
-      int item = -1-b->items[i];
-      if (item >= map->max_buckets)
+      int child = -1-b->items[i];
+      if (child >= max || map->buckets[child] == NULL) {
+        crush_free(t);
         return -EINVAL;
-      if (ref[item] == 0)
-        root_count--;
-      ref[item]++;
+      }
+      t->parent[child] = t->leaves[child]++ ? CRUSH_PARENT_MANY : -1-pos;
+    }
+  }
+
+  tail = 0;
+  for (pos = 0; pos < max; pos++)
+    if (map->buckets[pos] != NULL && t->leaves[pos] == 0)
+      t->order[tail++] = -1-pos;
+  t->root_count = tail;
+  for (head = 0; head < tail; head++) {
+    pos = -1-t->order[head];
+    struct crush_bucket *b = map->buckets[pos];
+    int depth = t->depth[pos] + 1;
+    for (i = 0; i < b->size; i++) {
+      if (b->items[i] >= 0)
+        continue;
+      int child = -1-b->items[i];
+      if (t->depth[child] < depth)
+        t->depth[child] = depth;
+      if (t->max_depth < depth)
+        t->max_depth = depth;
+      if (--t->leaves[child] == 0)
+        t->order[tail++] = b->items[i];
     }
   }
+  if (tail < t->bucket_count) {
+    crush_free(t);
+    return -EINVAL;
+  }
+
+  for (head = tail - 1; head >= 0; head--) {
+    pos = -1-t->order[head];
+    struct crush_bucket *b = map->buckets[pos];
+    for (i = 0; i < b->size; i++) {
+      if (b->items[i] >= 0) {
+        t->leaves[pos]++;
+        t->weight[pos] += (__u32)crush_get_bucket_item_weight(b, i);
+      } else {
+        int child = -1-b->items[i];
+        t->leaves[pos] += t->leaves[child];
+        t->weight[pos] += t->weight[child];
+      }
+    }
+  }
+
+  *topology = t;
+  return 0;
+}
+
+int crush_get_topology(struct crush_map *map,
+                       const struct crush_topology **topology)
+{
+  if (map->topology == NULL) {
+    int r = crush_analyze_topology(map, &map->topology);
+    if (r < 0)
+      return r;
+  }
+  *topology = map->topology;
+  return 0;
+}
+
+int crush_find_roots(struct crush_map *map, int **buckets)
+{
+  struct crush_topology *t;
+  int r = crush_analyze_topology(map, &t);
+  if (r < 0)
+    return r;
 
-  int *roots = (int*)malloc(root_count * sizeof(int));
-  if (roots == NULL)
+  int *roots = (int*)malloc((t->root_count ? t->root_count : 1) * sizeof(int));
+  if (roots == NULL) {
+    crush_destroy_topology(t);
     return -ENOMEM;
-  int roots_length = 0;
-  for (pos = 0; pos < map->max_buckets; pos++) {
-    if (map->buckets[pos] != NULL && ref[pos] == 0)
-      roots[roots_length++] = -1-pos;
   }
-  assert(roots_length == root_count);
+  memcpy(roots, t->order, t->root_count * sizeof(int));
+  r = t->root_count;
+  crush_destroy_topology(t);
   *buckets = roots;
-  return root_count;
+  return r;
 }
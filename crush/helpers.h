@@ -3,11 +3,61 @@
 
 #include "crush.h"
 
+/** @ingroup API
+ *
+ * Analyze the hierarchy of __map__ and set __topology__ to describe
+ * the roots, depth, parent, number of devices and weight of each
+ * bucket (see crush_topology). The weight of a bucket is the sum of
+ * the weights of the devices it contains, recursively, as found in
+ * the buckets containing them: it differs from __bucket->weight__
+ * if a weight was changed without being propagated.
+ *
+ * The analysis is done in time linear in the number of items of the
+ * __map__, without recursion. The __map__ is not modified: like
+ * crush_do_rule(), it can run concurrently with other readers of
+ * the __map__. The caller must deallocate the __topology__ with
+ * crush_destroy_topology().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EINVAL if a bucket references a non existent bucket or
+ *   if buckets contain each other
+ *
+ * @param[in] map the crush_map
+ * @param[out] topology the shape of the hierarchy of __map__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_analyze_topology(const struct crush_map *map,
+                                  struct crush_topology **topology);
+
+/** @ingroup API
+ *
+ * Same as crush_analyze_topology() but the __topology__ is cached
+ * in the __map__ and released with it: it is computed again only
+ * after the __map__ is modified with a builder function such as
+ * crush_bucket_add_item() or crush_finalize(). The __topology__ must
+ * not be modified nor used after the __map__ is modified.
+ *
+ * Filling the cache modifies the __map__: the caller must not call
+ * crush_get_topology() concurrently with any other function using
+ * the same __map__, crush_get_topology() included.
+ *
+ * @param[in] map the crush_map
+ * @param[out] topology the shape of the hierarchy of __map__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_get_topology(struct crush_map *map,
+                              const struct crush_topology **topology);
+
 /** @ingroup API
  *
  * Look for all buckets that are not referenced in any buckets and
  * return them in the __buckets__ __malloc(3)__ array. The size of the
- * array is returned. The buckets are negative numbers.
+ * array is returned. The buckets are negative numbers, in decreasing
+ * order. They are the first elements of __order__ in the topology
+ * returned by crush_analyze_topology(), which is not cached: the
+ * __map__ is not modified.
  *
  * It is the responsibility of the caller to __free(3)__ the
  * __buckets__ array allocated by the function. If the function
@@ -15,7 +65,8 @@
  * undefined.
  *
  * - return -ENOMEM if __malloc(3)__ fails to allocate the array
- * - return -EINVAL if a bucket references a non existent item
+ * - return -EINVAL if a bucket references a non existent bucket or
+ *   if buckets contain each other
  * 
  * @param[in] map the crush_map
  * @param[out] buckets an array of items with no parents
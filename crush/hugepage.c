@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "hugepage.h"
+
+static int crush_hugepages = CRUSH_HUGEPAGES_NONE;
+
+void crush_set_hugepages(int mode)
+{
+	crush_hugepages = mode;
+}
+
+int crush_get_hugepages(void)
+{
+	return crush_hugepages;
+}
+
+/*
+ * Map __length__ bytes aligned on a huge page so that the kernel can
+ * back them with huge pages: map one more huge page and trim.
+ */
+static void *crush_hugepage_map_aligned(size_t length)
+{
+	char *p, *aligned;
+	size_t head;
+
+	p = mmap(NULL, length + CRUSH_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	aligned = (char *)(((uintptr_t)p + CRUSH_HUGEPAGE_SIZE - 1) &
+			   ~((uintptr_t)CRUSH_HUGEPAGE_SIZE - 1));
+	head = aligned - p;
+	if (head)
+		munmap(p, head);
+	munmap(aligned + length, CRUSH_HUGEPAGE_SIZE - head);
+	return aligned;
+}
+
+void *crush_hugepage_alloc(size_t *size, int *backing)
+{
+	size_t length;
+	void *p;
+	int mode = crush_hugepages;
+
+	if (mode == CRUSH_HUGEPAGES_NONE || *size < CRUSH_HUGEPAGE_MIN)
+		return NULL;
+	length = (*size + CRUSH_HUGEPAGE_SIZE - 1) & ~((size_t)CRUSH_HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+	if (mode == CRUSH_HUGEPAGES_HUGETLB) {
+		p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			if (backing)
+				*backing = CRUSH_HUGEPAGES_HUGETLB;
+			*size = length;
+			return p;
+		}
+	}
+#endif
+	p = crush_hugepage_map_aligned(length);
+	if (p == NULL)
+		return NULL;
+	if (backing)
+		*backing = CRUSH_HUGEPAGES_NONE;
+#ifdef MADV_HUGEPAGE
+	if (madvise(p, length, MADV_HUGEPAGE) == 0 && backing)
+		*backing = CRUSH_HUGEPAGES_MADVISE;
+#endif
+	*size = length;
+	return p;
+}
+
+void crush_hugepage_free(void *p, size_t size)
+{
+	munmap(p, size);
+}
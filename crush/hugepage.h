@@ -0,0 +1,90 @@
+#ifndef CEPH_CRUSH_HUGEPAGE_H
+#define CEPH_CRUSH_HUGEPAGE_H
+
+#include <stddef.h>
+
+/** @ingroup API
+ * Allocate large data with the allocator, see crush_set_hugepages().
+ */
+#define CRUSH_HUGEPAGES_NONE 0
+/** @ingroup API
+ * Map large data and advise the kernel to back it with transparent
+ * huge pages with __madvise(MADV_HUGEPAGE)__.
+ */
+#define CRUSH_HUGEPAGES_MADVISE 1
+/** @ingroup API
+ * Map large data with __mmap(MAP_HUGETLB)__ from the pool of huge
+ * pages reserved by the administrator, or as with
+ * ::CRUSH_HUGEPAGES_MADVISE if there are not enough of them.
+ */
+#define CRUSH_HUGEPAGES_HUGETLB 2
+
+/** @ingroup API
+ * The size of a huge page, the unit in which large data is mapped.
+ */
+#define CRUSH_HUGEPAGE_SIZE (2 << 20)
+/** @ingroup API
+ * Data smaller than this is never placed in huge pages.
+ */
+#define CRUSH_HUGEPAGE_MIN (CRUSH_HUGEPAGE_SIZE / 2)
+
+/** @ingroup API
+ *
+ * Place the large data allocated by libcrush from now on in huge
+ * pages, to reduce the TLB misses of crush_do_rule() on maps with
+ * many buckets. The large data is the chunks of at least
+ * ::CRUSH_HUGEPAGE_MIN bytes of the arena of a map (see
+ * crush_create_arena_map(), crush_decode() and crush_parse_text())
+ * and the workspaces of crush_do_rule_batch() of that size.
+ *
+ * The __mode__ is one of ::CRUSH_HUGEPAGES_NONE (the default),
+ * ::CRUSH_HUGEPAGES_MADVISE or ::CRUSH_HUGEPAGES_HUGETLB. If huge
+ * pages are not available, the data is mapped with normal pages or,
+ * if __mmap(2)__ fails, allocated as usual.
+ *
+ * @param mode how to back large data
+ */
+extern void crush_set_hugepages(int mode);
+
+/** @ingroup API
+ *
+ * Return the mode set with crush_set_hugepages().
+ *
+ * @returns ::CRUSH_HUGEPAGES_NONE, ::CRUSH_HUGEPAGES_MADVISE or ::CRUSH_HUGEPAGES_HUGETLB
+ */
+extern int crush_get_hugepages(void);
+
+/** @ingroup API
+ *
+ * Map at least __*size__ bytes of zeroed memory aligned on
+ * ::CRUSH_HUGEPAGE_SIZE, as set with crush_set_hugepages(), and set
+ * __*size__ to the length of the mapping, a multiple of
+ * ::CRUSH_HUGEPAGE_SIZE. It can be used by the caller for its own
+ * data, for instance to copy a crush_freeze() image in huge pages.
+ *
+ * If __backing__ is not NULL, it is set to ::CRUSH_HUGEPAGES_HUGETLB
+ * if the memory is in reserved huge pages, ::CRUSH_HUGEPAGES_MADVISE
+ * if the kernel was advised to use transparent huge pages (it may
+ * not) or ::CRUSH_HUGEPAGES_NONE if it is in normal pages.
+ *
+ * Return NULL if the mode is ::CRUSH_HUGEPAGES_NONE, if __*size__ is
+ * smaller than ::CRUSH_HUGEPAGE_MIN or if __mmap(2)__ fails: the
+ * caller is expected to allocate the memory otherwise.
+ *
+ * @param[in,out] size the number of bytes needed, then mapped
+ * @param[out] backing the kind of pages obtained or NULL
+ *
+ * @returns a pointer to be released with crush_hugepage_free() or NULL
+ */
+extern void *crush_hugepage_alloc(size_t *size, int *backing);
+
+/** @ingroup API
+ *
+ * Unmap memory returned by crush_hugepage_alloc().
+ *
+ * @param p the memory returned by crush_hugepage_alloc()
+ * @param size the length set by crush_hugepage_alloc()
+ */
+extern void crush_hugepage_free(void *p, size_t size);
+
+#endif
@@ -10,6 +10,25 @@
 
 #include "crush.h"
 
+/** @ingroup API
+ *
+ * Return the lowest numbered rule of __map__ with the __ruleset__
+ * and __type__ and for which __size__ is between __min_size__ and
+ * __max_size__ (see crush_make_rule()), or -1 if there is none.
+ *
+ * The rule is found in constant time in the index maintained by
+ * crush_add_rule() and crush_finalize(). The rules are scanned
+ * instead if __map->rules__ was reallocated without
+ * crush_add_rule(). The caller must call crush_finalize() after
+ * replacing an element of __map->rules__ directly.
+ *
+ * @param map the crush_map
+ * @param ruleset the ruleset of the rule
+ * @param type the type of the rule
+ * @param size the number of items to map
+ *
+ * @returns a rule number or -1
+ */
 extern int crush_find_rule(const struct crush_map *map, int ruleset, int type, int size);
 /** @ingroup API
  *
@@ -90,4 +109,222 @@ static inline size_t crush_work_size(const struct crush_map *map,
 
 extern void crush_init_workspace(const struct crush_map *m, void *v);
 
+#ifndef __KERNEL__
+/*! @cond INTERNAL */
+
+/* compute 2^44*log2(input+1), the logarithm used by straw2 buckets */
+extern __u64 crush_ln(unsigned int xin);
+
+/*! @endcond */
+
+/** @ingroup API
+ *
+ * Allocate a zeroed crush_choose_stats with one element per try
+ * allowed by __map->choose_total_tries__. It must be released with
+ * crush_destroy_choose_stats().
+ *
+ * @param map the crush_map
+ *
+ * @returns the histogram or NULL if memory allocation fails
+ */
+extern struct crush_choose_stats *crush_make_choose_stats(const struct crush_map *map);
+
+/** @ingroup API
+ *
+ * Release a histogram allocated by crush_make_choose_stats().
+ */
+extern void crush_destroy_choose_stats(struct crush_choose_stats *stats);
+
+/** @ingroup API
+ *
+ * Count the retries of the items chosen by crush_do_rule() or
+ * crush_frozen_do_rule() with the workspace __cwin__ in __stats__,
+ * or stop counting if __stats__ is NULL. The workspace is the only
+ * thing written to, so that each thread counting with its own
+ * workspace and histogram does not slow down the others. The
+ * histograms are combined with crush_choose_stats_add().
+ *
+ * crush_init_workspace() detaches the histogram and it must be set
+ * again after the workspace is initialized. The counting is compiled
+ * out if libcrush is configured with -DWITH_CHOOSE_STATS=OFF and
+ * __stats__ then stays zero.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param stats the histogram or NULL
+ */
+extern void crush_workspace_set_choose_stats(void *cwin,
+					     struct crush_choose_stats *stats);
+
+/** @ingroup API
+ *
+ * Add the counters of __stats__ to those of __total__. The counters
+ * of __stats__ beyond the size of __total__ are added to its last
+ * element.
+ *
+ * @param total the histogram updated
+ * @param stats the histogram added
+ */
+extern void crush_choose_stats_add(struct crush_choose_stats *total,
+				   const struct crush_choose_stats *stats);
+
+/** @ingroup API
+ *
+ * Copy the counters of what crush_do_rule() did with the workspace
+ * __cwin__ since it was initialized with crush_init_workspace() or
+ * reset with crush_workspace_reset_counters(). The counters are kept
+ * by the workspace, written by the thread that uses it only.
+ *
+ * The counters are compiled in if libcrush is configured with
+ * -DWITH_COUNTERS=ON and crush_do_rule() does not pay for them
+ * otherwise: __counters__ is then zeroed and -EOPNOTSUPP returned.
+ * crush_frozen_do_rule() updates them the same way.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param[out] counters the counters of the workspace
+ *
+ * @returns 0 on success, -EOPNOTSUPP if the counters are compiled out
+ */
+extern int crush_workspace_get_counters(const void *cwin,
+					struct crush_counters *counters);
+
+/** @ingroup API
+ *
+ * Zero the counters of the workspace __cwin__, see
+ * crush_workspace_get_counters().
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ */
+extern void crush_workspace_reset_counters(void *cwin);
+
+/** @ingroup API
+ *
+ * Opaque set of rules mapped together by crush_do_rule_plan().
+ */
+struct crush_rule_plan;
+
+/** @ingroup API
+ *
+ * Prepare the mapping of a value with each of the __count__ rules
+ * __rulenos[i]__ and their __result_max[i]__, as done by
+ * crush_do_rule_plan(). Rules that start with the same steps, for
+ * instance the same take and chooseleaf, share the evaluation of
+ * these steps. A step is shared when it would give the same result
+ * for each of the rules: when their __result_max__ are the same or
+ * when the step cannot choose or emit more items than any of them.
+ * The same rule may be listed more than once.
+ *
+ * The plan copies the steps of the rules: it must be prepared again
+ * if the rules of the __map__ are modified. It must be released with
+ * crush_destroy_rule_plan().
+ *
+ * - return -EINVAL if __count__ < 1, a rule does not exist or a
+ *   __result_max__ is negative
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param map the crush_map
+ * @param rulenos the rules to map with
+ * @param result_max the maximum number of items for each rule
+ * @param count the number of rules
+ * @param[out] plan the new plan
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_make_rule_plan(const struct crush_map *map,
+				const int *rulenos, const int *result_max,
+				int count, struct crush_rule_plan **plan);
+
+/** @ingroup API
+ *
+ * Release a plan allocated by crush_make_rule_plan().
+ */
+extern void crush_destroy_rule_plan(struct crush_rule_plan *plan);
+
+/** @ingroup API
+ *
+ * Return the size of the workspace crush_do_rule_plan() needs, to be
+ * used instead of crush_work_size() and initialized with
+ * crush_init_workspace().
+ *
+ * @param map the crush_map
+ * @param plan the plan
+ *
+ * @returns the size of the workspace in bytes
+ */
+extern size_t crush_rule_plan_work_size(const struct crush_map *map,
+					const struct crush_rule_plan *plan);
+
+/** @ingroup API
+ *
+ * Return the sum of the __result_max__ of the rules of __plan__, the
+ * number of items crush_do_rule_plan() may write for one value.
+ */
+extern int crush_rule_plan_result_size(const struct crush_rule_plan *plan);
+
+/** @ingroup API
+ *
+ * Return the number of steps crush_do_rule_plan() evaluates for one
+ * value, at most the sum of the lengths of the rules of __plan__.
+ */
+extern int crush_rule_plan_steps(const struct crush_rule_plan *plan);
+
+/** @ingroup API
+ *
+ * Map __x__ with each rule of __plan__, with the same result as
+ * calling crush_do_rule() for each of them. The items found with the
+ * rule __i__ are stored in __results__ starting at the sum of the
+ * __result_max__ of the rules before __i__ and their number is stored
+ * in __result_lens[i]__.
+ *
+ * The steps shared by several rules are evaluated once: a trace set
+ * with crush_workspace_set_trace() records their events once and the
+ * retries counted by crush_workspace_set_choose_stats() are those of
+ * the steps evaluated.
+ *
+ * @param map the crush_map the plan was prepared for
+ * @param plan the plan
+ * @param x the value to map
+ * @param results an array of crush_rule_plan_result_size() items
+ * @param result_lens an array with one element per rule
+ * @param weights as in crush_do_rule()
+ * @param weight_max the size of the __weights__ array
+ * @param cwin a workspace of crush_rule_plan_work_size() bytes
+ *             initialized by crush_init_workspace()
+ * @param choose_args as in crush_do_rule(), may be NULL
+ */
+extern void crush_do_rule_plan(const struct crush_map *map,
+			       const struct crush_rule_plan *plan, int x,
+			       int *results, int *result_lens,
+			       const __u32 *weights, int weight_max,
+			       void *cwin,
+			       const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Map the __count__ values __xs[i]__, or __x_start + i__ if __xs__
+ * is NULL, with crush_do_rule_plan(). The results of the value at
+ * index __i__ are stored at __results[i * crush_rule_plan_result_size()]__
+ * and their lengths at __result_lens[i * count]__, __count__ being the
+ * number of rules of the __plan__.
+ *
+ * @param map the crush_map the plan was prepared for
+ * @param plan the plan
+ * @param xs the values to map or NULL
+ * @param x_start the first value to map if __xs__ is NULL
+ * @param count the number of values to map
+ * @param results the items found for each value
+ * @param result_lens the number of items found for each value and rule
+ * @param weights as in crush_do_rule()
+ * @param weight_max the size of the __weights__ array
+ * @param cwin a workspace as for crush_do_rule_plan()
+ * @param choose_args as in crush_do_rule(), may be NULL
+ */
+extern void crush_do_rule_plan_batch(const struct crush_map *map,
+				     const struct crush_rule_plan *plan,
+				     const int *xs, int x_start, int count,
+				     int *results, int *result_lens,
+				     const __u32 *weights, int weight_max,
+				     void *cwin,
+				     const struct crush_choose_arg *choose_args);
+#endif
+
 #endif
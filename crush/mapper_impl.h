@@ -0,0 +1,1429 @@
+/*
+ * The core of the CRUSH mapper, shared by crush_do_rule() and
+ * crush_frozen_do_rule(): mapper.c and frozen.c each include it once,
+ * after defining how the map they are given is read.
+ *
+ * MAPPER_FN(name)		the name of a function, crush_##name or
+ *				crush_frozen_##name
+ * MAPPER_MAP			the type of the map
+ * MAPPER_BUCKET		the type of a bucket, with the id, type,
+ *				alg, hash and size fields of crush_bucket
+ * MAPPER_BUCKET_AT(map, pos)	the bucket at position __pos__
+ * MAPPER_RULE_AT(map, ruleno)	the crush_rule __ruleno__
+ * MAPPER_WORKING_SIZE(map)	the size of the crush_work of __map__
+ * MAPPER_ITEMS(map, b)		the items of __b__
+ * MAPPER_LIST_ITEM_WEIGHTS(map, b), MAPPER_LIST_SUM_WEIGHTS(map, b),
+ * MAPPER_TREE_NUM_NODES(map, b), MAPPER_TREE_NODE_WEIGHTS(map, b),
+ * MAPPER_STRAW_STRAWS(map, b), MAPPER_STRAW2_ITEM_WEIGHTS(map, b)
+ *				the arrays of each bucket algorithm
+ *
+ * The macros are undefined at the end of this file. Whatever the
+ * layout, the workspace is a struct crush_work, and the choose
+ * statistics, counters, trace events and probes are the same.
+ */
+
+#if !defined(__KERNEL__) && defined(CRUSH_CHOOSE_STATS)
+static inline void crush_count_tries(struct crush_work *work,
+				     unsigned int ftotal)
+{
+	struct crush_choose_stats *stats = work->stats;
+
+	if (stats == NULL)
+		return;
+	if (ftotal >= stats->size)
+		ftotal = stats->size - 1;
+	stats->tries[ftotal]++;
+}
+#else
+# define crush_count_tries(work, ftotal) do { } while (0)
+#endif
+
+#if !defined(__KERNEL__) && defined(CRUSH_COUNTERS)
+# define crush_count(work, counter, n) ((work)->counters.counter += (n))
+#else
+# define crush_count(work, counter, n) do { } while (0)
+#endif
+
+#ifndef __KERNEL__
+# define crush_trace_point(work, type, flags, bucket, item, x, r, value)	\
+	do {								\
+		if (__builtin_expect((work)->trace != NULL, 0))	\
+			crush_trace_emit((work)->trace, type, flags,	\
+					 bucket, item, x, r, value);	\
+	} while (0)
+#else
+# define crush_trace_point(work, type, flags, bucket, item, x, r, value) \
+	do { } while (0)
+# define CRUSH_PROBE3(name, a, b, c) do { } while (0)
+# define CRUSH_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+/* (binary) tree */
+static int height(int n)
+{
+	int h = 0;
+	while ((n & 1) == 0) {
+		h++;
+		n = n >> 1;
+	}
+	return h;
+}
+
+static int left(int x)
+{
+	int h = height(x);
+	return x - (1 << (h-1));
+}
+
+static int right(int x)
+{
+	int h = height(x);
+	return x + (1 << (h-1));
+}
+
+static int terminal(int x)
+{
+	return x & 1;
+}
+
+/*
+ * The state of crush_do_rule() between two steps of a rule: the
+ * working vector, the output and leaf vectors the next choose step
+ * writes to and the tunables set by the previous steps.
+ */
+struct crush_rule_state {
+	int *w;
+	int *o;
+	int *c;
+	int wsize;
+	int result_len;
+	int choose_tries;
+	int choose_leaf_tries;
+	int choose_local_retries;
+	int choose_local_fallback_retries;
+	int vary_r;
+	int stable;
+};
+
+#ifndef __KERNEL__
+/*
+ * The rules of a plan form a tree of steps: the children of a node
+ * are the different steps that follow it in the rules, the roots the
+ * first steps. The nodes are stored in depth first order so that the
+ * state after a node at depth d is computed from the state at depth
+ * d - 1, which is the state after its parent.
+ */
+struct crush_rule_plan_node {
+	struct crush_rule_step step;
+	int result_max;		/* given to the step */
+	int depth;		/* 1 for the first step of a rule */
+	int first_end;		/* rules ending with this step are ends[first_end...] */
+	int num_ends;
+};
+
+struct crush_rule_plan {
+	int count;		/* number of rules */
+	int result_max;		/* the largest of the rules */
+	int result_size;	/* the sum for all rules */
+	int max_depth;
+	int num_nodes;
+	int *offsets;		/* of the results of each rule */
+	int *ends;		/* rules grouped by their last node */
+	struct crush_rule_plan_node nodes[0];
+};
+
+/*
+ * Return the result_max to give to __step__ for a rule whose
+ * __result_max__ is not the largest of the plan. __wsize__ and
+ * __result_len__ are upper bounds of the state before the step and
+ * are updated for the state after it. The step is evaluated with the
+ * largest result_max if it cannot choose or emit as many items as
+ * __result_max__, which then makes no difference.
+ */
+static int crush_rule_plan_step_max(const struct crush_rule_step *step,
+				    int result_max, int plan_max,
+				    __s64 *wsize, __s64 *result_len)
+{
+	int numrep;
+
+	switch (step->op) {
+	case CRUSH_RULE_TAKE:
+		if (*wsize < 1)
+			*wsize = 1;
+		return plan_max;
+	case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+	case CRUSH_RULE_CHOOSE_FIRSTN:
+	case CRUSH_RULE_CHOOSELEAF_INDEP:
+	case CRUSH_RULE_CHOOSE_INDEP:
+		if (*wsize == 0)
+			return plan_max;
+		if (step->arg1 > 0 && *wsize * step->arg1 <= result_max) {
+			*wsize *= step->arg1;
+			return plan_max;
+		}
+		numrep = step->arg1 > 0 ? step->arg1 : step->arg1 + result_max;
+		*wsize = numrep > 0 ? *wsize * numrep : 0;
+		if (*wsize > result_max)
+			*wsize = result_max;
+		return result_max;
+	case CRUSH_RULE_EMIT:
+		*result_len += *wsize;
+		*wsize = 0;
+		if (*result_len <= result_max)
+			return plan_max;
+		*result_len = result_max;
+		return result_max;
+	default:
+		return plan_max;
+	}
+}
+
+/* the state after the node of each depth, 0 being before any step */
+struct crush_rule_plan_level {
+	struct crush_rule_state st;
+	int *result;
+};
+
+#endif
+
+/*
+ * bucket choose methods
+ *
+ * For each bucket algorithm, we have a "choose" method that, given a
+ * crush input @x and replica position (usually, position in output set) @r,
+ * will produce an item in the bucket.
+ */
+
+/*
+ * Choose based on a random permutation of the bucket.
+ *
+ * We used to use some prime number arithmetic to do this, but it
+ * wasn't very random, and had some other bad behaviors.  Instead, we
+ * calculate an actual random permutation of the bucket members.
+ * Since this is expensive, we optimize for the r=0 case, which
+ * captures the vast majority of calls.
+ */
+static int MAPPER_FN(bucket_perm_choose)(const MAPPER_MAP *map,
+					 const MAPPER_BUCKET *bucket,
+					 struct crush_work *cw,
+					 int x, int r)
+{
+	struct crush_work_bucket *work = cw->work[-1-bucket->id];
+	unsigned int pr = r % bucket->size;
+	unsigned int i, s;
+
+	/* start a new permutation if @x has changed */
+	if (work->perm_x != (__u32)x || work->perm_n == 0) {
+		dprintk("bucket %d new x=%d\n", bucket->id, x);
+		work->perm_x = x;
+
+		/* optimize common r=0 case */
+		if (pr == 0) {
+			s = crush_hash32_3(bucket->hash, x, bucket->id, 0) %
+				bucket->size;
+			crush_count(cw, hashes, 1);
+			work->perm[0] = s;
+			work->perm_n = 0xffff;   /* magic value, see below */
+			goto out;
+		}
+
+		for (i = 0; i < bucket->size; i++)
+			work->perm[i] = i;
+		work->perm_n = 0;
+	} else if (work->perm_n == 0xffff) {
+		/* clean up after the r=0 case above */
+		for (i = 1; i < bucket->size; i++)
+			work->perm[i] = i;
+		work->perm[work->perm[0]] = 0;
+		work->perm_n = 1;
+	}
+
+	/* calculate permutation up to pr */
+	for (i = 0; i < work->perm_n; i++)
+		dprintk(" perm_choose have %d: %d\n", i, work->perm[i]);
+	while (work->perm_n <= pr) {
+		unsigned int p = work->perm_n;
+		/* no point in swapping the final entry */
+		if (p < bucket->size - 1) {
+			i = crush_hash32_3(bucket->hash, x, bucket->id, p) %
+				(bucket->size - p);
+			crush_count(cw, hashes, 1);
+			if (i) {
+				unsigned int t = work->perm[p + i];
+				work->perm[p + i] = work->perm[p];
+				work->perm[p] = t;
+			}
+			dprintk(" perm_choose swap %d with %d\n", p, p+i);
+		}
+		work->perm_n++;
+	}
+	for (i = 0; i < bucket->size; i++)
+		dprintk(" perm_choose  %d: %d\n", i, work->perm[i]);
+
+	s = work->perm[pr];
+out:
+	dprintk(" perm_choose %d sz=%d x=%d r=%d (%d) s=%d\n", bucket->id,
+		bucket->size, x, r, pr, s);
+	return MAPPER_ITEMS(map, bucket)[s];
+}
+
+/* list */
+static int MAPPER_FN(bucket_list_choose)(const MAPPER_MAP *map,
+					 const MAPPER_BUCKET *bucket,
+					 struct crush_work *work, int x, int r)
+{
+	const __s32 *items = MAPPER_ITEMS(map, bucket);
+	const __u32 *item_weights = MAPPER_LIST_ITEM_WEIGHTS(map, bucket);
+	const __u32 *sum_weights = MAPPER_LIST_SUM_WEIGHTS(map, bucket);
+	int i;
+
+	for (i = bucket->size-1; i >= 0; i--) {
+		__u64 w = crush_hash32_4(bucket->hash, x, items[i],
+					 r, bucket->id);
+		crush_count(work, hashes, 1);
+		w &= 0xffff;
+		dprintk("list_choose i=%d x=%d r=%d item %d weight %x "
+			"sw %x rand %llx",
+			i, x, r, items[i], item_weights[i],
+			sum_weights[i], w);
+		w *= sum_weights[i];
+		w = w >> 16;
+		/*dprintk(" scaled %llx\n", w);*/
+		if (w < item_weights[i]) {
+			return items[i];
+		}
+	}
+
+	dprintk("bad list sums for bucket %d\n", bucket->id);
+	return items[0];
+}
+
+/* (binary) tree */
+static int MAPPER_FN(bucket_tree_choose)(const MAPPER_MAP *map,
+					 const MAPPER_BUCKET *bucket,
+					 struct crush_work *work, int x, int r)
+{
+	const __u32 *node_weights = MAPPER_TREE_NODE_WEIGHTS(map, bucket);
+	int n;
+	__u32 w;
+	__u64 t;
+
+	/* start at root */
+	n = MAPPER_TREE_NUM_NODES(map, bucket) >> 1;
+
+	while (!terminal(n)) {
+		int l;
+		/* pick point in [0, w) */
+		w = node_weights[n];
+		t = (__u64)crush_hash32_4(bucket->hash, x, n, r,
+					  bucket->id) * (__u64)w;
+		t = t >> 32;
+		crush_count(work, hashes, 1);
+
+		/* descend to the left or right? */
+		l = left(n);
+		if (t < node_weights[l])
+			n = l;
+		else
+			n = right(n);
+	}
+
+	return MAPPER_ITEMS(map, bucket)[n >> 1];
+}
+
+
+/* straw */
+
+static int MAPPER_FN(bucket_straw_choose)(const MAPPER_MAP *map,
+					  const MAPPER_BUCKET *bucket,
+					  struct crush_work *work, int x, int r)
+{
+	const __s32 *items = MAPPER_ITEMS(map, bucket);
+	const __u32 *straws = MAPPER_STRAW_STRAWS(map, bucket);
+	__u32 i;
+	int high = 0;
+	__u64 high_draw = 0;
+	__u64 draw;
+
+	for (i = 0; i < bucket->size; i++) {
+		draw = crush_hash32_3(bucket->hash, x, items[i], r);
+		draw &= 0xffff;
+		crush_count(work, hashes, 1);
+		draw *= straws[i];
+		if (i == 0 || draw > high_draw) {
+			high = i;
+			high_draw = draw;
+		}
+	}
+	crush_trace_point(work, CRUSH_TRACE_DRAW, 0, bucket->id,
+			  items[high], x, r, high_draw);
+	return items[high];
+}
+
+/*
+ * straw2
+ *
+ * for reference, see:
+ *
+ * http://en.wikipedia.org/wiki/Exponential_distribution#Distribution_of_the_minimum_of_exponential_random_variables
+ *
+ */
+
+static int MAPPER_FN(bucket_straw2_choose)(const MAPPER_MAP *map,
+					   const MAPPER_BUCKET *bucket,
+					   struct crush_work *work,
+					   int x, int r, const struct crush_choose_arg *arg,
+					   int position)
+{
+	const __s32 *items = MAPPER_ITEMS(map, bucket);
+	const __u32 *weights = MAPPER_STRAW2_ITEM_WEIGHTS(map, bucket);
+	const __s32 *ids = items;
+	unsigned int i, high = 0;
+	unsigned int u;
+	__s64 ln, draw, high_draw = 0;
+
+	if (arg && arg->weight_set && arg->weight_set_size) {
+		if (position >= (int)arg->weight_set_size)
+			position = arg->weight_set_size - 1;
+		weights = arg->weight_set[position].weights;
+	}
+	if (arg && arg->ids)
+		ids = arg->ids;
+	for (i = 0; i < bucket->size; i++) {
+		if (weights[i]) {
+			u = crush_hash32_3(bucket->hash, x, ids[i], r);
+			u &= 0xffff;
+			crush_count(work, hashes, 1);
+
+			/*
+			 * for some reason slightly less than 0x10000 produces
+			 * a slightly more accurate distribution... probably a
+			 * rounding effect.
+			 *
+			 * the natural log lookup table maps [0,0xffff]
+			 * (corresponding to real numbers [1/0x10000, 1] to
+			 * [0, 0xffffffffffff] (corresponding to real numbers
+			 * [-11.090355,0]).
+			 */
+			ln = crush_ln(u) - 0x1000000000000ll;
+
+			/*
+			 * divide by 16.16 fixed-point weight.  note
+			 * that the ln value is negative, so a larger
+			 * weight means a larger (less negative) value
+			 * for draw.
+			 */
+			draw = div64_s64(ln, weights[i]);
+		} else {
+			draw = S64_MIN;
+		}
+
+		if (i == 0 || draw > high_draw) {
+			high = i;
+			high_draw = draw;
+		}
+	}
+
+	crush_trace_point(work, CRUSH_TRACE_DRAW, 0, bucket->id,
+			  items[high], x, r, high_draw);
+	return items[high];
+}
+
+
+static int MAPPER_FN(bucket_choose)(const MAPPER_MAP *map,
+				    const MAPPER_BUCKET *in,
+				    struct crush_work *work,
+				    int x, int r,
+				    const struct crush_choose_arg *arg,
+				    int position)
+{
+	BUG_ON(in->size == 0);
+	switch (in->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		crush_count(work, bucket_visits[CRUSH_BUCKET_UNIFORM], 1);
+		return MAPPER_FN(bucket_perm_choose)(map, in, work, x, r);
+	case CRUSH_BUCKET_LIST:
+		crush_count(work, bucket_visits[CRUSH_BUCKET_LIST], 1);
+		return MAPPER_FN(bucket_list_choose)(map, in, work, x, r);
+	case CRUSH_BUCKET_TREE:
+		crush_count(work, bucket_visits[CRUSH_BUCKET_TREE], 1);
+		return MAPPER_FN(bucket_tree_choose)(map, in, work, x, r);
+	case CRUSH_BUCKET_STRAW:
+		crush_count(work, bucket_visits[CRUSH_BUCKET_STRAW], 1);
+		return MAPPER_FN(bucket_straw_choose)(map, in, work, x, r);
+	case CRUSH_BUCKET_STRAW2:
+		crush_count(work, bucket_visits[CRUSH_BUCKET_STRAW2], 1);
+		return MAPPER_FN(bucket_straw2_choose)(map, in, work, x, r,
+						       arg, position);
+	default:
+		dprintk("unknown bucket %d alg %d\n", in->id, in->alg);
+		return MAPPER_ITEMS(map, in)[0];
+	}
+}
+
+/*
+ * true if device is marked "out" (failed, fully offloaded)
+ * of the cluster
+ */
+static int MAPPER_FN(is_out)(const MAPPER_MAP *map,
+			     struct crush_work *work,
+			     const __u32 *weight, int weight_max,
+			     int item, int x)
+{
+	if (item >= weight_max)
+		goto out;
+	if (weight[item] >= 0x10000)
+		return 0;
+	if (weight[item] == 0)
+		goto out;
+	crush_count(work, hashes, 1);
+	if ((crush_hash32_2(CRUSH_HASH_RJENKINS1, x, item) & 0xffff)
+	    < weight[item])
+		return 0;
+out:
+	crush_count(work, is_out, 1);
+	return 1;
+}
+
+/**
+ * crush_choose_firstn - choose numrep distinct items of given type
+ * @map: the crush_map
+ * @bucket: the bucket we are choose an item from
+ * @x: crush input value
+ * @numrep: the number of items to choose
+ * @type: the type of item to choose
+ * @out: pointer to output vector
+ * @outpos: our position in that vector
+ * @out_size: size of the out vector
+ * @tries: number of attempts to make
+ * @recurse_tries: number of attempts to have recursive chooseleaf make
+ * @local_retries: localized retries
+ * @local_fallback_retries: localized fallback retries
+ * @recurse_to_leaf: true if we want one device under each item of given type (chooseleaf instead of choose)
+ * @stable: stable mode starts rep=0 in the recursive call for all replicas
+ * @vary_r: pass r to recursive calls
+ * @out2: second output vector for leaf items (if @recurse_to_leaf)
+ * @parent_r: r value passed from the parent
+ */
+static int MAPPER_FN(choose_firstn)(const MAPPER_MAP *map,
+				    struct crush_work *work,
+				    const MAPPER_BUCKET *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int numrep, int type,
+				    int *out, int outpos,
+				    int out_size,
+				    unsigned int tries,
+				    unsigned int recurse_tries,
+				    unsigned int local_retries,
+				    unsigned int local_fallback_retries,
+				    int recurse_to_leaf,
+				    unsigned int vary_r,
+				    unsigned int stable,
+				    int *out2,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args)
+{
+	int rep;
+	unsigned int ftotal, flocal;
+	int retry_descent, retry_bucket, skip_rep;
+	const MAPPER_BUCKET *in = bucket;
+	int r;
+	int i;
+	int item = 0;
+	int itemtype;
+	int collide, reject;
+	int count = out_size;
+
+	for (rep = stable ? 0 : outpos; rep < numrep && count > 0 ; rep++) {
+		/* keep trying until we get a non-out, non-colliding item */
+		ftotal = 0;
+		skip_rep = 0;
+		do {
+			retry_descent = 0;
+			in = bucket;              /* initial bucket */
+
+			/* choose through intervening buckets */
+			flocal = 0;
+			do {
+				collide = 0;
+				retry_bucket = 0;
+				r = rep + parent_r;
+				/* r' = r + f_total */
+				r += ftotal;
+
+				/* bucket choose */
+				if (in->size == 0) {
+					crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+							  in->id, 0, x, r,
+							  CRUSH_TRACE_REJECT_EMPTY);
+					reject = 1;
+					goto reject;
+				}
+				if (local_fallback_retries > 0 &&
+				    flocal >= (in->size>>1) &&
+				    flocal > local_fallback_retries) {
+					crush_count(work, perm_fallback, 1);
+					item = MAPPER_FN(bucket_perm_choose)(
+						map, in, work, x, r);
+				} else
+					item = MAPPER_FN(bucket_choose)(
+						map, in, work,
+						x, r,
+                                                (choose_args ? &choose_args[-1-in->id] : 0),
+                                                outpos);
+				crush_trace_point(work, CRUSH_TRACE_CHOOSE, 0,
+						  in->id, item, x, r, 0);
+				CRUSH_PROBE4(bucket_choose, in->id, in->alg, r, item);
+				if (item >= map->max_devices) {
+					crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+							  in->id, item, x, r,
+							  CRUSH_TRACE_REJECT_BAD_ITEM);
+					skip_rep = 1;
+					break;
+				}
+
+				/* desired type? */
+				if (item < 0)
+					itemtype = MAPPER_BUCKET_AT(map, -1-item)->type;
+				else
+					itemtype = 0;
+
+				/* keep going? */
+				if (itemtype != type) {
+					if (item >= 0 ||
+					    (-1-item) >= map->max_buckets) {
+						crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+								  in->id, item, x, r,
+								  CRUSH_TRACE_REJECT_BAD_ITEM);
+						skip_rep = 1;
+						break;
+					}
+					in = MAPPER_BUCKET_AT(map, -1-item);
+					retry_bucket = 1;
+					continue;
+				}
+
+				/* collision? */
+				for (i = 0; i < outpos; i++) {
+					if (out[i] == item) {
+						collide = 1;
+						crush_count(work, collisions, 1);
+						crush_trace_point(work, CRUSH_TRACE_COLLIDE, 0,
+								  in->id, item, x, r, 0);
+						break;
+					}
+				}
+
+				reject = 0;
+				if (!collide && recurse_to_leaf) {
+					if (item < 0) {
+						int sub_r;
+						if (vary_r)
+							sub_r = r >> (vary_r-1);
+						else
+							sub_r = 0;
+						if (MAPPER_FN(choose_firstn)(
+							    map,
+							    work,
+							    MAPPER_BUCKET_AT(map, -1-item),
+							    weight, weight_max,
+							    x, stable ? 1 : outpos+1, 0,
+							    out2, outpos, count,
+							    recurse_tries, 0,
+							    local_retries,
+							    local_fallback_retries,
+							    0,
+							    vary_r,
+							    stable,
+							    NULL,
+							    sub_r,
+                                                            choose_args) <= outpos) {
+							/* didn't get leaf */
+							crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+									  in->id, item, x, r,
+									  CRUSH_TRACE_REJECT_NO_LEAF);
+							reject = 1;
+						}
+					} else {
+						/* we already have a leaf! */
+						out2[outpos] = item;
+		                        }
+				}
+
+				if (!reject && !collide) {
+					/* out? */
+					if (itemtype == 0)
+						reject = MAPPER_FN(is_out)(map, work, weight,
+								weight_max,
+								item, x);
+					if (reject)
+						crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+								  in->id, item, x, r,
+								  CRUSH_TRACE_REJECT_OUT);
+				}
+
+reject:
+				if (reject || collide) {
+					ftotal++;
+					flocal++;
+
+					if (collide && flocal <= local_retries)
+						/* retry locally a few times */
+						retry_bucket = 1;
+					else if (local_fallback_retries > 0 &&
+						 flocal <= in->size + local_fallback_retries)
+						/* exhaustive bucket search */
+						retry_bucket = 1;
+					else if (ftotal < tries)
+						/* then retry descent */
+						retry_descent = 1;
+					else
+						/* else give up */
+						skip_rep = 1;
+					if (retry_bucket)
+						crush_count(work, retry_bucket, 1);
+					if (retry_descent)
+						crush_count(work, retry_descent, 1);
+					crush_trace_point(work, CRUSH_TRACE_RETRY,
+							  retry_bucket ? CRUSH_TRACE_RETRY_BUCKET :
+							  retry_descent ? CRUSH_TRACE_RETRY_DESCENT :
+							  CRUSH_TRACE_RETRY_GIVE_UP,
+							  in->id, item, x, r, ftotal);
+					CRUSH_PROBE4(retry, in->id, item, ftotal,
+						     retry_bucket ? CRUSH_TRACE_RETRY_BUCKET :
+						     retry_descent ? CRUSH_TRACE_RETRY_DESCENT :
+						     CRUSH_TRACE_RETRY_GIVE_UP);
+				}
+			} while (retry_bucket);
+		} while (retry_descent);
+
+		if (skip_rep) {
+			/* out2 is only NULL in recursive calls */
+			if (out2)
+				crush_count(work, item_none, 1);
+			continue;
+		}
+
+		crush_trace_point(work, CRUSH_TRACE_RESULT, 0, 0, item, x, 0, outpos);
+		out[outpos] = item;
+		outpos++;
+		count--;
+		crush_count_tries(work, ftotal);
+	}
+
+	return outpos;
+}
+
+
+/**
+ * crush_choose_indep: alternative breadth-first positionally stable mapping
+ *
+ */
+static void MAPPER_FN(choose_indep)(const MAPPER_MAP *map,
+				    struct crush_work *work,
+				    const MAPPER_BUCKET *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int left, int numrep, int type,
+				    int *out, int outpos,
+				    unsigned int tries,
+				    unsigned int recurse_tries,
+				    int recurse_to_leaf,
+				    int *out2,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args)
+{
+	const MAPPER_BUCKET *in = bucket;
+	int endpos = outpos + left;
+	int rep;
+	unsigned int ftotal;
+	int r;
+	int i;
+	int item = 0;
+	int itemtype;
+	int collide;
+
+	/* initially my result is undefined */
+	for (rep = outpos; rep < endpos; rep++) {
+		out[rep] = CRUSH_ITEM_UNDEF;
+		if (out2)
+			out2[rep] = CRUSH_ITEM_UNDEF;
+	}
+
+	for (ftotal = 0; left > 0 && ftotal < tries; ftotal++) {
+#ifdef DEBUG_INDEP
+		if (out2 && ftotal) {
+			dprintk("%u %d a: ", ftotal, left);
+			for (rep = outpos; rep < endpos; rep++) {
+				dprintk(" %d", out[rep]);
+			}
+			dprintk("\n");
+			dprintk("%u %d b: ", ftotal, left);
+			for (rep = outpos; rep < endpos; rep++) {
+				dprintk(" %d", out2[rep]);
+			}
+			dprintk("\n");
+		}
+#endif
+		for (rep = outpos; rep < endpos; rep++) {
+			if (out[rep] != CRUSH_ITEM_UNDEF)
+				continue;
+			if (ftotal) {
+				crush_count(work, retry_descent, 1);
+				crush_trace_point(work, CRUSH_TRACE_RETRY,
+						  CRUSH_TRACE_RETRY_DESCENT,
+						  bucket->id, 0, x, rep + parent_r,
+						  ftotal);
+				CRUSH_PROBE4(retry, bucket->id, 0, ftotal,
+					     CRUSH_TRACE_RETRY_DESCENT);
+			}
+
+			in = bucket;  /* initial bucket */
+
+			/* choose through intervening buckets */
+			for (;;) {
+				/* note: we base the choice on the position
+				 * even in the nested call.  that means that
+				 * if the first layer chooses the same bucket
+				 * in a different position, we will tend to
+				 * choose a different item in that bucket.
+				 * this will involve more devices in data
+				 * movement and tend to distribute the load.
+				 */
+				r = rep + parent_r;
+
+				/* be careful */
+				if (in->alg == CRUSH_BUCKET_UNIFORM &&
+				    in->size % numrep == 0)
+					/* r'=r+(n+1)*f_total */
+					r += (numrep+1) * ftotal;
+				else
+					/* r' = r + n*f_total */
+					r += numrep * ftotal;
+
+				/* bucket choose */
+				if (in->size == 0) {
+					crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+							  in->id, 0, x, r,
+							  CRUSH_TRACE_REJECT_EMPTY);
+					break;
+				}
+
+				item = MAPPER_FN(bucket_choose)(
+					map, in, work,
+					x, r,
+                                        (choose_args ? &choose_args[-1-in->id] : 0),
+                                        outpos);
+				crush_trace_point(work, CRUSH_TRACE_CHOOSE, 0,
+						  in->id, item, x, r, 0);
+				CRUSH_PROBE4(bucket_choose, in->id, in->alg, r, item);
+				if (item >= map->max_devices) {
+					crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+							  in->id, item, x, r,
+							  CRUSH_TRACE_REJECT_BAD_ITEM);
+					out[rep] = CRUSH_ITEM_NONE;
+					if (out2)
+						out2[rep] = CRUSH_ITEM_NONE;
+					left--;
+					break;
+				}
+
+				/* desired type? */
+				if (item < 0)
+					itemtype = MAPPER_BUCKET_AT(map, -1-item)->type;
+				else
+					itemtype = 0;
+
+				/* keep going? */
+				if (itemtype != type) {
+					if (item >= 0 ||
+					    (-1-item) >= map->max_buckets) {
+						crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+								  in->id, item, x, r,
+								  CRUSH_TRACE_REJECT_BAD_ITEM);
+						out[rep] = CRUSH_ITEM_NONE;
+						if (out2)
+							out2[rep] =
+								CRUSH_ITEM_NONE;
+						left--;
+						break;
+					}
+					in = MAPPER_BUCKET_AT(map, -1-item);
+					continue;
+				}
+
+				/* collision? */
+				collide = 0;
+				for (i = outpos; i < endpos; i++) {
+					if (out[i] == item) {
+						collide = 1;
+						crush_count(work, collisions, 1);
+						break;
+					}
+				}
+				if (collide) {
+					crush_trace_point(work, CRUSH_TRACE_COLLIDE, 0,
+							  in->id, item, x, r, 0);
+					break;
+				}
+
+				if (recurse_to_leaf) {
+					if (item < 0) {
+						MAPPER_FN(choose_indep)(
+							map,
+							work,
+							MAPPER_BUCKET_AT(map, -1-item),
+							weight, weight_max,
+							x, 1, numrep, 0,
+							out2, rep,
+							recurse_tries, 0,
+							0, NULL, r, choose_args);
+						if (out2[rep] == CRUSH_ITEM_NONE) {
+							/* placed nothing; no leaf */
+							crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+									  in->id, item, x, r,
+									  CRUSH_TRACE_REJECT_NO_LEAF);
+							break;
+						}
+					} else {
+						/* we already have a leaf! */
+						out2[rep] = item;
+					}
+				}
+
+				/* out? */
+				if (itemtype == 0 &&
+				    MAPPER_FN(is_out)(map, work, weight, weight_max, item, x)) {
+					crush_trace_point(work, CRUSH_TRACE_REJECT, 0,
+							  in->id, item, x, r,
+							  CRUSH_TRACE_REJECT_OUT);
+					break;
+				}
+
+				/* yay! */
+				crush_trace_point(work, CRUSH_TRACE_RESULT, 0, 0, item, x, 0, rep);
+				out[rep] = item;
+				left--;
+				break;
+			}
+		}
+	}
+	for (rep = outpos; rep < endpos; rep++) {
+		if (out[rep] == CRUSH_ITEM_UNDEF) {
+			out[rep] = CRUSH_ITEM_NONE;
+		}
+		if (out2 && out2[rep] == CRUSH_ITEM_UNDEF) {
+			out2[rep] = CRUSH_ITEM_NONE;
+		}
+		/* out2 is only NULL in recursive calls */
+		if (out2 && out[rep] == CRUSH_ITEM_NONE)
+			crush_count(work, item_none, 1);
+	}
+	crush_count_tries(work, ftotal);
+#ifdef DEBUG_INDEP
+	if (out2) {
+		dprintk("%u %d a: ", ftotal, left);
+		for (rep = outpos; rep < endpos; rep++) {
+			dprintk(" %d", out[rep]);
+		}
+		dprintk("\n");
+		dprintk("%u %d b: ", ftotal, left);
+		for (rep = outpos; rep < endpos; rep++) {
+			dprintk(" %d", out2[rep]);
+		}
+		dprintk("\n");
+	}
+#endif
+}
+
+static void MAPPER_FN(rule_state_init)(const MAPPER_MAP *map,
+				       struct crush_rule_state *st,
+				       int *w, int *o, int *c)
+{
+	st->w = w;
+	st->o = o;
+	st->c = c;
+	st->wsize = 0;
+	st->result_len = 0;
+	/*
+	 * the original choose_total_tries value was off by one (it
+	 * counted "retries" and not "tries").  add one.
+	 */
+	st->choose_tries = map->choose_total_tries + 1;
+	st->choose_leaf_tries = 0;
+	/*
+	 * the local tries values were counted as "retries", though,
+	 * and need no adjustment
+	 */
+	st->choose_local_retries = map->choose_local_tries;
+	st->choose_local_fallback_retries = map->choose_local_fallback_tries;
+
+	st->vary_r = map->chooseleaf_vary_r;
+	st->stable = map->chooseleaf_stable;
+}
+
+/*
+ * Apply __curstep__ to the state __st__, appending the items emitted
+ * to __result__.
+ */
+static void MAPPER_FN(do_step)(const MAPPER_MAP *map,
+			       struct crush_work *cw,
+			       const struct crush_rule_step *curstep,
+			       struct crush_rule_state *st,
+			       int x, int *result, int result_max,
+			       const __u32 *weight, int weight_max,
+			       const struct crush_choose_arg *choose_args)
+{
+	int firstn = 0;
+	int recurse_to_leaf;
+	int osize;
+	int *tmp;
+	int i, j;
+	int numrep;
+	int out_size;
+
+	switch (curstep->op) {
+	case CRUSH_RULE_TAKE:
+		if ((curstep->arg1 >= 0 &&
+		     curstep->arg1 < map->max_devices) ||
+		    (-1-curstep->arg1 >= 0 &&
+		     -1-curstep->arg1 < map->max_buckets &&
+		     MAPPER_BUCKET_AT(map, -1-curstep->arg1))) {
+			st->w[0] = curstep->arg1;
+			st->wsize = 1;
+		} else {
+			dprintk(" bad take value %d\n", curstep->arg1);
+		}
+		break;
+
+	case CRUSH_RULE_SET_CHOOSE_TRIES:
+		if (curstep->arg1 > 0)
+			st->choose_tries = curstep->arg1;
+		break;
+
+	case CRUSH_RULE_SET_CHOOSELEAF_TRIES:
+		if (curstep->arg1 > 0)
+			st->choose_leaf_tries = curstep->arg1;
+		break;
+
+	case CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES:
+		if (curstep->arg1 >= 0)
+			st->choose_local_retries = curstep->arg1;
+		break;
+
+	case CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES:
+		if (curstep->arg1 >= 0)
+			st->choose_local_fallback_retries = curstep->arg1;
+		break;
+
+	case CRUSH_RULE_SET_CHOOSELEAF_VARY_R:
+		if (curstep->arg1 >= 0)
+			st->vary_r = curstep->arg1;
+		break;
+
+	case CRUSH_RULE_SET_CHOOSELEAF_STABLE:
+		if (curstep->arg1 >= 0)
+			st->stable = curstep->arg1;
+		break;
+
+	case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+	case CRUSH_RULE_CHOOSE_FIRSTN:
+		firstn = 1;
+		/* fall through */
+	case CRUSH_RULE_CHOOSELEAF_INDEP:
+	case CRUSH_RULE_CHOOSE_INDEP:
+		if (st->wsize == 0)
+			break;
+
+		recurse_to_leaf =
+			curstep->op ==
+			 CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+			curstep->op ==
+			CRUSH_RULE_CHOOSELEAF_INDEP;
+
+		/* reset output */
+		osize = 0;
+
+		for (i = 0; i < st->wsize; i++) {
+			int bno;
+			/*
+			 * see CRUSH_N, CRUSH_N_MINUS macros.
+			 * basically, numrep <= 0 means relative to
+			 * the provided result_max
+			 */
+			numrep = curstep->arg1;
+			if (numrep <= 0) {
+				numrep += result_max;
+				if (numrep <= 0)
+					continue;
+			}
+			j = 0;
+			/* make sure bucket id is valid */
+			bno = -1 - st->w[i];
+			if (bno < 0 || bno >= map->max_buckets) {
+				// w[i] is probably CRUSH_ITEM_NONE
+				dprintk("  bad w[i] %d\n", st->w[i]);
+				continue;
+			}
+			if (firstn) {
+				int recurse_tries;
+				if (st->choose_leaf_tries)
+					recurse_tries =
+						st->choose_leaf_tries;
+				else if (map->chooseleaf_descend_once)
+					recurse_tries = 1;
+				else
+					recurse_tries = st->choose_tries;
+				osize += MAPPER_FN(choose_firstn)(
+					map,
+					cw,
+					MAPPER_BUCKET_AT(map, bno),
+					weight, weight_max,
+					x, numrep,
+					curstep->arg2,
+					st->o+osize, j,
+					result_max-osize,
+					st->choose_tries,
+					recurse_tries,
+					st->choose_local_retries,
+					st->choose_local_fallback_retries,
+					recurse_to_leaf,
+					st->vary_r,
+					st->stable,
+					st->c+osize,
+					0,
+					choose_args);
+			} else {
+				out_size = ((numrep < (result_max-osize)) ?
+					    numrep : (result_max-osize));
+				MAPPER_FN(choose_indep)(
+					map,
+					cw,
+					MAPPER_BUCKET_AT(map, bno),
+					weight, weight_max,
+					x, out_size, numrep,
+					curstep->arg2,
+					st->o+osize, j,
+					st->choose_tries,
+					st->choose_leaf_tries ?
+					   st->choose_leaf_tries : 1,
+					recurse_to_leaf,
+					st->c+osize,
+					0,
+					choose_args);
+				osize += out_size;
+			}
+		}
+
+		if (recurse_to_leaf)
+			/* copy final _leaf_ values to output set */
+			memcpy(st->o, st->c, osize*sizeof(*st->o));
+
+		/* swap o and w arrays */
+		tmp = st->o;
+		st->o = st->w;
+		st->w = tmp;
+		st->wsize = osize;
+		break;
+
+
+	case CRUSH_RULE_EMIT:
+		for (i = 0; i < st->wsize && st->result_len < result_max; i++) {
+			result[st->result_len] = st->w[i];
+			st->result_len++;
+		}
+		st->wsize = 0;
+		break;
+
+	default:
+		dprintk(" unknown op %d\n", curstep->op);
+		break;
+	}
+}
+
+/**
+ * crush_do_rule - calculate a mapping with the given input and rule
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @x: hash input
+ * @result: pointer to result vector
+ * @result_max: maximum result size
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: Pointer to at least map->working_size bytes of memory or NULL.
+ */
+int MAPPER_FN(do_rule)(const MAPPER_MAP *map,
+		       int ruleno, int x, int *result, int result_max,
+		       const __u32 *weight, int weight_max,
+		       void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_work *cw = cwin;
+	int *a = (int *)((char *)cw + MAPPER_WORKING_SIZE(map));
+	int *b = a + result_max;
+	int *c = b + result_max;
+	struct crush_rule_state st;
+	const struct crush_rule *rule;
+	__u32 step;
+
+	CRUSH_PROBE3(do_rule_entry, ruleno, x, result_max);
+	if ((__u32)ruleno >= map->max_rules) {
+		dprintk(" bad ruleno %d\n", ruleno);
+		CRUSH_PROBE3(do_rule_return, ruleno, x, 0);
+		return 0;
+	}
+
+	rule = MAPPER_RULE_AT(map, ruleno);
+	if (rule == NULL) {
+		dprintk(" no rule %d\n", ruleno);
+		CRUSH_PROBE3(do_rule_return, ruleno, x, 0);
+		return 0;
+	}
+	MAPPER_FN(rule_state_init)(map, &st, a, b, c);
+	crush_trace_point(cw, CRUSH_TRACE_RULE, 0, 0, ruleno, x, 0, result_max);
+
+	for (step = 0; step < rule->len; step++)
+		MAPPER_FN(do_step)(map, cw, &rule->steps[step], &st, x,
+			      result, result_max, weight, weight_max,
+			      choose_args);
+
+	CRUSH_PROBE3(do_rule_return, ruleno, x, st.result_len);
+	return st.result_len;
+}
+
+#ifndef __KERNEL__
+int MAPPER_FN(make_rule_plan)(const MAPPER_MAP *map,
+			      const int *rulenos, const int *result_max,
+			      int count, struct crush_rule_plan **planp)
+{
+	struct crush_rule_plan_node *tree = NULL;
+	struct crush_rule_plan *plan;
+	int *parent = NULL, *first_child, *next_sibling, *last, *preorder;
+	int first_root = -1, num_nodes = 0, total = 0, plan_max = 0, ends;
+	int i, n, err = -ENOMEM;
+	__u32 s;
+
+	if (count < 1)
+		return -EINVAL;
+	for (i = 0; i < count; i++) {
+		if (rulenos[i] < 0 || (__u32)rulenos[i] >= map->max_rules ||
+		    MAPPER_RULE_AT(map, rulenos[i]) == NULL || result_max[i] < 0)
+			return -EINVAL;
+		total += MAPPER_RULE_AT(map, rulenos[i])->len;
+		if (result_max[i] > plan_max)
+			plan_max = result_max[i];
+	}
+
+	tree = crush_malloc((total + 1) * sizeof(*tree));
+	parent = crush_malloc((4 * (total + 1) + count) * sizeof(*parent));
+	if (tree == NULL || parent == NULL)
+		goto out;
+	first_child = parent + total + 1;
+	next_sibling = first_child + total + 1;
+	preorder = next_sibling + total + 1;
+	last = preorder + total + 1;
+
+	/* insert the steps of each rule, sharing the nodes already there */
+	for (i = 0; i < count; i++) {
+		const struct crush_rule *rule = MAPPER_RULE_AT(map, rulenos[i]);
+		__s64 wsize = 0, result_len = 0;
+		int node = -1;
+
+		for (s = 0; s < rule->len; s++) {
+			const struct crush_rule_step *step = &rule->steps[s];
+			int step_max = crush_rule_plan_step_max(step, result_max[i], plan_max,
+								&wsize, &result_len);
+
+			n = node < 0 ? first_root : first_child[node];
+			for (; n >= 0; n = next_sibling[n])
+				if (tree[n].step.op == step->op &&
+				    tree[n].step.arg1 == step->arg1 &&
+				    tree[n].step.arg2 == step->arg2 &&
+				    tree[n].result_max == step_max)
+					break;
+			if (n < 0) {
+				n = num_nodes++;
+				tree[n].step = *step;
+				tree[n].result_max = step_max;
+				tree[n].depth = s + 1;
+				tree[n].num_ends = 0;
+				parent[n] = node;
+				first_child[n] = -1;
+				next_sibling[n] = node < 0 ? first_root : first_child[node];
+				if (node < 0)
+					first_root = n;
+				else
+					first_child[node] = n;
+			}
+			node = n;
+		}
+		last[i] = node;
+		if (node >= 0)
+			tree[node].num_ends++;
+	}
+
+	plan = crush_malloc(sizeof(*plan) + num_nodes * sizeof(plan->nodes[0]) +
+			    2 * count * sizeof(int));
+	if (plan == NULL)
+		goto out;
+	plan->count = count;
+	plan->result_max = plan_max;
+	plan->result_size = 0;
+	plan->max_depth = 0;
+	plan->num_nodes = num_nodes;
+	plan->offsets = (int *)&plan->nodes[num_nodes];
+	plan->ends = plan->offsets + count;
+	for (i = 0; i < count; i++) {
+		plan->offsets[i] = plan->result_size;
+		plan->result_size += result_max[i];
+	}
+
+	/* copy the nodes depth first, their rules grouped after each other */
+	i = 0;
+	ends = 0;
+	n = first_root;
+	while (n >= 0) {
+		struct crush_rule_plan_node *node = &plan->nodes[i];
+
+		*node = tree[n];
+		node->first_end = ends;
+		ends += node->num_ends;
+		node->num_ends = 0;
+		if (node->depth > plan->max_depth)
+			plan->max_depth = node->depth;
+		preorder[n] = i++;
+		if (first_child[n] >= 0) {
+			n = first_child[n];
+			continue;
+		}
+		while (n >= 0 && next_sibling[n] < 0)
+			n = parent[n];
+		if (n >= 0)
+			n = next_sibling[n];
+	}
+	for (i = 0; i < count; i++) {
+		struct crush_rule_plan_node *node;
+
+		if (last[i] < 0)
+			continue;
+		node = &plan->nodes[preorder[last[i]]];
+		plan->ends[node->first_end + node->num_ends++] = i;
+	}
+	*planp = plan;
+	err = 0;
+out:
+	crush_free(parent);
+	crush_free(tree);
+	return err;
+}
+/*
+ * The workspace of crush_do_rule_plan() holds the o and c vectors,
+ * then the w and result vectors of each depth and then the levels.
+ */
+static size_t MAPPER_FN(rule_plan_levels_offset)(const MAPPER_MAP *map,
+						 const struct crush_rule_plan *plan)
+{
+	size_t align = __alignof__(struct crush_rule_plan_level);
+	size_t offset = MAPPER_WORKING_SIZE(map) +
+		(2 + 2 * (size_t)plan->max_depth) * plan->result_max * sizeof(int);
+
+	return (offset + align - 1) & ~(align - 1);
+}
+
+size_t MAPPER_FN(rule_plan_work_size)(const MAPPER_MAP *map,
+				      const struct crush_rule_plan *plan)
+{
+	return MAPPER_FN(rule_plan_levels_offset)(map, plan) +
+		(plan->max_depth + 1) * sizeof(struct crush_rule_plan_level);
+}
+
+void MAPPER_FN(do_rule_plan)(const MAPPER_MAP *map,
+			     const struct crush_rule_plan *plan, int x,
+			     int *results, int *result_lens,
+			     const __u32 *weight, int weight_max,
+			     void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_work *cw = cwin;
+	int result_max = plan->result_max;
+	int *o = (int *)((char *)cw + MAPPER_WORKING_SIZE(map));
+	int *c = o + result_max;
+	int *vectors = c + result_max;
+	struct crush_rule_plan_level *levels = (struct crush_rule_plan_level *)
+		((char *)cw + MAPPER_FN(rule_plan_levels_offset)(map, plan));
+	int i, n;
+
+	MAPPER_FN(rule_state_init)(map, &levels[0].st, NULL, o, c);
+	levels[0].result = NULL;
+	for (i = 0; i < plan->count; i++)
+		result_lens[i] = 0;
+
+	for (n = 0; n < plan->num_nodes; n++) {
+		const struct crush_rule_plan_node *node = &plan->nodes[n];
+		int d = node->depth;
+		int *w = vectors + 2 * (d - 1) * result_max;
+		struct crush_rule_plan_level *level = &levels[d];
+		struct crush_rule_state *st = &level->st;
+
+		*level = levels[d - 1];
+		st->c = c;
+		switch (node->step.op) {
+		case CRUSH_RULE_TAKE:
+			/* the vector of the parent is left as it is */
+			if (st->wsize)
+				memcpy(w, st->w, st->wsize * sizeof(*w));
+			st->w = w;
+			st->o = o;
+			break;
+		case CRUSH_RULE_EMIT:
+			level->result = w + result_max;
+			if (st->result_len)
+				memcpy(level->result, levels[d - 1].result,
+				       st->result_len * sizeof(*w));
+			break;
+		default:
+			/* a choose step writes the new vector there */
+			st->o = w;
+			break;
+		}
+		MAPPER_FN(do_step)(map, cw, &node->step, st, x, level->result,
+			      node->result_max, weight, weight_max, choose_args);
+
+		for (i = node->first_end; i < node->first_end + node->num_ends; i++) {
+			int rule = plan->ends[i];
+
+			if (st->result_len)
+				memcpy(results + plan->offsets[rule], level->result,
+				       st->result_len * sizeof(*results));
+			result_lens[rule] = st->result_len;
+		}
+	}
+}
+
+void MAPPER_FN(do_rule_plan_batch)(const MAPPER_MAP *map,
+				   const struct crush_rule_plan *plan,
+				   const int *xs, int x_start, int count,
+				   int *results, int *result_lens,
+				   const __u32 *weight, int weight_max,
+				   void *cwin, const struct crush_choose_arg *choose_args)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		MAPPER_FN(do_rule_plan)(map, plan, xs ? xs[i] : x_start + i,
+				   results + (size_t)i * plan->result_size,
+				   result_lens + (size_t)i * plan->count,
+				   weight, weight_max, cwin, choose_args);
+}
+#endif
+
+#undef MAPPER_FN
+#undef MAPPER_MAP
+#undef MAPPER_BUCKET
+#undef MAPPER_BUCKET_AT
+#undef MAPPER_RULE_AT
+#undef MAPPER_WORKING_SIZE
+#undef MAPPER_ITEMS
+#undef MAPPER_LIST_ITEM_WEIGHTS
+#undef MAPPER_LIST_SUM_WEIGHTS
+#undef MAPPER_TREE_NUM_NODES
+#undef MAPPER_TREE_NODE_WEIGHTS
+#undef MAPPER_STRAW_STRAWS
+#undef MAPPER_STRAW2_ITEM_WEIGHTS
@@ -0,0 +1,432 @@
+#include <errno.h>
+#include <math.h>
+
+#include "crush_compat.h"
+#include "batch.h"
+#include "optimizer.h"
+
+#define dprintk(args...) /* printf(args) */
+
+/*
+ * A step never changes a weight by more than this factor, up or
+ * down, to dampen the oscillations caused by the interactions
+ * between positions and between the levels of the hierarchy.
+ */
+#define CRUSH_OPTIMIZER_MAX_FACTOR 2.0
+
+/*
+ * Devices and buckets share the same index space in the optimizer
+ * arrays: device d is at index d and bucket b (< 0) is at index
+ * max_devices + (-1-b).
+ */
+struct crush_optimizer {
+	const struct crush_map *map;
+	struct crush_choose_arg *choose_args;
+	struct crush_optimizer_params params;
+	int num_items;		/* max_devices + max_buckets */
+	int *results;		/* samples * num_rep */
+	int *result_lens;	/* samples */
+	double *target;		/* num_items */
+	double target_total;	/* sum of the device targets under TAKE */
+	__u64 *counts;		/* num_rep * num_items placements */
+	char *reachable;	/* num_items, under a TAKE step of the rule */
+	char *done;		/* num_items, scratch for the subtree sums */
+};
+
+static int item_index(const struct crush_optimizer *o, int item)
+{
+	if (item >= 0)
+		return item;
+	return o->map->max_devices + (-1-item);
+}
+
+static const struct crush_bucket *index_bucket(const struct crush_optimizer *o, int index)
+{
+	if (index < o->map->max_devices)
+		return NULL;
+	return o->map->buckets[index - o->map->max_devices];
+}
+
+/* the target of a bucket is the sum of the targets of its children */
+static double subtree_target(struct crush_optimizer *o, int index)
+{
+	const struct crush_bucket *b = index_bucket(o, index);
+	double sum = 0;
+	__u32 i;
+
+	if (b == NULL || o->done[index])
+		return o->target[index];
+	o->done[index] = 1;
+	for (i = 0; i < b->size; i++) {
+		int child = item_index(o, b->items[i]);
+		if (child < 0 || child >= o->num_items)
+			continue;
+		sum += subtree_target(o, child);
+	}
+	o->target[index] = sum;
+	return sum;
+}
+
+static void mark_reachable(struct crush_optimizer *o, int index)
+{
+	const struct crush_bucket *b = index_bucket(o, index);
+	__u32 i;
+
+	if (o->reachable[index])
+		return;
+	o->reachable[index] = 1;
+	if (b == NULL)
+		return;
+	for (i = 0; i < b->size; i++) {
+		int child = item_index(o, b->items[i]);
+		if (child >= 0 && child < o->num_items)
+			mark_reachable(o, child);
+	}
+}
+
+static int init_targets(struct crush_optimizer *o)
+{
+	const struct crush_map *map = o->map;
+	const struct crush_rule *rule;
+	__u32 i, step;
+	int b, index;
+
+	if ((__u32)o->params.ruleno >= map->max_rules ||
+	    map->rules[o->params.ruleno] == NULL)
+		return -EINVAL;
+	rule = map->rules[o->params.ruleno];
+
+	if (o->params.target) {
+		for (index = 0; index < map->max_devices; index++)
+			if (index < o->params.target_max)
+				o->target[index] = o->params.target[index];
+	} else {
+		/* the weight of a device in the first bucket containing it */
+		memset(o->done, 0, o->num_items);
+		for (b = 0; b < map->max_buckets; b++) {
+			const struct crush_bucket *bucket = map->buckets[b];
+			if (bucket == NULL)
+				continue;
+			for (i = 0; i < bucket->size; i++) {
+				int item = bucket->items[i];
+				if (item < 0 || item >= map->max_devices ||
+				    o->done[item])
+					continue;
+				o->done[item] = 1;
+				o->target[item] =
+					crush_get_bucket_item_weight(bucket, i);
+			}
+		}
+	}
+
+	memset(o->done, 0, o->num_items);
+	for (index = map->max_devices; index < o->num_items; index++)
+		subtree_target(o, index);
+
+	for (step = 0; step < rule->len; step++) {
+		int item = rule->steps[step].arg1;
+		if (rule->steps[step].op != CRUSH_RULE_TAKE)
+			continue;
+		index = item_index(o, item);
+		if (index >= 0 && index < o->num_items &&
+		    (item >= 0 || map->buckets[-1-item]))
+			mark_reachable(o, index);
+	}
+
+	o->target_total = 0;
+	for (index = 0; index < map->max_devices; index++)
+		if (o->reachable[index])
+			o->target_total += o->target[index];
+	return 0;
+}
+
+int crush_optimizer_create(const struct crush_map *map,
+			   struct crush_choose_arg *choose_args,
+			   const struct crush_optimizer_params *params,
+			   struct crush_optimizer **optimizer)
+{
+	struct crush_optimizer *o;
+	int r;
+
+	if (params->num_rep <= 0 || params->samples <= 0)
+		return -EINVAL;
+
+	o = crush_malloc(sizeof(*o));
+	if (!o)
+		return -ENOMEM;
+	memset(o, 0, sizeof(*o));
+	o->map = map;
+	o->choose_args = choose_args;
+	o->params = *params;
+	o->num_items = map->max_devices + map->max_buckets;
+
+	o->results = crush_malloc(sizeof(int) * (size_t)params->samples * params->num_rep);
+	o->result_lens = crush_malloc(sizeof(int) * params->samples);
+	o->target = crush_calloc(o->num_items, sizeof(double));
+	o->counts = crush_malloc(sizeof(__u64) * (size_t)params->num_rep * o->num_items);
+	o->reachable = crush_calloc(o->num_items, 1);
+	o->done = crush_malloc(o->num_items);
+	r = -ENOMEM;
+	if (!o->results || !o->result_lens || !o->target || !o->counts ||
+	    !o->reachable || !o->done)
+		goto err;
+
+	r = init_targets(o);
+	if (r < 0)
+		goto err;
+	*optimizer = o;
+	return 0;
+err:
+	crush_optimizer_destroy(o);
+	return r;
+}
+
+void crush_optimizer_destroy(struct crush_optimizer *o)
+{
+	crush_free(o->results);
+	crush_free(o->result_lens);
+	crush_free(o->target);
+	crush_free(o->counts);
+	crush_free(o->reachable);
+	crush_free(o->done);
+	crush_free(o);
+}
+
+/* add the placements of the children of a bucket to the bucket */
+static __u64 subtree_count(struct crush_optimizer *o, __u64 *counts, int index)
+{
+	const struct crush_bucket *b = index_bucket(o, index);
+	__u32 i;
+
+	if (b == NULL || o->done[index])
+		return counts[index];
+	o->done[index] = 1;
+	for (i = 0; i < b->size; i++) {
+		int child = item_index(o, b->items[i]);
+		if (child < 0 || child >= o->num_items)
+			continue;
+		counts[index] += subtree_count(o, counts, child);
+	}
+	return counts[index];
+}
+
+static double count_placements(struct crush_optimizer *o)
+{
+	const int num_rep = o->params.num_rep;
+	double deviation = 0;
+	int i, p, index;
+
+	memset(o->counts, 0, sizeof(__u64) * (size_t)num_rep * o->num_items);
+	for (i = 0; i < o->params.samples; i++) {
+		const int *result = o->results + (size_t)i * num_rep;
+		for (p = 0; p < o->result_lens[i]; p++) {
+			if (result[p] == CRUSH_ITEM_NONE)
+				continue;
+			index = item_index(o, result[p]);
+			if (index >= 0 && index < o->num_items)
+				o->counts[(size_t)p * o->num_items + index]++;
+		}
+	}
+
+	for (p = 0; p < num_rep; p++) {
+		__u64 *counts = o->counts + (size_t)p * o->num_items;
+		__u64 total = 0;
+
+		for (index = 0; index < o->map->max_devices; index++)
+			total += counts[index];
+		if (total == 0 || o->target_total == 0)
+			continue;
+		for (index = 0; index < o->map->max_devices; index++) {
+			double expected, d;
+			if (!o->reachable[index] || o->target[index] == 0)
+				continue;
+			expected = total * o->target[index] / o->target_total;
+			d = fabs(counts[index] - expected) / expected;
+			if (d > deviation)
+				deviation = d;
+		}
+
+		memset(o->done, 0, o->num_items);
+		for (index = o->map->max_devices; index < o->num_items; index++)
+			subtree_count(o, counts, index);
+	}
+	return deviation;
+}
+
+static void adjust_weight_set(struct crush_optimizer *o,
+			      const struct crush_bucket *b,
+			      struct crush_weight_set *weight_set,
+			      int first, int last)
+{
+	double actual_total = 0, target_total = 0;
+	__u32 i;
+	int p;
+
+	for (i = 0; i < b->size && i < weight_set->size; i++) {
+		int child = item_index(o, b->items[i]);
+		if (child < 0 || child >= o->num_items)
+			continue;
+		target_total += o->target[child];
+		for (p = first; p <= last; p++)
+			actual_total += o->counts[(size_t)p * o->num_items + child];
+	}
+	if (actual_total == 0 || target_total == 0)
+		return;
+
+	for (i = 0; i < b->size && i < weight_set->size; i++) {
+		int child = item_index(o, b->items[i]);
+		double actual = 0, factor, weight;
+
+		if (child < 0 || child >= o->num_items)
+			continue;
+		if (o->target[child] == 0) {
+			weight_set->weights[i] = 0;
+			continue;
+		}
+		for (p = first; p <= last; p++)
+			actual += o->counts[(size_t)p * o->num_items + child];
+		if (actual == 0)
+			factor = CRUSH_OPTIMIZER_MAX_FACTOR;
+		else
+			factor = (o->target[child] / target_total) /
+				(actual / actual_total);
+		if (factor > CRUSH_OPTIMIZER_MAX_FACTOR)
+			factor = CRUSH_OPTIMIZER_MAX_FACTOR;
+		if (factor < 1 / CRUSH_OPTIMIZER_MAX_FACTOR)
+			factor = 1 / CRUSH_OPTIMIZER_MAX_FACTOR;
+		weight = weight_set->weights[i] * factor;
+		if (weight < 1)
+			weight = 1;
+		if (weight > U32_MAX)
+			weight = U32_MAX;
+		dprintk("bucket %d item %d actual %f factor %f weight 0x%x -> 0x%x\n",
+			b->id, b->items[i], actual, factor,
+			weight_set->weights[i], (__u32)weight);
+		weight_set->weights[i] = weight;
+	}
+}
+
+int crush_optimizer_step(struct crush_optimizer *o, double *deviation)
+{
+	const struct crush_map *map = o->map;
+	int b, position, r;
+
+	r = crush_do_rule_batch(map, o->params.ruleno, NULL, 0,
+				o->params.samples,
+				o->results, o->result_lens, o->params.num_rep,
+				o->params.weights, o->params.weight_max,
+				o->choose_args, o->params.num_threads);
+	if (r < 0)
+		return r;
+
+	*deviation = count_placements(o);
+
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+		struct crush_choose_arg *arg = &o->choose_args[b];
+		int last;
+
+		if (bucket == NULL || bucket->alg != CRUSH_BUCKET_STRAW2 ||
+		    !o->reachable[map->max_devices + b] ||
+		    arg->weight_set == NULL || arg->weight_set_size == 0)
+			continue;
+		/*
+		 * positions beyond the last weight set are drawn with
+		 * the last weight set, see get_choose_arg_weights()
+		 */
+		for (position = 0; position < (int)arg->weight_set_size &&
+			     position < o->params.num_rep; position++) {
+			if (position == (int)arg->weight_set_size - 1)
+				last = o->params.num_rep - 1;
+			else
+				last = position;
+			adjust_weight_set(o, bucket, &arg->weight_set[position],
+					  position, last);
+		}
+	}
+	return 0;
+}
+
+/* copy all the weights of the weight sets, in bucket order */
+static void copy_weight_sets(const struct crush_map *map,
+			     struct crush_choose_arg *choose_args,
+			     __u32 *saved, int save)
+{
+	int b;
+	__u32 position;
+
+	for (b = 0; b < map->max_buckets; b++) {
+		struct crush_choose_arg *arg = &choose_args[b];
+		if (map->buckets[b] == NULL || arg->weight_set == NULL)
+			continue;
+		for (position = 0; position < arg->weight_set_size; position++) {
+			struct crush_weight_set *ws = &arg->weight_set[position];
+			if (save)
+				memcpy(saved, ws->weights, sizeof(__u32) * ws->size);
+			else
+				memcpy(ws->weights, saved, sizeof(__u32) * ws->size);
+			saved += ws->size;
+		}
+	}
+}
+
+int crush_optimize_choose_args(const struct crush_map *map,
+			       struct crush_choose_arg *choose_args,
+			       const struct crush_optimizer_params *params,
+			       int max_steps, double max_deviation,
+			       double *deviation)
+{
+	struct crush_optimizer *o;
+	double best = -1, current;
+	__u32 *saved, *best_saved;
+	size_t size = 0;
+	int b, r = 0, steps = 0;
+	__u32 position;
+
+	if (params->num_rep <= 0 || params->samples <= 0)
+		return -EINVAL;
+
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b] && choose_args[b].weight_set)
+			for (position = 0; position < choose_args[b].weight_set_size; position++)
+				size += choose_args[b].weight_set[position].size;
+	saved = crush_malloc(sizeof(__u32) * (size ? size : 1) * 2);
+	if (!saved)
+		return -ENOMEM;
+	best_saved = saved + (size ? size : 1);
+
+	r = crush_optimizer_create(map, choose_args, params, &o);
+	if (r < 0) {
+		crush_free(saved);
+		return r;
+	}
+
+	while (steps < max_steps) {
+		copy_weight_sets(map, choose_args, saved, 1);
+		r = crush_optimizer_step(o, &current);
+		if (r < 0)
+			break;
+		steps++;
+		dprintk("step %d deviation %f\n", steps, current);
+		if (best >= 0 && current > best)
+			break;
+		best = current;
+		memcpy(best_saved, saved, sizeof(__u32) * size);
+		if (current <= max_deviation)
+			break;
+	}
+	/*
+	 * the last step adjusted the weights after measuring them,
+	 * go back to the weights with the lowest measured deviation
+	 */
+	if (best >= 0)
+		copy_weight_sets(map, choose_args, best_saved, 0);
+
+	crush_optimizer_destroy(o);
+	crush_free(saved);
+	if (r < 0)
+		return r;
+	if (deviation)
+		*deviation = best;
+	return steps;
+}
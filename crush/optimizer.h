@@ -0,0 +1,119 @@
+#ifndef CEPH_CRUSH_OPTIMIZER_H
+#define CEPH_CRUSH_OPTIMIZER_H
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * Parameters of the choose_args optimizer, see crush_optimizer_create().
+ */
+struct crush_optimizer_params {
+	int ruleno;            /*!< the rule mapping the samples */
+	int num_rep;           /*!< the number of items mapped, as result_max in crush_do_rule() */
+	int samples;           /*!< the number of values mapped per step, x in [0,__samples__[ */
+	int num_threads;       /*!< the number of mapping threads, 0 for one per online cpu */
+	const __u32 *weights;  /*!< the device weights, as in crush_do_rule() */
+	int weight_max;        /*!< the size of the __weights__ array */
+	/*! The 16.16 fixed point share of the placements each device
+	 * should get or NULL. If NULL, the target of a device is its
+	 * weight in the bucket containing it.
+	 */
+	const __u32 *target;
+	int target_max;        /*!< the size of the __target__ array */
+};
+
+/** @ingroup API
+ *
+ * The state of an optimization in progress, allocated by
+ * crush_optimizer_create() and deallocated by crush_optimizer_destroy().
+ */
+struct crush_optimizer;
+
+/** @ingroup API
+ *
+ * Prepare the optimization of the __choose_args__ weight sets so that
+ * the number of placements of each device, at each position,
+ * approaches its target. The __choose_args__ must have been allocated
+ * with crush_make_choose_args() for __map__, with at least one
+ * position. When __params->num_rep__ is larger than the number of
+ * positions, all extra positions are accounted to the last one, the
+ * same way crush_do_rule() uses the last weight set for them.
+ *
+ * The __map__ must not be modified while the optimizer exists. The
+ * __params__ are copied, the arrays they point to are not and must
+ * remain valid until crush_optimizer_destroy().
+ *
+ * - return -ENOMEM if memory cannot be allocated
+ * - return -EINVAL if __params->num_rep__ or __params->samples__ is
+ *   not strictly positive or if __params->ruleno__ is not a rule
+ *
+ * @param map the crush_map, after crush_finalize()
+ * @param choose_args the weight sets to optimize in place
+ * @param params the optimizer parameters
+ * @param[out] optimizer the optimizer state
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_optimizer_create(const struct crush_map *map,
+				  struct crush_choose_arg *choose_args,
+				  const struct crush_optimizer_params *params,
+				  struct crush_optimizer **optimizer);
+/** @ingroup API
+ *
+ * Map the samples with the current weight sets and store in
+ * __deviation__ the largest relative difference between the number of
+ * placements of a device and its target, at any position. For
+ * instance 0.05 means no device is more than 5% above or below its
+ * target. Then adjust the weight of each item in the weight set of
+ * each straw2 bucket, at each position, in proportion of the
+ * difference between the placements the item received and its
+ * target, so that the next step is closer to the targets.
+ *
+ * The mapping of the samples is shared between __params->num_threads__
+ * threads, the weight adjustment is linear in the size of the map.
+ *
+ * - return -ENOMEM if the mapping threads cannot allocate memory
+ * - return -EAGAIN if the mapping threads cannot be created
+ *
+ * @param optimizer the state returned by crush_optimizer_create()
+ * @param[out] deviation the deviation before the adjustment
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_optimizer_step(struct crush_optimizer *optimizer, double *deviation);
+/** @ingroup API
+ *
+ * Deallocate the __optimizer__ created by crush_optimizer_create(). The
+ * weight sets it adjusted are left unchanged.
+ *
+ * @param optimizer the state returned by crush_optimizer_create()
+ */
+extern void crush_optimizer_destroy(struct crush_optimizer *optimizer);
+
+/** @ingroup API
+ *
+ * Call crush_optimizer_step() up to __max_steps__ times and stop
+ * early if the deviation is lower or equal to __max_deviation__. If a
+ * step makes the deviation worse than the best seen so far, the
+ * weight sets of the best step are restored and the function returns.
+ *
+ * - return -ENOMEM if memory cannot be allocated
+ * - return -EINVAL if the __params__ are not valid
+ * - return -EAGAIN if the mapping threads cannot be created
+ *
+ * @param map the crush_map, after crush_finalize()
+ * @param choose_args the weight sets to optimize in place
+ * @param params the optimizer parameters
+ * @param max_steps the maximum number of steps
+ * @param max_deviation the deviation at which to stop
+ * @param[out] deviation the deviation of the weight sets left in __choose_args__
+ *
+ * @returns the number of steps on success, < 0 on error
+ */
+extern int crush_optimize_choose_args(const struct crush_map *map,
+				      struct crush_choose_arg *choose_args,
+				      const struct crush_optimizer_params *params,
+				      int max_steps, double max_deviation,
+				      double *deviation);
+
+#endif
@@ -0,0 +1,1011 @@
+#include <errno.h>
+#include <stdarg.h>
+
+#include "crush_compat.h"
+#include "hash.h"
+#include "builder.h"
+#include "arena.h"
+#include "parser.h"
+
+/*
+ * The text is compiled while it is tokenized: there is no syntax
+ * tree, buckets and rules are added to the map as soon as their
+ * closing brace is read. Names are kept as pointers into the text.
+ */
+
+enum {
+	CRUSH_NAME_TYPE,
+	CRUSH_NAME_ITEM,
+	CRUSH_NAME_RULE,
+};
+
+struct crush_name {
+	const char *s;
+	__u32 len;
+	__u32 hash;
+	int kind;
+	int value;
+};
+
+/* a slot of the name table, empty if index is 0 */
+struct crush_name_slot {
+	__u32 hash;
+	__u32 index;		/* in names, + 1 */
+};
+
+struct crush_parser_item {
+	int item;
+	int weight;
+	int pos;		/* -1 if not set */
+	int line;
+	int column;
+};
+
+struct crush_parser {
+	const char *p;
+	const char *end;
+	int line;
+	const char *line_start;
+
+	/* the current token, tok is NULL at the end of the text */
+	const char *tok;
+	size_t len;
+	int tok_line;
+	int tok_column;
+	int unread;
+
+	struct crush_map *map;
+	struct crush_parse_error *error;
+
+	/*
+	 * the names in the order they are defined and an open
+	 * addressing hash table of small slots, at most 3/4 full
+	 */
+	struct crush_name *names;
+	int name_count;
+	int name_max;
+	struct crush_name_slot *table;
+	__u32 table_mask;
+
+	/* device weights, indexed by device id */
+	__u32 *weights;
+	char *declared;
+	int device_max;
+	int max_devices;
+
+	/* the items of the bucket being parsed */
+	struct crush_parser_item *items;
+	int item_max;
+	int *bucket_items;
+	int *bucket_weights;
+	int bucket_max;
+	int next_bucket_pos;
+
+	/* the steps of the rule being parsed */
+	struct crush_rule_step *steps;
+	int step_max;
+};
+
+static int parse_error(struct crush_parser *ps, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int parse_error_at(struct crush_parser *ps, int line, int column,
+			  const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static void parse_verror(struct crush_parser *ps, int line, int column,
+			 const char *fmt, va_list ap)
+{
+	if (ps->error == NULL)
+		return;
+	ps->error->line = line;
+	ps->error->column = column;
+	vsnprintf(ps->error->message, sizeof(ps->error->message), fmt, ap);
+}
+
+static int parse_error_at(struct crush_parser *ps, int line, int column,
+			  const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	parse_verror(ps, line, column, fmt, ap);
+	va_end(ap);
+	return -EINVAL;
+}
+
+/* an error located at the current token */
+static int parse_error(struct crush_parser *ps, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	parse_verror(ps, ps->tok_line, ps->tok_column, fmt, ap);
+	va_end(ap);
+	return -EINVAL;
+}
+
+/* grow the array at __p__ of __max__ elements of __size__ to at least __n__ */
+static int parse_grow(void *p, int *max, int n, size_t size)
+{
+	void **array = p;
+	void *_realloc;
+	int new_max = *max ? *max : 64;
+
+	if (n <= *max)
+		return 0;
+	while (new_max < n)
+		new_max *= 2;
+	if ((_realloc = crush_realloc(*array, new_max * size)) == NULL)
+		return -ENOMEM;
+	*array = _realloc;
+	*max = new_max;
+	return 0;
+}
+
+/** tokens **/
+
+static inline int is_delimiter(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+		c == '{' || c == '}' || c == '#';
+}
+
+/* return 0 at the end of the text, 1 otherwise */
+static int next_token(struct crush_parser *ps)
+{
+	const char *p = ps->p;
+	const char *end = ps->end;
+
+	if (ps->unread) {
+		ps->unread = 0;
+		return ps->tok != NULL;
+	}
+	while (p < end) {
+		char c = *p;
+		if (c == '\n') {
+			ps->line++;
+			ps->line_start = ++p;
+		} else if (c == ' ' || c == '\t' || c == '\r') {
+			p++;
+		} else if (c == '#') {
+			p = memchr(p, '\n', end - p);
+			if (p == NULL)
+				p = end;
+		} else {
+			break;
+		}
+	}
+	ps->tok_line = ps->line;
+	ps->tok_column = p - ps->line_start + 1;
+	if (p == end) {
+		ps->p = p;
+		ps->tok = NULL;
+		ps->len = 0;
+		return 0;
+	}
+	ps->tok = p;
+	if (*p == '{' || *p == '}')
+		p++;
+	else
+		while (p < end && !is_delimiter(*p))
+			p++;
+	ps->len = p - ps->tok;
+	ps->p = p;
+	return 1;
+}
+
+/* the next call to next_token() returns the current token again */
+static void unread_token(struct crush_parser *ps)
+{
+	ps->unread = 1;
+}
+
+static int token_is(const struct crush_parser *ps, const char *word)
+{
+	size_t len = strlen(word);
+
+	return ps->tok && ps->len == len && memcmp(ps->tok, word, len) == 0;
+}
+
+static int expect_token(struct crush_parser *ps, const char *what)
+{
+	if (!next_token(ps))
+		return parse_error(ps, "unexpected end of file, expected %s", what);
+	return 0;
+}
+
+static int expect_word(struct crush_parser *ps, const char *word)
+{
+	int err = expect_token(ps, word);
+
+	if (err < 0)
+		return err;
+	if (!token_is(ps, word))
+		return parse_error(ps, "expected '%s' instead of '%.*s'",
+				   word, (int)ps->len, ps->tok);
+	return 0;
+}
+
+static int parse_int(struct crush_parser *ps, int *value)
+{
+	const char *p, *end;
+	long long v = 0;
+	int negative = 0;
+	int err = expect_token(ps, "an integer");
+
+	if (err < 0)
+		return err;
+	p = ps->tok;
+	end = ps->tok + ps->len;
+	if (*p == '-' || *p == '+')
+		negative = *p++ == '-';
+	if (p == end)
+		goto invalid;
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9')
+			goto invalid;
+		v = v * 10 + (*p - '0');
+		if (v > 0x80000000ll)
+			goto invalid;
+	}
+	if (negative)
+		v = -v;
+	if (v > 0x7fffffffll)
+		goto invalid;
+	*value = v;
+	return 0;
+invalid:
+	return parse_error(ps, "'%.*s' is not a valid integer",
+			   (int)ps->len, ps->tok);
+}
+
+static int parse_int_range(struct crush_parser *ps, int *value,
+			   int min, int max, const char *what)
+{
+	int err = parse_int(ps, value);
+
+	if (err < 0)
+		return err;
+	if (*value < min || *value > max)
+		return parse_error(ps, "%s %d is not in [%d,%d]",
+				   what, *value, min, max);
+	return 0;
+}
+
+/* a decimal number converted to 16.16 fixed point, truncated */
+static int parse_weight(struct crush_parser *ps, __u32 *weight)
+{
+	const char *p, *end;
+	__u64 integer = 0, fraction = 0, scale = 1;
+	int digits = 0;
+	int err = expect_token(ps, "a weight");
+
+	if (err < 0)
+		return err;
+	p = ps->tok;
+	end = ps->tok + ps->len;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		integer = integer * 10 + (*p - '0');
+		if (integer > 0xffff)
+			goto invalid;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+			/* more than 9 digits do not change the result */
+			if (scale < 1000000000ull) {
+				fraction = fraction * 10 + (*p - '0');
+				scale *= 10;
+			}
+		}
+	}
+	if (p != end || digits == 0)
+		goto invalid;
+	*weight = (integer << 16) + ((fraction << 16) / scale);
+	return 0;
+invalid:
+	return parse_error(ps, "'%.*s' is not a valid weight",
+			   (int)ps->len, ps->tok);
+}
+
+/** names **/
+
+static __u32 name_hash(int kind, const char *s, size_t len)
+{
+	__u32 hash = 2166136261u ^ kind;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)s[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Return the slot of the name __s__ of __kind__ or the empty slot
+ * where it belongs. The names are compared in place in the text.
+ */
+static struct crush_name_slot *name_slot(struct crush_parser *ps, int kind,
+					 const char *s, size_t len, __u32 hash)
+{
+	struct crush_name_slot *slot;
+	__u32 i;
+
+	for (i = hash & ps->table_mask; ; i = (i + 1) & ps->table_mask) {
+		const struct crush_name *name;
+		slot = &ps->table[i];
+		if (slot->index == 0)
+			return slot;
+		if (slot->hash != hash)
+			continue;
+		name = &ps->names[slot->index - 1];
+		if (name->kind == kind && name->len == len &&
+		    memcmp(name->s, s, len) == 0)
+			return slot;
+	}
+}
+
+static struct crush_name *name_find(struct crush_parser *ps, int kind,
+				    const char *s, size_t len)
+{
+	struct crush_name_slot *slot;
+
+	slot = name_slot(ps, kind, s, len, name_hash(kind, s, len));
+	return slot->index ? &ps->names[slot->index - 1] : NULL;
+}
+
+/* rehash the names in a table of __size__ slots, a power of two */
+static int name_grow_table(struct crush_parser *ps, __u32 size)
+{
+	struct crush_name_slot *table;
+	int n;
+
+	table = crush_calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+	for (n = 0; n < ps->name_count; n++) {
+		__u32 i = ps->names[n].hash & (size - 1);
+		while (table[i].index)
+			i = (i + 1) & (size - 1);
+		table[i].hash = ps->names[n].hash;
+		table[i].index = n + 1;
+	}
+	crush_free(ps->table);
+	ps->table = table;
+	ps->table_mask = size - 1;
+	return 0;
+}
+
+/* add the current token as a name, which must not exist */
+static int name_add(struct crush_parser *ps, int kind, int value)
+{
+	struct crush_name_slot *slot;
+	struct crush_name *name;
+	__u32 hash = name_hash(kind, ps->tok, ps->len);
+	int err;
+
+	if (4 * ((__u64)ps->name_count + 1) > 3 * ((__u64)ps->table_mask + 1)) {
+		err = name_grow_table(ps, 2 * (ps->table_mask + 1));
+		if (err < 0)
+			return err;
+	}
+	slot = name_slot(ps, kind, ps->tok, ps->len, hash);
+	if (slot->index)
+		return parse_error(ps, "'%.*s' is already defined",
+				   (int)ps->len, ps->tok);
+	err = parse_grow(&ps->names, &ps->name_max, ps->name_count + 1,
+			 sizeof(*ps->names));
+	if (err < 0)
+		return err;
+	name = &ps->names[ps->name_count];
+	name->s = ps->tok;
+	name->len = ps->len;
+	name->hash = hash;
+	name->kind = kind;
+	name->value = value;
+	slot->hash = hash;
+	slot->index = ++ps->name_count;
+	return 0;
+}
+
+static int expect_name(struct crush_parser *ps, int kind, int *value,
+		       const char *what)
+{
+	struct crush_name *name;
+	int err = expect_token(ps, what);
+
+	if (err < 0)
+		return err;
+	name = name_find(ps, kind, ps->tok, ps->len);
+	if (name == NULL)
+		return parse_error(ps, "unknown %s '%.*s'", what,
+				   (int)ps->len, ps->tok);
+	*value = name->value;
+	return 0;
+}
+
+/** statements **/
+
+static int parse_tunable(struct crush_parser *ps)
+{
+	struct crush_map *map = ps->map;
+	const char *tok;
+	size_t len;
+	int line, column;
+	int value;
+	int err;
+
+	err = expect_token(ps, "a tunable");
+	if (err < 0)
+		return err;
+	tok = ps->tok;
+	len = ps->len;
+	line = ps->tok_line;
+	column = ps->tok_column;
+	err = parse_int_range(ps, &value, 0, 0x7fffffff, "tunable");
+	if (err < 0)
+		return err;
+#define TUNABLE(name) \
+	if (len == strlen(#name) && memcmp(tok, #name, len) == 0) { \
+		map->name = value; \
+		return 0; \
+	}
+	TUNABLE(choose_local_tries);
+	TUNABLE(choose_local_fallback_tries);
+	TUNABLE(choose_total_tries);
+	TUNABLE(chooseleaf_descend_once);
+	TUNABLE(chooseleaf_vary_r);
+	TUNABLE(chooseleaf_stable);
+	TUNABLE(straw_calc_version);
+	TUNABLE(allowed_bucket_algs);
+#undef TUNABLE
+	return parse_error_at(ps, line, column, "unknown tunable '%.*s'",
+			      (int)len, tok);
+}
+
+static int parse_device(struct crush_parser *ps)
+{
+	__u32 weight = 0x10000;
+	int device_max = ps->device_max;
+	int id, i;
+	int err;
+
+	err = parse_int_range(ps, &id, 0, 0x7ffffffe, "device id");
+	if (err < 0)
+		return err;
+	if (id < ps->max_devices && ps->declared[id])
+		return parse_error(ps, "device %d is already defined", id);
+	err = expect_token(ps, "a device name");
+	if (err < 0)
+		return err;
+	err = name_add(ps, CRUSH_NAME_ITEM, id);
+	if (err < 0)
+		return err;
+
+	while (next_token(ps)) {
+		if (token_is(ps, "down")) {
+			weight = 0;
+		} else if (token_is(ps, "offload")) {
+			__u32 offload;
+			err = parse_weight(ps, &offload);
+			if (err < 0)
+				return err;
+			if (offload > 0x10000)
+				return parse_error(ps, "offload must be in [0,1]");
+			weight = 0x10000 - offload;
+		} else if (token_is(ps, "class")) {
+			err = expect_token(ps, "a device class");
+			if (err < 0)
+				return err;
+		} else {
+			unread_token(ps);
+			break;
+		}
+	}
+
+	err = parse_grow(&ps->weights, &device_max, id + 1, sizeof(*ps->weights));
+	if (err == 0)
+		err = parse_grow(&ps->declared, &ps->device_max, device_max,
+				 sizeof(*ps->declared));
+	if (err < 0)
+		return err;
+	for (i = ps->max_devices; i <= id; i++) {
+		ps->weights[i] = 0x10000;
+		ps->declared[i] = 0;
+	}
+	if (id >= ps->max_devices)
+		ps->max_devices = id + 1;
+	ps->weights[id] = weight;
+	ps->declared[id] = 1;
+	return 0;
+}
+
+static int parse_type(struct crush_parser *ps)
+{
+	int id;
+	int err;
+
+	err = parse_int_range(ps, &id, 0, 0xffff, "type id");
+	if (err < 0)
+		return err;
+	err = expect_token(ps, "a type name");
+	if (err < 0)
+		return err;
+	return name_add(ps, CRUSH_NAME_TYPE, id);
+}
+
+static const char *bucket_algs[] = {
+	[CRUSH_BUCKET_UNIFORM] = "uniform",
+	[CRUSH_BUCKET_LIST] = "list",
+	[CRUSH_BUCKET_TREE] = "tree",
+	[CRUSH_BUCKET_STRAW] = "straw",
+	[CRUSH_BUCKET_STRAW2] = "straw2",
+};
+
+static int parse_bucket_item(struct crush_parser *ps, int count)
+{
+	struct crush_parser_item *item;
+	int item_max = ps->item_max;
+	int err;
+
+	err = parse_grow(&ps->items, &item_max, count + 1, sizeof(*ps->items));
+	if (err < 0)
+		return err;
+	ps->item_max = item_max;
+	item = &ps->items[count];
+	err = expect_name(ps, CRUSH_NAME_ITEM, &item->item, "item");
+	if (err < 0)
+		return err;
+	item->line = ps->tok_line;
+	item->column = ps->tok_column;
+	item->pos = -1;
+	if (item->item >= 0)
+		item->weight = 0x10000;
+	else
+		item->weight = ps->map->buckets[-1-item->item]->weight;
+	while (next_token(ps)) {
+		if (token_is(ps, "weight")) {
+			__u32 weight;
+			err = parse_weight(ps, &weight);
+			if (err < 0)
+				return err;
+			if (weight > 0x7fffffff)
+				return parse_error(ps, "weight is too large");
+			item->weight = weight;
+		} else if (token_is(ps, "pos")) {
+			err = parse_int_range(ps, &item->pos, 0, 0x7fffffff,
+					      "pos");
+			if (err < 0)
+				return err;
+		} else {
+			unread_token(ps);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Order the __count__ items of the bucket: those with a pos first,
+ * then the others in the first positions left.
+ */
+static int place_bucket_items(struct crush_parser *ps, int count)
+{
+	int bucket_max = ps->bucket_max;
+	int i, pos;
+	int err;
+
+	err = parse_grow(&ps->bucket_items, &bucket_max, count,
+			 sizeof(*ps->bucket_items));
+	if (err == 0)
+		err = parse_grow(&ps->bucket_weights, &ps->bucket_max, bucket_max,
+				 sizeof(*ps->bucket_weights));
+	if (err < 0)
+		return err;
+	for (i = 0; i < count; i++)
+		ps->bucket_items[i] = CRUSH_ITEM_UNDEF;
+	for (i = 0; i < count; i++) {
+		const struct crush_parser_item *item = &ps->items[i];
+		if (item->pos < 0)
+			continue;
+		if (item->pos >= count)
+			return parse_error_at(ps, item->line, item->column,
+					      "pos %d is not lower than the %d items of the bucket",
+					      item->pos, count);
+		if (ps->bucket_items[item->pos] != CRUSH_ITEM_UNDEF)
+			return parse_error_at(ps, item->line, item->column,
+					      "pos %d is already used", item->pos);
+		ps->bucket_items[item->pos] = item->item;
+		ps->bucket_weights[item->pos] = item->weight;
+	}
+	for (i = 0, pos = 0; i < count; i++) {
+		const struct crush_parser_item *item = &ps->items[i];
+		if (item->pos >= 0)
+			continue;
+		while (ps->bucket_items[pos] != CRUSH_ITEM_UNDEF)
+			pos++;
+		ps->bucket_items[pos] = item->item;
+		ps->bucket_weights[pos] = item->weight;
+	}
+	return 0;
+}
+
+static int parse_bucket(struct crush_parser *ps, int type)
+{
+	struct crush_map *map = ps->map;
+	struct crush_bucket *bucket;
+	const char *name;
+	size_t name_len;
+	int line, column, id_line = 0, id_column = 0;
+	int id = 0, alg = 0, hash = CRUSH_HASH_RJENKINS1;
+	int count = 0;
+	__u64 weight = 0;
+	int i, err;
+
+	err = expect_token(ps, "a bucket name");
+	if (err < 0)
+		return err;
+	if (name_find(ps, CRUSH_NAME_ITEM, ps->tok, ps->len))
+		return parse_error(ps, "'%.*s' is already defined",
+				   (int)ps->len, ps->tok);
+	name = ps->tok;
+	name_len = ps->len;
+	line = ps->tok_line;
+	column = ps->tok_column;
+	err = expect_word(ps, "{");
+	if (err < 0)
+		return err;
+
+	for (;;) {
+		err = expect_token(ps, "'}'");
+		if (err < 0)
+			return err;
+		if (token_is(ps, "}")) {
+			break;
+		} else if (token_is(ps, "id")) {
+			int value, value_line, value_column;
+			err = parse_int_range(ps, &value, -0x7fffffff, -1, "bucket id");
+			if (err < 0)
+				return err;
+			value_line = ps->tok_line;
+			value_column = ps->tok_column;
+			/* the id of the shadow bucket of a device class */
+			if (next_token(ps) && token_is(ps, "class")) {
+				err = expect_token(ps, "a device class");
+				if (err < 0)
+					return err;
+				continue;
+			}
+			unread_token(ps);
+			id = value;
+			id_line = value_line;
+			id_column = value_column;
+		} else if (token_is(ps, "alg")) {
+			err = expect_token(ps, "a bucket algorithm");
+			if (err < 0)
+				return err;
+			for (alg = CRUSH_BUCKET_UNIFORM; alg <= CRUSH_BUCKET_STRAW2; alg++)
+				if (token_is(ps, bucket_algs[alg]))
+					break;
+			if (alg > CRUSH_BUCKET_STRAW2)
+				return parse_error(ps, "unknown bucket algorithm '%.*s'",
+						   (int)ps->len, ps->tok);
+		} else if (token_is(ps, "hash")) {
+			if (next_token(ps) && token_is(ps, "rjenkins1")) {
+				hash = CRUSH_HASH_RJENKINS1;
+				continue;
+			}
+			unread_token(ps);
+			err = parse_int_range(ps, &hash, CRUSH_HASH_RJENKINS1,
+					      CRUSH_HASH_RJENKINS1, "hash");
+			if (err < 0)
+				return err;
+		} else if (token_is(ps, "item")) {
+			err = parse_bucket_item(ps, count);
+			if (err < 0)
+				return err;
+			weight += ps->items[count].weight;
+			count++;
+		} else {
+			return parse_error(ps, "unexpected '%.*s' in bucket",
+					   (int)ps->len, ps->tok);
+		}
+	}
+
+	if (alg == 0)
+		return parse_error_at(ps, line, column,
+				      "bucket '%.*s' has no alg",
+				      (int)name_len, name);
+	err = place_bucket_items(ps, count);
+	if (err < 0)
+		return err;
+	if (alg == CRUSH_BUCKET_UNIFORM) {
+		for (i = 1; i < count; i++)
+			if (ps->bucket_weights[i] != ps->bucket_weights[0])
+				return parse_error_at(ps, line, column,
+						      "the items of uniform bucket '%.*s' do not all have the same weight",
+						      (int)name_len, name);
+		if (count)
+			weight = (__u64)count * ps->bucket_weights[0];
+	}
+	if (weight > 0xffffffffull)
+		return parse_error_at(ps, line, column,
+				      "the weight of bucket '%.*s' overflows",
+				      (int)name_len, name);
+
+	if (id == 0) {
+		while (ps->next_bucket_pos < map->max_buckets &&
+		       map->buckets[ps->next_bucket_pos])
+			ps->next_bucket_pos++;
+		id = -1 - ps->next_bucket_pos;
+	} else if (-1-id < map->max_buckets && map->buckets[-1-id]) {
+		return parse_error_at(ps, id_line, id_column,
+				      "bucket id %d is already used", id);
+	}
+	bucket = crush_make_arena_bucket(map, alg, hash, type, count,
+					 ps->bucket_items, ps->bucket_weights);
+	if (bucket == NULL)
+		return -ENOMEM;
+	err = crush_add_bucket(map, id, bucket, &id);
+	if (err < 0)
+		return err;
+
+	ps->tok = name;
+	ps->len = name_len;
+	return name_add(ps, CRUSH_NAME_ITEM, id);
+}
+
+static int parse_rule_step(struct crush_parser *ps, struct crush_rule_step *step)
+{
+	static const struct {
+		const char *name;
+		int op;
+	} set_steps[] = {
+		{ "set_choose_tries", CRUSH_RULE_SET_CHOOSE_TRIES },
+		{ "set_chooseleaf_tries", CRUSH_RULE_SET_CHOOSELEAF_TRIES },
+		{ "set_choose_local_tries", CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES },
+		{ "set_choose_local_fallback_tries", CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES },
+		{ "set_chooseleaf_vary_r", CRUSH_RULE_SET_CHOOSELEAF_VARY_R },
+		{ "set_chooseleaf_stable", CRUSH_RULE_SET_CHOOSELEAF_STABLE },
+	};
+	unsigned i;
+	int err;
+
+	step->arg1 = 0;
+	step->arg2 = 0;
+	err = expect_token(ps, "a step");
+	if (err < 0)
+		return err;
+	if (token_is(ps, "take")) {
+		step->op = CRUSH_RULE_TAKE;
+		err = expect_name(ps, CRUSH_NAME_ITEM, &step->arg1, "item");
+		if (err < 0)
+			return err;
+		if (next_token(ps) && token_is(ps, "class"))
+			return parse_error(ps, "device classes are not supported");
+		unread_token(ps);
+		return 0;
+	}
+	if (token_is(ps, "choose") || token_is(ps, "chooseleaf")) {
+		int leaf = token_is(ps, "chooseleaf");
+		err = expect_token(ps, "firstn or indep");
+		if (err < 0)
+			return err;
+		if (token_is(ps, "firstn"))
+			step->op = leaf ? CRUSH_RULE_CHOOSELEAF_FIRSTN :
+				CRUSH_RULE_CHOOSE_FIRSTN;
+		else if (token_is(ps, "indep"))
+			step->op = leaf ? CRUSH_RULE_CHOOSELEAF_INDEP :
+				CRUSH_RULE_CHOOSE_INDEP;
+		else
+			return parse_error(ps, "expected firstn or indep instead of '%.*s'",
+					   (int)ps->len, ps->tok);
+		err = parse_int(ps, &step->arg1);
+		if (err == 0)
+			err = expect_word(ps, "type");
+		if (err == 0)
+			err = expect_name(ps, CRUSH_NAME_TYPE, &step->arg2, "type");
+		return err;
+	}
+	if (token_is(ps, "emit")) {
+		step->op = CRUSH_RULE_EMIT;
+		return 0;
+	}
+	if (token_is(ps, "noop")) {
+		step->op = CRUSH_RULE_NOOP;
+		return 0;
+	}
+	for (i = 0; i < sizeof(set_steps) / sizeof(set_steps[0]); i++) {
+		if (token_is(ps, set_steps[i].name)) {
+			step->op = set_steps[i].op;
+			return parse_int(ps, &step->arg1);
+		}
+	}
+	return parse_error(ps, "unknown step '%.*s'", (int)ps->len, ps->tok);
+}
+
+static int parse_rule(struct crush_parser *ps)
+{
+	struct crush_map *map = ps->map;
+	struct crush_rule *rule;
+	int line, column;
+	int ruleno = -1, ruleset = -1, type = 1, min_size = 1, max_size = 10;
+	int len = 0;
+	int err;
+
+	err = expect_token(ps, "a rule name or '{'");
+	if (err < 0)
+		return err;
+	line = ps->tok_line;
+	column = ps->tok_column;
+	if (!token_is(ps, "{")) {
+		err = name_add(ps, CRUSH_NAME_RULE, 0);
+		if (err == 0)
+			err = expect_word(ps, "{");
+		if (err < 0)
+			return err;
+	}
+
+	for (;;) {
+		err = expect_token(ps, "'}'");
+		if (err < 0)
+			return err;
+		if (token_is(ps, "}")) {
+			break;
+		} else if (token_is(ps, "id")) {
+			err = parse_int_range(ps, &ruleno, 0, CRUSH_MAX_RULES - 1, "rule id");
+			if (err < 0)
+				return err;
+			if ((__u32)ruleno < map->max_rules && map->rules[ruleno])
+				return parse_error(ps, "rule id %d is already used", ruleno);
+		} else if (token_is(ps, "ruleset") || token_is(ps, "pool")) {
+			err = parse_int_range(ps, &ruleset, 0, 255, "ruleset");
+		} else if (token_is(ps, "type")) {
+			if (next_token(ps) && token_is(ps, "replicated")) {
+				type = 1;
+			} else if (token_is(ps, "erasure")) {
+				type = 3;
+			} else {
+				unread_token(ps);
+				err = parse_int_range(ps, &type, 0, 255, "rule type");
+			}
+		} else if (token_is(ps, "min_size")) {
+			err = parse_int_range(ps, &min_size, 0, 255, "min_size");
+		} else if (token_is(ps, "max_size")) {
+			err = parse_int_range(ps, &max_size, 0, 255, "max_size");
+		} else if (token_is(ps, "step")) {
+			err = parse_grow(&ps->steps, &ps->step_max, len + 1,
+					 sizeof(*ps->steps));
+			if (err == 0)
+				err = parse_rule_step(ps, &ps->steps[len]);
+			len++;
+		} else {
+			return parse_error(ps, "unexpected '%.*s' in rule",
+					   (int)ps->len, ps->tok);
+		}
+		if (err < 0)
+			return err;
+	}
+
+	if (ruleno < 0) {
+		for (ruleno = 0; (__u32)ruleno < map->max_rules; ruleno++)
+			if (map->rules[ruleno] == NULL)
+				break;
+		if (ruleno >= CRUSH_MAX_RULES)
+			return parse_error_at(ps, line, column,
+					      "more than %d rules", CRUSH_MAX_RULES);
+	}
+	if (ruleset < 0)
+		ruleset = ruleno;
+	rule = crush_make_arena_rule(map, len, ruleset, type, min_size, max_size);
+	if (rule == NULL)
+		return -ENOMEM;
+	if (len)
+		memcpy(rule->steps, ps->steps, len * sizeof(*ps->steps));
+	err = crush_add_rule(map, rule, ruleno);
+	return err < 0 ? err : 0;
+}
+
+static int parse(struct crush_parser *ps)
+{
+	struct crush_name *type;
+	int err;
+
+	while (next_token(ps)) {
+		if (token_is(ps, "device"))
+			err = parse_device(ps);
+		else if (token_is(ps, "type"))
+			err = parse_type(ps);
+		else if (token_is(ps, "rule"))
+			err = parse_rule(ps);
+		else if (token_is(ps, "tunable"))
+			err = parse_tunable(ps);
+		else if ((type = name_find(ps, CRUSH_NAME_TYPE, ps->tok, ps->len)))
+			err = parse_bucket(ps, type->value);
+		else if (ps->tok[0] == '<')
+			err = parse_error(ps, "'%.*s' is the legacy <types> <devices> "
+					  "<buckets> <rules> syntax, which is not supported",
+					  (int)ps->len, ps->tok);
+		else
+			err = parse_error(ps, "unexpected '%.*s'",
+					  (int)ps->len, ps->tok);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+int crush_parse_text(const char *text, size_t length,
+		     struct crush_map **mapp, __u32 **weightsp,
+		     struct crush_parse_error *error)
+{
+	struct crush_parser ps;
+	struct crush_map *map;
+	__u32 size;
+	int err, i;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.p = text;
+	ps.end = text + length;
+	ps.line = 1;
+	ps.line_start = text;
+	ps.error = error;
+
+	/* the buckets and rules are a fraction of the size of the text */
+	map = crush_create_arena_map(length / 4);
+	if (!map)
+		return -ENOMEM;
+	ps.map = map;
+
+	/*
+	 * A name is usually defined and used at least once on lines of
+	 * more than 32 bytes: size the table to not be rehashed.
+	 */
+	size = 1024;
+	while (size < length / 32 && size < 0x40000000)
+		size *= 2;
+	err = name_grow_table(&ps, size);
+	if (err == 0)
+		err = parse_grow(&ps.names, &ps.name_max, size / 2,
+				 sizeof(*ps.names));
+	if (err < 0)
+		goto out;
+
+	err = parse(&ps);
+	if (err < 0)
+		goto out;
+
+	crush_finalize(map);
+	if (ps.max_devices > map->max_devices)
+		map->max_devices = ps.max_devices;
+	if (weightsp) {
+		__u32 *weights = malloc(sizeof(*weights) * (map->max_devices + 1));
+		if (!weights) {
+			err = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < map->max_devices; i++)
+			weights[i] = i < ps.max_devices ? ps.weights[i] : 0x10000;
+		*weightsp = weights;
+	}
+	*mapp = map;
+	map = NULL;
+out:
+	if (err == -ENOMEM && error) {
+		error->line = ps.tok_line;
+		error->column = ps.tok_column;
+		snprintf(error->message, sizeof(error->message), "out of memory");
+	}
+	if (map)
+		crush_destroy(map);
+	crush_free(ps.names);
+	crush_free(ps.table);
+	crush_free(ps.weights);
+	crush_free(ps.declared);
+	crush_free(ps.items);
+	crush_free(ps.bucket_items);
+	crush_free(ps.bucket_weights);
+	crush_free(ps.steps);
+	return err;
+}
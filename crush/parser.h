@@ -0,0 +1,78 @@
+#ifndef CEPH_CRUSH_PARSER_H
+#define CEPH_CRUSH_PARSER_H
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * The location and description of the first error found by
+ * crush_parse_text().
+ */
+struct crush_parse_error {
+	int line;          /*!< 1 based line of the error */
+	int column;        /*!< 1 based column of the error */
+	char message[128]; /*!< what is wrong */
+};
+
+/** @ingroup API
+ *
+ * Compile the text crush map in the __length__ bytes at __text__
+ * into a new finalized crush_map, ready to be used with
+ * crush_do_rule(). The grammar is the one documented in
+ * crush/sample.txt, as produced by "crushtool -d":
+ *
+ *     # a comment
+ *     tunable choose_total_tries 50
+ *     device 0 osd.0 [class hdd] [down] [offload 0.5]
+ *     type 1 host
+ *     host host0 {
+ *             id -2               # optional
+ *             alg straw2          # uniform, list, tree, straw or straw2
+ *             hash 0              # optional, 0 or rjenkins1
+ *             item osd.0 weight 1.000 pos 0  # weight and pos are optional
+ *     }
+ *     rule replicated_rule {
+ *             id 0                # or ruleset or pool, optional
+ *             type replicated     # replicated, erasure or a number
+ *             min_size 1
+ *             max_size 10
+ *             step take host0
+ *             step chooseleaf firstn 0 type host
+ *             step emit
+ *     }
+ *
+ * The legacy syntax of crush/old_sample.txt, made of <types>,
+ * <devices>, <buckets> and <rules> sections, is not supported: its
+ * first section is rejected with an error that says so.
+ *
+ * Devices and buckets must be declared before they are used as an
+ * item. The weight of an item defaults to 1.0 for a device and to
+ * the weight of the bucket otherwise. The names and device classes
+ * are only used while compiling.
+ *
+ * The text is read once, names are looked up in a hash table and the
+ * buckets and rules are allocated from __map->arena__. The caller is
+ * responsible for deallocating the map with crush_destroy().
+ *
+ * If __weights__ is not NULL, it is set to a __malloc(3)__ array of
+ * __map->max_devices__ weights to be given to crush_do_rule(): 0 for
+ * a device marked down, 0x10000 minus the offload for the others. It
+ * is the responsibility of the caller to __free(3)__ it.
+ *
+ * - return -EINVAL if the text is not valid and describe the problem
+ *   in __error__ if it is not NULL
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param text the text crush map
+ * @param length the number of bytes in __text__
+ * @param[out] map the compiled crush_map
+ * @param[out] weights the device weights or NULL
+ * @param[out] error the first error or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_parse_text(const char *text, size_t length,
+			    struct crush_map **map, __u32 **weights,
+			    struct crush_parse_error *error);
+
+#endif
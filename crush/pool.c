@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "hash.h"
+#include "mapper.h"
+#include "pool.h"
+
+/* the mix of lookup2, the same as crush_hashmix() */
+#define crush_str_mix(a, b, c) do {			\
+		a = a-b;  a = a-c;  a = a^(c>>13);	\
+		b = b-c;  b = b-a;  b = b^(a<<8);	\
+		c = c-a;  c = c-b;  c = c^(b>>13);	\
+		a = a-b;  a = a-c;  a = a^(c>>12);	\
+		b = b-c;  b = b-a;  b = b^(a<<16);	\
+		c = c-a;  c = c-b;  c = c^(b>>5);	\
+		a = a-b;  a = a-c;  a = a^(c>>3);	\
+		b = b-c;  b = b-a;  b = b^(a<<10);	\
+		c = c-a;  c = c-b;  c = c^(b>>15);	\
+	} while (0)
+
+#define crush_str_le32(k) ((__u32)(k)[0] | ((__u32)(k)[1] << 8) |	\
+			   ((__u32)(k)[2] << 16) | ((__u32)(k)[3] << 24))
+
+#define CRUSH_STR_HASH_LANES 4
+
+/*
+ * Add the last __len__ < 12 bytes at __k__ and the __length__ of the
+ * whole string to the state before the final mix.
+ */
+#define crush_str_tail(k, len, length, a, b, c) do {	\
+		c += length;				\
+		switch (len) {				\
+		case 11:				\
+			c += (__u32)k[10] << 24;	\
+			/* fall through */		\
+		case 10:				\
+			c += (__u32)k[9] << 16;		\
+			/* fall through */		\
+		case 9:					\
+			/* the first byte of c is the length */	\
+			c += (__u32)k[8] << 8;		\
+			/* fall through */		\
+		case 8:					\
+			b += (__u32)k[7] << 24;		\
+			/* fall through */		\
+		case 7:					\
+			b += (__u32)k[6] << 16;		\
+			/* fall through */		\
+		case 6:					\
+			b += (__u32)k[5] << 8;		\
+			/* fall through */		\
+		case 5:					\
+			b += k[4];			\
+			/* fall through */		\
+		case 4:					\
+			a += (__u32)k[3] << 24;		\
+			/* fall through */		\
+		case 3:					\
+			a += (__u32)k[2] << 16;		\
+			/* fall through */		\
+		case 2:					\
+			a += (__u32)k[1] << 8;		\
+			/* fall through */		\
+		case 1:					\
+			a += k[0];			\
+		}					\
+	} while (0)
+
+/*
+ * Hash the bytes of __k__ left after the state __a__, __b__, __c__
+ * mixed the first ones, __length__ being the length of the whole
+ * string and __len__ what is left of it.
+ */
+static __u32 crush_str_hash_finish(const unsigned char *k, __u32 len,
+				   __u32 length, __u32 a, __u32 b, __u32 c)
+{
+	while (len >= 12) {
+		a += crush_str_le32(k);
+		b += crush_str_le32(k + 4);
+		c += crush_str_le32(k + 8);
+		crush_str_mix(a, b, c);
+		k += 12;
+		len -= 12;
+	}
+	crush_str_tail(k, len, length, a, b, c);
+	crush_str_mix(a, b, c);
+	return c;
+}
+
+__u32 crush_str_hash_rjenkins(const char *str, unsigned int length)
+{
+	/* the golden ratio, an arbitrary value */
+	return crush_str_hash_finish((const unsigned char *)str, length, length,
+				     0x9e3779b9, 0x9e3779b9, 0);
+}
+
+/* one lane per string, in a vector register where there is one */
+typedef __u32 crush_str_lanes __attribute__((vector_size(4 * CRUSH_STR_HASH_LANES)));
+
+void crush_str_hash_rjenkins_batch(const char *const *strs,
+				   const unsigned int *lengths,
+				   int count, __u32 *hashes)
+{
+	crush_str_lanes a, b, c, ka, kb, kc;
+	const unsigned char *k[CRUSH_STR_HASH_LANES];
+	__u32 blocks, offset;
+	int i, l;
+
+	for (i = 0; i + CRUSH_STR_HASH_LANES <= count; i += CRUSH_STR_HASH_LANES) {
+		blocks = lengths[i] / 12;
+		for (l = 0; l < CRUSH_STR_HASH_LANES; l++) {
+			k[l] = (const unsigned char *)strs[i + l];
+			a[l] = b[l] = 0x9e3779b9;
+			c[l] = 0;
+			if (lengths[i + l] / 12 < blocks)
+				blocks = lengths[i + l] / 12;
+		}
+		/* the blocks all the strings have, mixed side by side */
+		for (offset = 0; offset < blocks * 12; offset += 12) {
+			for (l = 0; l < CRUSH_STR_HASH_LANES; l++) {
+				ka[l] = crush_str_le32(k[l] + offset);
+				kb[l] = crush_str_le32(k[l] + offset + 4);
+				kc[l] = crush_str_le32(k[l] + offset + 8);
+			}
+			a += ka;
+			b += kb;
+			c += kc;
+			crush_str_mix(a, b, c);
+		}
+		for (l = 0; l < CRUSH_STR_HASH_LANES; l++)
+			if (lengths[i + l] - offset >= 12)
+				break;
+		if (l < CRUSH_STR_HASH_LANES) {
+			/* a string has more blocks than the others */
+			for (l = 0; l < CRUSH_STR_HASH_LANES; l++)
+				hashes[i + l] = crush_str_hash_finish(
+					k[l] + offset, lengths[i + l] - offset,
+					lengths[i + l], a[l], b[l], c[l]);
+			continue;
+		}
+		/* all the strings end in this block */
+		for (l = 0; l < CRUSH_STR_HASH_LANES; l++) {
+			const unsigned char *tail = k[l] + offset;
+			__u32 ta = 0, tb = 0, tc = 0;
+
+			crush_str_tail(tail, lengths[i + l] - offset, lengths[i + l],
+				       ta, tb, tc);
+			ka[l] = ta;
+			kb[l] = tb;
+			kc[l] = tc;
+		}
+		a += ka;
+		b += kb;
+		c += kc;
+		crush_str_mix(a, b, c);
+		for (l = 0; l < CRUSH_STR_HASH_LANES; l++)
+			hashes[i + l] = c[l];
+	}
+	for (; i < count; i++)
+		hashes[i] = crush_str_hash_rjenkins(strs[i], lengths[i]);
+}
+
+__u32 crush_pg_num_mask(__u32 pg_num)
+{
+	__u32 mask = 0;
+
+	while (mask < pg_num - 1 && mask != 0xffffffff)
+		mask = (mask << 1) | 1;
+	return pg_num ? mask : 0;
+}
+
+__u32 crush_pool_pg(const struct crush_pool *pool, __u32 hash)
+{
+	return crush_stable_mod(hash, pool->pg_num, crush_pg_num_mask(pool->pg_num));
+}
+
+/* the seed of the PG, before it is mixed with the pool */
+static __u32 crush_pool_seed(const struct crush_pool *pool, __u32 pgp_mask, __u32 ps)
+{
+	return crush_stable_mod(ps, pool->pgp_num, pgp_mask);
+}
+
+static __u32 crush_pool_seed_pps(const struct crush_pool *pool, __u32 seed)
+{
+	if (pool->hashpspool)
+		return crush_hash32_2(CRUSH_HASH_RJENKINS1, seed, pool->id);
+	return seed + pool->id;
+}
+
+__u32 crush_pool_pps(const struct crush_pool *pool, __u32 ps)
+{
+	return crush_pool_seed_pps(pool,
+		crush_pool_seed(pool, crush_pg_num_mask(pool->pgp_num), ps));
+}
+
+/*
+ * The placement of each seed is valid if its stamp is the generation
+ * of the cache: clearing the cache is a matter of incrementing it.
+ */
+struct crush_pg_cache {
+	struct crush_pool pool;
+	__u32 generation;
+	__u64 hits;
+	__u64 misses;
+	__u32 *stamps;		/* pgp_num */
+	int *lens;		/* pgp_num */
+	int *results;		/* pgp_num * size */
+};
+
+static int crush_pool_valid(const struct crush_pool *pool)
+{
+	return pool->pg_num > 0 && pool->pgp_num > 0 &&
+		pool->pgp_num <= pool->pg_num && pool->size > 0;
+}
+
+int crush_make_pg_cache(const struct crush_pool *pool,
+			struct crush_pg_cache **cachep)
+{
+	struct crush_pg_cache *cache;
+
+	if (!crush_pool_valid(pool))
+		return -EINVAL;
+	cache = crush_malloc(sizeof(*cache));
+	if (cache == NULL)
+		return -ENOMEM;
+	cache->pool = *pool;
+	cache->generation = 1;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->stamps = crush_calloc(pool->pgp_num, sizeof(*cache->stamps));
+	cache->lens = crush_malloc(pool->pgp_num * sizeof(*cache->lens));
+	cache->results = crush_malloc((size_t)pool->pgp_num * pool->size *
+				      sizeof(*cache->results));
+	if (cache->stamps == NULL || cache->lens == NULL || cache->results == NULL) {
+		crush_destroy_pg_cache(cache);
+		return -ENOMEM;
+	}
+	*cachep = cache;
+	return 0;
+}
+
+void crush_pg_cache_clear(struct crush_pg_cache *cache)
+{
+	if (++cache->generation == 0) {
+		memset(cache->stamps, 0, cache->pool.pgp_num * sizeof(*cache->stamps));
+		cache->generation = 1;
+	}
+}
+
+void crush_pg_cache_stats(const struct crush_pg_cache *cache,
+			  __u64 *hits, __u64 *misses)
+{
+	*hits = cache->hits;
+	*misses = cache->misses;
+}
+
+void crush_destroy_pg_cache(struct crush_pg_cache *cache)
+{
+	if (cache == NULL)
+		return;
+	crush_free(cache->stamps);
+	crush_free(cache->lens);
+	crush_free(cache->results);
+	crush_free(cache);
+}
+
+/* names are hashed this many at a time, on the stack */
+#define CRUSH_POOL_CHUNK 64
+
+int crush_map_objects(const struct crush_map *map,
+		      const struct crush_pool *pool,
+		      const char *const *names,
+		      const unsigned int *lengths, int count,
+		      __u32 *pgs, int *results, int *result_lens,
+		      const __u32 *weights, int weight_max, void *cwin,
+		      const struct crush_choose_arg *choose_args,
+		      struct crush_pg_cache *cache)
+{
+	__u32 hashes[CRUSH_POOL_CHUNK];
+	__u32 pg_mask = crush_pg_num_mask(pool->pg_num);
+	__u32 pgp_mask = crush_pg_num_mask(pool->pgp_num);
+	int size = pool->size;
+	int start, n, i;
+
+	if (count < 0 || pool->ruleno < 0 || (__u32)pool->ruleno >= map->max_rules ||
+	    map->rules[pool->ruleno] == NULL ||
+	    memcmp(pool, &cache->pool, sizeof(*pool)))
+		return -EINVAL;
+
+	for (start = 0; start < count; start += CRUSH_POOL_CHUNK) {
+		n = count - start < CRUSH_POOL_CHUNK ? count - start : CRUSH_POOL_CHUNK;
+		crush_str_hash_rjenkins_batch(names + start, lengths + start, n, hashes);
+		for (i = 0; i < n; i++) {
+			int *result = results + (size_t)(start + i) * size;
+			__u32 seed = crush_pool_seed(pool, pgp_mask, hashes[i]);
+			int *cached = cache->results + (size_t)seed * size;
+
+			if (pgs)
+				pgs[start + i] = crush_stable_mod(hashes[i], pool->pg_num,
+								  pg_mask);
+			if (cache->stamps[seed] != cache->generation) {
+				cache->lens[seed] = crush_do_rule(
+					map, pool->ruleno,
+					crush_pool_seed_pps(pool, seed),
+					cached, size, weights, weight_max,
+					cwin, choose_args);
+				cache->stamps[seed] = cache->generation;
+				cache->misses++;
+			} else {
+				cache->hits++;
+			}
+			memcpy(result, cached, cache->lens[seed] * sizeof(*result));
+			result_lens[start + i] = cache->lens[seed];
+		}
+	}
+	return 0;
+}
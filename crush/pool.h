@@ -0,0 +1,184 @@
+#ifndef CEPH_CRUSH_POOL_H
+#define CEPH_CRUSH_POOL_H
+
+#include "crush.h"
+
+/*
+ * Ceph places an object in three steps: the name of the object is
+ * hashed with ceph_str_hash_rjenkins(), the hash is reduced with
+ * ceph_stable_mod() to one of the placement groups (PG) of its pool
+ * and the PG is mapped with crush_do_rule(). The functions below do
+ * the first two steps the same way and crush_map_objects() chains the
+ * three for an array of names, mapping each PG once.
+ */
+
+/** @ingroup API
+ *
+ * A pool as seen by the placement of its objects.
+ */
+struct crush_pool {
+	int id;		/*!< the pool id, mixed with the PG */
+	int ruleno;	/*!< the rule mapping the PGs */
+	int size;	/*!< the number of items of each PG, the __result_max__ */
+	__u32 pg_num;	/*!< the number of PGs, > 0 */
+	__u32 pgp_num;	/*!< the number of PGs placed differently, in [1, __pg_num__] */
+	int hashpspool;	/*!< non zero to hash the PG with the pool id (FLAG_HASHPSPOOL) */
+};
+
+/** @ingroup API
+ *
+ * Hash the __length__ bytes of __str__ like
+ * ceph_str_hash_rjenkins(), which is Bob Jenkins' lookup2 hash.
+ *
+ * @param str the bytes to hash, not necessarily null terminated
+ * @param length the number of bytes
+ *
+ * @returns the hash
+ */
+extern __u32 crush_str_hash_rjenkins(const char *str, unsigned int length);
+
+/** @ingroup API
+ *
+ * Set __hashes[i]__ to crush_str_hash_rjenkins(__strs[i]__,
+ * __lengths[i]__) for each of the __count__ strings. Four strings are
+ * hashed at a time in the lanes of a vector, which is worth it when
+ * they have the same number of 12 bytes blocks, as object names of a
+ * pool usually do: the others are finished one at a time.
+ *
+ * @param strs the strings to hash
+ * @param lengths the length of each string
+ * @param count the number of strings
+ * @param[out] hashes the hash of each string
+ */
+extern void crush_str_hash_rjenkins_batch(const char *const *strs,
+					  const unsigned int *lengths,
+					  int count, __u32 *hashes);
+
+/** @ingroup API
+ *
+ * Reduce __x__ to [0, __b__[ like ceph_stable_mod(), so that few
+ * values move when __b__ grows. __bmask__ must be
+ * crush_pg_num_mask(__b__).
+ */
+static inline __u32 crush_stable_mod(__u32 x, __u32 b, __u32 bmask)
+{
+	if ((x & bmask) < b)
+		return x & bmask;
+	else
+		return x & (bmask >> 1);
+}
+
+/** @ingroup API
+ *
+ * Return the smallest 2^n - 1 >= __pg_num__ - 1, the mask to give
+ * crush_stable_mod() with __pg_num__.
+ */
+extern __u32 crush_pg_num_mask(__u32 pg_num);
+
+/** @ingroup API
+ *
+ * Return the PG of __pool__ an object whose name hashes to __hash__
+ * belongs to.
+ */
+extern __u32 crush_pool_pg(const struct crush_pool *pool, __u32 hash);
+
+/** @ingroup API
+ *
+ * Return the value to give crush_do_rule() to map the PG __ps__ of
+ * __pool__, the placement seed of Ceph. Two PGs with the same value
+ * are always placed together.
+ */
+extern __u32 crush_pool_pps(const struct crush_pool *pool, __u32 ps);
+
+/** @ingroup API
+ *
+ * Opaque cache of the placement of the PGs of a pool.
+ */
+struct crush_pg_cache;
+
+/** @ingroup API
+ *
+ * Allocate an empty cache for the placement of the PGs of __pool__,
+ * with room for each of its __pgp_num__ placement seeds. It must be
+ * released with crush_destroy_pg_cache().
+ *
+ * - return -EINVAL if __pool__ does not have valid __pg_num__,
+ *   __pgp_num__ and __size__
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param pool the pool
+ * @param[out] cache the new cache
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_make_pg_cache(const struct crush_pool *pool,
+			       struct crush_pg_cache **cache);
+
+/** @ingroup API
+ *
+ * Forget the placements of __cache__, in constant time. It must be
+ * called when the map, the weights or the choose_args change.
+ */
+extern void crush_pg_cache_clear(struct crush_pg_cache *cache);
+
+/** @ingroup API
+ *
+ * Get the number of placements found in __cache__ and of placements
+ * computed and added to it since it was created.
+ *
+ * @param cache the cache
+ * @param[out] hits the placements found
+ * @param[out] misses the placements computed
+ */
+extern void crush_pg_cache_stats(const struct crush_pg_cache *cache,
+				 __u64 *hits, __u64 *misses);
+
+/** @ingroup API
+ *
+ * Release a cache allocated by crush_make_pg_cache().
+ */
+extern void crush_destroy_pg_cache(struct crush_pg_cache *cache);
+
+/** @ingroup API
+ *
+ * Place each of the __count__ objects named __names[i]__ in __pool__:
+ * hash the name with crush_str_hash_rjenkins_batch(), find its PG
+ * with crush_pool_pg() and map it with crush_do_rule() and
+ * crush_pool_pps(), unless the placement of a PG with the same seed
+ * is in __cache__. The names are bytes hashed as is: a namespace or a
+ * locator key must be prepended by the caller as Ceph does.
+ *
+ * The items of the object at index __i__ are stored in
+ * __results[i * pool->size]__ to __results[i * pool->size +
+ * pool->size - 1]__ and their number in __result_lens[i]__.
+ *
+ * - return -EINVAL if __count__ is negative, the rule of __pool__
+ *   does not exist or __cache__ was made for another pool
+ *
+ * @param map the crush_map, after crush_finalize()
+ * @param pool the pool of the objects
+ * @param names the names of the objects
+ * @param lengths the length of each name
+ * @param count the number of objects
+ * @param[out] pgs the PG of each object or NULL
+ * @param[out] results an array of __count * pool->size__ items
+ * @param[out] result_lens an array of __count__ result sizes
+ * @param weights as in crush_do_rule()
+ * @param weight_max the size of the __weights__ array
+ * @param cwin a workspace of crush_work_size(__map__, __pool->size__)
+ *             bytes initialized by crush_init_workspace()
+ * @param choose_args as in crush_do_rule(), may be NULL
+ * @param cache the placements already known, updated
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_objects(const struct crush_map *map,
+			     const struct crush_pool *pool,
+			     const char *const *names,
+			     const unsigned int *lengths, int count,
+			     __u32 *pgs, int *results, int *result_lens,
+			     const __u32 *weights, int weight_max, void *cwin,
+			     const struct crush_choose_arg *choose_args,
+			     struct crush_pg_cache *cache);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef CEPH_CRUSH_PROBES_H
+#define CEPH_CRUSH_PROBES_H
+
+/*
+ * USDT probes of the libcrush provider, for perf, bpftrace or
+ * SystemTap. They are compiled in when <sys/sdt.h> is found and
+ * libcrush is configured with -DWITH_USDT=ON (the default). A probe
+ * that no tracer is attached to is a single nop; see
+ * tools/bpftrace for examples.
+ *
+ *   do_rule_entry(ruleno, x, result_max)
+ *   do_rule_return(ruleno, x, result_len)
+ *   bucket_choose(bucket id, bucket alg, r, item chosen)
+ *   retry(bucket id, item rejected, failures so far, CRUSH_TRACE_RETRY_*)
+ *   finalize_entry(max_buckets)
+ *   finalize_return(max_buckets, max_devices, working_size)
+ */
+
+#include "acconfig.h"
+
+#ifdef CRUSH_USDT
+# include <sys/sdt.h>
+# define CRUSH_PROBE1(name, a) DTRACE_PROBE1(libcrush, name, a)
+# define CRUSH_PROBE3(name, a, b, c) DTRACE_PROBE3(libcrush, name, a, b, c)
+# define CRUSH_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libcrush, name, a, b, c, d)
+#else
+# define CRUSH_PROBE1(name, a) do { } while (0)
+# define CRUSH_PROBE3(name, a, b, c) do { } while (0)
+# define CRUSH_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
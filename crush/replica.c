@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "crush_compat.h"
+#include "hugepage.h"
+#include "replica.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define CRUSH_REPLICAS_SYSFS "/sys/devices/system/node"
+
+/* the copies made by one crush_replicas_publish() */
+struct crush_replica_set {
+	int nodes;
+	void *copies[CRUSH_REPLICAS_MAX_NODES];
+	size_t mapped[CRUSH_REPLICAS_MAX_NODES];
+};
+
+struct crush_replicas {
+	int nodes;
+	int cpus;
+	__s32 *cpu_node;		/* node of each cpu, cpus entries */
+	struct crush_handle *handle;	/* of the current crush_replica_set */
+};
+
+/*
+ * Parse a sysfs list such as "0-3,8-11" and set ids[i] to value for
+ * each i listed and < max. Return the largest i listed + 1 or -errno.
+ */
+static int crush_replicas_read_list(const char *path, __s32 *ids, int max,
+				    int value)
+{
+	FILE *f;
+	int first, last, i, end = 0;
+	char sep;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+	while (fscanf(f, "%d", &first) == 1) {
+		last = first;
+		sep = fgetc(f);
+		if (sep == '-') {
+			if (fscanf(f, "%d", &last) != 1)
+				break;
+			sep = fgetc(f);
+		}
+		for (i = first; i <= last && i < max; i++)
+			ids[i] = value;
+		if (last + 1 > end)
+			end = last + 1;
+		if (sep != ',')
+			break;
+	}
+	fclose(f);
+	return end;
+}
+
+int crush_replicas_create(int nodes, int max_readers,
+			  struct crush_replicas **replicas)
+{
+	struct crush_replicas *r;
+	char path[64];
+	int node, err;
+
+	if (nodes < 0 || nodes > CRUSH_REPLICAS_MAX_NODES || max_readers < 1)
+		return -EINVAL;
+	if (nodes == 0) {
+		nodes = crush_replicas_read_list(CRUSH_REPLICAS_SYSFS "/online",
+						 NULL, 0, 0);
+		if (nodes <= 0)
+			nodes = 1;
+		if (nodes > CRUSH_REPLICAS_MAX_NODES)
+			nodes = CRUSH_REPLICAS_MAX_NODES;
+	}
+	r = crush_calloc(1, sizeof(*r));
+	if (r == NULL)
+		return -ENOMEM;
+	r->nodes = nodes;
+	r->cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (r->cpus < 1)
+		r->cpus = 1;
+	r->cpu_node = crush_calloc(r->cpus, sizeof(*r->cpu_node));
+	if (r->cpu_node == NULL) {
+		crush_free(r);
+		return -ENOMEM;
+	}
+	err = crush_handle_create(max_readers, &r->handle);
+	if (err < 0) {
+		crush_free(r->cpu_node);
+		crush_free(r);
+		return err;
+	}
+	/* cpus of nodes beyond the ones replicated stay on node 0 */
+	for (node = 1; node < nodes; node++) {
+		snprintf(path, sizeof(path), CRUSH_REPLICAS_SYSFS "/node%d/cpulist", node);
+		crush_replicas_read_list(path, r->cpu_node, r->cpus, node);
+	}
+	*replicas = r;
+	return 0;
+}
+
+/*
+ * Map __*size__ bytes whose pages will be allocated on __node__ when
+ * first written to. Huge pages are used if crush_set_hugepages()
+ * allows and otherwise whole pages so that mbind(2) applies to the
+ * mapping only.
+ */
+static void *crush_replicas_map(const struct crush_replicas *r, int node,
+				size_t *size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t length = *size;
+	void *p;
+
+	p = crush_hugepage_alloc(&length, NULL);
+	if (p == NULL) {
+		length = (*size + page - 1) & ~(page - 1);
+		p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+	}
+#ifdef SYS_mbind
+	if (r->nodes > 1) {
+		unsigned long mask = 1UL << node;
+		/* best effort: without NUMA the copy lands anywhere */
+		syscall(SYS_mbind, p, length, MPOL_PREFERRED, &mask,
+			sizeof(mask) * 8 + 1, 0);
+	}
+#endif
+	*size = length;
+	return p;
+}
+
+/* unmap the copies of __set__ and release it, as crush_handle_reclaim() does */
+static void crush_replicas_unmap(void *object)
+{
+	struct crush_replica_set *set = object;
+	int node;
+
+	for (node = 0; node < set->nodes; node++)
+		if (set->copies[node])
+			munmap(set->copies[node], set->mapped[node]);
+	crush_free(set);
+}
+
+int crush_replicas_publish(struct crush_replicas *r, const struct crush_map *map)
+{
+	struct crush_replica_set *set;
+	void *image;
+	size_t length;
+	int node, err;
+
+	set = crush_calloc(1, sizeof(*set));
+	if (set == NULL)
+		return -ENOMEM;
+	err = crush_freeze(map, &image, &length);
+	if (err < 0) {
+		crush_free(set);
+		return err;
+	}
+	for (node = 0; node < r->nodes; node++) {
+		set->mapped[node] = length;
+		set->copies[node] = crush_replicas_map(r, node, &set->mapped[node]);
+		set->nodes = node + 1;
+		if (set->copies[node] == NULL) {
+			crush_replicas_unmap(set);
+			free(image);
+			return -ENOMEM;
+		}
+		memcpy(set->copies[node], image, length);
+	}
+	free(image);
+
+	err = crush_handle_publish_object(r->handle, set, crush_replicas_unmap, NULL);
+	if (err < 0)
+		crush_replicas_unmap(set);
+	return err;
+}
+
+int crush_replicas_register(struct crush_replicas *r, struct crush_reader **reader)
+{
+	return crush_handle_register(r->handle, reader);
+}
+
+void crush_replicas_unregister(struct crush_reader *reader)
+{
+	crush_handle_unregister(reader);
+}
+
+int crush_replicas_current_node(const struct crush_replicas *r)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0 || cpu >= r->cpus)
+		return 0;
+	return r->cpu_node[cpu];
+}
+
+const struct crush_frozen_map *crush_replicas_node(struct crush_replicas *r,
+						   struct crush_reader *reader,
+						   int node)
+{
+	const struct crush_replica_set *set = crush_handle_pin_object(reader, NULL);
+
+	if (set == NULL || node < 0 || node >= set->nodes)
+		return NULL;
+	return set->copies[node];
+}
+
+const struct crush_frozen_map *crush_replicas_local(struct crush_replicas *r,
+						    struct crush_reader *reader)
+{
+	return crush_replicas_node(r, reader, crush_replicas_current_node(r));
+}
+
+void crush_replicas_unpin(struct crush_reader *reader)
+{
+	crush_handle_unpin(reader);
+}
+
+int crush_replicas_nodes(const struct crush_replicas *r)
+{
+	return r->nodes;
+}
+
+void crush_replicas_destroy(struct crush_replicas *r)
+{
+	if (r == NULL)
+		return;
+	crush_handle_destroy(r->handle);
+	crush_free(r->cpu_node);
+	crush_free(r);
+}
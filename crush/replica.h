@@ -0,0 +1,158 @@
+#ifndef CEPH_CRUSH_REPLICA_H
+#define CEPH_CRUSH_REPLICA_H
+
+#include "frozen.h"
+#include "epoch.h"
+
+/*
+ * On a machine with several NUMA nodes, a thread mapping with a
+ * crush_map allocated on another node reads every bucket over the
+ * interconnect. A crush_replicas holds one frozen copy of the map
+ * (see crush_freeze()) in the memory of each node and gives every
+ * thread the copy of the node it runs on.
+ *
+ * The copies replaced by a publish are released as the maps of a
+ * crush_handle are (see epoch.h): each thread registers a reader,
+ * pins the copy it maps with and unpins it when done, and the
+ * copies are unmapped once no reader can still hold them.
+ */
+
+/** @ingroup API
+ * The largest number of NUMA nodes a crush_replicas can span.
+ */
+#define CRUSH_REPLICAS_MAX_NODES 64
+
+/** @ingroup API
+ *
+ * Opaque set of per NUMA node copies of a map.
+ */
+struct crush_replicas;
+
+/** @ingroup API
+ *
+ * Create an empty set of replicas for __nodes__ NUMA nodes, or for
+ * all the nodes of the machine as listed in
+ * __/sys/devices/system/node__ if __nodes__ is 0. If the machine does
+ * not expose NUMA nodes, there is a single node and a single copy.
+ * The replicas must be released with crush_replicas_destroy().
+ *
+ * - return -EINVAL if __nodes__ is < 0 or > ::CRUSH_REPLICAS_MAX_NODES
+ * - return -EINVAL if __max_readers__ < 1
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param nodes the number of nodes or 0
+ * @param max_readers the largest number of readers registered at once
+ * @param[out] replicas the new replicas
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_replicas_create(int nodes, int max_readers,
+				 struct crush_replicas **replicas);
+
+/** @ingroup API
+ *
+ * Register a reader of __replicas__, typically once per thread. The
+ * reader must be released with crush_replicas_unregister().
+ *
+ * - return -EBUSY if __max_readers__ readers are already registered
+ *
+ * @param replicas the replicas
+ * @param[out] reader the new reader
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_replicas_register(struct crush_replicas *replicas,
+				   struct crush_reader **reader);
+
+/** @ingroup API
+ *
+ * Release a __reader__ that does not have a copy pinned.
+ */
+extern void crush_replicas_unregister(struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Freeze __map__ once and copy the image in the memory of each node,
+ * placed with __mbind(2)__ and in huge pages as set with
+ * crush_set_hugepages(). When all copies are ready, they replace the
+ * previous ones for the threads calling crush_replicas_local() or
+ * crush_replicas_node() from then on.
+ *
+ * The copies replaced are unmapped by this or a later call once
+ * every reader that pinned them called crush_replicas_unpin(). Calls
+ * to crush_replicas_publish() are serialized. The __map__ is not
+ * referenced after the function returns.
+ *
+ * - return the errors of crush_freeze()
+ * - return -ENOMEM if a copy cannot be mapped or memory allocation fails
+ *
+ * @param replicas the replicas to update
+ * @param map the crush_map, finalized with crush_finalize()
+ *
+ * @returns 0 on success, < 0 on error and the previous copies remain
+ */
+extern int crush_replicas_publish(struct crush_replicas *replicas,
+				  const struct crush_map *map);
+
+/** @ingroup API
+ *
+ * Pin the current copies with __reader__ and return the one in the
+ * memory of the node of the CPU the calling thread is running on, or
+ * NULL if no map was published. The copy remains valid until
+ * crush_replicas_unpin(), even if the thread is migrated to another
+ * node, only further away, or another map is published. Pins do not
+ * nest, as with crush_handle_pin().
+ *
+ * @param replicas the replicas
+ * @param reader a reader of __replicas__
+ *
+ * @returns the frozen map to be used with crush_frozen_do_rule()
+ */
+extern const struct crush_frozen_map *crush_replicas_local(struct crush_replicas *replicas,
+							   struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Same as crush_replicas_local() for the copy in the memory of
+ * __node__, or NULL if no map was published or the node does not
+ * exist.
+ *
+ * @param replicas the replicas
+ * @param reader a reader of __replicas__
+ * @param node the NUMA node
+ *
+ * @returns the frozen map to be used with crush_frozen_do_rule()
+ */
+extern const struct crush_frozen_map *crush_replicas_node(struct crush_replicas *replicas,
+							  struct crush_reader *reader,
+							  int node);
+
+/** @ingroup API
+ *
+ * Release the copies pinned by crush_replicas_local() or
+ * crush_replicas_node(). The reader must not use them afterwards.
+ */
+extern void crush_replicas_unpin(struct crush_reader *reader);
+
+/** @ingroup API
+ *
+ * Return the number of nodes, and of copies, of __replicas__.
+ */
+extern int crush_replicas_nodes(const struct crush_replicas *replicas);
+
+/** @ingroup API
+ *
+ * Return the node of the CPU the calling thread is running on, as
+ * used by crush_replicas_local().
+ */
+extern int crush_replicas_current_node(const struct crush_replicas *replicas);
+
+/** @ingroup API
+ *
+ * Release the replicas and all copies of the map. No reader may have
+ * a copy pinned; the readers that are still registered are released
+ * as well.
+ */
+extern void crush_replicas_destroy(struct crush_replicas *replicas);
+
+#endif
@@ -0,0 +1,574 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "batch.h"
+#include "builder.h"
+#include "reverse.h"
+
+/* fewer values are not worth a thread of their own */
+#define CRUSH_REVERSE_CHUNK 4096
+
+/* the room left after the __size__ entries of an item */
+#define CRUSH_REVERSE_SLACK(size) ((size) / 8 + 2)
+
+/*
+ * The entries of the item with key __k__ are __entries[offsets[k]]__
+ * to __entries[offsets[k] + sizes[k] - 1]__, with room for them to
+ * grow up to __entries[offsets[k + 1] - 1]__. The key of device __d__
+ * is __d__ and the key of bucket __b__ is __max_devices - 1 - b__.
+ */
+struct crush_reverse_index {
+	int x_start;
+	int count;
+	int result_max;
+	int flags;
+	int num_threads;
+	int max_devices;
+	int max_buckets;
+	int *results;		/* count * result_max */
+	int *result_lens;	/* count */
+	size_t *offsets;	/* keys + 1 */
+	__u32 *sizes;		/* keys */
+	struct crush_reverse_entry *entries;
+};
+
+struct crush_reverse_job {
+	const struct crush_map *map;
+	struct crush_reverse_index *index;
+	int num_threads;
+	int chunk;		/* values of each thread */
+	size_t *cursors;	/* num_threads * keys entries counted or stored */
+	int error;
+};
+
+struct crush_reverse_thread {
+	struct crush_reverse_job *job;
+	int t;
+	void (*run)(struct crush_reverse_job *job, int t);
+	pthread_t thread;
+};
+
+static inline int reverse_keys(const struct crush_reverse_index *index)
+{
+	return index->max_devices + index->max_buckets;
+}
+
+static inline int reverse_key(const struct crush_reverse_index *index, int item)
+{
+	return item >= 0 ? item : index->max_devices - 1 - item;
+}
+
+static int reverse_valid_item(const struct crush_map *map,
+			      const struct crush_reverse_index *index, int item)
+{
+	if (item == CRUSH_ITEM_NONE)
+		return 1;
+	if (item >= 0)
+		return item < index->max_devices;
+	return -1 - item < index->max_buckets && map->buckets[-1 - item];
+}
+
+static int reverse_valid_row(const struct crush_map *map,
+			     const struct crush_reverse_index *index,
+			     const int *result, int len)
+{
+	int j;
+
+	if (len < 0 || len > index->result_max)
+		return 0;
+	for (j = 0; j < len; j++)
+		if (!reverse_valid_item(map, index, result[j]))
+			return 0;
+	return 1;
+}
+
+/* the next item whose entries include those of __id__, if any */
+static inline int reverse_next(const struct crush_map *map,
+			       const struct crush_reverse_index *index, int id)
+{
+	if (!(index->flags & CRUSH_REVERSE_ANCESTORS))
+		return CRUSH_PARENT_NONE;
+	return crush_get_parent(map, id);
+}
+
+/* the range of values of thread __t__ */
+static void reverse_range(const struct crush_reverse_job *job, int t,
+			  int *start, int *end)
+{
+	*start = t * job->chunk;
+	*end = *start + job->chunk;
+	if (*end > job->index->count)
+		*end = job->index->count;
+}
+
+static void reverse_count(struct crush_reverse_job *job, int t)
+{
+	const struct crush_reverse_index *index = job->index;
+	size_t *counts = job->cursors + (size_t)t * reverse_keys(index);
+	int start, end, i, j, id;
+
+	reverse_range(job, t, &start, &end);
+	for (i = start; i < end; i++) {
+		const int *result = index->results + (size_t)i * index->result_max;
+
+		if (!reverse_valid_row(job->map, index, result, index->result_lens[i])) {
+			job->error = -EINVAL;
+			return;
+		}
+		for (j = 0; j < index->result_lens[i]; j++) {
+			if (result[j] == CRUSH_ITEM_NONE)
+				continue;
+			id = result[j];
+			do {
+				counts[reverse_key(index, id)]++;
+				id = reverse_next(job->map, index, id);
+			} while (id < 0);
+		}
+	}
+}
+
+static void reverse_fill(struct crush_reverse_job *job, int t)
+{
+	struct crush_reverse_index *index = job->index;
+	size_t *cursors = job->cursors + (size_t)t * reverse_keys(index);
+	int start, end, i, j, id;
+
+	reverse_range(job, t, &start, &end);
+	for (i = start; i < end; i++) {
+		const int *result = index->results + (size_t)i * index->result_max;
+
+		for (j = 0; j < index->result_lens[i]; j++) {
+			if (result[j] == CRUSH_ITEM_NONE)
+				continue;
+			id = result[j];
+			do {
+				struct crush_reverse_entry *e =
+					&index->entries[cursors[reverse_key(index, id)]++];
+				e->x = index->x_start + i;
+				e->position = j;
+				id = reverse_next(job->map, index, id);
+			} while (id < 0);
+		}
+	}
+}
+
+static void *reverse_thread(void *arg)
+{
+	struct crush_reverse_thread *thread = arg;
+
+	thread->run(thread->job, thread->t);
+	return NULL;
+}
+
+/*
+ * Run __run__ for each range of values, in threads if there are
+ * several. The ranges of the threads that cannot be created are run
+ * by the caller.
+ */
+static int reverse_run(struct crush_reverse_job *job,
+		       void (*run)(struct crush_reverse_job *job, int t))
+{
+	struct crush_reverse_thread *threads;
+	int t;
+
+	if (job->num_threads == 1) {
+		run(job, 0);
+		return 0;
+	}
+	threads = crush_malloc(sizeof(*threads) * job->num_threads);
+	if (!threads)
+		return -ENOMEM;
+	for (t = 1; t < job->num_threads; t++) {
+		threads[t].job = job;
+		threads[t].t = t;
+		threads[t].run = run;
+		if (pthread_create(&threads[t].thread, NULL, reverse_thread,
+				   &threads[t]))
+			threads[t].job = NULL;
+	}
+	run(job, 0);
+	for (t = 1; t < job->num_threads; t++) {
+		if (threads[t].job)
+			pthread_join(threads[t].thread, NULL);
+		else
+			run(job, t);
+	}
+	crush_free(threads);
+	return 0;
+}
+
+/*
+ * Allocate and fill the entries of the results of __index__: count
+ * the entries of each item in each range, give each item its room
+ * and each range its place in it, then store the entries.
+ */
+static int reverse_build(const struct crush_map *map,
+			 struct crush_reverse_index *index)
+{
+	struct crush_reverse_job job;
+	int keys = reverse_keys(index);
+	size_t pos, size;
+	int k, t, err;
+
+	job.map = map;
+	job.index = index;
+	job.num_threads = index->num_threads;
+	if (job.num_threads > (index->count + CRUSH_REVERSE_CHUNK - 1) / CRUSH_REVERSE_CHUNK)
+		job.num_threads = (index->count + CRUSH_REVERSE_CHUNK - 1) / CRUSH_REVERSE_CHUNK;
+	if (job.num_threads < 1)
+		job.num_threads = 1;
+	job.chunk = (index->count + job.num_threads - 1) / job.num_threads;
+	job.error = 0;
+	job.cursors = crush_calloc((size_t)job.num_threads * keys + 1,
+				   sizeof(*job.cursors));
+	index->offsets = crush_malloc((keys + 1) * sizeof(*index->offsets));
+	index->sizes = crush_malloc((keys + 1) * sizeof(*index->sizes));
+	index->entries = NULL;
+	err = -ENOMEM;
+	if (!job.cursors || !index->offsets || !index->sizes)
+		goto out;
+
+	err = reverse_run(&job, reverse_count);
+	if (err == 0)
+		err = job.error;
+	if (err < 0)
+		goto out;
+
+	for (k = 0, pos = 0; k < keys; k++) {
+		index->offsets[k] = pos;
+		for (t = 0; t < job.num_threads; t++) {
+			size = job.cursors[(size_t)t * keys + k];
+			job.cursors[(size_t)t * keys + k] = pos;
+			pos += size;
+		}
+		index->sizes[k] = pos - index->offsets[k];
+		pos += CRUSH_REVERSE_SLACK(index->sizes[k]);
+	}
+	index->offsets[keys] = pos;
+	index->entries = crush_malloc((pos + 1) * sizeof(*index->entries));
+	err = -ENOMEM;
+	if (!index->entries)
+		goto out;
+	err = reverse_run(&job, reverse_fill);
+out:
+	crush_free(job.cursors);
+	if (err < 0) {
+		crush_free(index->offsets);
+		crush_free(index->sizes);
+		crush_free(index->entries);
+		index->offsets = NULL;
+		index->sizes = NULL;
+		index->entries = NULL;
+	}
+	return err;
+}
+
+int crush_make_reverse_index(const struct crush_map *map,
+			     const int *results, const int *result_lens,
+			     int result_max, int x_start, int count,
+			     int flags, int num_threads,
+			     struct crush_reverse_index **indexp)
+{
+	struct crush_reverse_index *index;
+	int err;
+
+	if (count < 0 || result_max < 0)
+		return -EINVAL;
+	if ((flags & CRUSH_REVERSE_ANCESTORS) && map->parents == NULL)
+		return -ENOENT;
+	index = crush_calloc(1, sizeof(*index));
+	if (!index)
+		return -ENOMEM;
+	index->x_start = x_start;
+	index->count = count;
+	index->result_max = result_max;
+	index->flags = flags;
+	index->num_threads = num_threads > 0 ? num_threads : crush_batch_default_threads();
+	index->max_devices = map->max_devices;
+	index->max_buckets = map->max_buckets;
+	index->results = crush_malloc(((size_t)count * result_max + 1) * sizeof(*results));
+	index->result_lens = crush_malloc(((size_t)count + 1) * sizeof(*result_lens));
+	err = -ENOMEM;
+	if (index->results && index->result_lens) {
+		memcpy(index->results, results, (size_t)count * result_max * sizeof(*results));
+		memcpy(index->result_lens, result_lens, (size_t)count * sizeof(*result_lens));
+		err = reverse_build(map, index);
+	}
+	if (err < 0) {
+		crush_destroy_reverse_index(index);
+		return err;
+	}
+	*indexp = index;
+	return 0;
+}
+
+int crush_reverse_index_get(const struct crush_reverse_index *index,
+			    int item,
+			    const struct crush_reverse_entry **entries)
+{
+	int k;
+
+	if (item >= index->max_devices || item < -index->max_buckets)
+		return -ENOENT;
+	k = reverse_key(index, item);
+	*entries = index->entries + index->offsets[k];
+	return index->sizes[k];
+}
+
+/* the first entry of key __k__ that is not before __x__, __position__ */
+static size_t reverse_find(const struct crush_reverse_index *index, int k,
+			   int x, int position)
+{
+	size_t lo = index->offsets[k], hi = lo + index->sizes[k];
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct crush_reverse_entry *e = &index->entries[mid];
+		if (e->x < x || (e->x == x && e->position < position))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* whether each key of __id__ has an entry for __x__, __position__ */
+static int reverse_has_entries(const struct crush_map *map,
+			       const struct crush_reverse_index *index,
+			       int id, int x, int position)
+{
+	const struct crush_reverse_entry *e;
+	size_t end;
+	int k;
+
+	do {
+		k = reverse_key(index, id);
+		e = &index->entries[reverse_find(index, k, x, position)];
+		end = index->offsets[k] + index->sizes[k];
+		if (e == &index->entries[end] || e->x != x || e->position != position)
+			return 0;
+		id = reverse_next(map, index, id);
+	} while (id < 0);
+	return 1;
+}
+
+static void reverse_remove(const struct crush_map *map,
+			   struct crush_reverse_index *index,
+			   int id, int x, int position)
+{
+	size_t e, end;
+	int k;
+
+	do {
+		k = reverse_key(index, id);
+		e = reverse_find(index, k, x, position);
+		end = index->offsets[k] + index->sizes[k];
+		memmove(&index->entries[e], &index->entries[e + 1],
+			(end - e - 1) * sizeof(*index->entries));
+		index->sizes[k]--;
+		id = reverse_next(map, index, id);
+	} while (id < 0);
+}
+
+static void reverse_insert(const struct crush_map *map,
+			   struct crush_reverse_index *index,
+			   int id, int x, int position)
+{
+	size_t e, end;
+	int k;
+
+	do {
+		k = reverse_key(index, id);
+		e = reverse_find(index, k, x, position);
+		end = index->offsets[k] + index->sizes[k];
+		memmove(&index->entries[e + 1], &index->entries[e],
+			(end - e) * sizeof(*index->entries));
+		index->entries[e].x = x;
+		index->entries[e].position = position;
+		index->sizes[k]++;
+		id = reverse_next(map, index, id);
+	} while (id < 0);
+}
+
+/* add __delta__ to the number of entries of the keys of __id__ */
+static void reverse_account(const struct crush_map *map,
+			    const struct crush_reverse_index *index,
+			    long *deltas, int id, int delta)
+{
+	if (id == CRUSH_ITEM_NONE)
+		return;
+	do {
+		deltas[reverse_key(index, id)] += delta;
+		id = reverse_next(map, index, id);
+	} while (id < 0);
+}
+
+/* remove the entries of the value at __i__ that __result__ does not keep */
+static void reverse_unlink(const struct crush_map *map,
+			   struct crush_reverse_index *index, int i,
+			   const int *result, int len)
+{
+	const int *old = index->results + (size_t)i * index->result_max;
+	int old_len = index->result_lens[i];
+	int x = index->x_start + i, j;
+
+	for (j = 0; j < old_len; j++)
+		if (old[j] != CRUSH_ITEM_NONE && (j >= len || old[j] != result[j]))
+			reverse_remove(map, index, old[j], x, j);
+}
+
+/*
+ * Replace the result of the value at __i__ and insert its new
+ * entries, once reverse_unlink() removed the old ones.
+ */
+static void reverse_replace(const struct crush_map *map,
+			    struct crush_reverse_index *index, int i,
+			    const int *result, int len, int move)
+{
+	int *old = index->results + (size_t)i * index->result_max;
+	int old_len = index->result_lens[i];
+	int x = index->x_start + i, j;
+
+	for (j = 0; move && j < len; j++)
+		if (result[j] != CRUSH_ITEM_NONE && (j >= old_len || old[j] != result[j]))
+			reverse_insert(map, index, result[j], x, j);
+	memcpy(old, result, len * sizeof(*result));
+	index->result_lens[i] = len;
+}
+
+/*
+ * Build the index again from a copy of its results with the new ones,
+ * so that it is left as it was if that fails.
+ */
+static int reverse_rebuild(const struct crush_map *map,
+			   struct crush_reverse_index *index,
+			   const int *xs, int count,
+			   const int *results, const int *result_lens)
+{
+	struct crush_reverse_index copy = *index;
+	size_t n = (size_t)index->count * index->result_max;
+	int u, err;
+
+	copy.results = crush_malloc((n + 1) * sizeof(*copy.results));
+	copy.result_lens = crush_malloc(((size_t)index->count + 1) *
+					sizeof(*copy.result_lens));
+	err = -ENOMEM;
+	if (copy.results && copy.result_lens) {
+		memcpy(copy.results, index->results, n * sizeof(*copy.results));
+		memcpy(copy.result_lens, index->result_lens,
+		       (size_t)index->count * sizeof(*copy.result_lens));
+		for (u = 0; u < count; u++)
+			reverse_replace(map, &copy, xs[u] - index->x_start,
+					results + (size_t)u * index->result_max,
+					result_lens[u], 0);
+		err = reverse_build(map, &copy);
+	}
+	if (err < 0) {
+		crush_free(copy.results);
+		crush_free(copy.result_lens);
+		return err;
+	}
+	crush_free(index->results);
+	crush_free(index->result_lens);
+	crush_free(index->offsets);
+	crush_free(index->sizes);
+	crush_free(index->entries);
+	*index = copy;
+	return 0;
+}
+
+int crush_reverse_index_update(const struct crush_map *map,
+			       struct crush_reverse_index *index,
+			       const int *xs, int count,
+			       const int *results, const int *result_lens)
+{
+	int keys = reverse_keys(index);
+	unsigned char *seen;
+	long *deltas;
+	int u, i, j, k, err = 0;
+
+	if (count < 0 || map->max_devices != index->max_devices ||
+	    map->max_buckets != index->max_buckets)
+		return -EINVAL;
+	if ((index->flags & CRUSH_REVERSE_ANCESTORS) && map->parents == NULL)
+		return -ENOENT;
+	seen = crush_calloc((size_t)index->count / 8 + 1, 1);
+	deltas = crush_calloc(keys + 1, sizeof(*deltas));
+	if (!seen || !deltas) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (u = 0; u < count && err == 0; u++) {
+		const int *result = results + (size_t)u * index->result_max;
+		const int *old;
+
+		if ((__s64)xs[u] < index->x_start ||
+		    (__s64)xs[u] - index->x_start >= index->count) {
+			err = -ENOENT;
+			break;
+		}
+		i = xs[u] - index->x_start;
+		if (seen[i / 8] & (1 << (i % 8)) ||
+		    !reverse_valid_row(map, index, result, result_lens[u])) {
+			err = -EINVAL;
+			break;
+		}
+		seen[i / 8] |= 1 << (i % 8);
+		old = index->results + (size_t)i * index->result_max;
+		for (j = 0; j < index->result_lens[i]; j++) {
+			/* the parents changed since the entries were stored */
+			if (old[j] != CRUSH_ITEM_NONE &&
+			    (j >= result_lens[u] || old[j] != result[j]) &&
+			    !reverse_has_entries(map, index, old[j], xs[u], j)) {
+				err = -EINVAL;
+				break;
+			}
+			reverse_account(map, index, deltas, old[j], -1);
+		}
+		for (j = 0; j < result_lens[u]; j++)
+			reverse_account(map, index, deltas, result[j], 1);
+	}
+	if (err < 0)
+		goto out;
+
+	for (k = 0; k < keys; k++)
+		if (deltas[k] > 0 &&
+		    (size_t)(index->sizes[k] + deltas[k]) >
+		    index->offsets[k + 1] - index->offsets[k])
+			break;
+	if (k < keys) {
+		err = reverse_rebuild(map, index, xs, count, results, result_lens);
+		goto out;
+	}
+	/*
+	 * The room was checked for the net number of entries of each
+	 * key: all the entries leaving a key must be removed before any
+	 * is inserted.
+	 */
+	for (u = 0; u < count; u++)
+		reverse_unlink(map, index, xs[u] - index->x_start,
+			       results + (size_t)u * index->result_max,
+			       result_lens[u]);
+	for (u = 0; u < count; u++)
+		reverse_replace(map, index, xs[u] - index->x_start,
+				results + (size_t)u * index->result_max,
+				result_lens[u], 1);
+out:
+	crush_free(seen);
+	crush_free(deltas);
+	return err;
+}
+
+void crush_destroy_reverse_index(struct crush_reverse_index *index)
+{
+	if (index == NULL)
+		return;
+	crush_free(index->results);
+	crush_free(index->result_lens);
+	crush_free(index->offsets);
+	crush_free(index->sizes);
+	crush_free(index->entries);
+	crush_free(index);
+}
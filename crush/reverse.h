@@ -0,0 +1,142 @@
+#ifndef CEPH_CRUSH_REVERSE_H
+#define CEPH_CRUSH_REVERSE_H
+
+#include "crush.h"
+
+/*
+ * A reverse index answers "which values map to this device", or to
+ * any device under this bucket, without scanning the results of all
+ * the values. It is built from the results of crush_do_rule_batch()
+ * in compressed sparse row form: the entries of all the items are in
+ * a single array, those of each item contiguous and sorted by value
+ * and position, with some room left after them so that updating the
+ * results of a few values does not move the others.
+ */
+
+/** @ingroup API
+ *
+ * The position of an item in the result of a value.
+ */
+struct crush_reverse_entry {
+	int x;		/*!< the value mapped */
+	int position;	/*!< the index of the item in the result of __x__ */
+};
+
+/** @ingroup API
+ * Also index each item under all the buckets containing it, as found
+ * by crush_get_parent(). A value with two items under the same bucket
+ * has two entries for that bucket, one per position. An item that is
+ * in more than one bucket (::CRUSH_PARENT_MANY) has no single chain of
+ * ancestors: its entries are not added to any bucket.
+ */
+#define CRUSH_REVERSE_ANCESTORS (1 << 0)
+
+/** @ingroup API
+ *
+ * Opaque reverse index.
+ */
+struct crush_reverse_index;
+
+/** @ingroup API
+ *
+ * Index the results of the __count__ values starting at __x_start__,
+ * laid out as crush_do_rule_batch() stores them: the items of the
+ * value __x_start + i__ are __results[i * result_max]__ to
+ * __results[i * result_max + result_lens[i] - 1]__. The index keeps
+ * a copy of the results and must be released with
+ * crush_destroy_reverse_index().
+ *
+ * Items that are ::CRUSH_ITEM_NONE are not indexed. The index is
+ * built by __num_threads__ threads, each counting then storing the
+ * entries of a range of values: the result is the same for any
+ * number of threads. With ::CRUSH_REVERSE_ANCESTORS in __flags__, the
+ * parents of __map__ must have been indexed with crush_build_parents().
+ *
+ * - return -EINVAL if __count__ or __result_max__ is negative, if a
+ *   result length is not in [0, __result_max__] or if an item is
+ *   neither a device nor a bucket of __map__
+ * - return -ENOENT if ::CRUSH_REVERSE_ANCESTORS is set and the parents
+ *   of __map__ are not indexed
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param map the crush_map the results were computed with
+ * @param results the items of each value
+ * @param result_lens the number of items of each value
+ * @param result_max the maximum number of items per value
+ * @param x_start the first value
+ * @param count the number of values
+ * @param flags 0 or ::CRUSH_REVERSE_ANCESTORS
+ * @param num_threads the number of threads, 0 for one per online cpu
+ * @param[out] index the new index
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_make_reverse_index(const struct crush_map *map,
+				    const int *results, const int *result_lens,
+				    int result_max, int x_start, int count,
+				    int flags, int num_threads,
+				    struct crush_reverse_index **index);
+
+/** @ingroup API
+ *
+ * Set __entries__ to the entries of __item__, sorted by value then
+ * position, and return their number. The entries are valid until the
+ * next crush_reverse_index_update().
+ *
+ * - return -ENOENT if __item__ is neither a device nor a bucket of
+ *   the map the index was made with
+ *
+ * @param index the reverse index
+ * @param item a device or bucket id
+ * @param[out] entries the entries of __item__
+ *
+ * @returns the number of entries, < 0 on error
+ */
+extern int crush_reverse_index_get(const struct crush_reverse_index *index,
+				   int item,
+				   const struct crush_reverse_entry **entries);
+
+/** @ingroup API
+ *
+ * Replace the results of the __count__ values __xs[i]__ with
+ * __results[i * result_max]__ to __results[i * result_max +
+ * result_lens[i] - 1]__, __result_max__ being the one of the index.
+ * Only the entries of the items these values leave or join are moved,
+ * unless an item has no room left for its new entries: the whole
+ * index is then built again with more room. The __map__ must be the
+ * one the index was made with, or have the same devices, buckets and
+ * parents.
+ *
+ * On error, the index is not modified.
+ *
+ * - return -ENOENT if a value is not in the index, or if
+ *   ::CRUSH_REVERSE_ANCESTORS is set and the parents of __map__ are
+ *   not indexed
+ * - return -EINVAL if a value is given twice, if a result is not
+ *   valid, as in crush_make_reverse_index(), if __map__ does not have
+ *   as many devices and buckets as the index or if the entries of an
+ *   old result are not where the parents of __map__ place them
+ * - return -ENOMEM if memory allocation fails
+ *
+ * @param map the crush_map the results were computed with
+ * @param index the reverse index
+ * @param xs the values whose results changed
+ * @param count the number of values
+ * @param results the new items of each value
+ * @param result_lens the new number of items of each value
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_reverse_index_update(const struct crush_map *map,
+				      struct crush_reverse_index *index,
+				      const int *xs, int count,
+				      const int *results,
+				      const int *result_lens);
+
+/** @ingroup API
+ *
+ * Release an index made by crush_make_reverse_index().
+ */
+extern void crush_destroy_reverse_index(struct crush_reverse_index *index);
+
+#endif
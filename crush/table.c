@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crush_compat.h"
+#include "batch.h"
+#include "frozen.h"
+#include "table.h"
+
+#define TABLE_ALIGN(size) (((size) + 7) & ~(__u64)7)
+
+/* the smallest number of bits that can tell __n__ values apart */
+static int table_bits(__u64 n)
+{
+	int bits = 0;
+
+	while (((__u64)1 << bits) < n)
+		bits++;
+	return bits;
+}
+
+/* the bytes of a column of __rows__ values of __bits__ bits */
+static __u64 table_column_size(__u64 rows, int bits)
+{
+	return (rows * bits + 63) / 64 * 8;
+}
+
+/* the 64 bits words of the changed rows bitmap of __count__ rows */
+static __u64 table_words(__u64 count)
+{
+	return (count + 63) / 64;
+}
+
+static inline const void *table_ptr(const struct crush_table *table,
+				    __u64 offset)
+{
+	return (const char *)table + offset;
+}
+
+/*
+ * The value __i__ of a column of __bits__ bits values, which may
+ * straddle two words.
+ */
+static inline __u32 table_unpack(const __u64 *column, __u64 i, int bits)
+{
+	__u64 bit, value;
+	unsigned int shift;
+
+	if (bits == 0)
+		return 0;
+	bit = i * bits;
+	shift = bit & 63;
+	value = column[bit >> 6] >> shift;
+	if (shift + bits > 64)
+		value |= column[(bit >> 6) + 1] << (64 - shift);
+	return value & (((__u64)1 << bits) - 1);
+}
+
+static void table_pack(__u64 *column, __u64 i, int bits, __u32 value)
+{
+	__u64 bit;
+	unsigned int shift;
+
+	if (bits == 0)
+		return;
+	bit = i * bits;
+	shift = bit & 63;
+	column[bit >> 6] |= (__u64)value << shift;
+	if (shift + bits > 64)
+		column[(bit >> 6) + 1] |= (__u64)value >> (64 - shift);
+}
+
+static int table_cmp_item(const void *a, const void *b)
+{
+	__s32 x = *(const __s32 *)a, y = *(const __s32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the index of __item__ in the sorted __dict__ where it must be */
+static __u32 table_code(const __s32 *dict, __u32 n, __s32 item)
+{
+	__u32 lo = 0, hi = n;
+
+	while (hi - lo > 1) {
+		__u32 mid = lo + (hi - lo) / 2;
+		if (dict[mid] <= item)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int table_same_row(const struct crush_table *base, int x,
+			  const int *result, int len, int *row)
+{
+	int base_len = crush_table_get(base, NULL, x, row);
+
+	return base_len == len && !memcmp(result, row, len * sizeof(*row));
+}
+
+int crush_table_encode(const int *results, const int *result_lens,
+		       int result_max, int x_start, int count,
+		       const struct crush_table *base,
+		       void **imagep, size_t *lengthp)
+{
+	struct crush_table *h;
+	char *image;
+	__u64 *changed = NULL, *column;
+	__s32 *items = NULL, *dict;
+	int *row = NULL;
+	__u64 words = 0, length, column_size, n = 0, k;
+	__u32 rows = 0, distinct = 0, *ranks;
+	int item_bits, len_bits, i, j, err = -ENOMEM;
+
+	if (count < 0 || result_max < 0)
+		return -EINVAL;
+	for (i = 0; i < count; i++)
+		if (result_lens[i] < 0 || result_lens[i] > result_max)
+			return -EINVAL;
+	if (base && (base->changed != 0 || base->x_start != x_start ||
+		     base->count != (__u32)count ||
+		     base->result_max != (__u32)result_max))
+		return -EINVAL;
+
+	/* the rows to store */
+	if (base) {
+		words = table_words(count);
+		changed = crush_calloc(words ? words : 1, sizeof(*changed));
+		row = crush_malloc((result_max ? result_max : 1) * sizeof(*row));
+		if (changed == NULL || row == NULL)
+			goto out;
+	}
+	for (i = 0; i < count; i++) {
+		if (base && table_same_row(base, x_start + i,
+					   results + (size_t)i * result_max,
+					   result_lens[i], row))
+			continue;
+		if (changed)
+			changed[i / 64] |= (__u64)1 << (i % 64);
+		rows++;
+		n += result_lens[i];
+	}
+
+	/* the sorted distinct items of the stored rows */
+	items = crush_malloc((n ? n : 1) * sizeof(*items));
+	if (items == NULL)
+		goto out;
+	for (i = 0, k = 0; i < count; i++) {
+		if (changed && !(changed[i / 64] >> (i % 64) & 1))
+			continue;
+		for (j = 0; j < result_lens[i]; j++)
+			items[k++] = results[(size_t)i * result_max + j];
+	}
+	qsort(items, n, sizeof(*items), table_cmp_item);
+	for (k = 0; k < n; k++)
+		if (distinct == 0 || items[k] != items[distinct - 1])
+			items[distinct++] = items[k];
+	item_bits = table_bits(distinct);
+	len_bits = table_bits((__u64)result_max + 1);
+	column_size = table_column_size(rows, item_bits);
+
+	/* the size of the image */
+	length = TABLE_ALIGN(sizeof(*h));
+	length += TABLE_ALIGN(((__u64)1 << item_bits) * sizeof(__s32));
+	length += words * sizeof(__u64);
+	length += TABLE_ALIGN(words * sizeof(__u32));
+	length += table_column_size(rows, len_bits);
+	length += column_size * result_max;
+
+	image = calloc(1, length);
+	if (!image)
+		goto out;
+	h = (struct crush_table *)image;
+	h->magic = CRUSH_TABLE_MAGIC;
+	h->version = CRUSH_TABLE_VERSION;
+	h->length = length;
+	h->x_start = x_start;
+	h->count = count;
+	h->result_max = result_max;
+	h->rows = rows;
+	h->dict_size = (__u32)1 << item_bits;
+	h->item_bits = item_bits;
+	h->len_bits = len_bits;
+	h->column_size = column_size;
+
+	length = TABLE_ALIGN(sizeof(*h));
+	h->dict = length;
+	dict = (__s32 *)(image + h->dict);
+	/* padded with the last item so that any code of item_bits is valid */
+	for (k = 0; k < h->dict_size; k++)
+		dict[k] = distinct ? items[k < distinct ? k : distinct - 1] : CRUSH_ITEM_NONE;
+	length += TABLE_ALIGN((__u64)h->dict_size * sizeof(__s32));
+	if (base) {
+		h->changed = length;
+		memcpy(image + h->changed, changed, words * sizeof(__u64));
+		length += words * sizeof(__u64);
+		h->ranks = length;
+		ranks = (__u32 *)(image + h->ranks);
+		for (k = 0, rows = 0; k < words; k++) {
+			ranks[k] = rows;
+			rows += __builtin_popcountll(changed[k]);
+		}
+		length += TABLE_ALIGN(words * sizeof(__u32));
+		h->base_checksum = base->checksum;
+	}
+	h->lens = length;
+	length += table_column_size(h->rows, len_bits);
+	h->items = length;
+	length += column_size * result_max;
+	BUG_ON(length != h->length);
+
+	for (i = 0, k = 0; i < count; i++) {
+		if (changed && !(changed[i / 64] >> (i % 64) & 1))
+			continue;
+		table_pack((__u64 *)(image + h->lens), k, len_bits, result_lens[i]);
+		for (j = 0; j < result_lens[i]; j++) {
+			column = (__u64 *)(image + h->items + j * column_size);
+			table_pack(column, k, item_bits,
+				   table_code(dict, distinct,
+					      results[(size_t)i * result_max + j]));
+		}
+		k++;
+	}
+
+	h->checksum = crush_frozen_checksum(image + sizeof(*h), h->length - sizeof(*h));
+	h->header_checksum = crush_frozen_checksum(h, offsetof(struct crush_table,
+							       header_checksum));
+	*imagep = image;
+	*lengthp = h->length;
+	err = 0;
+out:
+	crush_free(items);
+	crush_free(row);
+	crush_free(changed);
+	return err;
+}
+
+int crush_table_map(const struct crush_map *map, int ruleno,
+		    int x_start, int count, int result_max,
+		    const __u32 *weights, int weight_max,
+		    const struct crush_choose_arg *choose_args,
+		    int num_threads, const struct crush_table *base,
+		    void **image, size_t *length)
+{
+	int *results, *result_lens;
+	int err;
+
+	if (count < 0 || result_max < 0)
+		return -EINVAL;
+	results = crush_malloc(((size_t)count * result_max + 1) * sizeof(*results));
+	result_lens = crush_malloc(((size_t)count + 1) * sizeof(*result_lens));
+	err = -ENOMEM;
+	if (results && result_lens)
+		err = crush_do_rule_batch(map, ruleno, NULL, x_start, count,
+					  results, result_lens, result_max,
+					  weights, weight_max, choose_args,
+					  num_threads);
+	if (err == 0)
+		err = crush_table_encode(results, result_lens, result_max,
+					 x_start, count, base, image, length);
+	crush_free(results);
+	crush_free(result_lens);
+	return err;
+}
+
+/* true if the __size__ bytes at __offset__ are in the image */
+static int table_in_image(const struct crush_table *table, __u64 offset,
+			  __u64 size)
+{
+	return offset % 8 == 0 && offset >= sizeof(*table) &&
+		offset <= table->length && size <= table->length - offset;
+}
+
+static int table_verify_layout(const struct crush_table *table)
+{
+	__u64 words = table_words(table->count);
+
+	if (table->item_bits > 31 ||
+	    table->dict_size != (__u32)1 << table->item_bits ||
+	    table->len_bits != table_bits((__u64)table->result_max + 1) ||
+	    table->column_size != table_column_size(table->rows, table->item_bits) ||
+	    table->rows > table->count)
+		return 0;
+	if (!table_in_image(table, table->dict,
+			    (__u64)table->dict_size * sizeof(__s32)) ||
+	    !table_in_image(table, table->lens,
+			    table_column_size(table->rows, table->len_bits)))
+		return 0;
+	if (table->result_max > 0 &&
+	    (table->column_size > table->length / table->result_max ||
+	     !table_in_image(table, table->items,
+			     table->column_size * table->result_max)))
+		return 0;
+	if (table->changed == 0)
+		return table->rows == table->count && table->ranks == 0 &&
+			table->base_checksum == 0;
+	return table_in_image(table, table->changed, words * sizeof(__u64)) &&
+		table_in_image(table, table->ranks, words * sizeof(__u32));
+}
+
+int crush_table_check(const void *image, size_t length, int flags,
+		      const struct crush_table *base,
+		      const struct crush_table **tablep)
+{
+	const struct crush_table *table = image;
+
+	if ((size_t)image % 8 || length < sizeof(*table) ||
+	    table->magic != CRUSH_TABLE_MAGIC ||
+	    table->version != CRUSH_TABLE_VERSION ||
+	    table->length < sizeof(*table) || table->length > length ||
+	    table->length % 8 || !table_verify_layout(table))
+		return -EINVAL;
+	if (table->changed != 0 &&
+	    (base == NULL || base->changed != 0 ||
+	     base->checksum != table->base_checksum ||
+	     base->x_start != table->x_start || base->count != table->count ||
+	     base->result_max != table->result_max))
+		return -EINVAL;
+	if (flags & CRUSH_TABLE_VERIFY_CHECKSUM) {
+		if (table->header_checksum !=
+		    crush_frozen_checksum(table, offsetof(struct crush_table,
+							  header_checksum)) ||
+		    table->checksum !=
+		    crush_frozen_checksum(table + 1, table->length - sizeof(*table)))
+			return -EINVAL;
+	}
+	*tablep = table;
+	return 0;
+}
+
+int crush_table_mmap(const char *path, int flags,
+		     const struct crush_table *base,
+		     const struct crush_table **tablep)
+{
+	const struct crush_table *table;
+	struct stat st;
+	void *addr;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	if ((size_t)st.st_size < sizeof(*table)) {
+		close(fd);
+		return -EINVAL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = -errno;
+	close(fd);
+	if (addr == MAP_FAILED)
+		return err;
+	err = crush_table_check(addr, st.st_size, flags, base, &table);
+	if (err == 0 && table->length != (__u64)st.st_size)
+		err = -EINVAL;
+	if (err < 0) {
+		munmap(addr, st.st_size);
+		return err;
+	}
+	*tablep = table;
+	return 0;
+}
+
+void crush_table_munmap(const struct crush_table *table)
+{
+	munmap((void *)table, table->length);
+}
+
+int crush_table_get(const struct crush_table *table,
+		    const struct crush_table *base,
+		    int x, int *result)
+{
+	const __s32 *dict = table_ptr(table, table->dict);
+	__u64 i = (__s64)x - table->x_start, row = i;
+	__u32 len, j;
+
+	if ((__s64)x < table->x_start || i >= table->count)
+		return -ENOENT;
+	if (table->changed != 0) {
+		const __u64 *changed = table_ptr(table, table->changed);
+		const __u32 *ranks = table_ptr(table, table->ranks);
+		__u64 word = changed[i / 64];
+
+		if (base == NULL)
+			return -EINVAL;
+		if (!(word >> (i % 64) & 1))
+			return crush_table_get(base, NULL, x, result);
+		row = ranks[i / 64] +
+			__builtin_popcountll(word & (((__u64)1 << (i % 64)) - 1));
+		if (row >= table->rows)
+			return -EINVAL;
+	}
+	len = table_unpack(table_ptr(table, table->lens), row, table->len_bits);
+	if (len > table->result_max)
+		return -EINVAL;
+	for (j = 0; j < len; j++)
+		result[j] = dict[table_unpack(table_ptr(table, table->items +
+							j * table->column_size),
+					      row, table->item_bits)];
+	return len;
+}
@@ -0,0 +1,180 @@
+#ifndef CEPH_CRUSH_TABLE_H
+#define CEPH_CRUSH_TABLE_H
+
+#include "crush.h"
+
+/*
+ * A mapping table stores the result of crush_do_rule() for the
+ * __count__ consecutive values starting at __x_start__, e.g. all the
+ * PGs of a pool at a given epoch, in a single block of memory that
+ * can be written to a file and mapped read-only like a frozen map.
+ *
+ * The table is columnar: the result lengths are one column and the
+ * items at each position of the results are one column each. The
+ * items are replaced by their index in a sorted dictionary of the
+ * distinct items of the table and each column is bit-packed with
+ * just enough bits for the dictionary, i.e. ceil(log2(max_devices))
+ * bits or less. Row __x__ is therefore read in constant time, without
+ * decoding the rest of the table.
+ *
+ * A table can be a delta against a full table of the same values,
+ * typically the one of a previous epoch: a bitmap tells which rows
+ * changed and only those rows are stored, the others being read from
+ * the full table. The full table is identified by its checksum.
+ *
+ * As with a frozen map, the image is in the byte order of the host
+ * that wrote it and is rejected on hosts of the other byte order.
+ */
+
+#define CRUSH_TABLE_MAGIC 0x42545243 /* "CRTB" */
+#define CRUSH_TABLE_VERSION 1
+
+/** @ingroup API
+ *
+ * The header of a mapping table, at offset zero of the image. The
+ * offsets are from the beginning of the image.
+ */
+struct crush_table {
+	__u32 magic;              /*!< ::CRUSH_TABLE_MAGIC */
+	__u32 version;            /*!< ::CRUSH_TABLE_VERSION */
+	__u64 length;             /*!< size of the image, header included */
+	__s32 x_start;            /*!< the value of the first row */
+	__u32 count;              /*!< the number of rows */
+	__u32 result_max;         /*!< the number of item columns */
+	__u32 rows;               /*!< rows stored: __count__ or the changed rows */
+	__u32 dict_size;          /*!< 1 << __item_bits__ dictionary entries */
+	__u8 item_bits;           /*!< bits of each item, index in the dictionary */
+	__u8 len_bits;            /*!< bits of each result length */
+	__u16 __pad16;
+	__u64 dict;               /*!< offset of the __s32__ dictionary */
+	__u64 lens;               /*!< offset of the result length column */
+	__u64 items;              /*!< offset of the first item column */
+	__u64 column_size;        /*!< bytes of each item column */
+	__u64 changed;            /*!< offset of the changed rows bitmap, 0 if full */
+	__u64 ranks;              /*!< offset of the changed rows before each bitmap word */
+	__u64 base_checksum;      /*!< __checksum__ of the full table, 0 if full */
+	__u64 checksum;           /*!< of the bytes following the header */
+	__u64 header_checksum;    /*!< of the header bytes preceding this field */
+};
+
+/** @ingroup API
+ * Verify the checksums of the header and of the rest of the image.
+ */
+#define CRUSH_TABLE_VERIFY_CHECKSUM	(1 << 0)
+
+/** @ingroup API
+ *
+ * Encode the results of __count__ values into a table returned in a
+ * __malloc(3)__ buffer in __image__ and its size in __length__. It is
+ * the responsibility of the caller to __free(3)__ the __image__. The
+ * results are laid out as crush_do_rule_batch() stores them: the
+ * items of the value __x_start + i__ are __results[i * result_max]__
+ * to __results[i * result_max + result_lens[i] - 1]__.
+ *
+ * If __base__ is not NULL, the table is a delta against it: only the
+ * rows that differ from __base__ are stored. The __base__ must be a
+ * full table of the same __x_start__, __count__ and __result_max__.
+ *
+ * - return -EINVAL if __count__ or __result_max__ is negative, if a
+ *   result length is not in [0, __result_max__] or if __base__ does
+ *   not match
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param results the items of each value
+ * @param result_lens the number of items of each value
+ * @param result_max the maximum number of items per value
+ * @param x_start the first value
+ * @param count the number of values
+ * @param base the full table to encode against or NULL
+ * @param[out] image the table
+ * @param[out] length the number of bytes in __image__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_table_encode(const int *results, const int *result_lens,
+			      int result_max, int x_start, int count,
+			      const struct crush_table *base,
+			      void **image, size_t *length);
+
+/** @ingroup API
+ *
+ * Map the __count__ values starting at __x_start__ with
+ * crush_do_rule_batch() and encode them with crush_table_encode().
+ * The arguments are those of both functions.
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_table_map(const struct crush_map *map, int ruleno,
+			   int x_start, int count, int result_max,
+			   const __u32 *weights, int weight_max,
+			   const struct crush_choose_arg *choose_args,
+			   int num_threads, const struct crush_table *base,
+			   void **image, size_t *length);
+
+/** @ingroup API
+ *
+ * Check that the __length__ bytes at __image__ are a table and set
+ * __table__ to its header. The magic number, the version, the length
+ * and the layout are always checked, in constant time. The checksums
+ * are only verified if __flags__ contains
+ * ::CRUSH_TABLE_VERIFY_CHECKSUM. A delta table must be given the full
+ * table it was encoded against as __base__, which is then checked in
+ * constant time as well; __base__ is ignored for a full table. The
+ * __image__ must be aligned on an 8 bytes boundary.
+ *
+ * - return -EINVAL if the image is not valid or __base__ does not
+ *   match
+ *
+ * @param image the table
+ * @param length the number of bytes in __image__
+ * @param flags a combination of CRUSH_TABLE_VERIFY_*
+ * @param base the full table of a delta table or NULL
+ * @param[out] table the table header
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_table_check(const void *image, size_t length, int flags,
+			     const struct crush_table *base,
+			     const struct crush_table **table);
+
+/** @ingroup API
+ *
+ * Map the file at __path__ read-only and shared, check it with
+ * crush_table_check(), __flags__ and __base__ and set __table__ to
+ * its header. The file must only contain the image. The mapping must
+ * be released with crush_table_munmap().
+ *
+ * @returns 0 on success, -errno on error
+ */
+extern int crush_table_mmap(const char *path, int flags,
+			    const struct crush_table *base,
+			    const struct crush_table **table);
+
+/** @ingroup API
+ *
+ * Unmap a table mapped with crush_table_mmap().
+ */
+extern void crush_table_munmap(const struct crush_table *table);
+
+/** @ingroup API
+ *
+ * Read the items of the value __x__ from __table__ in constant time.
+ * The __base__ must be the one given to crush_table_check() for a
+ * delta table and is ignored for a full table.
+ *
+ * - return -ENOENT if __x__ is not in the table
+ * - return -EINVAL if __table__ is a delta table and __base__ is
+ *   NULL or if the row of a delta table is not where it should be
+ *
+ * @param table the table
+ * @param base the full table of a delta table or NULL
+ * @param x the value
+ * @param[out] result an array of __table->result_max__ items
+ *
+ * @returns the number of items stored in __result__, < 0 on error
+ */
+extern int crush_table_get(const struct crush_table *table,
+			   const struct crush_table *base,
+			   int x, int *result);
+
+#endif
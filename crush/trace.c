@@ -0,0 +1,104 @@
+#include <stdio.h>
+
+#include "crush_compat.h"
+#include "trace.h"
+
+struct crush_trace *crush_make_trace(unsigned int events)
+{
+	struct crush_trace *trace;
+	__u32 size = 1;
+
+	if (events == 0 || events > (1u << 31))
+		return NULL;
+	while (size < events)
+		size <<= 1;
+	trace = crush_malloc(sizeof(*trace) + size * sizeof(trace->events[0]));
+	if (trace == NULL)
+		return NULL;
+	trace->size = size;
+	trace->__pad = 0;
+	trace->head = 0;
+	return trace;
+}
+
+void crush_destroy_trace(struct crush_trace *trace)
+{
+	crush_free(trace);
+}
+
+void crush_workspace_set_trace(void *cwin, struct crush_trace *trace)
+{
+	((struct crush_work *)cwin)->trace = trace;
+}
+
+void crush_trace_clear(struct crush_trace *trace)
+{
+	trace->head = 0;
+}
+
+unsigned int crush_trace_count(const struct crush_trace *trace)
+{
+	return trace->head < trace->size ? trace->head : trace->size;
+}
+
+const struct crush_trace_event *crush_trace_get(const struct crush_trace *trace,
+						unsigned int i)
+{
+	unsigned int count = crush_trace_count(trace);
+
+	if (i >= count)
+		return NULL;
+	return &trace->events[(trace->head - count + i) & (trace->size - 1)];
+}
+
+static const char *crush_trace_reject_name(__s64 reason)
+{
+	switch (reason) {
+	case CRUSH_TRACE_REJECT_OUT: return "out";
+	case CRUSH_TRACE_REJECT_NO_LEAF: return "no_leaf";
+	case CRUSH_TRACE_REJECT_BAD_ITEM: return "bad_item";
+	case CRUSH_TRACE_REJECT_EMPTY: return "empty";
+	default: return "unknown";
+	}
+}
+
+static const char *crush_trace_retry_name(int flags)
+{
+	switch (flags) {
+	case CRUSH_TRACE_RETRY_BUCKET: return "bucket";
+	case CRUSH_TRACE_RETRY_DESCENT: return "descent";
+	case CRUSH_TRACE_RETRY_GIVE_UP: return "give_up";
+	default: return "unknown";
+	}
+}
+
+int crush_trace_format(const struct crush_trace_event *e, char *buf, size_t size)
+{
+	switch (e->type) {
+	case CRUSH_TRACE_RULE:
+		return snprintf(buf, size, "rule %d x %u result_max %lld",
+				e->item, e->x, (long long)e->value);
+	case CRUSH_TRACE_CHOOSE:
+		return snprintf(buf, size, "choose x %u r %d bucket %d item %d",
+				e->x, e->r, e->bucket, e->item);
+	case CRUSH_TRACE_DRAW:
+		return snprintf(buf, size, "draw x %u r %d bucket %d item %d draw %lld",
+				e->x, e->r, e->bucket, e->item, (long long)e->value);
+	case CRUSH_TRACE_REJECT:
+		return snprintf(buf, size, "reject x %u r %d bucket %d item %d %s",
+				e->x, e->r, e->bucket, e->item,
+				crush_trace_reject_name(e->value));
+	case CRUSH_TRACE_COLLIDE:
+		return snprintf(buf, size, "collide x %u r %d bucket %d item %d",
+				e->x, e->r, e->bucket, e->item);
+	case CRUSH_TRACE_RETRY:
+		return snprintf(buf, size, "retry x %u r %d bucket %d %s failures %lld",
+				e->x, e->r, e->bucket,
+				crush_trace_retry_name(e->flags), (long long)e->value);
+	case CRUSH_TRACE_RESULT:
+		return snprintf(buf, size, "result x %u item %d position %lld",
+				e->x, e->item, (long long)e->value);
+	default:
+		return snprintf(buf, size, "unknown event %u", e->type);
+	}
+}
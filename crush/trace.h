@@ -0,0 +1,206 @@
+#ifndef CEPH_CRUSH_TRACE_H
+#define CEPH_CRUSH_TRACE_H
+
+#include "crush.h"
+
+/*
+ * crush_do_rule() can record each decision it makes in a ring buffer
+ * attached to its workspace, see crush_workspace_set_trace(). The
+ * events are fixed size binary records, cheap to write and decoded
+ * into text afterwards with crush_trace_format(), possibly by another
+ * process if the events are saved.
+ */
+
+/** @ingroup API
+ * crush_do_rule() starts: __item__ is the rule number, __value__ the
+ * __result_max__.
+ */
+#define CRUSH_TRACE_RULE	1
+/** @ingroup API
+ * __item__ was chosen from __bucket__ with __r__.
+ */
+#define CRUSH_TRACE_CHOOSE	2
+/** @ingroup API
+ * __item__ won the draw of a straw or straw2 __bucket__ with the draw
+ * in __value__.
+ */
+#define CRUSH_TRACE_DRAW	3
+/** @ingroup API
+ * __item__ chosen from __bucket__ was rejected for the
+ * CRUSH_TRACE_REJECT_* reason in __value__.
+ */
+#define CRUSH_TRACE_REJECT	4
+/** @ingroup API
+ * __item__ chosen from __bucket__ was already chosen.
+ */
+#define CRUSH_TRACE_COLLIDE	5
+/** @ingroup API
+ * After a rejection or a collision in __bucket__, the choice is
+ * retried as given by the CRUSH_TRACE_RETRY_* __flags__, __value__
+ * being the total number of failures so far.
+ */
+#define CRUSH_TRACE_RETRY	6
+/** @ingroup API
+ * __item__ is placed at the position __value__ of the output of the
+ * step.
+ */
+#define CRUSH_TRACE_RESULT	7
+
+/** @ingroup API
+ * The item is a device that is out, see the __weight__ argument of
+ * crush_do_rule().
+ */
+#define CRUSH_TRACE_REJECT_OUT		1
+/** @ingroup API
+ * No leaf could be found under the item.
+ */
+#define CRUSH_TRACE_REJECT_NO_LEAF	2
+/** @ingroup API
+ * The item does not exist or is not of the type expected.
+ */
+#define CRUSH_TRACE_REJECT_BAD_ITEM	3
+/** @ingroup API
+ * The bucket is empty.
+ */
+#define CRUSH_TRACE_REJECT_EMPTY	4
+
+/** @ingroup API
+ * Choose again from the same bucket.
+ */
+#define CRUSH_TRACE_RETRY_BUCKET	1
+/** @ingroup API
+ * Choose again from the bucket of the step.
+ */
+#define CRUSH_TRACE_RETRY_DESCENT	2
+/** @ingroup API
+ * Give up, the replica is not placed.
+ */
+#define CRUSH_TRACE_RETRY_GIVE_UP	3
+
+/** @ingroup API
+ *
+ * An event of a crush_trace. The meaning of the fields depends on the
+ * __type__ and they are zero when they do not apply.
+ */
+struct crush_trace_event {
+	__u16 type;   /*!< CRUSH_TRACE_* */
+	__u16 flags;  /*!< CRUSH_TRACE_RETRY_* */
+	__s32 bucket; /*!< the bucket chosen from */
+	__s32 item;   /*!< the item chosen */
+	__s32 r;      /*!< the replica rank used for the choice */
+	__u32 x;      /*!< the value mapped */
+	__u32 __pad;
+	__s64 value;  /*!< type specific */
+};
+
+/** @ingroup API
+ *
+ * A ring buffer of the last __size__ events, __size__ being a power
+ * of two. The event __i__ in the order they were recorded, with __i__
+ * in [__head__ - __size__, __head__[, is at __events[i % size]__.
+ */
+struct crush_trace {
+	__u32 size;    /*!< number of elements in __events__ */
+	__u32 __pad;
+	__u64 head;    /*!< number of events recorded since the last clear */
+	struct crush_trace_event events[0];
+};
+
+/*! @cond INTERNAL */
+static inline void crush_trace_emit(struct crush_trace *trace, int type, int flags,
+				    int bucket, int item, int x, int r, __s64 value)
+{
+	struct crush_trace_event *e = &trace->events[trace->head & (trace->size - 1)];
+
+	e->type = type;
+	e->flags = flags;
+	e->bucket = bucket;
+	e->item = item;
+	e->r = r;
+	e->x = x;
+	e->__pad = 0;
+	e->value = value;
+	trace->head++;
+}
+/*! @endcond */
+
+/** @ingroup API
+ *
+ * Allocate a trace holding the last __events__ events, rounded up to
+ * a power of two. It must be released with crush_destroy_trace().
+ *
+ * @param events the minimum number of events kept
+ *
+ * @returns the trace or NULL if __events__ is 0 or too large or if
+ *          memory allocation fails
+ */
+extern struct crush_trace *crush_make_trace(unsigned int events);
+
+/** @ingroup API
+ *
+ * Release a trace allocated by crush_make_trace().
+ */
+extern void crush_destroy_trace(struct crush_trace *trace);
+
+/** @ingroup API
+ *
+ * Record the events of crush_do_rule() with the workspace __cwin__ in
+ * __trace__, or stop recording if __trace__ is NULL. The trace is
+ * written to by crush_do_rule() only and must be read by the thread
+ * using the workspace, or after it stopped.
+ *
+ * crush_do_rule() tests once per event if a trace is set: recording
+ * is not compiled out and can be turned on at any time, for instance
+ * for a single value to be mapped. crush_init_workspace() detaches
+ * the trace. crush_frozen_do_rule() records the same events.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param trace the trace or NULL
+ */
+extern void crush_workspace_set_trace(void *cwin, struct crush_trace *trace);
+
+/** @ingroup API
+ *
+ * Forget all the events of __trace__.
+ */
+extern void crush_trace_clear(struct crush_trace *trace);
+
+/** @ingroup API
+ *
+ * Return the number of events in __trace__, at most its size.
+ */
+extern unsigned int crush_trace_count(const struct crush_trace *trace);
+
+/** @ingroup API
+ *
+ * Return the event __i__ of __trace__, 0 being the oldest event kept
+ * and crush_trace_count() - 1 the most recent.
+ *
+ * @param trace the trace
+ * @param i the index of the event
+ *
+ * @returns the event or NULL if __i__ is out of range
+ */
+extern const struct crush_trace_event *crush_trace_get(const struct crush_trace *trace,
+						       unsigned int i);
+
+/** @ingroup API
+ *
+ * Describe __event__ in __buf__ as one line of text without a newline,
+ * with the same semantic as __snprintf(3)__. For instance:
+ *
+ *     rule 0 x 1234 result_max 3
+ *     choose x 1234 r 0 bucket -1 item -3
+ *     reject x 1234 r 0 bucket -3 item 7 out
+ *
+ * @param event the event to describe
+ * @param buf the buffer written to
+ * @param size the size of __buf__
+ *
+ * @returns the length of the description, which was truncated if
+ *          it is >= __size__
+ */
+extern int crush_trace_format(const struct crush_trace_event *event,
+			      char *buf, size_t size);
+
+#endif
@@ -0,0 +1,132 @@
+// Time building and destroying crush maps with the builder functions,
+// allocating with glibc and with a bump allocator installed with
+// crush_set_allocator().
+//
+//   bench_alloc [hosts [devices per host [maps]]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "alloc.h"
+}
+
+// Allocations are carved out of chunks that are kept when the
+// allocator is reset, so that the memory is touched once. Each block
+// is preceded by its capacity: realloc grows a block in place up to
+// its capacity, otherwise it copies it into a block twice as large.
+struct bump {
+  std::vector<char *> chunks;
+  size_t chunk_size = 64 << 20;
+  size_t current = 0;
+  size_t used = 0;
+
+  ~bump() {
+    for (char *c : chunks)
+      free(c);
+  }
+  void reset() {
+    current = 0;
+    used = 0;
+  }
+};
+
+static const size_t header = CRUSH_ALLOC_ALIGN;
+
+static void *bump_alloc(void *ctx, size_t size, size_t align) {
+  bump *b = (bump *)ctx;
+  size = (size + CRUSH_ALLOC_ALIGN - 1) & ~(CRUSH_ALLOC_ALIGN - 1);
+  if (header + size + align > b->chunk_size)
+    return NULL;
+  size_t offset = (b->used + header + align - 1) / align * align;
+  if (b->chunks.empty() || offset + size > b->chunk_size) {
+    if (!b->chunks.empty())
+      b->current++;
+    if (b->current == b->chunks.size()) {
+      char *chunk;
+      if (posix_memalign((void **)&chunk, 4096, b->chunk_size))
+        return NULL;
+      b->chunks.push_back(chunk);
+    }
+    offset = (header + align - 1) / align * align;
+  }
+  char *p = b->chunks[b->current] + offset;
+  *(size_t *)(p - header) = size;
+  b->used = offset + size;
+  return p;
+}
+
+static void *bump_realloc(void *ctx, void *p, size_t size) {
+  if (p == NULL)
+    return bump_alloc(ctx, size, CRUSH_ALLOC_ALIGN);
+  size_t capacity = *(size_t *)((char *)p - header);
+  if (size <= capacity)
+    return p;
+  void *q = bump_alloc(ctx, 2 * size, CRUSH_ALLOC_ALIGN);
+  if (q)
+    memcpy(q, p, capacity);
+  return q;
+}
+
+static void bump_free(void *ctx, void *p) {
+}
+
+// a root containing hosts of straw2 buckets, added one item at a time
+static void build(int hosts, int devices) {
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         2, 0, NULL, NULL);
+  int rootno;
+  crush_add_bucket(m, -1, root, &rootno);
+  for (int h = 0; h < hosts; h++) {
+    crush_bucket *host = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                           1, 0, NULL, NULL);
+    int hostno;
+    crush_add_bucket(m, -2 - h, host, &hostno);
+    for (int d = 0; d < devices; d++)
+      crush_bucket_add_item(m, host, h * devices + d, 0x10000);
+    crush_bucket_add_item(m, root, hostno, host->weight);
+  }
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  crush_add_rule(m, rule, -1);
+  crush_finalize(m);
+  crush_destroy(m);
+}
+
+static double run(int hosts, int devices, int maps, bump *b) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < maps; i++) {
+    build(hosts, devices);
+    if (b)
+      b->reset();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / maps;
+}
+
+int main(int argc, char **argv) {
+  int hosts = argc > 1 ? atoi(argv[1]) : 1000;
+  int devices = argc > 2 ? atoi(argv[2]) : 10;
+  int maps = argc > 3 ? atoi(argv[3]) : 20;
+
+  double glibc = run(hosts, devices, maps, NULL);
+
+  bump b;
+  crush_allocator allocator = { bump_alloc, bump_realloc, bump_free, &b };
+  crush_set_allocator(&allocator);
+  double bumped = run(hosts, devices, maps, &b);
+  crush_set_allocator(NULL);
+
+  printf("%d hosts of %d devices, %d maps\n", hosts, devices, maps);
+  printf("glibc %10.3f ms per map\n", glibc * 1000);
+  printf("bump  %10.3f ms per map\n", bumped * 1000);
+  return 0;
+}
@@ -0,0 +1,80 @@
+// Time crush_do_rule() on a map with many buckets, with its arena
+// and workspace in normal pages and then in huge pages, and report
+// the dTLB load misses per mapping when perf_event_open(2) allows it.
+//
+//   bench_hugepage [hosts [devices per host [mappings]]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "hugepage.h"
+}
+
+#include "crush_test_map.h"
+
+#include "perf_counters.h"
+
+static void run(const char *name, int mode, int hosts, int devices, int mappings) {
+  crush_set_hugepages(mode);
+  // a root of racks of 100 hosts of devices, in the map arena
+  const int racks = (hosts + 99) / 100;
+  crush_map *m = crush_test_tree(std::vector<int>{ racks, (hosts + racks - 1) / racks, devices },
+                                 CRUSH_BUCKET_STRAW2, std::vector<int>(1, CRUSH_BUCKET_STRAW2),
+                                 0x100, true);
+  size_t size = crush_work_size(m, 3);
+  size_t mapped = size;
+  int backing = CRUSH_HUGEPAGES_NONE;
+  void *cwin = crush_hugepage_alloc(&mapped, &backing);
+  if (!cwin) {
+    mapped = 0;
+    cwin = malloc(size);
+  }
+  crush_init_workspace(m, cwin);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  int result[3];
+
+  perf_counters counters;
+  counters.start();
+  auto start = std::chrono::steady_clock::now();
+  for (int x = 0; x < mappings; x++)
+    crush_do_rule(m, 0, x * 2654435761u, result, 3, weights.data(), weights.size(),
+                  cwin, NULL);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  counters.stop();
+  double misses = counters.value[perf_counters::DTLB_MISSES];
+
+  printf("%-8s workspace %-7s %8.1f ns per mapping", name,
+         backing == CRUSH_HUGEPAGES_HUGETLB ? "hugetlb" :
+         backing == CRUSH_HUGEPAGES_MADVISE ? "madvise" : "normal",
+         elapsed.count() * 1e9 / mappings);
+  if (misses >= 0)
+    printf(", %.2f dTLB misses per mapping\n", misses / mappings);
+  else
+    printf(", dTLB misses not available\n");
+
+  if (mapped)
+    crush_hugepage_free(cwin, mapped);
+  else
+    free(cwin);
+  crush_destroy(m);
+  crush_set_hugepages(CRUSH_HUGEPAGES_NONE);
+}
+
+int main(int argc, char **argv) {
+  int hosts = argc > 1 ? atoi(argv[1]) : 100000;
+  int devices = argc > 2 ? atoi(argv[2]) : 10;
+  int mappings = argc > 3 ? atoi(argv[3]) : 100000;
+
+  printf("%d hosts of %d devices, %d mappings\n", hosts, devices, mappings);
+  run("none", CRUSH_HUGEPAGES_NONE, hosts, devices, mappings);
+  run("madvise", CRUSH_HUGEPAGES_MADVISE, hosts, devices, mappings);
+  run("hugetlb", CRUSH_HUGEPAGES_HUGETLB, hosts, devices, mappings);
+  return 0;
+}
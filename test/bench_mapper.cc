@@ -0,0 +1,79 @@
+// Time crush_do_rule() for several map shapes, each built with every
+// bucket algorithm, and report per mapping the hardware counters that
+// tell whether it is bound by hashing, by divisions or by cache
+// misses: cycles, instructions, IPC, L1d, LLC, branch and dTLB
+// misses. Counters perf_event_open(2) does not allow are shown as n/a.
+//
+//   bench_mapper [mappings [perf]]
+//
+// perf is 1 (the default) to read the counters, 0 to only time.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+}
+
+#include "crush_test_map.h"
+#include "perf_counters.h"
+
+// a tree with fanout[0] buckets under the root, fanout[1] under each
+// of those and so on, the last level being devices. No fanout is
+// above 64: the node count of a tree bucket is a __u8.
+struct shape {
+  const char *name;
+  std::vector<int> fanout;
+};
+
+static void run(const shape &s, int alg, const char *alg_name, int mappings, bool perf) {
+  crush_map *m = crush_test_tree(s.fanout, alg, std::vector<int>(1, alg), 0x10000, true);
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, cwin.data());
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  int result[3];
+
+  perf_counters counters(perf);
+  counters.start();
+  auto start = std::chrono::steady_clock::now();
+  for (int x = 0; x < mappings; x++)
+    crush_do_rule(m, 0, x, result, 3, weights.data(), weights.size(), cwin.data(), NULL);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  counters.stop();
+
+  printf("%-12s %-7s %8.1f ns", s.name, alg_name, elapsed.count() * 1e9 / mappings);
+  if (counters.available())
+    counters.print(stdout, mappings);
+  printf("\n");
+  crush_destroy(m);
+}
+
+int main(int argc, char **argv) {
+  int mappings = argc > 1 ? atoi(argv[1]) : 100000;
+  bool perf = argc > 2 ? atoi(argv[2]) != 0 : true;
+  const shape shapes[] = {
+    { "flat-50", { 50 } },
+    { "50x10", { 50, 10 } },
+    { "10x10x10", { 10, 10, 10 } },
+    { "4x25x10", { 4, 25, 10 } },
+  };
+  const struct { int alg; const char *name; } algs[] = {
+    { CRUSH_BUCKET_UNIFORM, "uniform" },
+    { CRUSH_BUCKET_LIST, "list" },
+    { CRUSH_BUCKET_TREE, "tree" },
+    { CRUSH_BUCKET_STRAW, "straw" },
+    { CRUSH_BUCKET_STRAW2, "straw2" },
+  };
+
+  printf("%d mappings of 3 replicas, per mapping:\n", mappings);
+  if (perf && !perf_counters().available())
+    printf("perf_event_open(2) is not allowed, counters are n/a\n");
+  for (auto &s : shapes)
+    for (auto &a : algs)
+      run(s, a.alg, a.name, mappings, perf);
+  return 0;
+}
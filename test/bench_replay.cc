@@ -0,0 +1,256 @@
+// Replay captured inputs against a text crush map, time every
+// crush_do_rule() call and report, for each rule, the p50, p99, p99.9
+// and max latency from a log-linear histogram together with the
+// retries (the ftotal of each choice) of the mappings in the tail.
+//
+//   bench_replay map.txt [inputs [repeat]]
+//
+// The inputs are read one per line, # starting a comment:
+//
+//   weight <device> <weight>      e.g. weight 3 0.5, overrides the map
+//   rule <ruleno> <result_max>    rules replayed, all of them by default
+//   <x>                           a value to map with each rule
+//
+// Without inputs, x 0 to 99999 are mapped with every rule of the map
+// and the weights it defines. The whole set is replayed repeat times.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "parser.h"
+}
+
+// Values < 2^sub_bits are counted exactly, larger values in one of
+// 2^sub_bits linear sub buckets of their power of two: the relative
+// error is at most 2^-sub_bits.
+static const int sub_bits = 4;
+static const int sub_count = 1 << sub_bits;
+static const int bucket_count = (64 - sub_bits + 1) * sub_count;
+
+static int bucket_of(uint64_t v) {
+  if (v < (uint64_t)sub_count)
+    return v;
+  int e = 63 - __builtin_clzll(v);
+  return (e - sub_bits + 1) * sub_count + ((v >> (e - sub_bits)) & (sub_count - 1));
+}
+
+// the largest value counted in bucket b
+static uint64_t bucket_high(int b) {
+  if (b < sub_count)
+    return b;
+  int e = b / sub_count + sub_bits - 1;
+  uint64_t low = ((uint64_t)sub_count + b % sub_count) << (e - sub_bits);
+  return low + (1ULL << (e - sub_bits)) - 1;
+}
+
+struct histogram {
+  std::vector<uint64_t> count;
+  std::vector<uint64_t> retries;      // sum of the retries of the samples of each bucket
+  std::vector<uint64_t> retried;      // samples of each bucket with at least one retry
+  uint64_t total = 0;
+  uint64_t max = 0;
+  uint64_t max_retries = 0;           // of the slowest sample
+
+  histogram() : count(bucket_count), retries(bucket_count), retried(bucket_count) {}
+
+  void add(uint64_t ns, uint64_t r) {
+    int b = bucket_of(ns);
+    count[b]++;
+    retries[b] += r;
+    retried[b] += r > 0;
+    total++;
+    if (ns >= max) {
+      max = ns;
+      max_retries = r;
+    }
+  }
+
+  // the first bucket at or above the quantile q
+  int quantile(double q) const {
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    for (int b = 0; b < bucket_count; b++) {
+      seen += count[b];
+      if (seen > rank)
+        return b;
+    }
+    return bucket_count - 1;
+  }
+
+  // the upper bound of bucket b, which is at most the max
+  uint64_t high(int b) const {
+    uint64_t v = bucket_high(b);
+    return v < max ? v : max;
+  }
+
+  // mean retries and share of the samples retried from bucket b up
+  void tail(int from, double *mean, double *share) const {
+    uint64_t n = 0, r = 0, retried_n = 0;
+    for (int b = from; b < bucket_count; b++) {
+      n += count[b];
+      r += retries[b];
+      retried_n += retried[b];
+    }
+    *mean = n ? (double)r / n : 0;
+    *share = n ? 100.0 * retried_n / n : 0;
+  }
+};
+
+struct replay_rule {
+  int ruleno;
+  int result_max;
+  histogram latency;
+};
+
+static std::string read_file(const char *path) {
+  std::ifstream in(path);
+  if (!in) {
+    perror(path);
+    exit(1);
+  }
+  std::stringstream s;
+  s << in.rdbuf();
+  return s.str();
+}
+
+static void read_inputs(const char *path, crush_map *m, std::vector<__u32> &weights,
+                        std::vector<replay_rule> &rules, std::vector<__u32> &xs) {
+  std::ifstream in(path);
+  if (!in) {
+    perror(path);
+    exit(1);
+  }
+  std::string line;
+  for (int n = 1; std::getline(in, line); n++) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream s(line);
+    std::string word;
+    if (!(s >> word))
+      continue;
+    if (word == "weight") {
+      int device;
+      double w;
+      if (!(s >> device >> w) || device < 0 || device >= (int)weights.size() || w < 0 || w > 1)
+        goto bad;
+      weights[device] = w * 0x10000;
+    } else if (word == "rule") {
+      replay_rule r;
+      if (!(s >> r.ruleno >> r.result_max) || r.ruleno < 0 ||
+          (__u32)r.ruleno >= m->max_rules || !m->rules[r.ruleno] || r.result_max < 1)
+        goto bad;
+      rules.push_back(r);
+    } else {
+      char *end;
+      unsigned long long x = strtoull(word.c_str(), &end, 0);
+      if (*end || x > 0xffffffffULL)
+        goto bad;
+      xs.push_back(x);
+    }
+    continue;
+  bad:
+    fprintf(stderr, "%s:%d: cannot parse '%s'\n", path, n, line.c_str());
+    exit(1);
+  }
+}
+
+// the retries of the last mapping, as counted in the histogram of the
+// workspace, which is cleared for the next one
+static uint64_t take_retries(crush_choose_stats *stats) {
+  uint64_t r = 0;
+  for (__u32 i = 1; i < stats->size; i++)
+    r += (uint64_t)i * stats->tries[i];
+  memset(stats->tries, 0, stats->size * sizeof(stats->tries[0]));
+  return r;
+}
+
+static void report(const replay_rule &r) {
+  const histogram &h = r.latency;
+  int p50 = h.quantile(0.5), p99 = h.quantile(0.99), p999 = h.quantile(0.999);
+  printf("rule %d result_max %d: %" PRIu64 " mappings\n", r.ruleno, r.result_max, h.total);
+  printf("  latency ns  p50 %" PRIu64 "  p99 %" PRIu64 "  p99.9 %" PRIu64 "  max %" PRIu64 "\n",
+         h.high(p50), h.high(p99), h.high(p999), h.max);
+#ifdef CRUSH_CHOOSE_STATS
+  struct { const char *name; int from; } ranges[] = {
+    { "all", 0 }, { ">= p50", p50 }, { ">= p99", p99 }, { ">= p99.9", p999 },
+  };
+  for (auto &range : ranges) {
+    double mean, share;
+    h.tail(range.from, &mean, &share);
+    printf("  retries %-9s mean %6.2f  retried %5.1f%%\n", range.name, mean, share);
+  }
+  printf("  retries of the slowest mapping %" PRIu64 "\n", h.max_retries);
+#endif
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s map.txt [inputs [repeat]]\n", argv[0]);
+    return 1;
+  }
+  std::string text = read_file(argv[1]);
+  crush_map *m;
+  __u32 *parsed;
+  crush_parse_error error;
+  if (crush_parse_text(text.data(), text.size(), &m, &parsed, &error) < 0) {
+    fprintf(stderr, "%s:%d:%d: %s\n", argv[1], error.line, error.column, error.message);
+    return 1;
+  }
+  std::vector<__u32> weights(parsed, parsed + m->max_devices);
+  free(parsed);
+
+  std::vector<replay_rule> rules;
+  std::vector<__u32> xs;
+  if (argc > 2)
+    read_inputs(argv[2], m, weights, rules, xs);
+  if (rules.empty())
+    for (__u32 r = 0; r < m->max_rules; r++)
+      if (m->rules[r])
+        rules.push_back({ (int)r, m->rules[r]->mask.max_size, histogram() });
+  if (xs.empty())
+    for (__u32 x = 0; x < 100000; x++)
+      xs.push_back(x);
+  int repeat = argc > 3 ? atoi(argv[3]) : 1;
+
+  int result_max = 1;
+  for (auto &r : rules)
+    if (r.result_max > result_max)
+      result_max = r.result_max;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_choose_stats *stats = crush_make_choose_stats(m);
+  crush_workspace_set_choose_stats(cwin.data(), stats);
+  std::vector<int> result(result_max);
+
+  for (int i = 0; i < repeat; i++)
+    for (auto &r : rules)
+      for (__u32 x : xs) {
+        auto start = std::chrono::steady_clock::now();
+        crush_do_rule(m, r.ruleno, x, result.data(), r.result_max,
+                      weights.data(), weights.size(), cwin.data(), NULL);
+        auto end = std::chrono::steady_clock::now();
+        r.latency.add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                      take_retries(stats));
+      }
+
+  printf("%zu values, %d times, %zu rules\n", xs.size(), repeat, rules.size());
+  for (auto &r : rules)
+    report(r);
+#ifndef CRUSH_CHOOSE_STATS
+  printf("retries not available, libcrush built with WITH_CHOOSE_STATS=OFF\n");
+#endif
+
+  crush_destroy_choose_stats(stats);
+  crush_destroy(m);
+  return 0;
+}
@@ -0,0 +1,125 @@
+// The maps the tests and benchmarks map with, most of them a straw2
+// root of hosts of devices and a rule choosing each replica in a
+// different host.
+
+#ifndef CRUSH_TEST_MAP_H
+#define CRUSH_TEST_MAP_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+}
+
+// the buckets of a crush_test_tree() and the number of buckets and
+// devices numbered so far
+struct crush_test_nodes {
+  crush_map *map;
+  int buckets = 0, devices = 0;
+
+  // add bucket __id__ of the given level and its items, depth first
+  // so that the items of a bucket follow it, and return its weight
+  int add_level(const std::vector<int> &fanout, int a, const std::vector<int> &algs,
+                int w, int id, int level) {
+    int levels = fanout.size();
+    std::vector<int> items, weights;
+    for (int i = 0; i < fanout[level]; i++) {
+      if (level == levels - 1) {
+        items.push_back(devices++);
+        weights.push_back(w);
+      } else {
+        int alg = algs.empty() ? a : algs[(buckets - 1) % algs.size()];
+        int child = -1 - buckets++;
+        items.push_back(child);
+        weights.push_back(add_level(fanout, alg, algs, w, child, level + 1));
+      }
+    }
+    crush_bucket *b = crush_make_bucket(map, a, CRUSH_HASH_DEFAULT, levels - level,
+                                        items.size(), items.data(), weights.data());
+    int idout;
+    if (b == NULL || crush_add_bucket(map, id, b, &idout) != 0) {
+      fprintf(stderr, "crush_test_tree: crush_add_bucket failed\n");
+      abort();
+    }
+    return b->weight;
+  }
+};
+
+// A tree with fanout[0] buckets under the root, fanout[1] under each
+// of those and so on, the last level being devices of weight
+// __weight__. The root uses root_alg and the other buckets the
+// algorithms of algs in turn. The buckets are numbered -1 (the
+// root), -2, ... and the devices 0, 1, ... depth first, so that the
+// devices of host h of a root of hosts are h * host_size to
+// (h + 1) * host_size - 1. The buckets of the last level have type
+// 1, those above 2 and so on.
+//
+// Rule 0 takes the root and chooses each replica under a different
+// bucket of type 1 (chooseleaf firstn 0 type 1), or among the devices
+// of the root if it has no buckets. The map is finalized and, if
+// __arena__, the buckets and the rule are allocated in its arena.
+// Building it cannot fail on a valid tree: the program aborts if it
+// does.
+static inline crush_map *crush_test_tree(const std::vector<int> &fanout, int root_alg,
+                                         const std::vector<int> &algs, int weight = 0x10000,
+                                         bool arena = false) {
+  crush_test_nodes n;
+  n.map = arena ? crush_create_arena_map(1 << 20) : crush_create();
+  if (n.map == NULL) {
+    fprintf(stderr, "crush_test_tree: crush_create failed\n");
+    abort();
+  }
+  n.buckets = 1;
+  n.add_level(fanout, root_alg, algs, weight, -1, 0);
+  crush_map *m = n.map;
+  crush_rule *rule = arena ? crush_make_arena_rule(m, 3, 0, 1, 1, 10)
+                           : crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, -1, 0);
+  if (fanout.size() > 1)
+    crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  else
+    crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  if (crush_add_rule(m, rule, 0) != 0) {
+    fprintf(stderr, "crush_test_tree: crush_add_rule failed\n");
+    abort();
+  }
+  crush_finalize(m);
+  return m;
+}
+
+// Every bucket algorithm, for crush_test_map() to make a host of each.
+static inline std::vector<int> crush_test_algs() {
+  return std::vector<int>{ CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                           CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 };
+}
+
+// Add rule __ruleno__ of __ruleset__ and __type__ for 1 to __max_size__
+// replicas, taking the root and choosing each replica under a
+// different bucket of type 1 with __op__, for instance
+// CRUSH_RULE_CHOOSELEAF_INDEP, then finalize the map again.
+static inline void crush_test_add_rule(crush_map *m, int ruleno, int ruleset, int type,
+                                       int max_size, int op) {
+  crush_rule *rule = crush_make_rule(3, ruleset, type, 1, max_size);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, -1, 0);
+  crush_rule_set_step(rule, 1, op, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  if (crush_add_rule(m, rule, ruleno) != ruleno) {
+    fprintf(stderr, "crush_test_add_rule: crush_add_rule failed\n");
+    abort();
+  }
+  crush_finalize(m);
+}
+
+// A straw2 root of __hosts__ hosts of __host_size__ devices of
+// weight 1, the hosts using the algorithms of algs in turn.
+static inline crush_map *crush_test_map(int hosts, int host_size,
+                                        const std::vector<int> &algs =
+                                        std::vector<int>(1, CRUSH_BUCKET_STRAW2)) {
+  return crush_test_tree(std::vector<int>{ hosts, host_size }, CRUSH_BUCKET_STRAW2, algs);
+}
+
+#endif
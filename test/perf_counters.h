@@ -0,0 +1,122 @@
+// Hardware counters of the calling thread read with
+// perf_event_open(2) around a loop of the benchmarks. Each counter is
+// opened on its own so that the ones the CPU, the hypervisor or
+// perf_event_paranoid do not allow are merely reported as missing,
+// and its value is scaled if the kernel multiplexed it.
+
+#ifndef CRUSH_TEST_PERF_COUNTERS_H
+#define CRUSH_TEST_PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct perf_counters {
+  enum {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    DTLB_MISSES,
+    COUNT
+  };
+
+  int fd[COUNT];
+  double value[COUNT];          // < 0 if not available
+
+  static const char *name(int i) {
+    static const char *names[COUNT] = {
+      "cycles", "instructions", "L1d misses", "LLC misses",
+      "branch misses", "dTLB misses",
+    };
+    return names[i];
+  }
+
+  static int open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  static uint64_t cache_miss(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+
+  // no counter is opened if enabled is false
+  explicit perf_counters(bool enabled = true) {
+    for (int i = 0; i < COUNT; i++) {
+      fd[i] = -1;
+      value[i] = -1;
+    }
+    if (!enabled)
+      return;
+    fd[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fd[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fd[L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D));
+    fd[LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL));
+    fd[BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    fd[DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB));
+  }
+
+  ~perf_counters() {
+    for (int i = 0; i < COUNT; i++)
+      if (fd[i] >= 0)
+        close(fd[i]);
+  }
+
+  bool available() const {
+    for (int i = 0; i < COUNT; i++)
+      if (fd[i] >= 0)
+        return true;
+    return false;
+  }
+
+  void start() {
+    for (int i = 0; i < COUNT; i++)
+      if (fd[i] >= 0) {
+        ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+  }
+
+  void stop() {
+    for (int i = 0; i < COUNT; i++) {
+      uint64_t v[3];      // value, time enabled, time running
+      value[i] = -1;
+      if (fd[i] < 0)
+        continue;
+      ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd[i], v, sizeof(v)) != sizeof(v) || v[2] == 0)
+        continue;
+      value[i] = (double)v[0] * v[1] / v[2];
+    }
+  }
+
+  // print the counters divided by n, e.g. the number of mappings
+  void print(FILE *out, double n) const {
+    for (int i = 0; i < COUNT; i++) {
+      if (value[i] < 0)
+        fprintf(out, " %s n/a", name(i));
+      else
+        fprintf(out, " %s %.2f", name(i), value[i] / n);
+      if (i == INSTRUCTIONS && value[CYCLES] > 0 && value[INSTRUCTIONS] >= 0)
+        fprintf(out, " IPC %.2f", value[INSTRUCTIONS] / value[CYCLES]);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "helpers.h"
+#include "encoding.h"
+#include "parser.h"
+#include "alloc.h"
+}
+
+#include "crush_test_map.h"
+
+struct counts {
+  long allocs;
+  long frees;
+  long aligned;
+};
+
+static void *count_alloc(void *ctx, size_t size, size_t align) {
+  counts *c = (counts *)ctx;
+  void *p;
+  if (posix_memalign(&p, align, size ? size : 1))
+    return NULL;
+  c->allocs++;
+  if (align > CRUSH_ALLOC_ALIGN)
+    c->aligned++;
+  return p;
+}
+
+static void *count_realloc(void *ctx, void *p, size_t size) {
+  counts *c = (counts *)ctx;
+  void *q = realloc(p, size ? size : 1);
+  if (q && p == NULL)
+    c->allocs++;
+  return q;
+}
+
+static void count_free(void *ctx, void *p) {
+  counts *c = (counts *)ctx;
+  c->frees++;
+  free(p);
+}
+
+TEST(alloc, crush_set_allocator) {
+  const crush_allocator *libc = crush_get_allocator();
+  ASSERT_TRUE(libc->alloc != NULL);
+  crush_allocator saved = *libc;
+
+  counts c = { 0, 0, 0 };
+  crush_allocator allocator = { count_alloc, count_realloc, count_free, &c };
+  crush_set_allocator(&allocator);
+  EXPECT_EQ(&c, crush_get_allocator()->ctx);
+
+  crush_map *m = crush_test_map(5, 3, crush_test_algs());
+  EXPECT_EQ(0, crush_find_rule(m, 0, 1, 3));
+  const crush_topology *t;
+  EXPECT_EQ(0, crush_get_topology(m, &t));
+  EXPECT_EQ(0, crush_adjust_item_weight(m, 3, 0x20000));
+
+  // the buffers given to the caller are allocated with malloc(3)
+  void *buffer;
+  size_t length;
+  long allocs = c.allocs;
+  ASSERT_EQ(0, crush_encode(m, NULL, 0, &buffer, &length));
+  EXPECT_EQ(allocs, c.allocs);
+  crush_map *decoded;
+  ASSERT_EQ(0, crush_decode(buffer, length, &decoded, NULL, NULL));
+  free(buffer);
+  int *roots;
+  EXPECT_EQ(1, crush_find_roots(decoded, &roots));
+  free(roots);
+
+  const char text[] =
+    "device 0 osd.0\n"
+    "type 1 host\n"
+    "host host0 {\n"
+    "  alg straw2\n"
+    "  item osd.0\n"
+    "}\n";
+  crush_map *parsed;
+  __u32 *weights;
+  ASSERT_EQ(0, crush_parse_text(text, sizeof(text) - 1, &parsed, &weights, NULL));
+  free(weights);
+
+  void *aligned = crush_malloc_aligned(100, 4096);
+  ASSERT_TRUE(aligned != NULL);
+  EXPECT_EQ(0u, (uintptr_t)aligned % 4096);
+  EXPECT_EQ(1, c.aligned);
+  crush_free(aligned);
+
+  EXPECT_LT(c.frees, c.allocs);
+  crush_destroy(parsed);
+  crush_destroy(decoded);
+  crush_destroy(m);
+  EXPECT_GT(c.allocs, 20);
+  EXPECT_EQ(c.allocs, c.frees);
+
+  crush_set_allocator(NULL);
+  EXPECT_EQ(saved.alloc, crush_get_allocator()->alloc);
+  EXPECT_EQ(NULL, crush_get_allocator()->ctx);
+  crush_map *other = crush_test_map(5, 3, crush_test_algs());
+  crush_destroy(other);
+  EXPECT_EQ(c.allocs, c.frees);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_alloc && valgrind --tool=memcheck test/unittest_alloc"
+// End:
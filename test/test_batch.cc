@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "batch.h"
+}
+
+TEST(batch, crush_do_rule_batch) {
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 2,
+                                         0, NULL, NULL);
+  int rootno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  const int host_count = 8;
+  const int host_size = 3;
+  for (int host = 0; host < host_count; host++) {
+    int items[host_size];
+    int weights[host_size];
+    for (int i = 0; i < host_size; i++) {
+      items[i] = host * host_size + i;
+      weights[i] = 0x10000;
+    }
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                        host_size, items, weights);
+    int bno = 0;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    ASSERT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_rule *rule = crush_make_rule(3, 0, 0, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int ruleno = crush_add_rule(m, rule, -1);
+  crush_finalize(m);
+
+  const int device_count = host_count * host_size;
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int result_max = 3;
+  const int count = 10000;
+  std::vector<int> results(count * result_max);
+  std::vector<int> result_lens(count);
+
+  ASSERT_EQ(-EINVAL, crush_do_rule_batch(m, ruleno, NULL, 0, -1,
+                                         results.data(), result_lens.data(), result_max,
+                                         weights.data(), device_count, NULL, 0));
+
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  for (int num_threads : { 1, 4, 0 }) {
+    const int x_start = 100;
+    ASSERT_EQ(0, crush_do_rule_batch(m, ruleno, NULL, x_start, count,
+                                     results.data(), result_lens.data(), result_max,
+                                     weights.data(), device_count, NULL, num_threads));
+    for (int i = 0; i < count; i++) {
+      int expected[result_max];
+      int expected_len = crush_do_rule(m, ruleno, x_start + i, expected, result_max,
+                                       weights.data(), device_count, cwin.data(), NULL);
+      ASSERT_EQ(expected_len, result_lens[i]);
+      for (int j = 0; j < expected_len; j++)
+        ASSERT_EQ(expected[j], results[i * result_max + j]);
+    }
+  }
+
+  // explicit values
+  std::vector<int> xs = { 7, 1234, -5, 7 };
+  ASSERT_EQ(0, crush_do_rule_batch(m, ruleno, xs.data(), 0, xs.size(),
+                                   results.data(), result_lens.data(), result_max,
+                                   weights.data(), device_count, NULL, 2));
+  for (size_t i = 0; i < xs.size(); i++) {
+    int expected[result_max];
+    int expected_len = crush_do_rule(m, ruleno, xs[i], expected, result_max,
+                                     weights.data(), device_count, cwin.data(), NULL);
+    ASSERT_EQ(expected_len, result_lens[i]);
+    for (int j = 0; j < expected_len; j++)
+      ASSERT_EQ(expected[j], results[i * result_max + j]);
+  }
+
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_batch && valgrind --tool=memcheck test/unittest_batch"
+// End:
@@ -1,7 +1,11 @@
 #include <gtest/gtest.h>
 
+#include <vector>
+
 extern "C" {
+#include "crush/hash.h"
 #include "crush/builder.h"
+#include "crush/alloc.h"
 }
 
 TEST(builder, crush_create) {
@@ -165,6 +169,491 @@ TEST(builder, crush_make_choose_args) {
   crush_destroy(m);
 }
 
+// forwards to the allocator in use and fails realloc when asked to
+struct failing_realloc {
+  crush_allocator next;
+  bool fail;
+};
+
+static void *failing_alloc(void *ctx, size_t size, size_t align) {
+  crush_allocator *next = &((failing_realloc *)ctx)->next;
+  return next->alloc(next->ctx, size, align);
+}
+
+static void *failing_realloc_fn(void *ctx, void *p, size_t size) {
+  failing_realloc *f = (failing_realloc *)ctx;
+  if (f->fail)
+    return NULL;
+  return f->next.realloc(f->next.ctx, p, size);
+}
+
+static void failing_free(void *ctx, void *p) {
+  crush_allocator *next = &((failing_realloc *)ctx)->next;
+  next->free(next->ctx, p);
+}
+
+TEST(builder, crush_add_hierarchy) {
+  crush_map *m = crush_create();
+  // nodes are listed in any order, children may come before parents
+  //
+  //   root (straw2, -1)
+  //     rack0 (tree)         rack1 (list)
+  //       host0 (uniform)      host1 (straw)
+  //         osd.0 osd.1          osd.2 osd.3 osd.4
+  enum { OSD0, HOST0, OSD1, RACK0, ROOT, RACK1, OSD2, HOST1, OSD3, OSD4, COUNT };
+  int parent[COUNT], alg[COUNT], type[COUNT], weight[COUNT], ids[COUNT];
+  auto node = [&](int i, int p, int a, int t, int w, int id) {
+    parent[i] = p; alg[i] = a; type[i] = t; weight[i] = w; ids[i] = id;
+  };
+  node(OSD0, HOST0, 0, 0, 0x10000, 0);
+  node(HOST0, RACK0, CRUSH_BUCKET_UNIFORM, 1, 0, 0);
+  node(OSD1, HOST0, 0, 0, 0x10000, 1);
+  node(RACK0, ROOT, CRUSH_BUCKET_TREE, 2, 0, 0);
+  node(ROOT, -1, CRUSH_BUCKET_STRAW2, 3, 0, -1);
+  node(RACK1, ROOT, CRUSH_BUCKET_LIST, 2, 0, 0);
+  node(OSD2, HOST1, 0, 0, 0x10000, 2);
+  node(HOST1, RACK1, CRUSH_BUCKET_STRAW, 1, 0, -10);
+  node(OSD3, HOST1, 0, 0, 0x20000, 3);
+  node(OSD4, HOST1, 0, 0, 0x30000, 4);
+  ASSERT_EQ(0, crush_add_hierarchy(m, COUNT, parent, alg, type, weight, ids));
+  crush_finalize(m);
+
+  EXPECT_EQ(-1, ids[ROOT]);
+  EXPECT_EQ(-10, ids[HOST1]);
+  EXPECT_EQ(5, m->max_devices);
+  crush_bucket *root = m->buckets[0];
+  ASSERT_EQ(2u, root->size);
+  EXPECT_EQ(ids[RACK0], root->items[0]);
+  EXPECT_EQ(ids[RACK1], root->items[1]);
+  EXPECT_EQ(0x80000u, root->weight);
+  crush_bucket *host0 = m->buckets[-1-ids[HOST0]];
+  EXPECT_EQ(CRUSH_BUCKET_UNIFORM, host0->alg);
+  EXPECT_EQ(1, host0->type);
+  EXPECT_EQ(0x20000u, host0->weight);
+  EXPECT_EQ(0x20000u, m->buckets[-1-ids[RACK0]]->weight);
+  crush_bucket *host1 = m->buckets[-1-ids[HOST1]];
+  ASSERT_EQ(3u, host1->size);
+  EXPECT_EQ(2, host1->items[0]);
+  EXPECT_EQ(4, host1->items[2]);
+  EXPECT_EQ(0x60000u, host1->weight);
+  EXPECT_EQ(0x60000u, m->buckets[-1-ids[RACK1]]->weight);
+  // the buckets can still be modified
+  EXPECT_EQ(0, crush_bucket_add_item(m, host1, 5, 0x10000));
+  EXPECT_EQ(0x70000u, host1->weight);
+
+  // invalid hierarchies do not modify the map
+  int max_buckets = m->max_buckets;
+  int used = 0;
+  for (int b = 0; b < max_buckets; b++)
+    used += m->buckets[b] != NULL;
+  auto invalid = [&](int expected, int root_id = 0) {
+    for (int i = 0; i < COUNT; i++)
+      if (alg[i])
+        ids[i] = 0;
+    ids[ROOT] = root_id;
+    EXPECT_EQ(expected, crush_add_hierarchy(m, COUNT, parent, alg, type, weight, ids));
+    EXPECT_EQ(max_buckets, m->max_buckets);
+    int now = 0;
+    for (int b = 0; b < m->max_buckets; b++)
+      now += m->buckets[b] != NULL;
+    EXPECT_EQ(used, now);
+  };
+  invalid(-EEXIST, -1);  // root id -1 is taken
+  parent[ROOT] = RACK1;
+  invalid(-EINVAL);  // cycle
+  parent[ROOT] = -1;
+  parent[OSD2] = OSD3;
+  invalid(-EINVAL);  // a device is not a parent
+  parent[OSD2] = HOST1;
+  weight[OSD1] = 0x20000;
+  invalid(-EINVAL);  // uniform items of different weights
+  weight[OSD1] = 0x10000;
+  weight[OSD4] = 0x7fffffff;
+  weight[OSD3] = 0x7fffffff;
+  weight[OSD2] = 0x7fffffff;
+  invalid(-ERANGE);
+  weight[OSD2] = weight[OSD3] = weight[OSD4] = 0x10000;
+  alg[RACK1] = 42;
+  invalid(-EINVAL);
+  alg[RACK1] = CRUSH_BUCKET_LIST;
+  // the root is added last and the buckets array cannot grow for
+  // its id: the buckets added before it are removed
+  ASSERT_EQ(0, crush_build_parents(m));
+  failing_realloc f = { *crush_get_allocator(), true };
+  crush_allocator allocator = { failing_alloc, failing_realloc_fn, failing_free, &f };
+  crush_set_allocator(&allocator);
+  invalid(-ENOMEM, -1 - 4 * max_buckets);
+  crush_set_allocator(&f.next);
+  EXPECT_EQ(max_buckets, m->max_buckets);
+  EXPECT_EQ(-10, crush_get_parent(m, 2));
+  for (int i = 0; i < COUNT; i++)
+    if (alg[i])
+      ids[i] = 0;
+  EXPECT_EQ(0, crush_add_hierarchy(m, COUNT, parent, alg, type, weight, ids));
+  EXPECT_EQ(0x50000u, m->buckets[-1-ids[ROOT]]->weight);
+  EXPECT_EQ(0, crush_add_hierarchy(m, 0, NULL, NULL, NULL, NULL, NULL));
+
+  crush_destroy(m);
+}
+
+TEST(builder, crush_add_hierarchy_large) {
+  crush_map *m = crush_create();
+  const int hosts = 1000, host_size = 100;
+  const int count = 1 + hosts + hosts * host_size;
+  std::vector<int> parent(count), alg(count), type(count), weight(count), ids(count);
+  // the root, then the hosts, then the devices
+  parent[0] = -1; alg[0] = CRUSH_BUCKET_STRAW2; type[0] = 2;
+  for (int h = 0; h < hosts; h++) {
+    parent[1 + h] = 0; alg[1 + h] = CRUSH_BUCKET_STRAW2; type[1 + h] = 1;
+  }
+  for (int d = 0; d < hosts * host_size; d++) {
+    int i = 1 + hosts + d;
+    parent[i] = 1 + d / host_size; weight[i] = 0x100; ids[i] = d;
+  }
+  ASSERT_EQ(0, crush_add_hierarchy(m, count, parent.data(), alg.data(), type.data(),
+                                   weight.data(), ids.data()));
+  crush_finalize(m);
+  EXPECT_EQ(hosts * host_size, m->max_devices);
+  EXPECT_EQ((__u32)hosts * host_size * 0x100, m->buckets[-1-ids[0]]->weight);
+  EXPECT_EQ((__u32)hosts, m->buckets[-1-ids[0]]->size);
+  crush_destroy(m);
+}
+
+// root (straw2) > 2 racks (list, tree) > 2 hosts each (straw, straw2, uniform, straw) > 3 devices
+static crush_map *make_hierarchy() {
+  const int racks = 2, hosts = 2, devices = 3;
+  const int rack_algs[] = { CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE };
+  const int host_algs[] = { CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2,
+                            CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_STRAW };
+  std::vector<int> parent, alg, type, weight, ids;
+  auto node = [&](int p, int a, int t, int w, int id) {
+    parent.push_back(p); alg.push_back(a); type.push_back(t);
+    weight.push_back(w); ids.push_back(id);
+    return (int)parent.size() - 1;
+  };
+  int root = node(-1, CRUSH_BUCKET_STRAW2, 3, 0, 0);
+  int device = 0;
+  for (int r = 0; r < racks; r++) {
+    int rack = node(root, rack_algs[r], 2, 0, 0);
+    for (int h = 0; h < hosts; h++) {
+      int a = host_algs[r * hosts + h];
+      int host = node(rack, a, 1, 0, 0);
+      for (int d = 0; d < devices; d++, device++)
+        node(host, 0, 0, a == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x10000 * (d + 1), device);
+    }
+  }
+  crush_map *m = crush_create();
+  EXPECT_EQ(0, crush_add_hierarchy(m, parent.size(), parent.data(), alg.data(),
+                                   type.data(), weight.data(), ids.data()));
+  crush_finalize(m);
+  return m;
+}
+
+static void expect_same_buckets(const crush_map *a, const crush_map *b) {
+  ASSERT_EQ(a->max_buckets, b->max_buckets);
+  for (int i = 0; i < a->max_buckets; i++) {
+    const crush_bucket *x = a->buckets[i], *y = b->buckets[i];
+    if (x == NULL) {
+      EXPECT_EQ(NULL, y);
+      continue;
+    }
+    ASSERT_EQ(x->size, y->size);
+    EXPECT_EQ(x->weight, y->weight) << "bucket " << x->id;
+    for (unsigned j = 0; j < x->size; j++) {
+      EXPECT_EQ(x->items[j], y->items[j]);
+      EXPECT_EQ(crush_get_bucket_item_weight(x, j), crush_get_bucket_item_weight(y, j));
+    }
+    if (x->alg == CRUSH_BUCKET_STRAW)
+      for (unsigned j = 0; j < x->size; j++)
+        EXPECT_EQ(((crush_bucket_straw *)x)->straws[j], ((crush_bucket_straw *)y)->straws[j]);
+  }
+}
+
+TEST(builder, crush_create_arena_map) {
+  crush_map *maps[2] = { crush_create(), crush_create_arena_map(0) };
+  crush_map *other = crush_create();
+  for (crush_map *m : maps) {
+    int items[] = { 0, 1, 2 };
+    int weights[] = { 0x10000, 0x20000, 0x30000 };
+    int hosts[4];
+    for (int h = 0; h < 4; h++) {
+      crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2 - h, CRUSH_HASH_DEFAULT,
+                                          1, 3, items, weights);
+      ASSERT_TRUE(b != NULL);
+      ASSERT_EQ(0, crush_add_bucket(m, 0, b, &hosts[h]));
+      items[0] += 3; items[1] += 3; items[2] += 3;
+    }
+    crush_bucket *root = crush_make_bucket(other, CRUSH_BUCKET_STRAW2,
+                                           CRUSH_HASH_DEFAULT, 2, 0, NULL, NULL);
+    int rootno;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+    for (int h = 0; h < 4; h++)
+      ASSERT_EQ(0, crush_bucket_add_item(m, root, hosts[h],
+                                         m->buckets[-1-hosts[h]]->weight));
+    crush_bucket *host = m->buckets[-1-hosts[0]];
+    ASSERT_EQ(0, crush_bucket_add_item(m, host, 100, 0x10000));
+    ASSERT_EQ(0, crush_bucket_remove_item(m, host, 1));
+    ASSERT_EQ(0, crush_bucket_add_item(m, host, 101, 0x10000));
+    crush_bucket *empty = crush_make_bucket(m, CRUSH_BUCKET_LIST, CRUSH_HASH_DEFAULT,
+                                            1, 0, NULL, NULL);
+    int emptyno;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, empty, &emptyno));
+    ASSERT_EQ(0, crush_bucket_add_item(m, empty, 102, 0x10000));
+    ASSERT_EQ(0, crush_remove_bucket(m, m->buckets[-1-hosts[3]]));
+
+    crush_rule *rule = crush_make_arena_rule(m, 3, 0, 1, 1, 10);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+    crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+    crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+    ASSERT_EQ(0, crush_add_rule(m, rule, -1));
+    ASSERT_EQ(1, crush_add_rule(m, crush_make_rule(1, 1, 1, 1, 10), -1));
+    crush_finalize(m);
+  }
+  expect_same_buckets(maps[0], maps[1]);
+  EXPECT_EQ(0, maps[0]->arena_only);
+  EXPECT_EQ(1, maps[1]->arena_only);
+  // the root, the first host and the bucket that was empty
+  EXPECT_EQ(3, maps[1]->heap_bucket_count);
+  for (crush_map *m : maps)
+    crush_destroy(m);
+  crush_destroy(other);
+}
+
+TEST(builder, crush_adjust_item_weight) {
+  crush_map *m = make_hierarchy();
+  crush_map *expected = make_hierarchy();
+  EXPECT_EQ(CRUSH_PARENT_UNKNOWN, crush_get_parent(m, 0));
+  ASSERT_EQ(0, crush_build_parents(m));
+  crush_bucket *root = m->buckets[0];
+  EXPECT_EQ(CRUSH_PARENT_NONE, crush_get_parent(m, root->id));
+  EXPECT_EQ(root->id, crush_get_parent(m, root->items[1]));
+  crush_bucket *rack = m->buckets[-1-root->items[0]];
+  crush_bucket *host = m->buckets[-1-rack->items[0]];
+  EXPECT_EQ(host->id, crush_get_parent(m, 1));
+  EXPECT_EQ(CRUSH_PARENT_NONE, crush_get_parent(m, 1000));
+  EXPECT_EQ(-ENOENT, crush_adjust_item_weight(m, 1000, 0x10000));
+
+  // the same as adjusting the device and reweighting the whole map
+  for (int device : { 1, 4, 7, 10 }) {
+    for (int b = 0; b < expected->max_buckets; b++) {
+      crush_bucket *bucket = expected->buckets[b];
+      for (unsigned i = 0; bucket && i < bucket->size; i++)
+        if (bucket->items[i] == device)
+          crush_bucket_adjust_item_weight(expected, bucket, device, 0x28000);
+    }
+    EXPECT_EQ(0, crush_reweight_bucket(expected, expected->buckets[0]));
+    EXPECT_EQ(0, crush_adjust_item_weight(m, device, 0x28000));
+    expect_same_buckets(expected, m);
+  }
+
+  // the index is maintained by the builder
+  EXPECT_EQ(0, crush_bucket_remove_item(m, host, 1));
+  EXPECT_EQ(CRUSH_PARENT_NONE, crush_get_parent(m, 1));
+  crush_bucket *other = m->buckets[-1-rack->items[1]];
+  EXPECT_EQ(0, crush_bucket_add_item(m, other, 1, 0x10000));
+  EXPECT_EQ(other->id, crush_get_parent(m, 1));
+  EXPECT_EQ(0, crush_bucket_add_item(m, host, 1, 0x10000));
+  EXPECT_EQ(CRUSH_PARENT_MANY, crush_get_parent(m, 1));
+  int items[] = { 100 };
+  int weights[] = { 0x10000 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      1, items, weights);
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  EXPECT_EQ(id, crush_get_parent(m, 100));
+  EXPECT_EQ(0, crush_remove_bucket(m, b));
+  EXPECT_EQ(CRUSH_PARENT_NONE, crush_get_parent(m, 100));
+
+  // an item in two buckets is adjusted in both and all their
+  // ancestors weigh as much as their items again
+  EXPECT_EQ(0, crush_adjust_item_weight(m, 1, 0x20000));
+  EXPECT_EQ(0x20000, crush_get_bucket_item_weight(host, host->size - 1));
+  EXPECT_EQ(0x20000, crush_get_bucket_item_weight(other, other->size - 1));
+  for (crush_bucket *bucket : { root, rack, m->buckets[-1-root->items[1]] }) {
+    __u32 weight = 0;
+    for (unsigned i = 0; i < bucket->size; i++) {
+      EXPECT_EQ(m->buckets[-1-bucket->items[i]]->weight,
+                (__u32)crush_get_bucket_item_weight(bucket, i));
+      weight += crush_get_bucket_item_weight(bucket, i);
+    }
+    EXPECT_EQ(weight, bucket->weight);
+  }
+
+  crush_destroy(expected);
+  crush_destroy(m);
+}
+
+TEST(builder, item_index) {
+  // wide buckets, large enough to be indexed, modified like a vector
+  for (int alg : { CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2,
+                   CRUSH_BUCKET_UNIFORM }) {
+    crush_map *m = crush_create();
+    const int size = 200;
+    std::vector<int> items, weights;
+    for (int i = 0; i < size; i++) {
+      items.push_back(i);
+      weights.push_back(alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x10000 + i);
+    }
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, size,
+                                        items.data(), weights.data());
+    int id;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+    unsigned seed = 1;
+    auto next = [&]() { seed = seed * 1103515245 + 12345; return (seed >> 16) % items.size(); };
+    for (int n = 0; n < 300; n++) {
+      int pos = next();
+      switch (n % 3) {
+      case 0:
+        ASSERT_EQ(0, crush_bucket_remove_item(m, b, items[pos])) << alg;
+        items.erase(items.begin() + pos);
+        weights.erase(weights.begin() + pos);
+        break;
+      case 1: {
+        int weight = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x20000 + n;
+        ASSERT_EQ(0, crush_bucket_add_item(m, b, 1000 + n, weight));
+        items.push_back(1000 + n);
+        weights.push_back(weight);
+        break;
+      }
+      case 2:
+        if (alg == CRUSH_BUCKET_UNIFORM)
+          break;
+        crush_bucket_adjust_item_weight(m, b, items[pos], 0x30000 + n);
+        weights[pos] = 0x30000 + n;
+        break;
+      }
+      // also modified behind the back of the index
+      if (n == 100) {
+        ASSERT_EQ(0, crush_bucket_remove_item(m, b, items[0]));
+        items.erase(items.begin());
+        weights.erase(weights.begin());
+      }
+    }
+    ASSERT_EQ(items.size(), b->size);
+    __u32 weight = 0;
+    for (unsigned i = 0; i < b->size; i++) {
+      ASSERT_EQ(items[i], b->items[i]);
+      ASSERT_EQ(weights[i], crush_get_bucket_item_weight(b, i));
+      weight += weights[i];
+    }
+    EXPECT_EQ(weight, b->weight);
+    EXPECT_EQ(-ENOENT, crush_bucket_remove_item(m, b, 5000));
+    if (alg != CRUSH_BUCKET_UNIFORM)
+      EXPECT_EQ(0, crush_bucket_adjust_item_weight(m, b, 5000, 0));
+    crush_destroy(m);
+  }
+}
+
+TEST(builder, remove_last_item) {
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    crush_map *m = crush_create();
+    int items[] = { 0, 1 };
+    int weights[] = { 0x10000, 0x10000 };
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, 2, items, weights);
+    int id;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+    EXPECT_EQ(0, crush_bucket_remove_item(m, b, 1)) << alg;
+    EXPECT_EQ(0, crush_bucket_remove_item(m, b, 0)) << alg;
+    EXPECT_EQ(0u, b->size);
+    EXPECT_EQ((__s32 *)NULL, b->items);
+    EXPECT_EQ(0u, b->weight);
+    // the bucket can grow again
+    EXPECT_EQ(0, crush_bucket_add_item(m, b, 2, 0x10000)) << alg;
+    ASSERT_EQ(1u, b->size);
+    EXPECT_EQ(2, b->items[0]);
+    EXPECT_EQ(0x10000u, b->weight);
+    crush_destroy(m);
+  }
+}
+
+extern "C" {
+// not in builder.h
+int crush_add_straw2_bucket_item(struct crush_map *map, struct crush_bucket_straw2 *bucket,
+                                 int item, int weight);
+int crush_remove_straw2_bucket_item(struct crush_map *map, struct crush_bucket_straw2 *bucket,
+                                    int item);
+}
+
+TEST(builder, item_index_stale) {
+  crush_map *m = crush_create();
+  std::vector<int> items, weights;
+  for (int i = 0; i < 100; i++) {
+    items.push_back(i);
+    weights.push_back(0x10000);
+  }
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      items.size(), items.data(), weights.data());
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  crush_bucket_straw2 *straw2 = (crush_bucket_straw2 *)b;
+  EXPECT_EQ(0x10000, crush_bucket_adjust_item_weight(m, b, 50, 0x20000));
+  // the functions of a given algorithm do not know about the index
+  EXPECT_EQ(0, crush_remove_straw2_bucket_item(m, straw2, 10));
+  EXPECT_EQ(0, crush_add_straw2_bucket_item(m, straw2, 500, 0x10000));
+  EXPECT_EQ(0x10000, crush_bucket_adjust_item_weight(m, b, 50, 0x30000));
+  EXPECT_EQ(0x30000, crush_get_bucket_item_weight(b, 49));
+  EXPECT_EQ(0x10000, crush_bucket_adjust_item_weight(m, b, 500, 0x20000));
+  EXPECT_EQ(0, crush_bucket_adjust_item_weight(m, b, 10, 0x20000));
+  // the last item can be removed
+  EXPECT_EQ(0, crush_remove_straw2_bucket_item(m, straw2, 500));
+  EXPECT_EQ(99u, b->size);
+  EXPECT_EQ(0, crush_bucket_remove_item(m, b, 99));
+  EXPECT_EQ(98u, b->size);
+  crush_destroy(m);
+}
+
+TEST(builder, item_index_stale_same_size) {
+  // the first lookup after a remove and an add that keep the size is
+  // for the added item
+  crush_map *m = crush_create();
+  std::vector<int> items, weights;
+  for (int i = 0; i < 100; i++) {
+    items.push_back(i);
+    weights.push_back(0x10000);
+  }
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      items.size(), items.data(), weights.data());
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  crush_bucket_straw2 *straw2 = (crush_bucket_straw2 *)b;
+  EXPECT_EQ(0x10000, crush_bucket_adjust_item_weight(m, b, 50, 0x20000));
+  EXPECT_EQ(0, crush_remove_straw2_bucket_item(m, straw2, 99));
+  EXPECT_EQ(0, crush_add_straw2_bucket_item(m, straw2, 500, 0x10000));
+  EXPECT_EQ(100u, b->size);
+  EXPECT_EQ(0x10000, crush_bucket_adjust_item_weight(m, b, 500, 0x20000));
+  EXPECT_EQ(0x20000, crush_get_bucket_item_weight(b, 99));
+  EXPECT_EQ(0, crush_remove_straw2_bucket_item(m, straw2, 98));
+  EXPECT_EQ(0, crush_add_straw2_bucket_item(m, straw2, 600, 0x10000));
+  EXPECT_EQ(0, crush_bucket_remove_item(m, b, 600));
+  EXPECT_EQ(99u, b->size);
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_item(m, b, 98));
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_item(m, b, 99));
+  EXPECT_EQ(0, crush_bucket_remove_item(m, b, 500));
+  EXPECT_EQ(98u, b->size);
+  crush_destroy(m);
+}
+
+TEST(builder, item_index_reweight) {
+  // reweighting every item of a wide bucket is linear
+  crush_map *m = crush_create();
+  const int size = 100000;
+  std::vector<int> items(size), weights(size, 0x100);
+  for (int i = 0; i < size; i++)
+    items[i] = i;
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      size, items.data(), weights.data());
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  for (int i = size - 1; i >= 0; i--)
+    ASSERT_EQ(0x100, crush_bucket_adjust_item_weight(m, b, i, 0x200));
+  EXPECT_EQ((__u32)size * 0x200, b->weight);
+  for (int i = size - 1; i >= size / 2; i--)
+    ASSERT_EQ(0, crush_bucket_remove_item(m, b, i));
+  EXPECT_EQ((__u32)size / 2, b->size);
+  crush_destroy(m);
+}
+
 TEST(builder, crush_make_rule) {
   int ruleset = 0;
   int steps_count = 1;
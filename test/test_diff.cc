@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "diff.h"
+}
+
+#include "crush_test_map.h"
+
+static const int host_count = 4;
+static const int host_size = 4;
+static const int result_max = 3;
+
+struct change {
+  int x;
+  std::vector<int> before, after;
+};
+
+static std::vector<int> map_x(const crush_diff_epoch &epoch, int x) {
+  std::vector<char> cwin(crush_work_size(epoch.map, result_max));
+  crush_init_workspace(epoch.map, cwin.data());
+  int result[result_max];
+  int len = crush_do_rule(epoch.map, epoch.ruleno, x, result, result_max, epoch.weights,
+                          epoch.weight_max, cwin.data(), epoch.choose_args);
+  return std::vector<int>(result, result + len);
+}
+
+// compare the diff with the results of all the values in both epochs
+static void expect_diff(const crush_diff_epoch &before, const crush_diff_epoch &after,
+                        int x_start, int count, int num_threads, __u64 *skipped) {
+  std::vector<change> expected;
+  for (int x = x_start; x < x_start + count; x++) {
+    change c = { x, map_x(before, x), map_x(after, x) };
+    if (c.before != c.after)
+      expected.push_back(c);
+  }
+
+  crush_diff *diff;
+  ASSERT_EQ(0, crush_make_diff(&before, &after, x_start, count, result_max, num_threads,
+                               &diff));
+  crush_diff_change c;
+  size_t n = 0;
+  int ret;
+  while ((ret = crush_diff_next(diff, &c)) == 1) {
+    ASSERT_LT(n, expected.size());
+    EXPECT_EQ(expected[n].x, c.x);
+    EXPECT_EQ(expected[n].before, std::vector<int>(c.before, c.before + c.before_len));
+    EXPECT_EQ(expected[n].after, std::vector<int>(c.after, c.after + c.after_len));
+    n++;
+  }
+  EXPECT_EQ(0, ret);
+  EXPECT_EQ(expected.size(), n);
+  EXPECT_EQ(0, crush_diff_next(diff, &c));
+  __u64 mapped, changed;
+  crush_diff_stats(diff, &mapped, skipped, &changed);
+  EXPECT_EQ((__u64)count, mapped);
+  EXPECT_EQ(expected.size(), changed);
+  EXPECT_GE(mapped - changed, *skipped);
+  crush_destroy_diff(diff);
+}
+
+TEST(diff, crush_diff_weights) {
+  crush_map *m = crush_test_map(host_count, host_size);
+  std::vector<__u32> in(m->max_devices, 0x10000);
+  std::vector<__u32> out = in;
+  out[5] = 0;
+  out[9] = 0x8000;
+  crush_diff_epoch before = { m, 0, in.data(), (int)in.size(), NULL };
+  crush_diff_epoch after = { m, 0, out.data(), (int)out.size(), NULL };
+
+  // the values that never chose 5 or 9 are not mapped again
+  const int count = 10000;
+  __u64 skipped;
+  expect_diff(before, after, -500, count, 1, &skipped);
+  EXPECT_LT(count / 2u, skipped);
+  __u64 threads_skipped;
+  expect_diff(before, after, -500, count, 3, &threads_skipped);
+  EXPECT_EQ(skipped, threads_skipped);
+  // and back in
+  expect_diff(after, before, 0, count, 2, &skipped);
+  EXPECT_LT(count / 2u, skipped);
+  // a shorter weight vector marks the devices beyond it out
+  after.weight_max = m->max_devices - host_size;
+  expect_diff(before, after, 0, count, 1, &skipped);
+  EXPECT_LT(0u, skipped);
+
+  crush_diff *diff;
+  after.ruleno = 1;
+  EXPECT_EQ(-EINVAL, crush_make_diff(&before, &after, 0, count, result_max, 1, &diff));
+  crush_destroy(m);
+}
+
+TEST(diff, crush_diff_maps) {
+  crush_map *a = crush_test_map(host_count, host_size);
+  crush_map *b = crush_test_map(host_count, host_size);
+  std::vector<__u32> weights(a->max_devices, 0x10000);
+  crush_diff_epoch before = { a, 0, weights.data(), (int)weights.size(), NULL };
+  crush_diff_epoch after = { b, 0, weights.data(), (int)weights.size(), NULL };
+
+  // identical maps: no value is mapped again
+  const int count = 3000;
+  __u64 skipped;
+  expect_diff(before, after, 0, count, 1, &skipped);
+  EXPECT_EQ((__u64)count, skipped);
+
+  // a device reweighted in its host: only the values that chose from
+  // the host are mapped again
+  crush_bucket *host = b->buckets[1];
+  ASSERT_EQ(0x4000 - 0x10000, crush_bucket_adjust_item_weight(b, host, host->items[2], 0x4000));
+  expect_diff(before, after, 0, count, 2, &skipped);
+  EXPECT_LT(0u, skipped);
+  EXPECT_GT((__u64)count, skipped);
+
+  // choose_args of the host
+  crush_diff_epoch unchanged = { b, 0, weights.data(), (int)weights.size(), NULL };
+  crush_choose_arg *choose_args = crush_make_choose_args(b, 1);
+  choose_args[1].weight_set[0].weights[0] = 0x20000;
+  crush_diff_epoch with_args = { b, 0, weights.data(), (int)weights.size(), choose_args };
+  expect_diff(unchanged, with_args, 0, count, 1, &skipped);
+  EXPECT_LT(0u, skipped);
+
+  // other tunables: all the values are mapped again
+  b->choose_total_tries = a->choose_total_tries + 1;
+  expect_diff(before, after, 0, count, 1, &skipped);
+  EXPECT_EQ(0u, skipped);
+
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(a);
+  crush_destroy(b);
+}
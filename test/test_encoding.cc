@@ -0,0 +1,263 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "arena.h"
+#include "encoding.h"
+}
+
+#include "crush_test_map.h"
+
+// a host of each algorithm, or of straw2 only, and rule 2 with independent replicas
+static crush_map *make_mixed_map(bool straw2_only) {
+  crush_map *m = crush_test_map(5, 3, straw2_only ? std::vector<int>(1, CRUSH_BUCKET_STRAW2)
+                                                  : crush_test_algs());
+  // leave a hole at rule 1
+  crush_test_add_rule(m, 2, 2, 3, 20, CRUSH_RULE_CHOOSELEAF_INDEP);
+  m->choose_total_tries = 77;
+  m->chooseleaf_vary_r = 0;
+  m->straw_calc_version = 0;
+  crush_finalize(m);
+  return m;
+}
+
+static void expect_same_mappings(crush_map *a, const crush_choose_arg *a_args,
+                                 crush_map *b, const crush_choose_arg *b_args) {
+  const int result_max = 3;
+  std::vector<__u32> weights(a->max_devices, 0x10000);
+  std::vector<char> a_cwin(crush_work_size(a, result_max));
+  std::vector<char> b_cwin(crush_work_size(b, result_max));
+  crush_init_workspace(a, a_cwin.data());
+  crush_init_workspace(b, b_cwin.data());
+  for (int ruleno : { 0, 2 }) {
+    for (int x = 0; x < 1000; x++) {
+      int a_result[result_max];
+      int b_result[result_max];
+      int a_len = crush_do_rule(a, ruleno, x, a_result, result_max,
+                                weights.data(), weights.size(),
+                                a_cwin.data(), a_args);
+      int b_len = crush_do_rule(b, ruleno, x, b_result, result_max,
+                                weights.data(), weights.size(),
+                                b_cwin.data(), b_args);
+      ASSERT_EQ(a_len, b_len);
+      for (int i = 0; i < a_len; i++)
+        ASSERT_EQ(a_result[i], b_result[i]);
+    }
+  }
+}
+
+TEST(encoding, round_trip) {
+  crush_map *m = make_mixed_map(false);
+  void *buffer;
+  size_t length;
+  ASSERT_EQ(0, crush_encode(m, NULL, 0, &buffer, &length));
+
+  crush_map *d;
+  crush_choose_args *choose_args;
+  int choose_args_count = -1;
+  ASSERT_EQ(0, crush_decode(buffer, length, &d, &choose_args, &choose_args_count));
+  EXPECT_EQ(0, choose_args_count);
+  EXPECT_EQ(m->max_buckets, d->max_buckets);
+  EXPECT_EQ(m->max_rules, d->max_rules);
+  EXPECT_EQ(m->max_devices, d->max_devices);
+  EXPECT_EQ(m->working_size, d->working_size);
+  EXPECT_EQ(77u, d->choose_total_tries);
+  EXPECT_EQ(0, d->chooseleaf_vary_r);
+  EXPECT_EQ(m->chooseleaf_stable, d->chooseleaf_stable);
+  EXPECT_EQ(m->allowed_bucket_algs, d->allowed_bucket_algs);
+  EXPECT_EQ((crush_rule *)NULL, d->rules[1]);
+  ASSERT_NE((crush_arena *)NULL, d->arena);
+  for (int b = 0; b < d->max_buckets; b++) {
+    EXPECT_EQ(m->buckets[b] == NULL, d->buckets[b] == NULL);
+    if (d->buckets[b])
+      EXPECT_TRUE(crush_arena_contains(d->arena, d->buckets[b]));
+  }
+
+  void *again;
+  size_t again_length;
+  ASSERT_EQ(0, crush_encode(d, NULL, 0, &again, &again_length));
+  ASSERT_EQ(length, again_length);
+  EXPECT_EQ(0, memcmp(buffer, again, length));
+  free(again);
+
+  expect_same_mappings(m, NULL, d, NULL);
+
+  /* decoded buckets can be modified and removed */
+  for (int b = 1; b < d->max_buckets; b++) {
+    crush_bucket *bucket = d->buckets[b];
+    if (bucket == NULL || bucket->alg == CRUSH_BUCKET_UNIFORM)
+      continue;
+    ASSERT_EQ(0, crush_bucket_add_item(d, bucket, 100 + b, 0x10000));
+    ASSERT_EQ(0, crush_bucket_remove_item(d, bucket, bucket->items[0]));
+  }
+  ASSERT_EQ(0, crush_remove_bucket(d, d->buckets[1]));
+
+  crush_destroy_choose_args_array(choose_args, choose_args_count);
+  crush_destroy(d);
+  crush_destroy(m);
+  free(buffer);
+}
+
+TEST(encoding, choose_args) {
+  crush_map *m = make_mixed_map(true);
+  crush_choose_args choose_args[2];
+  choose_args[0].key = -1;
+  choose_args[0].arg_map.args = crush_make_choose_args(m, 2);
+  choose_args[0].arg_map.size = m->max_buckets;
+  choose_args[0].arg_map.args[0].weight_set[1].weights[0] = 0x5000;
+  choose_args[1].key = 1LL << 40;
+  choose_args[1].arg_map.args = crush_make_choose_args(m, 1);
+  choose_args[1].arg_map.size = m->max_buckets;
+  /* only the weights of the root bucket */
+  for (int b = 1; b < m->max_buckets; b++) {
+    choose_args[1].arg_map.args[b].weight_set_size = 0;
+    choose_args[1].arg_map.args[b].ids_size = 0;
+  }
+  choose_args[1].arg_map.args[0].ids_size = 0;
+  choose_args[1].arg_map.args[0].weight_set[0].weights[1] = 0x30000;
+
+  void *buffer;
+  size_t length;
+  ASSERT_EQ(0, crush_encode(m, choose_args, 2, &buffer, &length));
+
+  crush_map *d;
+  crush_choose_args *decoded;
+  int decoded_count;
+  ASSERT_EQ(0, crush_decode(buffer, length, &d, &decoded, &decoded_count));
+  ASSERT_EQ(2, decoded_count);
+  EXPECT_EQ(-1, decoded[0].key);
+  EXPECT_EQ(1LL << 40, decoded[1].key);
+  EXPECT_EQ(0x5000u, decoded[0].arg_map.args[0].weight_set[1].weights[0]);
+  EXPECT_EQ(1u, decoded[1].arg_map.args[0].weight_set_size);
+  EXPECT_EQ(0x30000u, decoded[1].arg_map.args[0].weight_set[0].weights[1]);
+  EXPECT_EQ(0u, decoded[1].arg_map.args[0].ids_size);
+  EXPECT_EQ(0u, decoded[1].arg_map.args[1].weight_set_size);
+
+  void *again;
+  size_t again_length;
+  ASSERT_EQ(0, crush_encode(d, decoded, decoded_count, &again, &again_length));
+  ASSERT_EQ(length, again_length);
+  EXPECT_EQ(0, memcmp(buffer, again, length));
+  free(again);
+
+  for (int i = 0; i < 2; i++)
+    expect_same_mappings(m, choose_args[i].arg_map.args,
+                         d, decoded[i].arg_map.args);
+
+  crush_destroy_choose_args_array(decoded, decoded_count);
+  crush_destroy(d);
+  for (int i = 0; i < 2; i++)
+    crush_destroy_choose_args(choose_args[i].arg_map.args);
+  crush_destroy(m);
+  free(buffer);
+}
+
+static void set_u32(unsigned char *p, __u32 v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+TEST(encoding, invalid) {
+  crush_map *m = make_mixed_map(true);
+  crush_choose_args choose_args;
+  choose_args.key = 3;
+  choose_args.arg_map.args = crush_make_choose_args(m, 2);
+  choose_args.arg_map.size = m->max_buckets;
+  void *buffer;
+  size_t length;
+  ASSERT_EQ(0, crush_encode(m, &choose_args, 1, &buffer, &length));
+  unsigned char *p = (unsigned char *)buffer;
+
+  crush_map *d;
+  crush_choose_args *decoded;
+  int decoded_count;
+  /*
+   * Older Ceph versions do not encode the most recent tunables: a
+   * map truncated at a tunable is valid, other truncations are not.
+   */
+  for (size_t truncated = 0; truncated < length; truncated++) {
+    int r = crush_decode(buffer, truncated, &d, &decoded, &decoded_count);
+    if (truncated < 16)
+      ASSERT_EQ(-EINVAL, r);
+    else
+      ASSERT_TRUE(r == 0 || r == -EINVAL) << r;
+    if (r == 0) {
+      crush_destroy_choose_args_array(decoded, decoded_count);
+      crush_destroy(d);
+    }
+  }
+
+  /* bad magic */
+  p[0] ^= 1;
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, &decoded, &decoded_count));
+  p[0] ^= 1;
+  /* the id of the first bucket does not match its position */
+  p[16 + 4] ^= 1;
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, &decoded, &decoded_count));
+  p[16 + 4] ^= 1;
+  /*
+   * the buffer ends with the two weight sets and the ids of the last
+   * bucket, each made of a size followed by three values: change the
+   * size of the first weight set so that it does not match the bucket
+   */
+  size_t weight_set_size = length - 3 * (4 + 3 * 4);
+  p[weight_set_size] ^= 1;
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, &decoded, &decoded_count));
+  p[weight_set_size] ^= 1;
+
+  /*
+   * the root bucket (alg, id, type, alg, hash, weight and size) is
+   * followed by its items: an item must be an existing bucket or a
+   * device below max_devices
+   */
+  size_t root_items = 16 + 4 + 16;
+  set_u32(p + root_items, -1 - m->max_buckets);
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, &decoded, &decoded_count));
+  set_u32(p + root_items, m->max_devices);
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, &decoded, &decoded_count));
+  set_u32(p + root_items, -2);
+
+  ASSERT_EQ(0, crush_decode(buffer, length, &d, NULL, NULL));
+  crush_destroy(d);
+
+  crush_destroy_choose_args(choose_args.arg_map.args);
+  crush_destroy(m);
+  free(buffer);
+}
+
+TEST(encoding, invalid_tree) {
+  crush_map *m = make_mixed_map(false);
+  void *buffer;
+  size_t length;
+  ASSERT_EQ(0, crush_encode(m, NULL, 0, &buffer, &length));
+  unsigned char *p = (unsigned char *)buffer;
+
+  crush_map *d;
+  /*
+   * the tree host follows the root with five items and weights, the
+   * uniform host with three items and their weight and the list host
+   * with three items, weights and sums. Its three items are followed
+   * by the number of nodes, 8, and their weights.
+   */
+  ASSERT_EQ(CRUSH_BUCKET_TREE, m->buckets[3]->alg);
+  size_t tree = 16 + (4 + 16 + 5 * 8) + (4 + 16 + 3 * 4 + 4) + (4 + 16 + 3 * 12);
+  size_t num_nodes = tree + 4 + 16 + 3 * 4;
+  ASSERT_EQ(8, p[num_nodes]);
+  p[num_nodes] = 16;
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, NULL, NULL));
+  p[num_nodes] = 8;
+  /* the weight of the leaf of the first item */
+  size_t leaf = num_nodes + 1 + 4;
+  p[leaf] ^= 1;
+  EXPECT_EQ(-EINVAL, crush_decode(buffer, length, &d, NULL, NULL));
+  p[leaf] ^= 1;
+
+  ASSERT_EQ(0, crush_decode(buffer, length, &d, NULL, NULL));
+  crush_destroy(d);
+  crush_destroy(m);
+  free(buffer);
+}
@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "epoch.h"
+}
+
+#include "crush_test_map.h"
+
+TEST(epoch, crush_handle_pin) {
+  crush_handle *h;
+  EXPECT_EQ(-EINVAL, crush_handle_create(0, &h));
+  ASSERT_EQ(0, crush_handle_create(2, &h));
+  crush_reader *r1, *r2, *r3;
+  ASSERT_EQ(0, crush_handle_register(h, &r1));
+  ASSERT_EQ(0, crush_handle_register(h, &r2));
+  EXPECT_EQ(-EBUSY, crush_handle_register(h, &r3));
+
+  __u64 version = 42;
+  EXPECT_TRUE(crush_handle_pin(r1, &version) == NULL);
+  EXPECT_EQ(0u, version);
+  crush_handle_unpin(r1);
+
+  crush_map *m1 = crush_test_map(2, 2);
+  ASSERT_EQ(0, crush_handle_publish(h, m1, &version));
+  EXPECT_EQ(1u, version);
+  EXPECT_EQ(m1, crush_handle_pin(r1, &version));
+  EXPECT_EQ(1u, version);
+
+  // r1 holds m1, which survives the publish of m2 and m3
+  crush_map *m2 = crush_test_map(3, 2);
+  ASSERT_EQ(0, crush_handle_publish(h, m2, &version));
+  EXPECT_EQ(2u, version);
+  EXPECT_EQ(m2, crush_handle_pin(r2, NULL));
+  crush_map *m3 = crush_test_map(4, 2);
+  ASSERT_EQ(0, crush_handle_publish(h, m3, &version));
+  EXPECT_EQ(2, crush_handle_reclaim(h));
+  EXPECT_EQ(4, m1->max_devices);
+
+  // m1 and m2 are still pinned by r1, m2 by r2
+  crush_handle_unpin(r2);
+  EXPECT_EQ(2, crush_handle_reclaim(h));
+  crush_handle_unpin(r1);
+  EXPECT_EQ(0, crush_handle_reclaim(h));
+
+  EXPECT_EQ(m3, crush_handle_pin(r1, &version));
+  EXPECT_EQ(3u, version);
+  crush_handle_unpin(r1);
+
+  crush_handle_unregister(r2);
+  ASSERT_EQ(0, crush_handle_register(h, &r3));
+  crush_handle_destroy(h);
+}
+
+TEST(epoch, concurrent) {
+  const int readers = 4;
+  const int maps = 50;
+  crush_handle *h;
+  ASSERT_EQ(0, crush_handle_create(readers, &h));
+  ASSERT_EQ(0, crush_handle_publish(h, crush_test_map(3, 2), NULL));
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < readers; t++) {
+    threads.emplace_back([h, &done]() {
+      crush_reader *reader;
+      ASSERT_EQ(0, crush_handle_register(h, &reader));
+      __u64 last = 0;
+      std::vector<__u32> weights(2 * (4 + maps), 0x10000);
+      for (int x = 0; !done.load(); x++) {
+        __u64 version;
+        const crush_map *m = crush_handle_pin(reader, &version);
+        ASSERT_LE(last, version);
+        last = version;
+        std::vector<char> cwin(crush_work_size(m, 3));
+        crush_init_workspace(m, cwin.data());
+        int result[3];
+        int len = crush_do_rule(m, 0, x, result, 3, weights.data(), m->max_devices,
+                                cwin.data(), NULL);
+        ASSERT_LE(1, len);
+        for (int i = 0; i < len; i++)
+          ASSERT_GT(m->max_devices, result[i]);
+        crush_handle_unpin(reader);
+      }
+      crush_handle_unregister(reader);
+    });
+  }
+  for (int i = 0; i < maps; i++) {
+    __u64 version;
+    ASSERT_EQ(0, crush_handle_publish(h, crush_test_map(4 + i, 2), &version));
+    EXPECT_EQ(2u + i, version);
+    std::this_thread::yield();
+  }
+  done = true;
+  for (auto &thread : threads)
+    thread.join();
+  crush_handle_synchronize(h);
+  EXPECT_EQ(0, crush_handle_reclaim(h));
+  crush_handle_destroy(h);
+}
@@ -0,0 +1,262 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "frozen.h"
+#include "trace.h"
+}
+
+#include "crush_test_map.h"
+
+// a host of each algorithm, or of straw2 only, and rule 2 with independent replicas
+static crush_map *make_mixed_map(bool straw2_only) {
+  crush_map *m = crush_test_map(5, 3, straw2_only ? std::vector<int>(1, CRUSH_BUCKET_STRAW2)
+                                                  : crush_test_algs());
+  crush_test_add_rule(m, 2, 2, 3, 20, CRUSH_RULE_CHOOSELEAF_INDEP);
+  return m;
+}
+
+static void expect_same_mappings(crush_map *m, const crush_frozen_map *f,
+                                 const crush_choose_arg *choose_args) {
+  const int result_max = 4;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[1] = 0;
+  weights[4] = 0x8000;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  std::vector<char> fwin(crush_frozen_work_size(f, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_frozen_init_workspace(f, fwin.data());
+  for (int ruleno : { 0, 2 }) {
+    for (int x = 0; x < 2000; x++) {
+      int expected[result_max];
+      int result[result_max];
+      int expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                       weights.data(), weights.size(),
+                                       cwin.data(), choose_args);
+      int len = crush_frozen_do_rule(f, ruleno, x, result, result_max,
+                                     weights.data(), weights.size(),
+                                     fwin.data(), choose_args);
+      ASSERT_EQ(expected_len, len);
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]);
+    }
+  }
+}
+
+TEST(frozen, crush_frozen_do_rule) {
+  crush_map *m = make_mixed_map(false);
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_freeze(m, &image, &length));
+
+  const crush_frozen_map *f;
+  ASSERT_EQ(0, crush_frozen_check(image, length, CRUSH_FROZEN_VERIFY_ALL, &f));
+  EXPECT_EQ(image, (const void *)f);
+  EXPECT_EQ(length, f->length);
+  EXPECT_EQ(m->max_buckets, f->max_buckets);
+  EXPECT_EQ(6u, f->bucket_count);
+  EXPECT_EQ(5u + 5 * 3, f->item_count);
+  EXPECT_EQ(0, crush_frozen_find_rule(f, 0, 1, 3));
+  EXPECT_EQ(2, crush_frozen_find_rule(f, 2, 3, 3));
+  EXPECT_EQ(-1, crush_frozen_find_rule(f, 2, 3, 30));
+  int result[3];
+  std::vector<char> fwin(crush_frozen_work_size(f, 3));
+  crush_frozen_init_workspace(f, fwin.data());
+  /* there is no rule 1 */
+  EXPECT_EQ(0, crush_frozen_do_rule(f, 1, 0, result, 3, NULL, 0, fwin.data(), NULL));
+
+  expect_same_mappings(m, f, NULL);
+
+  free(image);
+  crush_destroy(m);
+}
+
+TEST(frozen, choose_args) {
+  crush_map *m = make_mixed_map(true);
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 2);
+  choose_args[0].weight_set[1].weights[0] = 0x1000;
+  choose_args[0].weight_set[0].weights[3] = 0x30000;
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_freeze(m, &image, &length));
+  const crush_frozen_map *f;
+  ASSERT_EQ(0, crush_frozen_check(image, length, CRUSH_FROZEN_VERIFY_ALL, &f));
+  expect_same_mappings(m, f, choose_args);
+  free(image);
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+// the frozen map records the same events, retries and counters
+TEST(frozen, mapper) {
+  crush_map *m = make_mixed_map(false);
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_freeze(m, &image, &length));
+  const crush_frozen_map *f;
+  ASSERT_EQ(0, crush_frozen_check(image, length, CRUSH_FROZEN_VERIFY_ALL, &f));
+
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[1] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  std::vector<char> fwin(crush_frozen_work_size(f, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_frozen_init_workspace(f, fwin.data());
+  crush_trace *trace = crush_make_trace(1024);
+  crush_trace *ftrace = crush_make_trace(1024);
+  crush_workspace_set_trace(cwin.data(), trace);
+  crush_workspace_set_trace(fwin.data(), ftrace);
+  crush_choose_stats *stats = crush_make_choose_stats(m);
+  crush_choose_stats *fstats = crush_make_choose_stats(m);
+  crush_workspace_set_choose_stats(cwin.data(), stats);
+  crush_workspace_set_choose_stats(fwin.data(), fstats);
+  for (int ruleno : { 0, 2 }) {
+    for (int x = 0; x < 100; x++) {
+      int result[result_max];
+      crush_trace_clear(trace);
+      crush_trace_clear(ftrace);
+      crush_do_rule(m, ruleno, x, result, result_max, weights.data(), weights.size(),
+                    cwin.data(), NULL);
+      crush_frozen_do_rule(f, ruleno, x, result, result_max, weights.data(),
+                           weights.size(), fwin.data(), NULL);
+      ASSERT_LT(0u, crush_trace_count(trace));
+      ASSERT_EQ(crush_trace_count(trace), crush_trace_count(ftrace));
+      for (unsigned int i = 0; i < crush_trace_count(trace); i++)
+        ASSERT_EQ(0, memcmp(crush_trace_get(trace, i), crush_trace_get(ftrace, i),
+                            sizeof(crush_trace_event)));
+    }
+  }
+  for (__u32 i = 0; i < stats->size; i++)
+    EXPECT_EQ(stats->tries[i], fstats->tries[i]);
+  crush_counters counters, fcounters;
+  EXPECT_EQ(crush_workspace_get_counters(cwin.data(), &counters),
+            crush_workspace_get_counters(fwin.data(), &fcounters));
+  EXPECT_EQ(0, memcmp(&counters, &fcounters, sizeof(counters)));
+  crush_destroy_choose_stats(stats);
+  crush_destroy_choose_stats(fstats);
+  crush_destroy_trace(trace);
+  crush_destroy_trace(ftrace);
+
+  // the plans of the frozen map map as those of the crush_map
+  int rulenos[] = { 0, 2, 0 };
+  int result_maxs[] = { 3, 3, 2 };
+  crush_rule_plan *plan, *fplan;
+  ASSERT_EQ(0, crush_make_rule_plan(m, rulenos, result_maxs, 3, &plan));
+  ASSERT_EQ(0, crush_frozen_make_rule_plan(f, rulenos, result_maxs, 3, &fplan));
+  EXPECT_EQ(crush_rule_plan_steps(plan), crush_rule_plan_steps(fplan));
+  rulenos[1] = 1;
+  EXPECT_EQ(-EINVAL, crush_frozen_make_rule_plan(f, rulenos, result_maxs, 3, &fplan));
+  std::vector<char> pwin(crush_rule_plan_work_size(m, plan));
+  std::vector<char> fpwin(crush_frozen_rule_plan_work_size(f, fplan));
+  crush_init_workspace(m, pwin.data());
+  crush_frozen_init_workspace(f, fpwin.data());
+  const int count = 500;
+  const int size = crush_rule_plan_result_size(plan);
+  std::vector<int> results(count * size), fresults(count * size);
+  std::vector<int> lens(count * 3), flens(count * 3);
+  crush_do_rule_plan_batch(m, plan, NULL, 0, count, results.data(), lens.data(),
+                           weights.data(), weights.size(), pwin.data(), NULL);
+  crush_frozen_do_rule_plan_batch(f, fplan, NULL, 0, count, fresults.data(), flens.data(),
+                                  weights.data(), weights.size(), fpwin.data(), NULL);
+  EXPECT_EQ(lens, flens);
+  for (int i = 0; i < count * 3; i++) {
+    int offset = i / 3 * size + (i % 3) * 3;
+    for (int j = 0; j < lens[i]; j++)
+      ASSERT_EQ(results[offset + j], fresults[offset + j]) << i;
+  }
+  crush_destroy_rule_plan(plan);
+  crush_destroy_rule_plan(fplan);
+
+  free(image);
+  crush_destroy(m);
+}
+
+TEST(frozen, crush_frozen_mmap) {
+  crush_map *m = make_mixed_map(false);
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_freeze(m, &image, &length));
+
+  char path[] = "/tmp/unittest_frozen.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ((ssize_t)length, write(fd, image, length));
+  ASSERT_EQ(0, close(fd));
+
+  const crush_frozen_map *f;
+  ASSERT_EQ(0, crush_frozen_mmap(path, CRUSH_FROZEN_VERIFY_ALL, &f));
+  EXPECT_NE(image, (const void *)f);
+  expect_same_mappings(m, f, NULL);
+  crush_frozen_munmap(f);
+
+  /* trailing bytes are not part of the image */
+  fd = open(path, O_WRONLY | O_APPEND);
+  ASSERT_EQ(8, write(fd, image, 8));
+  ASSERT_EQ(0, close(fd));
+  EXPECT_EQ(-EINVAL, crush_frozen_mmap(path, 0, &f));
+
+  ASSERT_EQ(0, unlink(path));
+  EXPECT_EQ(-ENOENT, crush_frozen_mmap(path, 0, &f));
+  free(image);
+  crush_destroy(m);
+}
+
+TEST(frozen, crush_frozen_check) {
+  crush_map *m = make_mixed_map(false);
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_freeze(m, &image, &length));
+  crush_frozen_map *h = (crush_frozen_map *)image;
+  const crush_frozen_map *f;
+
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length - 8, 0, &f));
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, sizeof(*h) - 1, 0, &f));
+  h->version++;
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length, 0, &f));
+  h->version--;
+
+  /* a corrupted image is only detected if the checksum is verified */
+  char *last = (char *)image + length - 1;
+  (*last)++;
+  EXPECT_EQ(0, crush_frozen_check(image, length, 0, &f));
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length,
+                                        CRUSH_FROZEN_VERIFY_CHECKSUM, &f));
+  (*last)--;
+  h->max_devices++;
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length,
+                                        CRUSH_FROZEN_VERIFY_CHECKSUM, &f));
+  h->max_devices--;
+  EXPECT_EQ(0, crush_frozen_check(image, length, CRUSH_FROZEN_VERIFY_ALL, &f));
+
+  /* a host containing the root bucket */
+  const __u32 *buckets = (const __u32 *)((char *)image + h->buckets);
+  crush_frozen_bucket *host = (crush_frozen_bucket *)((char *)image + buckets[1]);
+  __s32 *items = (__s32 *)((char *)image + host->items);
+  __s32 item = items[0];
+  items[0] = -1;
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length,
+                                        CRUSH_FROZEN_VERIFY_STRUCTURE, &f));
+  /* a bucket that does not exist */
+  items[0] = -1 - h->max_buckets;
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length,
+                                        CRUSH_FROZEN_VERIFY_STRUCTURE, &f));
+  items[0] = item;
+  __u32 offset = host->items;
+  host->items = length;
+  EXPECT_EQ(-EINVAL, crush_frozen_check(image, length,
+                                        CRUSH_FROZEN_VERIFY_STRUCTURE, &f));
+  host->items = offset;
+  EXPECT_EQ(0, crush_frozen_check(image, length,
+                                  CRUSH_FROZEN_VERIFY_STRUCTURE, &f));
+
+  free(image);
+  crush_destroy(m);
+}
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -39,3 +40,122 @@ TEST(helpers, crush_find_roots) {
 
   crush_destroy(m);
 }
+
+TEST(helpers, crush_get_topology) {
+  const crush_topology *t;
+  struct crush_map *m = crush_create();
+  ASSERT_EQ(0, crush_get_topology(m, &t));
+  EXPECT_EQ(0, t->bucket_count);
+  EXPECT_EQ(0, t->root_count);
+
+  // root contains host0 and host1, both contain shared
+  int ids[4] = { 0, 0, 0, 0 };
+  for (int i = 0; i < 4; i++) {
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                        1, 0, NULL, NULL);
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &ids[i]));
+  }
+  crush_bucket *root = m->buckets[-1-ids[0]];
+  crush_bucket *host0 = m->buckets[-1-ids[1]];
+  crush_bucket *host1 = m->buckets[-1-ids[2]];
+  crush_bucket *shared = m->buckets[-1-ids[3]];
+  ASSERT_EQ(0, crush_bucket_add_item(m, shared, 0, 0x10000));
+  ASSERT_EQ(0, crush_bucket_add_item(m, shared, 1, 0x20000));
+  ASSERT_EQ(0, crush_bucket_add_item(m, host0, shared->id, shared->weight));
+  ASSERT_EQ(0, crush_bucket_add_item(m, host0, 2, 0x10000));
+  ASSERT_EQ(0, crush_bucket_add_item(m, host1, shared->id, shared->weight));
+  ASSERT_EQ(0, crush_bucket_add_item(m, host1, 3, 0x10000));
+  ASSERT_EQ(0, crush_bucket_add_item(m, root, host0->id, host0->weight));
+  ASSERT_EQ(0, crush_bucket_add_item(m, root, host1->id, host1->weight));
+  // not propagated to the host and root weights
+  ASSERT_EQ(0x10000, crush_bucket_adjust_item_weight(m, shared, 1, 0x30000));
+
+  ASSERT_EQ(0, crush_get_topology(m, &t));
+  ASSERT_EQ(m->max_buckets, t->max_buckets);
+  EXPECT_EQ(4, t->bucket_count);
+  ASSERT_EQ(1, t->root_count);
+  EXPECT_EQ(root->id, t->order[0]);
+  EXPECT_EQ(shared->id, t->order[3]);
+  EXPECT_EQ(2, t->max_depth);
+  EXPECT_EQ(0, t->depth[-1-root->id]);
+  EXPECT_EQ(1, t->depth[-1-host1->id]);
+  EXPECT_EQ(2, t->depth[-1-shared->id]);
+  EXPECT_EQ(CRUSH_PARENT_NONE, t->parent[-1-root->id]);
+  EXPECT_EQ(root->id, t->parent[-1-host0->id]);
+  EXPECT_EQ(CRUSH_PARENT_MANY, t->parent[-1-shared->id]);
+  EXPECT_EQ(2u, t->leaves[-1-shared->id]);
+  EXPECT_EQ(3u, t->leaves[-1-host0->id]);
+  EXPECT_EQ(6u, t->leaves[-1-root->id]);
+  EXPECT_EQ(0x40000u, t->weight[-1-shared->id]);
+  EXPECT_EQ(0x50000u, t->weight[-1-host0->id]);
+  EXPECT_EQ(0xa0000u, t->weight[-1-root->id]);
+  for (int i = 4; i < t->max_buckets; i++)
+    EXPECT_EQ(-1, t->depth[i]);
+
+  // cached until the map is modified
+  const crush_topology *cached;
+  ASSERT_EQ(0, crush_get_topology(m, &cached));
+  EXPECT_EQ(t, cached);
+  // not cached
+  crush_topology *analyzed;
+  ASSERT_EQ(0, crush_analyze_topology(m, &analyzed));
+  EXPECT_NE(t, analyzed);
+  EXPECT_EQ(0, memcmp(t->order, analyzed->order, t->bucket_count * sizeof(int)));
+  EXPECT_EQ(0xa0000u, analyzed->weight[-1-root->id]);
+  crush_destroy_topology(analyzed);
+  ASSERT_EQ(0, crush_bucket_remove_item(m, host1, shared->id));
+  ASSERT_EQ(0, crush_get_topology(m, &t));
+  EXPECT_EQ(host0->id, t->parent[-1-shared->id]);
+  EXPECT_EQ(4u, t->leaves[-1-root->id]);
+
+  // a cycle
+  ASSERT_EQ(0, crush_bucket_add_item(m, shared, root->id, root->weight));
+  EXPECT_EQ(-EINVAL, crush_get_topology(m, &t));
+  int *roots = NULL;
+  EXPECT_EQ(-EINVAL, crush_find_roots(m, &roots));
+  ASSERT_EQ(0, crush_bucket_remove_item(m, shared, root->id));
+  ASSERT_EQ(1, crush_find_roots(m, &roots));
+  free(roots);
+  EXPECT_EQ((crush_topology *)NULL, m->topology);
+
+  crush_destroy(m);
+}
+
+TEST(helpers, crush_get_topology_deep) {
+  // a chain of buckets, each containing the next and a device
+  const int length = 500000;
+  std::vector<int> parent, alg, type, weight, ids;
+  for (int i = 0; i < length; i++) {
+    parent.push_back(i == 0 ? -1 : 2 * (i - 1));
+    alg.push_back(CRUSH_BUCKET_STRAW2);
+    type.push_back(1);
+    weight.push_back(0);
+    ids.push_back(-1 - i);
+    parent.push_back(2 * i);
+    alg.push_back(0);
+    type.push_back(0);
+    weight.push_back(0x100);
+    ids.push_back(i);
+  }
+  struct crush_map *m = crush_create();
+  ASSERT_EQ(0, crush_add_hierarchy(m, parent.size(), parent.data(), alg.data(),
+                                   type.data(), weight.data(), ids.data()));
+  crush_finalize(m);
+
+  const crush_topology *t;
+  ASSERT_EQ(0, crush_get_topology(m, &t));
+  EXPECT_EQ(length, t->bucket_count);
+  EXPECT_EQ(length - 1, t->max_depth);
+  ASSERT_EQ(1, t->root_count);
+  EXPECT_EQ(-1, t->order[0]);
+  EXPECT_EQ((__u32)length, t->leaves[0]);
+  EXPECT_EQ((__u64)m->buckets[0]->weight, t->weight[0]);
+  EXPECT_EQ(length - 1, t->depth[length - 1]);
+  EXPECT_EQ(-length + 1, t->parent[length - 1]);
+
+  int *roots = NULL;
+  ASSERT_EQ(1, crush_find_roots(m, &roots));
+  EXPECT_EQ(-1, roots[0]);
+  free(roots);
+  crush_destroy(m);
+}
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "batch.h"
+#include "arena.h"
+#include "hugepage.h"
+}
+
+TEST(hugepage, crush_hugepage_alloc) {
+  size_t size = 3 << 20;
+  int backing = -1;
+  ASSERT_EQ(CRUSH_HUGEPAGES_NONE, crush_get_hugepages());
+  EXPECT_EQ(NULL, crush_hugepage_alloc(&size, &backing));
+  EXPECT_EQ(-1, backing);
+
+  for (int mode : { CRUSH_HUGEPAGES_MADVISE, CRUSH_HUGEPAGES_HUGETLB }) {
+    crush_set_hugepages(mode);
+    size = CRUSH_HUGEPAGE_MIN - 1;
+    EXPECT_EQ(NULL, crush_hugepage_alloc(&size, &backing));
+
+    size = 3 << 20;
+    char *p = (char *)crush_hugepage_alloc(&size, &backing);
+    ASSERT_TRUE(p != NULL);
+    EXPECT_EQ((size_t)(4 << 20), size);
+    EXPECT_EQ(0u, (uintptr_t)p % CRUSH_HUGEPAGE_SIZE);
+    EXPECT_TRUE(backing == CRUSH_HUGEPAGES_NONE ||
+                backing == CRUSH_HUGEPAGES_MADVISE ||
+                backing == mode);
+    EXPECT_EQ(0, p[0]);
+    EXPECT_EQ(0, p[size - 1]);
+    p[0] = p[size - 1] = 1;
+    crush_hugepage_free(p, size);
+  }
+  crush_set_hugepages(CRUSH_HUGEPAGES_NONE);
+}
+
+TEST(hugepage, arena) {
+  crush_set_hugepages(CRUSH_HUGEPAGES_MADVISE);
+  crush_arena *small = crush_arena_create(0);
+  EXPECT_EQ(0u, small->chunks->mapped);
+  crush_arena_destroy(small);
+
+  // a map whose arena is large enough to be in huge pages
+  const int hosts = 20000, devices = 10;
+  std::vector<int> parent, alg, type, weight, ids;
+  parent.push_back(-1); alg.push_back(CRUSH_BUCKET_STRAW2);
+  type.push_back(2); weight.push_back(0); ids.push_back(0);
+  for (int h = 0; h < hosts; h++) {
+    int host = parent.size();
+    parent.push_back(0); alg.push_back(CRUSH_BUCKET_STRAW2);
+    type.push_back(1); weight.push_back(0); ids.push_back(0);
+    for (int d = 0; d < devices; d++) {
+      parent.push_back(host); alg.push_back(0);
+      type.push_back(0); weight.push_back(0x100); ids.push_back(h * devices + d);
+    }
+  }
+  crush_map *m = crush_create_arena_map(CRUSH_HUGEPAGE_SIZE);
+  ASSERT_TRUE(m != NULL);
+  EXPECT_NE(0u, m->arena->chunks->mapped);
+  EXPECT_GE(m->arena->chunks->size, (size_t)CRUSH_HUGEPAGE_SIZE - sizeof(crush_arena_chunk));
+  ASSERT_EQ(0, crush_add_hierarchy(m, parent.size(), parent.data(), alg.data(),
+                                   type.data(), weight.data(), ids.data()));
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, ids[0], 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  ASSERT_EQ(0, crush_add_rule(m, rule, -1));
+  crush_finalize(m);
+
+  // the workspace is more than CRUSH_HUGEPAGE_MIN
+  ASSERT_GE(crush_work_size(m, 3), (size_t)CRUSH_HUGEPAGE_MIN);
+  const int count = 1000;
+  std::vector<int> results(count * 3), lens(count), expected(count * 3), expected_lens(count);
+  std::vector<__u32> weights(hosts * devices, 0x10000);
+  ASSERT_EQ(0, crush_do_rule_batch(m, 0, NULL, 0, count, results.data(), lens.data(), 3,
+                                   weights.data(), weights.size(), NULL, 1));
+  crush_set_hugepages(CRUSH_HUGEPAGES_NONE);
+  ASSERT_EQ(0, crush_do_rule_batch(m, 0, NULL, 0, count, expected.data(),
+                                   expected_lens.data(), 3,
+                                   weights.data(), weights.size(), NULL, 1));
+  EXPECT_EQ(expected_lens, lens);
+  EXPECT_EQ(expected, results);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_hugepage && valgrind --tool=memcheck test/unittest_hugepage"
+// End:
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include <list>
+#include <vector>
 
 extern "C" {
 #include "hash.h"
@@ -291,6 +292,357 @@ TEST(mapper, crush_do_rule_choose_arg) {
   crush_destroy(m);
 }
 
+static int scan_rules(const crush_map *m, int ruleset, int type, int size) {
+  for (unsigned i = 0; i < m->max_rules; i++) {
+    const crush_rule *r = m->rules[i];
+    if (r && r->mask.ruleset == ruleset && r->mask.type == type &&
+        r->mask.min_size <= size && r->mask.max_size >= size)
+      return i;
+  }
+  return -1;
+}
+
+static void expect_find_rule(const crush_map *m) {
+  for (int ruleset = -1; ruleset < 5; ruleset++)
+    for (int type = 0; type < 3; type++)
+      for (int size = -1; size < 300; size++)
+        ASSERT_EQ(scan_rules(m, ruleset, type, size),
+                  crush_find_rule(m, ruleset, type, size))
+          << ruleset << " " << type << " " << size;
+}
+
+TEST(mapper, crush_find_rule) {
+  crush_map *m = crush_create();
+  EXPECT_EQ(-1, crush_find_rule(m, 0, 0, 1));
+
+  // overlapping sizes, the lowest rule wins
+  ASSERT_EQ(0, crush_add_rule(m, crush_make_rule(1, 0, 1, 1, 10), -1));
+  ASSERT_EQ(1, crush_add_rule(m, crush_make_rule(1, 0, 1, 5, 20), -1));
+  ASSERT_EQ(3, crush_add_rule(m, crush_make_rule(1, 1, 2, 0, 255), 3));
+  ASSERT_EQ(2, crush_add_rule(m, crush_make_rule(1, 0, 1, 15, 30), 2));
+  ASSERT_NE((crush_rule_index *)NULL, m->rule_index);
+  EXPECT_EQ(0, crush_find_rule(m, 0, 1, 5));
+  EXPECT_EQ(1, crush_find_rule(m, 0, 1, 11));
+  EXPECT_EQ(2, crush_find_rule(m, 0, 1, 25));
+  EXPECT_EQ(3, crush_find_rule(m, 1, 2, 255));
+  EXPECT_EQ(-1, crush_find_rule(m, 1, 2, 256));
+  expect_find_rule(m);
+
+  // replacing a rule rebuilds the index
+  crush_destroy_rule(m->rules[1]);
+  ASSERT_EQ(1, crush_add_rule(m, crush_make_rule(1, 2, 0, 1, 3), 1));
+  EXPECT_EQ(2, crush_find_rule(m, 0, 1, 15));
+  expect_find_rule(m);
+
+  // a rule found in the index is checked
+  crush_rule *rule = m->rules[0];
+  m->rules[0] = crush_make_rule(1, 4, 2, 1, 1);
+  EXPECT_EQ(-1, crush_find_rule(m, 0, 1, 5));
+  expect_find_rule(m);
+  // and a rule missing from the index is scanned for
+  crush_destroy_rule(m->rules[0]);
+  m->rules[0] = crush_make_rule(1, 3, 1, 1, 9);
+  EXPECT_EQ(0, crush_find_rule(m, 3, 1, 5));
+  expect_find_rule(m);
+  crush_destroy_rule(m->rules[0]);
+  m->rules[0] = rule;
+
+  // the index is not used for rules reallocated without the builder
+
+  crush_rule **rules = (crush_rule **)malloc(5 * sizeof(*rules));
+  memcpy(rules, m->rules, 4 * sizeof(*rules));
+  rules[4] = crush_make_rule(1, 0, 1, 1, 1);
+  free(m->rules);
+  m->rules = rules;
+  m->max_rules = 5;
+  std::swap(m->rules[0], m->rules[4]);
+  EXPECT_EQ(0, crush_find_rule(m, 0, 1, 1));
+  expect_find_rule(m);
+  crush_finalize(m);
+  EXPECT_EQ(m->rules, m->rule_index->rules);
+  expect_find_rule(m);
+
+  crush_destroy(m);
+}
+
 // Local Variables:
 // compile-command: "cd ../build ; make unittest_mapper && valgrind --tool=memcheck test/unittest_mapper"
 // End:
+
+TEST(mapper, crush_choose_stats) {
+  crush_map *m = crush_create();
+  const int device_count = 8;
+  int items[device_count];
+  int weights[device_count];
+  for (int i = 0; i < device_count; i++) {
+    items[i] = i;
+    weights[i] = 0x10000;
+  }
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                         device_count, items, weights);
+  int rootno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int firstn = crush_add_rule(m, rule, -1);
+  rule = crush_make_rule(3, 1, 3, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_INDEP, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int indep = crush_add_rule(m, rule, -1);
+  crush_finalize(m);
+
+  // half of the devices are out and need retries
+  std::vector<__u32> weight(device_count, 0x10000);
+  for (int i = 0; i < device_count; i += 2)
+    weight[i] = 0;
+  const int result_max = 3;
+  std::vector<char> cwin_a(crush_work_size(m, result_max));
+  std::vector<char> cwin_b(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin_a.data());
+  crush_init_workspace(m, cwin_b.data());
+  crush_choose_stats *a = crush_make_choose_stats(m);
+  crush_choose_stats *b = crush_make_choose_stats(m);
+  ASSERT_EQ(m->choose_total_tries + 1, a->size);
+  crush_workspace_set_choose_stats(cwin_a.data(), a);
+  crush_workspace_set_choose_stats(cwin_b.data(), b);
+
+  const int n = 1000;
+  int result[result_max];
+  for (int x = 0; x < n; x++) {
+    ASSERT_EQ(3, crush_do_rule(m, firstn, x, result, result_max,
+                               weight.data(), weight.size(), cwin_a.data(), NULL));
+    ASSERT_EQ(3, crush_do_rule(m, indep, x, result, result_max,
+                               weight.data(), weight.size(), cwin_b.data(), NULL));
+  }
+  // firstn counts each item chosen, indep each call
+  __u64 total_a = 0, total_b = 0;
+  for (__u32 i = 0; i < a->size; i++) {
+    total_a += a->tries[i];
+    total_b += b->tries[i];
+  }
+#ifdef CRUSH_CHOOSE_STATS
+  EXPECT_EQ((__u64)3 * n, total_a);
+  EXPECT_EQ((__u64)n, total_b);
+  EXPECT_GT((__u64)3 * n, a->tries[0]);
+  EXPECT_GT((__u64)n, b->tries[0]);
+#else
+  EXPECT_EQ(0u, total_a);
+  EXPECT_EQ(0u, total_b);
+#endif
+
+  crush_choose_stats *total = crush_make_choose_stats(m);
+  crush_choose_stats_add(total, a);
+  crush_choose_stats_add(total, b);
+  for (__u32 i = 0; i < total->size; i++)
+    EXPECT_EQ(a->tries[i] + b->tries[i], total->tries[i]);
+
+  // crush_init_workspace() detaches the histogram
+  crush_init_workspace(m, cwin_a.data());
+  __u64 before = a->tries[0];
+  crush_do_rule(m, firstn, 0, result, result_max, weight.data(), weight.size(),
+                cwin_a.data(), NULL);
+  EXPECT_EQ(before, a->tries[0]);
+
+  crush_destroy_choose_stats(a);
+  crush_destroy_choose_stats(b);
+  crush_destroy_choose_stats(total);
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_workspace_get_counters) {
+  crush_map *m = crush_create();
+  const int device_count = 8;
+  int items[device_count];
+  int weights[device_count];
+  for (int i = 0; i < device_count; i++) {
+    items[i] = i;
+    weights[i] = 0x10000;
+  }
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                         device_count, items, weights);
+  int rootno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int firstn = crush_add_rule(m, rule, -1);
+  rule = crush_make_rule(3, 1, 3, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_INDEP, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int indep = crush_add_rule(m, rule, -1);
+  crush_finalize(m);
+
+  // half of the devices are out
+  std::vector<__u32> weight(device_count, 0x10000);
+  for (int i = 0; i < device_count; i += 2)
+    weight[i] = 0;
+  const int result_max = 6;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_counters counters;
+#ifndef CRUSH_COUNTERS
+  EXPECT_EQ(-EOPNOTSUPP, crush_workspace_get_counters(cwin.data(), &counters));
+  EXPECT_EQ(0u, counters.hashes);
+#else
+  ASSERT_EQ(0, crush_workspace_get_counters(cwin.data(), &counters));
+  EXPECT_EQ(0u, counters.hashes);
+
+  const int n = 1000;
+  int result[result_max];
+  for (int x = 0; x < n; x++)
+    ASSERT_EQ(3, crush_do_rule(m, firstn, x, result, 3,
+                               weight.data(), weight.size(), cwin.data(), NULL));
+  ASSERT_EQ(0, crush_workspace_get_counters(cwin.data(), &counters));
+  EXPECT_LE((__u64)3 * n, counters.bucket_visits[CRUSH_BUCKET_STRAW2]);
+  EXPECT_EQ(0u, counters.bucket_visits[CRUSH_BUCKET_LIST]);
+  EXPECT_EQ(device_count * counters.bucket_visits[CRUSH_BUCKET_STRAW2], counters.hashes);
+  EXPECT_LT(0u, counters.is_out);
+  EXPECT_LT(0u, counters.collisions);
+  // each item rejected is retried or given up
+  EXPECT_EQ(counters.is_out + counters.collisions,
+            counters.retry_bucket + counters.retry_descent + counters.item_none);
+  EXPECT_EQ(0u, counters.item_none);
+
+  // six positions and four devices in: two are CRUSH_ITEM_NONE
+  crush_workspace_reset_counters(cwin.data());
+  ASSERT_EQ(0, crush_workspace_get_counters(cwin.data(), &counters));
+  EXPECT_EQ(0u, counters.hashes);
+  for (int x = 0; x < n; x++)
+    ASSERT_EQ(6, crush_do_rule(m, indep, x, result, 6,
+                               weight.data(), weight.size(), cwin.data(), NULL));
+  ASSERT_EQ(0, crush_workspace_get_counters(cwin.data(), &counters));
+  EXPECT_EQ((__u64)2 * n, counters.item_none);
+  EXPECT_LT(0u, counters.retry_descent);
+  EXPECT_EQ(0u, counters.retry_bucket);
+#endif
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_do_rule_plan) {
+  // a root of 3 racks of 4 hosts of 3 devices
+  std::vector<int> parent, alg, type, weight, ids;
+  auto node = [&](int p, int a, int t, int id) {
+    parent.push_back(p); alg.push_back(a); type.push_back(t);
+    weight.push_back(0x10000); ids.push_back(id);
+    return (int)parent.size() - 1;
+  };
+  int root = node(-1, CRUSH_BUCKET_STRAW2, 3, 0);
+  for (int r = 0, d = 0; r < 3; r++) {
+    int rack = node(root, CRUSH_BUCKET_STRAW2, 2, 0);
+    for (int h = 0; h < 4; h++) {
+      int host = node(rack, CRUSH_BUCKET_STRAW2, 1, 0);
+      for (int i = 0; i < 3; i++)
+        node(host, 0, 0, d++);
+    }
+  }
+  crush_map *m = crush_create();
+  ASSERT_EQ(0, crush_add_hierarchy(m, parent.size(), parent.data(), alg.data(),
+                                   type.data(), weight.data(), ids.data()));
+  const int root_id = ids[root];
+  struct step { int op, arg1, arg2; };
+  const std::vector<std::vector<step>> rule_steps = {
+    { { CRUSH_RULE_TAKE, root_id, 0 }, { CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1 },
+      { CRUSH_RULE_EMIT, 0, 0 } },
+    { { CRUSH_RULE_TAKE, root_id, 0 }, { CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1 },
+      { CRUSH_RULE_EMIT, 0, 0 } },
+    { { CRUSH_RULE_TAKE, root_id, 0 }, { CRUSH_RULE_CHOOSE_FIRSTN, 2, 2 },
+      { CRUSH_RULE_CHOOSELEAF_FIRSTN, 2, 1 }, { CRUSH_RULE_EMIT, 0, 0 } },
+    { { CRUSH_RULE_TAKE, root_id, 0 }, { CRUSH_RULE_CHOOSE_FIRSTN, 2, 2 },
+      { CRUSH_RULE_CHOOSELEAF_FIRSTN, 1, 1 }, { CRUSH_RULE_EMIT, 0, 0 } },
+    { { CRUSH_RULE_TAKE, root_id, 0 }, { CRUSH_RULE_CHOOSELEAF_INDEP, 0, 1 },
+      { CRUSH_RULE_EMIT, 0, 0 } },
+    { { CRUSH_RULE_SET_CHOOSELEAF_TRIES, 5, 0 }, { CRUSH_RULE_TAKE, root_id, 0 },
+      { CRUSH_RULE_CHOOSE_INDEP, 1, 2 }, { CRUSH_RULE_EMIT, 0, 0 },
+      { CRUSH_RULE_TAKE, root_id, 0 }, { CRUSH_RULE_CHOOSELEAF_INDEP, -1, 1 },
+      { CRUSH_RULE_EMIT, 0, 0 } },
+  };
+  std::vector<int> rulenos;
+  for (auto &steps : rule_steps) {
+    crush_rule *rule = crush_make_rule(steps.size(), 0, 1, 1, 10);
+    for (size_t i = 0; i < steps.size(); i++)
+      crush_rule_set_step(rule, i, steps[i].op, steps[i].arg1, steps[i].arg2);
+    rulenos.push_back(crush_add_rule(m, rule, -1));
+  }
+  crush_finalize(m);
+
+  // rules and result_max, some only differing by one or the other
+  const std::vector<int> plan_rules = { 0, 0, 1, 2, 3, 3, 2, 4, 4, 5, 5, 0 };
+  const std::vector<int> plan_max = { 3, 2, 3, 4, 2, 4, 6, 3, 5, 4, 2, 0 };
+  std::vector<int> plan_rulenos;
+  int total_steps = 0;
+  for (int r : plan_rules) {
+    plan_rulenos.push_back(rulenos[r]);
+    total_steps += rule_steps[r].size();
+  }
+  const int count = plan_rules.size();
+  crush_rule_plan *plan;
+  ASSERT_EQ(0, crush_make_rule_plan(m, plan_rulenos.data(), plan_max.data(), count, &plan));
+  EXPECT_LT(crush_rule_plan_steps(plan), total_steps);
+  int result_size = crush_rule_plan_result_size(plan);
+  EXPECT_EQ(3 + 2 + 3 + 4 + 2 + 4 + 6 + 3 + 5 + 4 + 2 + 0, result_size);
+
+  // a third of the devices are out and need retries
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int i = 0; i < m->max_devices; i += 3)
+    weights[i] = 0;
+  std::vector<char> cwin(crush_rule_plan_work_size(m, plan));
+  crush_init_workspace(m, cwin.data());
+  std::vector<char> cwin_rule(crush_work_size(m, 6));
+  crush_init_workspace(m, cwin_rule.data());
+
+  const int n = 500;
+  std::vector<int> results((size_t)n * result_size);
+  std::vector<int> result_lens((size_t)n * count);
+  crush_do_rule_plan_batch(m, plan, NULL, 0, n, results.data(), result_lens.data(),
+                           weights.data(), weights.size(), cwin.data(), NULL);
+  for (int x = 0; x < n; x++) {
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+      int expected[6];
+      int len = crush_do_rule(m, plan_rulenos[i], x, expected, plan_max[i],
+                              weights.data(), weights.size(), cwin_rule.data(), NULL);
+      ASSERT_EQ(len, result_lens[x * count + i]) << "x " << x << " rule " << i;
+      for (int j = 0; j < len; j++)
+        ASSERT_EQ(expected[j], results[x * result_size + offset + j])
+          << "x " << x << " rule " << i << " item " << j;
+      offset += plan_max[i];
+    }
+  }
+
+  // the same with crush_do_rule_plan() and a list of values
+  const int xs[] = { 7, 1234567, -1 };
+  for (int x : xs) {
+    crush_do_rule_plan(m, plan, x, results.data(), result_lens.data(),
+                       weights.data(), weights.size(), cwin.data(), NULL);
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+      int expected[6];
+      int len = crush_do_rule(m, plan_rulenos[i], x, expected, plan_max[i],
+                              weights.data(), weights.size(), cwin_rule.data(), NULL);
+      ASSERT_EQ(len, result_lens[i]);
+      for (int j = 0; j < len; j++)
+        ASSERT_EQ(expected[j], results[offset + j]);
+      offset += plan_max[i];
+    }
+  }
+  crush_destroy_rule_plan(plan);
+
+  // identical rules and result_max share all their steps
+  const int same_rules[] = { rulenos[0], rulenos[1], rulenos[0] };
+  const int same_max[] = { 3, 3, 3 };
+  ASSERT_EQ(0, crush_make_rule_plan(m, same_rules, same_max, 3, &plan));
+  EXPECT_EQ(3, crush_rule_plan_steps(plan));
+  crush_destroy_rule_plan(plan);
+
+  const int bad_rule[] = { 100 };
+  const int negative[] = { -1 };
+  EXPECT_EQ(-EINVAL, crush_make_rule_plan(m, same_rules, same_max, 0, &plan));
+  EXPECT_EQ(-EINVAL, crush_make_rule_plan(m, bad_rule, same_max, 1, &plan));
+  EXPECT_EQ(-EINVAL, crush_make_rule_plan(m, same_rules, negative, 1, &plan));
+  crush_destroy(m);
+}
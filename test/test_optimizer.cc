@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "optimizer.h"
+}
+
+//
+// 10 hosts with two devices each, the weight of the devices of the
+// host N is N + 1 so that the hosts have very different weights. With
+// three replicas, straw2 overfills the smallest hosts and underfills
+// the largest ones.
+//
+static crush_map *make_uneven_map(int *ruleno, int *device_count)
+{
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 2,
+                                         0, NULL, NULL);
+  int rootno = 0;
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  const int host_count = 10;
+  const int host_size = 2;
+  for (int host = 0; host < host_count; host++) {
+    int items[host_size];
+    int weights[host_size];
+    for (int i = 0; i < host_size; i++) {
+      items[i] = host * host_size + i;
+      weights[i] = (host + 1) * 0x10000;
+    }
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                        host_size, items, weights);
+    int bno = 0;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+    EXPECT_EQ(0, crush_bucket_add_item(m, root, bno, b->weight));
+  }
+  crush_rule *rule = crush_make_rule(3, 0, 0, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  *ruleno = crush_add_rule(m, rule, -1);
+  crush_finalize(m);
+  *device_count = host_count * host_size;
+  return m;
+}
+
+TEST(optimizer, crush_optimizer_step) {
+  int ruleno, device_count;
+  crush_map *m = make_uneven_map(&ruleno, &device_count);
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int num_rep = 3;
+  crush_choose_arg *choose_args = crush_make_choose_args(m, num_rep);
+
+  crush_optimizer_params params;
+  memset(&params, '\0', sizeof(params));
+  params.ruleno = ruleno;
+  params.num_rep = num_rep;
+  params.samples = 0;
+  params.weights = weights.data();
+  params.weight_max = device_count;
+  crush_optimizer *o;
+  EXPECT_EQ(-EINVAL, crush_optimizer_create(m, choose_args, &params, &o));
+  params.samples = 20000;
+  params.ruleno = ruleno + 1;
+  EXPECT_EQ(-EINVAL, crush_optimizer_create(m, choose_args, &params, &o));
+
+  params.ruleno = ruleno;
+  ASSERT_EQ(0, crush_optimizer_create(m, choose_args, &params, &o));
+  double initial, deviation;
+  ASSERT_EQ(0, crush_optimizer_step(o, &initial));
+  EXPECT_GT(initial, 0.1);
+  // in the root bucket, the weight of the smallest host went down
+  // and the weight of the largest host went up
+  const int root = 0;
+  ASSERT_EQ(10u, choose_args[root].weight_set[1].size);
+  EXPECT_LT(choose_args[root].weight_set[1].weights[0], (__u32)2 * 0x10000);
+  EXPECT_GT(choose_args[root].weight_set[1].weights[9], (__u32)20 * 0x10000);
+  for (int i = 0; i < 5; i++)
+    ASSERT_EQ(0, crush_optimizer_step(o, &deviation));
+  EXPECT_LT(deviation, initial);
+  crush_optimizer_destroy(o);
+
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+TEST(optimizer, crush_optimize_choose_args) {
+  int ruleno, device_count;
+  crush_map *m = make_uneven_map(&ruleno, &device_count);
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int num_rep = 3;
+  crush_choose_arg *choose_args = crush_make_choose_args(m, num_rep);
+
+  crush_optimizer_params params;
+  memset(&params, '\0', sizeof(params));
+  params.ruleno = ruleno;
+  params.num_rep = num_rep;
+  params.samples = 20000;
+  params.num_threads = 4;
+  params.weights = weights.data();
+  params.weight_max = device_count;
+
+  double initial;
+  ASSERT_EQ(1, crush_optimize_choose_args(m, choose_args, &params, 1, 0, &initial));
+  // a single step leaves the weights it measured untouched
+  EXPECT_EQ((__u32)0x10000, choose_args[-1-(-2)].weight_set[0].weights[0]);
+
+  double deviation;
+  params.ruleno = ruleno + 1;
+  EXPECT_EQ(-EINVAL, crush_optimize_choose_args(m, choose_args, &params, 1, 0, &deviation));
+  params.ruleno = ruleno;
+  int steps = crush_optimize_choose_args(m, choose_args, &params, 50, 0.05, &deviation);
+  ASSERT_GT(steps, 1);
+  EXPECT_LT(deviation, initial / 2);
+
+  // the deviation reported matches the weights left in choose_args
+  crush_optimizer *o;
+  ASSERT_EQ(0, crush_optimizer_create(m, choose_args, &params, &o));
+  double measured;
+  ASSERT_EQ(0, crush_optimizer_step(o, &measured));
+  EXPECT_DOUBLE_EQ(deviation, measured);
+  crush_optimizer_destroy(o);
+
+  // the target of the first device is zero, it no longer gets any placement
+  std::vector<__u32> target(device_count, 0x10000);
+  target[0] = 0;
+  params.target = target.data();
+  params.target_max = device_count;
+  crush_destroy_choose_args(choose_args);
+  choose_args = crush_make_choose_args(m, num_rep);
+  ASSERT_GT(crush_optimize_choose_args(m, choose_args, &params, 10, 0.05, &deviation), 0);
+  for (int position = 0; position < num_rep; position++)
+    EXPECT_EQ(0u, choose_args[-1-(-2)].weight_set[position].weights[0]);
+
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_optimizer && valgrind --tool=memcheck test/unittest_optimizer"
+// End:
@@ -0,0 +1,251 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "parser.h"
+}
+
+#include "crush_test_map.h"
+
+static int parse(const std::string &text, crush_map **m, __u32 **weights,
+                 crush_parse_error *error) {
+  return crush_parse_text(text.data(), text.size(), m, weights, error);
+}
+
+TEST(parser, sample) {
+  /* crush/sample.txt */
+  const std::string text =
+    "# devices\n"
+    "device 1 osd001\n"
+    "device 2 osd002\n"
+    "device 3 osd003 down   # same as offload 1.0\n"
+    "device 4 osd004 offload 0       # 0.0 -> normal, 1.0 -> failed\n"
+    "device 5 osd005 offload 0.1\n"
+    "device 6 osd006 offload 0.1\n"
+    "\n"
+    "# hierarchy\n"
+    "type 0 osd   # 'device' is actually the default for 0\n"
+    "type 2 cab\n"
+    "type 3 row\n"
+    "type 10 pool\n"
+    "\n"
+    "cab root {\n"
+    "       id -1         # optional\n"
+    "       alg tree     # required\n"
+    "       item osd001\n"
+    "       item osd002 weight 600 pos 1\n"
+    "       item osd003 weight 600 pos 0\n"
+    "       item osd004 weight 600 pos 3\n"
+    "       item osd005 weight 600 pos 4\n"
+    "}\n"
+    "\n"
+    "# rules\n"
+    "rule normal {\n"
+    "     # these are required.\n"
+    "     pool 0\n"
+    "     type replicated \n"
+    "     min_size 1\n"
+    "     max_size 4\n"
+    "     # need 1 or more of these.\n"
+    "     step take root\n"
+    "     step choose firstn 0 type osd\n"
+    "     step emit\n"
+    "}\n"
+    "\n"
+    "rule {\n"
+    "     pool 1\n"
+    "     type erasure\n"
+    "     min_size 3\n"
+    "     max_size 6\n"
+    "     step take root\n"
+    "     step choose indep 0 type osd\n"
+    "     step emit\n"
+    "}\n";
+  crush_map *m;
+  __u32 *weights;
+  crush_parse_error error;
+  ASSERT_EQ(0, parse(text, &m, &weights, &error)) << error.line << ":"
+                                                  << error.column << " " << error.message;
+
+  EXPECT_EQ(7, m->max_devices);
+  EXPECT_EQ(0x10000u, weights[1]);
+  EXPECT_EQ(0u, weights[3]);
+  EXPECT_EQ(0x10000u, weights[4]);
+  EXPECT_EQ(0x10000u - 6553, weights[5]);
+
+  crush_bucket *root = m->buckets[0];
+  ASSERT_NE(nullptr, root);
+  EXPECT_EQ(-1, root->id);
+  EXPECT_EQ(2, root->type);
+  EXPECT_EQ(CRUSH_BUCKET_TREE, root->alg);
+  EXPECT_EQ(5u, root->size);
+  /* items with a pos first, the others in the positions left */
+  const int items[] = { 3, 2, 1, 4, 5 };
+  for (int i = 0; i < 5; i++)
+    EXPECT_EQ(items[i], root->items[i]);
+  EXPECT_EQ((4 * 600 + 1) * 0x10000u, root->weight);
+
+  ASSERT_EQ(2u, m->max_rules);
+  EXPECT_EQ(0, crush_find_rule(m, 0, 1, 3));
+  EXPECT_EQ(1, crush_find_rule(m, 1, 3, 4));
+  EXPECT_EQ(CRUSH_RULE_CHOOSE_INDEP, m->rules[1]->steps[1].op);
+  EXPECT_EQ(0, m->rules[1]->steps[1].arg2);
+
+  free(weights);
+  crush_destroy(m);
+}
+
+/* if __light__, all devices weigh 1/256 for the total to fit 32 bits */
+static std::string make_text(int hosts, int host_size, bool light = false) {
+  std::string text = "tunable choose_total_tries 50\n";
+  for (int i = 0; i < hosts * host_size; i++)
+    text += "device " + std::to_string(i) + " osd." + std::to_string(i) + " class hdd\n";
+  text += "type 0 osd\ntype 1 host\ntype 2 root\n";
+  for (int host = 0; host < hosts; host++) {
+    text += "host host" + std::to_string(host) + " {\n"
+      "\tid " + std::to_string(-2 - host) + "\n"
+      "\tid " + std::to_string(-1000 - host) + " class hdd\n"
+      "\talg " + (host % 2 ? "straw" : "straw2") + "\n"
+      "\thash 0\n";
+    for (int i = 0; i < host_size; i++) {
+      char weight[32];
+      snprintf(weight, sizeof(weight), "%.8f",
+               light ? 1 / 256.0 : (0x10000 + i * 0x1000) / (double)0x10000);
+      text += "\titem osd." + std::to_string(host * host_size + i) + " weight " + weight + "\n";
+    }
+    text += "}\n";
+  }
+  text += "root default {\n\tid -1\n\talg straw2\n\thash rjenkins1\n";
+  for (int host = 0; host < hosts; host++)
+    text += "\titem host" + std::to_string(host) + "\n";
+  text += "}\n"
+    "rule replicated_rule {\n"
+    "\tid 0\n\ttype replicated\n\tmin_size 1\n\tmax_size 10\n"
+    "\tstep take default\n\tstep chooseleaf firstn 0 type host\n\tstep emit\n"
+    "}\n";
+  return text;
+}
+
+TEST(parser, same_as_builder) {
+  const int hosts = 10, host_size = 5;
+  crush_map *expected = crush_test_map(hosts, host_size, std::vector<int>{
+      CRUSH_BUCKET_STRAW2, CRUSH_BUCKET_STRAW });
+  crush_bucket *root = expected->buckets[0];
+  for (int host = 0; host < hosts; host++) {
+    crush_bucket *b = expected->buckets[1 + host];
+    for (int i = 0; i < host_size; i++)
+      crush_bucket_adjust_item_weight(expected, b, b->items[i], 0x10000 + i * 0x1000);
+    crush_bucket_adjust_item_weight(expected, root, b->id, b->weight);
+  }
+  crush_map *m;
+  __u32 *weights;
+  crush_parse_error error;
+  ASSERT_EQ(0, parse(make_text(hosts, host_size), &m, &weights, &error))
+    << error.line << ":" << error.column << " " << error.message;
+  EXPECT_EQ(expected->max_devices, m->max_devices);
+  EXPECT_EQ(50u, m->choose_total_tries);
+  ASSERT_EQ(expected->max_buckets, m->max_buckets);
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (expected->buckets[b] == NULL) {
+      EXPECT_EQ(nullptr, m->buckets[b]);
+      continue;
+    }
+    ASSERT_NE(nullptr, m->buckets[b]);
+    EXPECT_EQ(expected->buckets[b]->weight, m->buckets[b]->weight);
+  }
+
+  const int result_max = 3;
+  std::vector<char> ewin(crush_work_size(expected, result_max));
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(expected, ewin.data());
+  crush_init_workspace(m, cwin.data());
+  for (int x = 0; x < 1000; x++) {
+    int eresult[result_max], result[result_max];
+    int elen = crush_do_rule(expected, 0, x, eresult, result_max, weights,
+                             m->max_devices, ewin.data(), NULL);
+    int len = crush_do_rule(m, 0, x, result, result_max, weights,
+                            m->max_devices, cwin.data(), NULL);
+    ASSERT_EQ(elen, len);
+    for (int i = 0; i < len; i++)
+      ASSERT_EQ(eresult[i], result[i]);
+  }
+  free(weights);
+  crush_destroy(m);
+  crush_destroy(expected);
+}
+
+static void expect_error(const std::string &text, int line, int column,
+                         const char *message) {
+  crush_map *m = NULL;
+  crush_parse_error error;
+  EXPECT_EQ(-EINVAL, parse(text, &m, NULL, &error)) << text;
+  EXPECT_EQ(nullptr, m);
+  EXPECT_EQ(line, error.line) << text;
+  EXPECT_EQ(column, error.column) << text;
+  EXPECT_NE(nullptr, strstr(error.message, message)) << error.message;
+}
+
+TEST(parser, errors) {
+  const std::string header = "device 0 osd.0\ntype 1 host\n";
+  expect_error("foo", 1, 1, "unexpected 'foo'");
+  expect_error("device 0 osd.0\n  device 1 osd.0", 2, 12, "already defined");
+  expect_error("device 0 osd.0\ndevice 0 osd.1", 2, 8, "device 0 is already defined");
+  expect_error("device x osd.0", 1, 8, "not a valid integer");
+  expect_error("device 0 osd.0 offload 1.5", 1, 24, "offload");
+  expect_error("device 0", 1, 9, "unexpected end of file");
+  expect_error("tunable foo 1", 1, 9, "unknown tunable 'foo'");
+  /* crush/old_sample.txt */
+  expect_error("\n# first define our types\n<types>\n\t<type osd>\n\t   type_id = 0\n"
+               "\t</type>\n</types>\n", 3, 1, "'<types>' is the legacy");
+  expect_error(header + "host h {\n\talg straw2\n\titem osd.1\n}", 5, 7, "unknown item 'osd.1'");
+  expect_error(header + "host h {\n\titem osd.0\n}", 3, 6, "has no alg");
+  expect_error(header + "host h {\n\talg foo\n}", 4, 6, "unknown bucket algorithm");
+  expect_error(header + "host h {\n\talg straw2\n\titem osd.0 pos 1\n}", 5, 7, "pos 1");
+  expect_error(header + "host h {\n\talg straw2\n\tfoo\n}", 5, 2, "unexpected 'foo' in bucket");
+  expect_error(header + "host h {\n\talg straw2\n\titem osd.0 weight 1.x\n}", 5, 20,
+               "not a valid weight");
+  expect_error(header + "host h {\n\talg straw2\n\tid -1\n}\nhost i {\n\talg straw2\n\tid -1\n}",
+               9, 5, "bucket id -1 is already used");
+  expect_error(header + "host h {\n\talg straw2\n}\nhost h {\n\talg straw2\n}", 6, 6,
+               "'h' is already defined");
+  expect_error(header + "host h {\n\talg straw2\n}\nrule {\n\tstep take h class hdd\n}", 7, 14,
+               "device classes are not supported");
+  expect_error(header + "rule {\n\tstep take h\n}", 4, 12, "unknown item 'h'");
+  expect_error(header + "rule {\n\tstep choose firstn 0 type rack\n}", 4, 28, "unknown type 'rack'");
+  expect_error(header + "rule {\n\tstep foo\n}", 4, 7, "unknown step 'foo'");
+  expect_error(header + "rule {\n\tid 0\n}\nrule {\n\tid 0\n}", 7, 5, "rule id 0 is already used");
+  expect_error(header + "rule r {\n}\nrule r {\n}", 5, 6, "'r' is already defined");
+  expect_error(header + "rule {\n\tmin_size 256\n}", 4, 11, "min_size 256");
+  expect_error(header + "rule {\n", 4, 1, "unexpected end of file");
+
+  /* the error is optional */
+  crush_map *m;
+  EXPECT_EQ(-EINVAL, crush_parse_text("foo", 3, &m, NULL, NULL));
+}
+
+TEST(parser, large) {
+  const int hosts = 10000, host_size = 100;
+  const std::string text = make_text(hosts, host_size, true);
+  crush_map *m;
+  __u32 *weights;
+  crush_parse_error error;
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_EQ(0, parse(text, &m, &weights, &error))
+    << error.line << ":" << error.column << " " << error.message;
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "parsed " << text.size() << " bytes, " << hosts * host_size
+            << " devices in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+            << "ms" << std::endl;
+  EXPECT_EQ(hosts * host_size, m->max_devices);
+  EXPECT_EQ(hosts, (int)m->buckets[0]->size);
+  free(weights);
+  crush_destroy(m);
+}
@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "pool.h"
+}
+
+static __u32 hash(const std::string &s) {
+  return crush_str_hash_rjenkins(s.data(), s.size());
+}
+
+TEST(pool, crush_str_hash_rjenkins) {
+  // "ceph osd map data foo" shows object 'foo' -> pg 0.7fc1f406 (0.6)
+  EXPECT_EQ(0x7fc1f406u, hash("foo"));
+  EXPECT_EQ(0xbd49d10du, hash(""));
+  EXPECT_EQ(0x92f31ad0u, hash("0123456789ab"));
+  EXPECT_EQ(0x10e4bb72u, hash("a fairly long object name that spans several blocks"));
+  // not null terminated
+  EXPECT_EQ(hash("foo"), crush_str_hash_rjenkins("foobar", 3));
+}
+
+TEST(pool, crush_str_hash_rjenkins_batch) {
+  // lengths around the 12 bytes blocks, in lanes of different lengths
+  std::vector<std::string> strs;
+  for (int i = 0; i < 67; i++)
+    strs.push_back(std::string((i * 7) % 41, 'a' + i % 26) + std::to_string(i));
+  std::vector<const char *> ptrs;
+  std::vector<unsigned int> lengths;
+  for (auto &s : strs) {
+    ptrs.push_back(s.data());
+    lengths.push_back(s.size());
+  }
+  std::vector<__u32> hashes(strs.size());
+  crush_str_hash_rjenkins_batch(ptrs.data(), lengths.data(), strs.size(), hashes.data());
+  for (size_t i = 0; i < strs.size(); i++)
+    EXPECT_EQ(hash(strs[i]), hashes[i]) << strs[i];
+}
+
+TEST(pool, crush_stable_mod) {
+  EXPECT_EQ(0u, crush_pg_num_mask(1));
+  EXPECT_EQ(1u, crush_pg_num_mask(2));
+  EXPECT_EQ(15u, crush_pg_num_mask(12));
+  EXPECT_EQ(15u, crush_pg_num_mask(16));
+  EXPECT_EQ(31u, crush_pg_num_mask(17));
+  EXPECT_EQ(0xffffffffu, crush_pg_num_mask(0xffffffff));
+
+  // 12 PGs: 13 & 15 is too large and falls back to 13 & 7
+  EXPECT_EQ(11u, crush_stable_mod(11, 12, 15));
+  EXPECT_EQ(5u, crush_stable_mod(13, 12, 15));
+  for (__u32 x = 0; x < 1000; x++)
+    EXPECT_GT(12u, crush_stable_mod(x, 12, 15));
+
+  crush_pool pool = { 0, 0, 3, 64, 64, 0 };
+  EXPECT_EQ(6u, crush_pool_pg(&pool, hash("foo")));
+  EXPECT_EQ(6u, crush_pool_pps(&pool, hash("foo")));
+  pool.id = 3;
+  EXPECT_EQ(9u, crush_pool_pps(&pool, hash("foo")));
+  pool.hashpspool = 1;
+  EXPECT_EQ(crush_hash32_2(CRUSH_HASH_RJENKINS1, 6, 3), crush_pool_pps(&pool, hash("foo")));
+  // PGs beyond pgp_num are placed with one of the first pgp_num
+  pool.pgp_num = 32;
+  EXPECT_EQ(crush_pool_pps(&pool, 6), crush_pool_pps(&pool, 38));
+  EXPECT_EQ(38u, crush_pool_pg(&pool, 38));
+}
+
+TEST(pool, crush_map_objects) {
+  crush_map *m = crush_create();
+  const int device_count = 10;
+  int items[device_count];
+  int weights[device_count];
+  for (int i = 0; i < device_count; i++) {
+    items[i] = i;
+    weights[i] = 0x10000;
+  }
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                         device_count, items, weights);
+  int rootno = 0;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  int ruleno = crush_add_rule(m, rule, -1);
+  crush_finalize(m);
+
+  crush_pool pool = { 5, ruleno, 3, 24, 16, 1 };
+  crush_pg_cache *cache;
+  ASSERT_EQ(0, crush_make_pg_cache(&pool, &cache));
+
+  const int count = 1000;
+  std::vector<std::string> names;
+  std::vector<const char *> ptrs;
+  std::vector<unsigned int> lengths;
+  for (int i = 0; i < count; i++)
+    names.push_back("rbd_data.10074b0dc51.0000000000000" + std::to_string(i));
+  for (auto &s : names) {
+    ptrs.push_back(s.data());
+    lengths.push_back(s.size());
+  }
+  std::vector<__u32> weight(device_count, 0x10000);
+  weight[3] = 0;
+  std::vector<char> cwin(crush_work_size(m, pool.size));
+  crush_init_workspace(m, cwin.data());
+  std::vector<__u32> pgs(count);
+  std::vector<int> results(count * pool.size);
+  std::vector<int> result_lens(count);
+  ASSERT_EQ(0, crush_map_objects(m, &pool, ptrs.data(), lengths.data(), count,
+                                 pgs.data(), results.data(), result_lens.data(),
+                                 weight.data(), weight.size(), cwin.data(), NULL, cache));
+
+  std::set<__u32> seeds;
+  for (int i = 0; i < count; i++) {
+    __u32 h = hash(names[i]);
+    EXPECT_EQ(crush_pool_pg(&pool, h), pgs[i]);
+    EXPECT_GT(pool.pg_num, pgs[i]);
+    seeds.insert(crush_pool_pps(&pool, h));
+    int expected[3];
+    int len = crush_do_rule(m, ruleno, crush_pool_pps(&pool, h), expected, pool.size,
+                            weight.data(), weight.size(), cwin.data(), NULL);
+    ASSERT_EQ(len, result_lens[i]);
+    for (int j = 0; j < len; j++) {
+      EXPECT_EQ(expected[j], results[i * pool.size + j]);
+      EXPECT_NE(3, results[i * pool.size + j]);
+    }
+  }
+  // each of the pgp_num seeds is mapped once
+  EXPECT_EQ(pool.pgp_num, seeds.size());
+  __u64 hits, misses;
+  crush_pg_cache_stats(cache, &hits, &misses);
+  EXPECT_EQ(pool.pgp_num, misses);
+  EXPECT_EQ(count - pool.pgp_num, hits);
+
+  // after a weight change, the cache is cleared and the placements change
+  weight[3] = 0x10000;
+  crush_pg_cache_clear(cache);
+  ASSERT_EQ(0, crush_map_objects(m, &pool, ptrs.data(), lengths.data(), count,
+                                 NULL, results.data(), result_lens.data(),
+                                 weight.data(), weight.size(), cwin.data(), NULL, cache));
+  crush_pg_cache_stats(cache, &hits, &misses);
+  EXPECT_EQ(2 * pool.pgp_num, misses);
+  bool device_3 = false;
+  for (int r : results)
+    device_3 = device_3 || r == 3;
+  EXPECT_TRUE(device_3);
+
+  // the cache belongs to one pool
+  crush_pool other = pool;
+  other.id = 6;
+  EXPECT_EQ(-EINVAL, crush_map_objects(m, &other, ptrs.data(), lengths.data(), count,
+                                       NULL, results.data(), result_lens.data(),
+                                       weight.data(), weight.size(), cwin.data(), NULL,
+                                       cache));
+  other = pool;
+  other.pgp_num = pool.pg_num + 1;
+  crush_pg_cache *invalid;
+  EXPECT_EQ(-EINVAL, crush_make_pg_cache(&other, &invalid));
+
+  crush_destroy_pg_cache(cache);
+  crush_destroy(m);
+}
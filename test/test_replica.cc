@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "replica.h"
+}
+
+#include "crush_test_map.h"
+
+static void expect_same_mappings(crush_map *m, const crush_frozen_map *f) {
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  std::vector<char> fwin(crush_frozen_work_size(f, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_frozen_init_workspace(f, fwin.data());
+  for (int x = 0; x < 1000; x++) {
+    int expected[result_max];
+    int result[result_max];
+    int expected_len = crush_do_rule(m, 0, x, expected, result_max,
+                                     weights.data(), weights.size(), cwin.data(), NULL);
+    int len = crush_frozen_do_rule(f, 0, x, result, result_max,
+                                   weights.data(), weights.size(), fwin.data(), NULL);
+    ASSERT_EQ(expected_len, len);
+    for (int i = 0; i < len; i++)
+      ASSERT_EQ(expected[i], result[i]);
+  }
+}
+
+TEST(replica, crush_replicas_publish) {
+  crush_replicas *r;
+  EXPECT_EQ(-EINVAL, crush_replicas_create(-1, 1, &r));
+  EXPECT_EQ(-EINVAL, crush_replicas_create(CRUSH_REPLICAS_MAX_NODES + 1, 1, &r));
+  EXPECT_EQ(-EINVAL, crush_replicas_create(2, 0, &r));
+  ASSERT_EQ(0, crush_replicas_create(2, 2, &r));
+  EXPECT_EQ(2, crush_replicas_nodes(r));
+  crush_reader *reader, *other;
+  ASSERT_EQ(0, crush_replicas_register(r, &reader));
+  ASSERT_EQ(0, crush_replicas_register(r, &other));
+  EXPECT_EQ(-EBUSY, crush_replicas_register(r, &other));
+  EXPECT_TRUE(crush_replicas_local(r, reader) == NULL);
+  crush_replicas_unpin(reader);
+
+  crush_map *m = crush_test_map(4, 3);
+  ASSERT_EQ(0, crush_replicas_publish(r, m));
+  const crush_frozen_map *f0 = crush_replicas_node(r, reader, 0);
+  const crush_frozen_map *f1 = crush_replicas_node(r, other, 1);
+  ASSERT_TRUE(f0 != NULL);
+  ASSERT_TRUE(f1 != NULL);
+  EXPECT_NE(f0, f1);
+  crush_replicas_unpin(other);
+  EXPECT_TRUE(crush_replicas_node(r, other, 2) == NULL);
+  crush_replicas_unpin(other);
+  int node = crush_replicas_current_node(r);
+  EXPECT_TRUE(node == 0 || node == 1);
+  EXPECT_EQ(crush_replicas_node(r, other, node), crush_replicas_local(r, other));
+  crush_replicas_unpin(other);
+  EXPECT_EQ(0, crush_frozen_check(f1, f1->length, CRUSH_FROZEN_VERIFY_ALL, &f1));
+  expect_same_mappings(m, f0);
+  expect_same_mappings(m, f1);
+
+  // the copies pinned remain readable whatever is published meanwhile
+  crush_map *m2 = crush_test_map(7, 3);
+  ASSERT_EQ(0, crush_replicas_publish(r, m2));
+  ASSERT_EQ(0, crush_replicas_publish(r, m2));
+  ASSERT_EQ(0, crush_replicas_publish(r, m));
+  EXPECT_EQ(4u + 4 * 3, f0->item_count);
+  expect_same_mappings(m, f0);
+  crush_replicas_unpin(reader);
+  ASSERT_EQ(0, crush_replicas_publish(r, m2));
+  const crush_frozen_map *f = crush_replicas_node(r, reader, 1);
+  EXPECT_EQ(7u + 7 * 3, f->item_count);
+  expect_same_mappings(m2, f);
+  crush_replicas_unpin(reader);
+
+  crush_replicas_unregister(other);
+  crush_replicas_destroy(r);
+  crush_destroy(m);
+  crush_destroy(m2);
+}
+
+TEST(replica, machine) {
+  crush_replicas *r;
+  ASSERT_EQ(0, crush_replicas_create(0, 1, &r));
+  EXPECT_LE(1, crush_replicas_nodes(r));
+  EXPECT_GT(crush_replicas_nodes(r), crush_replicas_current_node(r));
+  crush_reader *reader;
+  ASSERT_EQ(0, crush_replicas_register(r, &reader));
+  crush_map *m = crush_test_map(3, 3);
+  ASSERT_EQ(0, crush_replicas_publish(r, m));
+  for (int node = 0; node < crush_replicas_nodes(r); node++) {
+    expect_same_mappings(m, crush_replicas_node(r, reader, node));
+    crush_replicas_unpin(reader);
+  }
+  crush_replicas_unregister(reader);
+  crush_replicas_destroy(r);
+  crush_destroy(m);
+}
@@ -0,0 +1,238 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "batch.h"
+#include "reverse.h"
+}
+
+#include "crush_test_map.h"
+
+static const int host_count = 4;
+static const int host_size = 4;
+static const int result_max = 3;
+
+// the test map with its parents indexed, its hosts then its root appended to buckets
+static crush_map *make_indexed_map(std::vector<int> &buckets) {
+  crush_map *m = crush_test_map(host_count, host_size);
+  EXPECT_EQ(0, crush_build_parents(m));
+  for (int h = 0; h < host_count; h++)
+    buckets.push_back(-2 - h);
+  buckets.push_back(-1);
+  return m;
+}
+
+// the entries of item found by scanning the results
+static std::vector<crush_reverse_entry> scan(crush_map *m, const std::vector<int> &results,
+                                             const std::vector<int> &result_lens,
+                                             int x_start, int item) {
+  std::vector<crush_reverse_entry> entries;
+  for (size_t i = 0; i < result_lens.size(); i++)
+    for (int j = 0; j < result_lens[i]; j++) {
+      int id = results[i * result_max + j];
+      bool found = id == item;
+      // device 0 is CRUSH_PARENT_NONE, hence the walk up the buckets only
+      for (id = crush_get_parent(m, id); !found && id < 0; id = crush_get_parent(m, id))
+        found = id == item;
+      if (found) {
+        crush_reverse_entry e = { x_start + (int)i, j };
+        entries.push_back(e);
+      }
+    }
+  return entries;
+}
+
+static void expect_index(crush_map *m, const crush_reverse_index *index,
+                         const std::vector<int> &results,
+                         const std::vector<int> &result_lens, int x_start,
+                         const std::vector<int> &items) {
+  for (int item : items) {
+    std::vector<crush_reverse_entry> expected = scan(m, results, result_lens, x_start, item);
+    const crush_reverse_entry *entries;
+    ASSERT_EQ((int)expected.size(), crush_reverse_index_get(index, item, &entries)) << item;
+    for (size_t e = 0; e < expected.size(); e++) {
+      EXPECT_EQ(expected[e].x, entries[e].x) << item;
+      EXPECT_EQ(expected[e].position, entries[e].position) << item;
+    }
+  }
+}
+
+TEST(reverse, crush_make_reverse_index) {
+  std::vector<int> items;
+  crush_map *m = make_indexed_map(items);
+  for (int d = 0; d < host_count * host_size; d++)
+    items.push_back(d);
+  const int x_start = -1000;
+  const int count = 10000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<int> results(count * result_max);
+  std::vector<int> result_lens(count);
+  ASSERT_EQ(0, crush_do_rule_batch(m, 0, NULL, x_start, count, results.data(),
+                                   result_lens.data(), result_max, weights.data(),
+                                   weights.size(), NULL, 1));
+
+  // the same index whatever the number of threads
+  crush_reverse_index *index;
+  ASSERT_EQ(0, crush_make_reverse_index(m, results.data(), result_lens.data(), result_max,
+                                        x_start, count, CRUSH_REVERSE_ANCESTORS, 1, &index));
+  expect_index(m, index, results, result_lens, x_start, items);
+  crush_destroy_reverse_index(index);
+  ASSERT_EQ(0, crush_make_reverse_index(m, results.data(), result_lens.data(), result_max,
+                                        x_start, count, CRUSH_REVERSE_ANCESTORS, 3, &index));
+  expect_index(m, index, results, result_lens, x_start, items);
+  // the root has all the entries
+  const crush_reverse_entry *entries;
+  EXPECT_EQ(count * result_max, crush_reverse_index_get(index, items[host_count], &entries));
+  EXPECT_EQ(-ENOENT, crush_reverse_index_get(index, m->max_devices, &entries));
+  EXPECT_EQ(-ENOENT, crush_reverse_index_get(index, -1 - m->max_buckets, &entries));
+  crush_destroy_reverse_index(index);
+
+  // without ancestors, only the devices have entries
+  ASSERT_EQ(0, crush_make_reverse_index(m, results.data(), result_lens.data(), result_max,
+                                        x_start, count, 0, 0, &index));
+  EXPECT_EQ(0, crush_reverse_index_get(index, items[0], &entries));
+  crush_destroy_reverse_index(index);
+
+  results[5] = m->max_devices;
+  EXPECT_EQ(-EINVAL, crush_make_reverse_index(m, results.data(), result_lens.data(),
+                                              result_max, x_start, count, 0, 2, &index));
+  crush_destroy_parents(m->parents);
+  m->parents = NULL;
+  EXPECT_EQ(-ENOENT, crush_make_reverse_index(m, results.data(), result_lens.data(),
+                                              result_max, x_start, count,
+                                              CRUSH_REVERSE_ANCESTORS, 1, &index));
+  crush_destroy(m);
+}
+
+TEST(reverse, crush_reverse_index_update) {
+  std::vector<int> items;
+  crush_map *m = make_indexed_map(items);
+  for (int d = 0; d < host_count * host_size; d++)
+    items.push_back(d);
+  const int x_start = 0;
+  const int count = 5000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<int> results(count * result_max);
+  std::vector<int> result_lens(count);
+  ASSERT_EQ(0, crush_do_rule_batch(m, 0, NULL, x_start, count, results.data(),
+                                   result_lens.data(), result_max, weights.data(),
+                                   weights.size(), NULL, 1));
+  crush_reverse_index *index;
+  ASSERT_EQ(0, crush_make_reverse_index(m, results.data(), result_lens.data(), result_max,
+                                        x_start, count, CRUSH_REVERSE_ANCESTORS, 2, &index));
+
+  // a device reweighted: the values that moved fit in the room of the
+  // others and the entries are updated in place
+  const crush_reverse_entry *entries, *before;
+  int before_size = crush_reverse_index_get(index, 5, &entries);
+  crush_reverse_index_get(index, 0, &before);
+  weights[5] = 0xe000;
+  std::vector<int> after(count * result_max);
+  std::vector<int> after_lens(count);
+  ASSERT_EQ(0, crush_do_rule_batch(m, 0, NULL, x_start, count, after.data(),
+                                   after_lens.data(), result_max, weights.data(),
+                                   weights.size(), NULL, 1));
+  std::vector<int> xs, changed, changed_lens;
+  for (int i = 0; i < count; i++) {
+    if (std::equal(&results[i * result_max], &results[i * result_max] + result_max,
+                   &after[i * result_max]))
+      continue;
+    xs.push_back(x_start + i);
+    changed.insert(changed.end(), &after[i * result_max], &after[i * result_max] + result_max);
+    changed_lens.push_back(after_lens[i]);
+  }
+  ASSERT_LT(0u, xs.size());
+  ASSERT_EQ(0, crush_reverse_index_update(m, index, xs.data(), xs.size(), changed.data(),
+                                          changed_lens.data()));
+  expect_index(m, index, after, after_lens, x_start, items);
+  EXPECT_GT(before_size, crush_reverse_index_get(index, 5, &entries));
+  crush_reverse_index_get(index, 0, &entries);
+  EXPECT_EQ(before, entries);
+
+  // invalid updates leave the index as it was
+  int x = 3;
+  int bad[result_max] = { m->max_devices, 0, 0 };
+  int len = 1;
+  EXPECT_EQ(-EINVAL, crush_reverse_index_update(m, index, &x, 1, bad, &len));
+  x = count;
+  bad[0] = 0;
+  EXPECT_EQ(-ENOENT, crush_reverse_index_update(m, index, &x, 1, bad, &len));
+  int twice[] = { 1, 1 };
+  int twice_results[2 * result_max] = { 0, 0, 0, 0, 0, 0 };
+  int twice_lens[] = { 1, 1 };
+  EXPECT_EQ(-EINVAL, crush_reverse_index_update(m, index, twice, 2, twice_results,
+                                                twice_lens));
+  // the ancestors of the old results cannot be found without the parents
+  x = x_start;
+  bad[0] = after[0] == 0 ? 1 : 0;
+  crush_parents *parents = m->parents;
+  m->parents = NULL;
+  EXPECT_EQ(-ENOENT, crush_reverse_index_update(m, index, &x, 1, bad, &len));
+  m->parents = parents;
+  // a device moved to another host: its old entries are not where the
+  // parents now place them
+  int moved = after[0];
+  crush_bucket *from = m->buckets[-1 - crush_get_parent(m, moved)];
+  crush_bucket *to = m->buckets[from->id == -2 ? 2 : 1];
+  int from_pos = std::find(from->items, from->items + from->size, moved) - from->items;
+  std::swap(from->items[from_pos], to->items[0]);
+  ASSERT_EQ(0, crush_build_parents(m));
+  EXPECT_EQ(-EINVAL, crush_reverse_index_update(m, index, &x, 1, bad, &len));
+  std::swap(from->items[from_pos], to->items[0]);
+  ASSERT_EQ(0, crush_build_parents(m));
+  // a map with more buckets than the index
+  m->max_buckets++;
+  EXPECT_EQ(-EINVAL, crush_reverse_index_update(m, index, &x, 1, bad, &len));
+  m->max_buckets--;
+  expect_index(m, index, after, after_lens, x_start, items);
+
+  // a device without room left keeps the same number of entries: the
+  // value leaving it is removed before the one joining it is inserted
+  {
+    const int values = host_count * host_size;
+    std::vector<int> own(values * result_max, 0), own_lens(values, 1);
+    for (int i = 0; i < values; i++)
+      own[i * result_max] = i;
+    crush_reverse_index *full;
+    ASSERT_EQ(0, crush_make_reverse_index(m, own.data(), own_lens.data(), result_max, 0,
+                                          values, CRUSH_REVERSE_ANCESTORS, 1, &full));
+    // device 0 has room for 3 entries, those of device 1 follow
+    int fill[] = { 2, 4 };
+    int fill_results[2 * result_max] = { 0, 0, 0, 0, 0, 0 };
+    int fill_lens[] = { 1, 1 };
+    ASSERT_EQ(0, crush_reverse_index_update(m, full, fill, 2, fill_results, fill_lens));
+    own[2 * result_max] = own[4 * result_max] = 0;
+    const crush_reverse_entry *full_before;
+    ASSERT_EQ(3, crush_reverse_index_get(full, 0, &full_before));
+    int swap[] = { 3, 0 };
+    int swap_results[2 * result_max] = { 0, 0, 0, 5, 0, 0 };
+    int swap_lens[] = { 1, 1 };
+    ASSERT_EQ(0, crush_reverse_index_update(m, full, swap, 2, swap_results, swap_lens));
+    own[3 * result_max] = 0;
+    own[0 * result_max] = 5;
+    expect_index(m, full, own, own_lens, 0, items);
+    EXPECT_EQ(3, crush_reverse_index_get(full, 0, &entries));
+    EXPECT_EQ(full_before, entries);
+    crush_destroy_reverse_index(full);
+  }
+
+  // all the values on one device: it has no room left and all is built again
+  xs.clear();
+  std::vector<int> one(count * result_max, 0);
+  std::vector<int> one_lens(count, 1);
+  for (int i = 0; i < count; i++)
+    xs.push_back(x_start + i);
+  ASSERT_EQ(0, crush_reverse_index_update(m, index, xs.data(), xs.size(), one.data(),
+                                          one_lens.data()));
+  expect_index(m, index, one, one_lens, x_start, items);
+  EXPECT_EQ(count, crush_reverse_index_get(index, 0, &entries));
+  EXPECT_NE(before, entries);
+
+  crush_destroy_reverse_index(index);
+  crush_destroy(m);
+}
@@ -0,0 +1,178 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "table.h"
+}
+
+#include "crush_test_map.h"
+
+// a root of devices, each replica chosen independently
+static crush_map *make_flat_map(int device_count) {
+  crush_map *m = crush_test_tree(std::vector<int>(1, device_count), CRUSH_BUCKET_STRAW2,
+                                 std::vector<int>());
+  m->rules[0]->steps[1].op = CRUSH_RULE_CHOOSE_INDEP;
+  return m;
+}
+
+static void expect_same_mappings(crush_map *m, const std::vector<__u32> &weights,
+                                 const crush_table *t, const crush_table *base) {
+  std::vector<char> cwin(crush_work_size(m, t->result_max));
+  crush_init_workspace(m, cwin.data());
+  for (__u32 i = 0; i < t->count; i++) {
+    int x = t->x_start + i;
+    int expected[3], result[3];
+    int len = crush_do_rule(m, 0, x, expected, 3, weights.data(), weights.size(),
+                            cwin.data(), NULL);
+    ASSERT_EQ(len, crush_table_get(t, base, x, result)) << x;
+    for (int j = 0; j < len; j++)
+      EXPECT_EQ(expected[j], result[j]) << x;
+  }
+}
+
+TEST(table, crush_table_encode) {
+  // holes, buckets and results shorter than result_max
+  const int result_max = 3;
+  const int results[] = {
+    1, 5, 9,
+    CRUSH_ITEM_NONE, 5, -3,
+    9, 0, 0,
+    0, 0, 0,
+    -3, 1, 0,
+  };
+  const int result_lens[] = { 3, 3, 1, 0, 2 };
+  const int count = 5;
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_table_encode(results, result_lens, result_max, 10, count, NULL,
+                                  &image, &length));
+  const crush_table *t;
+  ASSERT_EQ(0, crush_table_check(image, length, CRUSH_TABLE_VERIFY_CHECKSUM, NULL, &t));
+  // -3, 1, 5, 9 and CRUSH_ITEM_NONE
+  EXPECT_EQ(3, t->item_bits);
+  EXPECT_EQ(2, t->len_bits);
+  for (int i = 0; i < count; i++) {
+    int result[result_max];
+    ASSERT_EQ(result_lens[i], crush_table_get(t, NULL, 10 + i, result));
+    for (int j = 0; j < result_lens[i]; j++)
+      EXPECT_EQ(results[i * result_max + j], result[j]);
+  }
+  int result[result_max];
+  EXPECT_EQ(-ENOENT, crush_table_get(t, NULL, 9, result));
+  EXPECT_EQ(-ENOENT, crush_table_get(t, NULL, 10 + count, result));
+
+  // a single item needs no bits at all
+  const int lens[] = { 1, 1 };
+  const int same[] = { 7, 7 };
+  void *single;
+  ASSERT_EQ(0, crush_table_encode(same, lens, 1, 0, 2, NULL, &single, &length));
+  ASSERT_EQ(0, crush_table_check(single, length, 0, NULL, &t));
+  EXPECT_EQ(0, t->item_bits);
+  EXPECT_EQ(1, crush_table_get(t, NULL, 1, result));
+  EXPECT_EQ(7, result[0]);
+
+  // the base must be a full table of the same values
+  EXPECT_EQ(-EINVAL, crush_table_encode(same, lens, 1, 0, 2, (crush_table *)image,
+                                        &single, &length));
+  const int too_long[] = { 2, 1 };
+  EXPECT_EQ(-EINVAL, crush_table_encode(same, too_long, 1, 0, 2, NULL, &single, &length));
+  EXPECT_EQ(-EINVAL, crush_table_encode(same, lens, 1, 0, -1, NULL, &single, &length));
+  free(single);
+  free(image);
+}
+
+TEST(table, crush_table_delta) {
+  const int device_count = 64;
+  crush_map *m = make_flat_map(device_count);
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int count = 4096;
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_table_map(m, 0, 0, count, 3, weights.data(), weights.size(), NULL,
+                               1, NULL, &image, &length));
+  const crush_table *base;
+  ASSERT_EQ(0, crush_table_check(image, length, CRUSH_TABLE_VERIFY_CHECKSUM, NULL, &base));
+  EXPECT_EQ(6, base->item_bits);
+  // 6 bits per item and 2 per length instead of 4 bytes each
+  EXPECT_GT(count * (3 + 1) * sizeof(int) / 4, length);
+  expect_same_mappings(m, weights, base, NULL);
+
+  // a device out: only the rows it was in change
+  weights[7] = 0;
+  void *delta_image;
+  size_t delta_length;
+  ASSERT_EQ(0, crush_table_map(m, 0, 0, count, 3, weights.data(), weights.size(), NULL,
+                               1, base, &delta_image, &delta_length));
+  const crush_table *delta;
+  EXPECT_EQ(-EINVAL, crush_table_check(delta_image, delta_length, 0, NULL, &delta));
+  ASSERT_EQ(0, crush_table_check(delta_image, delta_length, CRUSH_TABLE_VERIFY_CHECKSUM,
+                                 base, &delta));
+  EXPECT_LT(0u, delta->rows);
+  EXPECT_GT(count / 10u, delta->rows);
+  EXPECT_GT(length / 4, delta_length);
+  expect_same_mappings(m, weights, delta, base);
+  int result[3];
+  EXPECT_EQ(-EINVAL, crush_table_get(delta, NULL, 0, result));
+
+  // a delta is only valid with its own base
+  void *other;
+  size_t other_length;
+  ASSERT_EQ(0, crush_table_map(m, 0, 0, count, 3, weights.data(), weights.size(), NULL,
+                               1, NULL, &other, &other_length));
+  const crush_table *t;
+  EXPECT_EQ(-EINVAL, crush_table_check(delta_image, delta_length, 0,
+                                       (crush_table *)other, &t));
+  EXPECT_EQ(-EINVAL, crush_table_check(delta_image, delta_length, 0, delta, &t));
+
+  free(other);
+  free(delta_image);
+  free(image);
+  crush_destroy(m);
+}
+
+TEST(table, crush_table_mmap) {
+  const int device_count = 10;
+  crush_map *m = make_flat_map(device_count);
+  std::vector<__u32> weights(device_count, 0x10000);
+  void *image;
+  size_t length;
+  ASSERT_EQ(0, crush_table_map(m, 0, -100, 1000, 3, weights.data(), weights.size(), NULL,
+                               0, NULL, &image, &length));
+
+  char path[] = "/tmp/unittest_table.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ((ssize_t)length, write(fd, image, length));
+  ASSERT_EQ(0, close(fd));
+
+  const crush_table *t;
+  ASSERT_EQ(0, crush_table_mmap(path, CRUSH_TABLE_VERIFY_CHECKSUM, NULL, &t));
+  EXPECT_NE(image, (const void *)t);
+  expect_same_mappings(m, weights, t, NULL);
+  crush_table_munmap(t);
+
+  /* a flipped bit is only caught by the checksum */
+  ((char *)image)[length - 1] ^= 1;
+  fd = open(path, O_WRONLY | O_TRUNC);
+  ASSERT_EQ((ssize_t)length, write(fd, image, length));
+  ASSERT_EQ(0, close(fd));
+  ASSERT_EQ(0, crush_table_mmap(path, 0, NULL, &t));
+  crush_table_munmap(t);
+  EXPECT_EQ(-EINVAL, crush_table_mmap(path, CRUSH_TABLE_VERIFY_CHECKSUM, NULL, &t));
+
+  /* a truncated image is always caught */
+  ASSERT_EQ(0, truncate(path, length - 8));
+  EXPECT_EQ(-EINVAL, crush_table_mmap(path, 0, NULL, &t));
+
+  ASSERT_EQ(0, unlink(path));
+  EXPECT_EQ(-ENOENT, crush_table_mmap(path, 0, NULL, &t));
+  free(image);
+  crush_destroy(m);
+}
@@ -0,0 +1,117 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "trace.h"
+}
+
+#include "crush_test_map.h"
+
+TEST(trace, crush_do_rule) {
+  EXPECT_TRUE(crush_make_trace(0) == NULL);
+  crush_map *m = crush_test_map(4, 2);
+  crush_test_add_rule(m, 1, 1, 3, 10, CRUSH_RULE_CHOOSELEAF_INDEP);
+  // the first device of each host is out
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int i = 0; i < m->max_devices; i += 2)
+    weights[i] = 0;
+  const int result_max = 3;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_trace *trace = crush_make_trace(1000);
+  ASSERT_EQ(1024u, trace->size);
+  EXPECT_EQ(0u, crush_trace_count(trace));
+  crush_workspace_set_trace(cwin.data(), trace);
+
+  for (int ruleno : { 0, 1 }) {
+    int rejected_out = 0;
+    for (int x = 0; x < 20; x++) {
+      crush_trace_clear(trace);
+      int result[result_max];
+      ASSERT_EQ(3, crush_do_rule(m, ruleno, x, result, result_max,
+                                 weights.data(), weights.size(), cwin.data(), NULL));
+      unsigned int count = crush_trace_count(trace);
+      ASSERT_LT(0u, count);
+      EXPECT_TRUE(crush_trace_get(trace, count) == NULL);
+      const crush_trace_event *e = crush_trace_get(trace, 0);
+      EXPECT_EQ(CRUSH_TRACE_RULE, e->type);
+      EXPECT_EQ(ruleno, e->item);
+      EXPECT_EQ(result_max, e->value);
+
+      std::vector<int> hosts(result_max, -1);
+      for (unsigned int i = 0; i < count; i++) {
+        e = crush_trace_get(trace, i);
+        EXPECT_EQ((__u32)x, e->x);
+        char line[128];
+        int len = crush_trace_format(e, line, sizeof(line));
+        ASSERT_LT(0, len);
+        ASSERT_GT((int)sizeof(line), len);
+        EXPECT_EQ(std::string::npos, std::string(line).find("unknown"));
+        if (e->type == CRUSH_TRACE_REJECT && e->value == CRUSH_TRACE_REJECT_OUT) {
+          EXPECT_EQ(0u, weights[e->item]);
+          EXPECT_NE(std::string::npos, std::string(line).find(" out"));
+          rejected_out++;
+        }
+        if (e->type == CRUSH_TRACE_DRAW)
+          EXPECT_GT(0, e->value);
+        // the leaves are placed by recursive calls in their own output
+        if (e->type == CRUSH_TRACE_RESULT && e->item < 0)
+          hosts[e->value] = e->item;
+      }
+      for (int i = 0; i < result_max; i++)
+        EXPECT_EQ(m->buckets[-1 - hosts[i]]->items[1], result[i]);
+    }
+    EXPECT_LT(0, rejected_out);
+  }
+
+  // the ring keeps the most recent events
+  crush_trace *small = crush_make_trace(3);
+  ASSERT_EQ(4u, small->size);
+  crush_workspace_set_trace(cwin.data(), small);
+  int result[result_max];
+  crush_do_rule(m, 0, 1, result, result_max, weights.data(), weights.size(),
+                cwin.data(), NULL);
+  EXPECT_LT((__u64)4, small->head);
+  EXPECT_EQ(4u, crush_trace_count(small));
+  const crush_trace_event *last = crush_trace_get(small, 3);
+  EXPECT_EQ(CRUSH_TRACE_RESULT, last->type);
+  EXPECT_EQ(result[2], m->buckets[-1 - last->item]->items[1]);
+
+  // crush_init_workspace() detaches the trace
+  crush_init_workspace(m, cwin.data());
+  crush_trace_clear(small);
+  crush_do_rule(m, 0, 1, result, result_max, weights.data(), weights.size(),
+                cwin.data(), NULL);
+  EXPECT_EQ(0u, crush_trace_count(small));
+
+  crush_destroy_trace(trace);
+  crush_destroy_trace(small);
+  crush_destroy(m);
+}
+
+TEST(trace, crush_trace_format) {
+  crush_trace_event e = {};
+  e.type = CRUSH_TRACE_REJECT;
+  e.bucket = -3;
+  e.item = 7;
+  e.x = 1234;
+  e.value = CRUSH_TRACE_REJECT_OUT;
+  char line[64];
+  EXPECT_EQ(38, crush_trace_format(&e, line, sizeof(line)));
+  EXPECT_STREQ("reject x 1234 r 0 bucket -3 item 7 out", line);
+  EXPECT_EQ(38, crush_trace_format(&e, line, 7));
+  EXPECT_STREQ("reject", line);
+  e.type = CRUSH_TRACE_RETRY;
+  e.flags = CRUSH_TRACE_RETRY_DESCENT;
+  e.value = 2;
+  crush_trace_format(&e, line, sizeof(line));
+  EXPECT_STREQ("retry x 1234 r 0 bucket -3 descent failures 2", line);
+  e.type = 99;
+  crush_trace_format(&e, line, sizeof(line));
+  EXPECT_STREQ("unknown event 99", line);
+}